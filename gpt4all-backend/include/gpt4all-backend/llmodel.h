@@ -167,10 +167,10 @@ public:
     virtual size_t embeddingSize() const {
         throw std::logic_error(std::string(implementation().modelType()) + " does not support embeddings");
     }
-    // user-specified prefix
+    // user-specified prefix, textTokenCounts receives the tokens of each text that tokenCount is the sum of
     virtual void embed(const std::vector<std::string> &texts, float *embeddings, std::optional<std::string> prefix,
                        int dimensionality = -1, size_t *tokenCount = nullptr, bool doMean = true, bool atlas = false,
-                       EmbedCancelCallback *cancelCb = nullptr);
+                       EmbedCancelCallback *cancelCb = nullptr, std::vector<size_t> *textTokenCounts = nullptr);
     // automatic prefix
     virtual void embed(const std::vector<std::string> &texts, float *embeddings, bool isRetrieval,
                        int dimensionality = -1, size_t *tokenCount = nullptr, bool doMean = true, bool atlas = false);
@@ -178,6 +178,11 @@ public:
     virtual void setThreadCount(int32_t n_threads) { (void)n_threads; }
     virtual int32_t threadCount() const { return 1; }
 
+    // Makes another model with its own context of n_ctx tokens over the weights of this loaded one, which it keeps
+    // alive. The two may be used from different threads at the same time. Returns nullptr if the backend cannot share
+    // its weights.
+    virtual LLModel *newContext(int n_ctx) const { (void)n_ctx; return nullptr; }
+
     const Implementation &implementation() const {
         return *m_implementation;
     }
@@ -224,6 +224,7 @@ struct LLamaPrivate {
     std::vector<LLModel::Token>  inputTokens;
 
     llama_model          *model        = nullptr;
+    std::shared_ptr<llama_model> modelOwner; // frees model, shared with the contexts made by newContext()
     llama_context        *ctx          = nullptr;
     llama_model_params    model_params;
     llama_context_params  ctx_params;
@@ -339,14 +340,12 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     d_ptr->modelLoaded = false;
 
     // clean up after previous loadModel()
-    if (d_ptr->model) {
-        llama_free_model(d_ptr->model);
-        d_ptr->model = nullptr;
-    }
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
         d_ptr->ctx = nullptr;
     }
+    d_ptr->modelOwner.reset();
+    d_ptr->model = nullptr;
 
     if (n_ctx < 8) {
         std::cerr << "warning: minimum context size is 8, using minimum size.\n";
@@ -407,6 +406,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
         std::cerr << "LLAMA ERROR: failed to load model from " << modelPath << std::endl;
         return false;
     }
+    d_ptr->modelOwner = std::shared_ptr<llama_model>(d_ptr->model, llama_free_model);
 
     // -- initialize the context --
 
@@ -443,7 +443,7 @@ bool LLamaModel::loadModel(const std::string &modelPath, int n_ctx, int ngl)
     if (!d_ptr->ctx) {
         fflush(stdout);
         std::cerr << "LLAMA ERROR: failed to init context for model " <<  modelPath << std::endl;
-        llama_free_model(d_ptr->model);
+        d_ptr->modelOwner.reset();
         d_ptr->model = nullptr;
 #ifndef GGML_USE_CUDA
         d_ptr->device = -1;
@@ -486,12 +486,49 @@ int32_t LLamaModel::threadCount() const
     return d_ptr->n_threads;
 }
 
+LLModel *LLamaModel::newContext(int n_ctx) const
+{
+    if (!d_ptr->modelLoaded)
+        return nullptr;
+
+    auto *other = new LLamaModel;
+    auto &od = *other->d_ptr;
+    od.device       = d_ptr->device;
+    od.deviceName   = d_ptr->deviceName;
+    od.n_threads    = d_ptr->n_threads;
+    od.end_tokens   = d_ptr->end_tokens;
+    od.backend_name = d_ptr->backend_name;
+    od.model        = d_ptr->model;
+    od.modelOwner   = d_ptr->modelOwner;
+    od.model_params = d_ptr->model_params;
+    od.ctx_params   = d_ptr->ctx_params;
+
+    od.ctx_params.n_ctx = n_ctx;
+    if (m_supportsEmbedding) {
+        od.ctx_params.n_batch  = n_ctx;
+        od.ctx_params.n_ubatch = n_ctx;
+    }
+
+    od.ctx = llama_new_context_with_model(od.model, od.ctx_params);
+    if (!od.ctx) {
+        std::cerr << "LLAMA ERROR: failed to init another context for the model\n";
+        delete other;
+        return nullptr;
+    }
+
+    other->m_implementation     = m_implementation;
+    other->m_supportsEmbedding  = m_supportsEmbedding;
+    other->m_supportsCompletion = m_supportsCompletion;
+    od.modelLoaded = true;
+    return other;
+}
+
 LLamaModel::~LLamaModel()
 {
     if (d_ptr->ctx) {
         llama_free(d_ptr->ctx);
     }
-    llama_free_model(d_ptr->model);
+    d_ptr->modelOwner.reset();
     llama_sampler_free(d_ptr->sampler_chain);
 }
 
@@ -1019,7 +1056,8 @@ void LLamaModel::embed(
 
 void LLamaModel::embed(
     const std::vector<std::string> &texts, float *embeddings, std::optional<std::string> prefix, int dimensionality,
-    size_t *tokenCount, bool doMean, bool atlas, LLModel::EmbedCancelCallback *cancelCb
+    size_t *tokenCount, bool doMean, bool atlas, LLModel::EmbedCancelCallback *cancelCb,
+    std::vector<size_t> *textTokenCounts
 ) {
     if (!d_ptr->model)
         throw std::logic_error("no model is loaded");
@@ -1057,7 +1095,8 @@ void LLamaModel::embed(
         throw std::invalid_argument(ss.str());
     }
 
-    embedInternal(texts, embeddings, *prefix, dimensionality, tokenCount, doMean, atlas, cancelCb, spec);
+    embedInternal(texts, embeddings, *prefix, dimensionality, tokenCount, doMean, atlas, cancelCb, textTokenCounts,
+                  spec);
 }
 
 // MD5 hash of "nomic empty"
@@ -1077,7 +1116,8 @@ double getL2NormScale(T *start, T *end)
 
 void LLamaModel::embedInternal(
     const std::vector<std::string> &texts, float *embeddings, std::string prefix, int dimensionality,
-    size_t *tokenCount, bool doMean, bool atlas, LLModel::EmbedCancelCallback *cancelCb, const EmbModelSpec *spec
+    size_t *tokenCount, bool doMean, bool atlas, LLModel::EmbedCancelCallback *cancelCb,
+    std::vector<size_t> *textTokenCounts, const EmbModelSpec *spec
 ) {
     typedef std::vector<LLModel::Token> TokenString;
     static constexpr int32_t atlasMaxLength = 8192;
@@ -1157,6 +1197,8 @@ void LLamaModel::embedInternal(
     struct split_batch { unsigned idx; TokenString batch; };
     std::vector<split_batch> batches;
     size_t totalTokens = 0;
+    if (textTokenCounts)
+        textTokenCounts->assign(texts.size(), 0);
     for (unsigned i = 0; i < inputs.size(); i++) {
         auto &input = inputs[i];
         for (unsigned j = 0; j < input.size(); j += max_len) {
@@ -1167,6 +1209,8 @@ void LLamaModel::embedInternal(
             batch = prefixTokens;
             batch.insert(batch.end(), input.begin() + j, input.begin() + end);
             totalTokens += end - j;
+            if (textTokenCounts)
+                (*textTokenCounts)[i] += end - j;
             batch.push_back(eos_token);
             if (!doMean) { break; /* limit text to one chunk */ }
         }
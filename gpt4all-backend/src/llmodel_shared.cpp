@@ -62,8 +62,8 @@ auto LLModel::decodePrompt(
     // This is used to skip unnecessary work when the prompt shares a common prefix with the previous result.
     int32_t nPast = computeModelInputPosition(embd_inp);
 
-    // always decode up to a full batch before generating, even if cached
-    nPast -= std::min(n_batch, nPast);
+    // the last prompt token must be decoded to get logits to sample from, even if cached
+    nPast = std::min(nPast, int32_t(embd_inp.size()) - 1);
 
     // TODO(jared): generalize this to find the smallest new_embd_inp.size() - nPast given the cache
     if (!nPast && int32_t(embd_inp.size()) > nCtx) {
@@ -84,7 +84,7 @@ auto LLModel::decodePrompt(
 
         // check the cache again, just in case
         nPast = computeModelInputPosition(embd_inp);
-        nPast -= std::min(n_batch, nPast);
+        nPast = std::min(nPast, int32_t(embd_inp.size()) - 1);
     }
 
     setModelInputPosition(nPast);
@@ -270,7 +270,7 @@ void LLModel::generateResponse(
 
 void LLModel::embed(
     const std::vector<std::string> &texts, float *embeddings, std::optional<std::string> prefix, int dimensionality,
-    size_t *tokenCount, bool doMean, bool atlas, EmbedCancelCallback *cancelCb
+    size_t *tokenCount, bool doMean, bool atlas, EmbedCancelCallback *cancelCb, std::vector<size_t> *textTokenCounts
 ) {
     (void)texts;
     (void)embeddings;
@@ -280,6 +280,7 @@ void LLModel::embed(
     (void)doMean;
     (void)atlas;
     (void)cancelCb;
+    (void)textTokenCounts;
     throw std::logic_error(std::string(implementation().modelType()) + " does not support embeddings");
 }
 
@@ -0,0 +1,172 @@
+#include "batchstore.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QJsonDocument>
+#include <QJsonParseError>
+#include <QJsonValue>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QStringList>
+#include <QUuid>
+#include <QtLogging>
+
+#include <algorithm>
+
+using namespace Qt::Literals::StringLiterals;
+namespace ranges = std::ranges;
+
+
+static QList<QJsonObject> newestFirst(const QMap<QString, QJsonObject> &objects)
+{
+    QList<QJsonObject> list = objects.values();
+    ranges::stable_sort(list, ranges::greater(), [](auto &obj) { return obj["created_at"].toInteger(); });
+    return list;
+}
+
+BatchStore::BatchStore()
+    : m_dir(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + u"/server-batches"_s)
+{
+    for (auto kind : { u"files"_s, u"batches"_s }) {
+        QDir dir(u"%1/%2"_s.arg(m_dir, kind));
+        if (!dir.mkpath(u"."_s))
+            qWarning() << "BatchStore: failed to create" << dir.path();
+    }
+
+    auto load = [this](const QString &kind) {
+        QMap<QString, QJsonObject> objects;
+        QDir dir(u"%1/%2"_s.arg(m_dir, kind));
+        for (auto &info : dir.entryInfoList({ u"*.json"_s }, QDir::Files)) {
+            QFile file(info.filePath());
+            if (!file.open(QIODevice::ReadOnly))
+                continue;
+            QJsonParseError err;
+            QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &err);
+            if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+                qWarning() << "BatchStore: ignoring corrupt metadata" << file.fileName();
+                continue;
+            }
+            objects.insert(info.completeBaseName(), doc.object());
+        }
+        return objects;
+    };
+    m_files   = load(u"files"_s);
+    m_batches = load(u"batches"_s);
+
+    static const QStringList unfinished { u"validating"_s, u"in_progress"_s, u"finalizing"_s, u"cancelling"_s };
+    for (auto &batch : m_batches) {
+        if (unfinished.contains(batch["status"].toString())) {
+            batch["status"]     = u"expired"_s;
+            batch["expired_at"] = QDateTime::currentSecsSinceEpoch();
+            writeMetadata(u"batches"_s, batch);
+        }
+    }
+
+    // the output files of those batches were never added
+    QDir filesDir(u"%1/files"_s.arg(m_dir));
+    for (auto &info : filesDir.entryInfoList({ u"*.jsonl"_s }, QDir::Files)) {
+        if (!m_files.contains(info.completeBaseName()))
+            QFile::remove(info.filePath());
+    }
+}
+
+QString BatchStore::newFileId()
+{
+    return u"file-"_s + QString::fromLatin1(QUuid::createUuid().toByteArray(QUuid::Id128));
+}
+
+QString BatchStore::newBatchId()
+{
+    return u"batch_"_s + QString::fromLatin1(QUuid::createUuid().toByteArray(QUuid::Id128));
+}
+
+QString BatchStore::filePath(const QString &id) const
+{
+    return u"%1/files/%2.jsonl"_s.arg(m_dir, id);
+}
+
+QString BatchStore::metadataPath(const QString &kind, const QString &id) const
+{
+    return u"%1/%2/%3.json"_s.arg(m_dir, kind, id);
+}
+
+bool BatchStore::writeMetadata(const QString &kind, const QJsonObject &obj)
+{
+    QSaveFile file(metadataPath(kind, obj["id"].toString()));
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(obj).toJson(QJsonDocument::Compact)) < 0
+        || !file.commit()) {
+        qWarning() << "BatchStore: failed to write" << file.fileName() << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+QJsonObject BatchStore::addFile(const QString &filename, const QString &purpose, const QByteArray &content)
+{
+    QString id = newFileId();
+    QSaveFile file(filePath(id));
+    if (!file.open(QIODevice::WriteOnly) || file.write(content) < 0 || !file.commit()) {
+        qWarning() << "BatchStore: failed to write" << file.fileName() << file.errorString();
+        return {};
+    }
+    return adoptFile(id, filename, purpose);
+}
+
+QJsonObject BatchStore::adoptFile(const QString &id, const QString &filename, const QString &purpose)
+{
+    QJsonObject obj {
+        { "id",         id                                 },
+        { "object",     "file"                             },
+        { "bytes",      QFileInfo(filePath(id)).size()     },
+        { "created_at", QDateTime::currentSecsSinceEpoch() },
+        { "filename",   filename                           },
+        { "purpose",    purpose                            },
+    };
+    if (!writeMetadata(u"files"_s, obj))
+        return {};
+    m_files.insert(id, obj);
+    return obj;
+}
+
+std::optional<QJsonObject> BatchStore::file(const QString &id) const
+{
+    if (auto it = m_files.constFind(id); it != m_files.constEnd())
+        return *it;
+    return std::nullopt;
+}
+
+QList<QJsonObject> BatchStore::files() const
+{
+    return newestFirst(m_files);
+}
+
+bool BatchStore::removeFile(const QString &id)
+{
+    if (!m_files.remove(id))
+        return false;
+    QFile::remove(metadataPath(u"files"_s, id));
+    QFile::remove(filePath(id));
+    return true;
+}
+
+std::optional<QJsonObject> BatchStore::batch(const QString &id) const
+{
+    if (auto it = m_batches.constFind(id); it != m_batches.constEnd())
+        return *it;
+    return std::nullopt;
+}
+
+QList<QJsonObject> BatchStore::batches() const
+{
+    return newestFirst(m_batches);
+}
+
+void BatchStore::saveBatch(const QJsonObject &batch)
+{
+    m_batches.insert(batch["id"].toString(), batch);
+    writeMetadata(u"batches"_s, batch);
+}
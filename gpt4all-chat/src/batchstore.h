@@ -0,0 +1,46 @@
+#ifndef BATCHSTORE_H
+#define BATCHSTORE_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+#include <optional>
+
+
+// The files and batches of the API server's batch endpoints. Each is described by a JSON object in the format of
+// OpenAI's API, and kept on disk along with the file contents so that results survive a restart. Not thread-safe,
+// the server only uses it on its HTTP thread.
+class BatchStore
+{
+public:
+    // Batches that were still running when the server stopped are marked as expired, and their output is deleted.
+    BatchStore();
+
+    QJsonObject addFile(const QString &filename, const QString &purpose, const QByteArray &content);
+    // describes a file that was written to filePath(id) directly, such as the output of a batch
+    QJsonObject adoptFile(const QString &id, const QString &filename, const QString &purpose);
+    std::optional<QJsonObject> file(const QString &id) const;
+    QList<QJsonObject> files() const; // newest first
+    bool removeFile(const QString &id);
+    QString filePath(const QString &id) const;
+
+    std::optional<QJsonObject> batch(const QString &id) const;
+    QList<QJsonObject> batches() const; // newest first
+    void saveBatch(const QJsonObject &batch);
+
+    static QString newFileId();
+    static QString newBatchId();
+
+private:
+    QString metadataPath(const QString &kind, const QString &id) const;
+    bool writeMetadata(const QString &kind, const QJsonObject &obj);
+
+    QString                    m_dir;
+    QMap<QString, QJsonObject> m_files;
+    QMap<QString, QJsonObject> m_batches;
+};
+
+#endif // BATCHSTORE_H
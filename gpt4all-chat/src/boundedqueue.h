@@ -0,0 +1,88 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QtTypes>
+
+#include <deque>
+#include <optional>
+#include <utility>
+
+
+// A FIFO queue between threads that holds at most capacity items. push() blocks while the queue is full, which slows
+// producers down to the pace of the consumer. Closing the queue fails further pushes, the items already in it can still
+// be popped. Thread-safe.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(qsizetype capacity)
+        : m_capacity(capacity) {}
+
+    // Waits for room in the queue. Returns false, dropping the item, if the queue is or gets closed.
+    bool push(T item)
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_closed && qsizetype(m_items.size()) >= m_capacity)
+            m_notFull.wait(&m_mutex);
+        if (m_closed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.wakeOne();
+        return true;
+    }
+
+    // waits for an item, returns nullopt once the queue is closed and empty
+    std::optional<T> pop()
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_closed && m_items.empty())
+            m_notEmpty.wait(&m_mutex);
+        return takeFront();
+    }
+
+    // never blocks, returns nullopt if the queue is empty
+    std::optional<T> tryPop()
+    {
+        QMutexLocker locker(&m_mutex);
+        return takeFront();
+    }
+
+    bool isEmpty() const
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_items.empty();
+    }
+
+    // fails all present and future calls to push(), so that producers can be joined, and tells consumers that no more
+    // items are coming
+    void close()
+    {
+        QMutexLocker locker(&m_mutex);
+        m_closed = true;
+        m_notFull.wakeAll();
+        m_notEmpty.wakeAll();
+    }
+
+private:
+    std::optional<T> takeFront() // with the mutex held
+    {
+        if (m_items.empty())
+            return std::nullopt;
+        T item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.wakeOne();
+        return item;
+    }
+
+    const qsizetype m_capacity;
+    mutable QMutex  m_mutex;
+    QWaitCondition  m_notFull;
+    QWaitCondition  m_notEmpty;
+    std::deque<T>   m_items;
+    bool            m_closed = false;
+};
+
+#endif // BOUNDEDQUEUE_H
@@ -7,7 +7,6 @@
 #include <QAnyStringView>
 #include <QCoreApplication>
 #include <QDebug>
-#include <QGuiApplication>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -241,7 +240,7 @@ void ChatAPIWorker::request(const QString &apiKey, const QByteArray &array)
 #endif
     m_networkManager = new QNetworkAccessManager(this);
     QNetworkReply *reply = m_networkManager->post(request, array);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
     connect(reply, &QNetworkReply::finished, this, &ChatAPIWorker::handleFinished);
     connect(reply, &QNetworkReply::readyRead, this, &ChatAPIWorker::handleReadyRead);
     connect(reply, &QNetworkReply::errorOccurred, this, &ChatAPIWorker::handleErrorOccurred);
@@ -10,7 +10,6 @@
 #include <QFile>
 #include <QFileInfo>
 #include <QGlobalStatic>
-#include <QGuiApplication>
 #include <QIODevice>
 #include <QSettings>
 #include <QStringList> // IWYU pragma: keep
@@ -286,7 +285,7 @@ void ChatsRestoreThread::run()
         qDebug() << "deserializing chat" << f.file;
 
         auto chat = std::make_unique<Chat>();
-        chat->moveToThread(qGuiApp->thread());
+        chat->moveToThread(QCoreApplication::instance()->thread());
         bool ok = chat->deserialize(in, version);
         if (!ok) {
             qWarning() << "ERROR: Couldn't deserialize chat from file:" << file.fileName();
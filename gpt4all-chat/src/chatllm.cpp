@@ -224,6 +224,10 @@ void LLModelInfo::resetModel(ChatLLM *cllm, LLModel *model) {
 }
 
 ChatLLM::ChatLLM(Chat *parent, bool isServer)
+    : ChatLLM(parent, parent->chatModel(), isServer)
+{}
+
+ChatLLM::ChatLLM(Chat *parent, ChatModel *chatModel, bool isServer)
     : QObject{nullptr}
     , m_chat(parent)
     , m_shouldBeLoaded(false)
@@ -234,23 +238,20 @@ ChatLLM::ChatLLM(Chat *parent, bool isServer)
     , m_isServer(isServer)
     , m_forceMetal(MySettings::globalInstance()->forceMetal())
     , m_reloadingToChangeVariant(false)
-    , m_chatModel(parent->chatModel())
+    , m_chatModel(chatModel)
 {
     moveToThread(&m_llmThread);
     connect(this, &ChatLLM::shouldBeLoadedChanged, this, &ChatLLM::handleShouldBeLoadedChanged,
         Qt::QueuedConnection); // explicitly queued
     connect(this, &ChatLLM::trySwitchContextRequested, this, &ChatLLM::trySwitchContextOfLoadedModel,
         Qt::QueuedConnection); // explicitly queued
-    connect(parent, &Chat::idChanged, this, &ChatLLM::handleChatIdChanged);
+    if (parent) // the headless server has no chat
+        connect(parent, &Chat::idChanged, this, &ChatLLM::handleChatIdChanged);
     connect(&m_llmThread, &QThread::started, this, &ChatLLM::handleThreadStarted);
     connect(MySettings::globalInstance(), &MySettings::forceMetalChanged, this, &ChatLLM::handleForceMetalChanged);
     connect(MySettings::globalInstance(), &MySettings::deviceChanged, this, &ChatLLM::handleDeviceChanged);
 
-    // The following are blocking operations and will block the llm thread
-    connect(this, &ChatLLM::requestRetrieveFromDB, LocalDocs::globalInstance()->database(), &Database::retrieveFromDB,
-        Qt::BlockingQueuedConnection);
-
-    m_llmThread.setObjectName(parent->id());
+    m_llmThread.setObjectName(parent ? parent->id() : u"server"_s);
     m_llmThread.start();
 }
 
@@ -907,7 +908,7 @@ std::string ChatLLM::applyJinjaTemplate(std::span<const MessageItem> items) cons
 }
 
 auto ChatLLM::promptInternalChat(const QStringList &enabledCollections, const LLModel::PromptContext &ctx,
-                                 qsizetype startOffset) -> ChatPromptResult
+                                 qsizetype startOffset, const ResponseChunkCallback &onChunk) -> ChatPromptResult
 {
     Q_ASSERT(isModelLoaded());
     Q_ASSERT(m_chatModel);
@@ -923,6 +924,7 @@ auto ChatLLM::promptInternalChat(const QStringList &enabledCollections, const LL
     };
 
     QList<ResultInfo> databaseResults;
+    qint64 retrievalMs = -1;
     if (!enabledCollections.isEmpty()) {
         std::optional<std::pair<int, QString>> query;
         {
@@ -934,34 +936,81 @@ auto ChatLLM::promptInternalChat(const QStringList &enabledCollections, const LL
 
         if (query) {
             auto &[promptIndex, queryStr] = *query;
-            const int retrievalSize = MySettings::globalInstance()->localDocsRetrievalSize();
-            emit requestRetrieveFromDB(enabledCollections, queryStr, retrievalSize, &databaseResults); // blocks
+            databaseResults = retrieveSources(enabledCollections, queryStr, &retrievalMs);
             m_chatModel->updateSources(promptIndex, databaseResults);
-            emit databaseResultsChanged(databaseResults);
         }
     }
 
     auto messageItems = getChat();
     messageItems.pop_back(); // exclude new response
 
-    auto result = promptInternal(messageItems, ctx, !databaseResults.isEmpty());
+    auto result = promptInternal(messageItems, ctx, !databaseResults.isEmpty(), onChunk);
     return {
         /*PromptResult*/ {
-            .response       = std::move(result.response),
-            .promptTokens   = result.promptTokens,
-            .responseTokens = result.responseTokens,
+            .response           = std::move(result.response),
+            .promptTokens       = result.promptTokens,
+            .cachedPromptTokens = result.cachedPromptTokens,
+            .responseTokens     = result.responseTokens,
         },
         /*databaseResults*/ std::move(databaseResults),
+        /*retrievalMs*/     retrievalMs,
     };
 }
 
+auto ChatLLM::promptInternalConversation(std::vector<MessageItem> &conversation,
+                                         const QStringList &enabledCollections, const LLModel::PromptContext &ctx,
+                                         const ResponseChunkCallback &onChunk,
+                                         const CancelCallback &isCancelled) -> ChatPromptResult
+{
+    Q_ASSERT(isModelLoaded());
+    Q_ASSERT(!conversation.empty());
+
+    QList<ResultInfo> databaseResults;
+    qint64 retrievalMs = -1;
+    // as in promptInternalChat, the query is the prompt that the new response answers, if there is one
+    if (auto &last = conversation.back(); !enabledCollections.isEmpty() && last.type() == MessageItem::Type::Prompt
+                                          && !(isCancelled && isCancelled())) {
+        databaseResults = retrieveSources(enabledCollections, last.content(), &retrievalMs);
+        last = MessageItem(*last.index(), last.type(), last.content(), databaseResults, last.promptAttachments());
+    }
+
+    auto result = promptInternal(conversation, ctx, !databaseResults.isEmpty(), onChunk, isCancelled);
+    return {
+        /*PromptResult*/ {
+            .response           = std::move(result.response),
+            .promptTokens       = result.promptTokens,
+            .cachedPromptTokens = result.cachedPromptTokens,
+            .responseTokens     = result.responseTokens,
+        },
+        /*databaseResults*/ std::move(databaseResults),
+        /*retrievalMs*/     retrievalMs,
+    };
+}
+
+QList<ResultInfo> ChatLLM::retrieveSources(const QStringList &enabledCollections, const QString &query,
+                                           qint64 *elapsedMs)
+{
+    QList<ResultInfo> databaseResults;
+    const int retrievalSize = MySettings::globalInstance()->localDocsRetrievalSize();
+    QElapsedTimer retrievalTimer;
+    retrievalTimer.start();
+    LocalDocs::globalInstance()->database()->retrieveFromDB(enabledCollections, query, retrievalSize,
+                                                            &databaseResults); // blocks
+    *elapsedMs = retrievalTimer.elapsed();
+    emit databaseResultsChanged(databaseResults);
+    return databaseResults;
+}
+
 class ChatViewResponseHandler : public BaseResponseHandler {
 public:
-    ChatViewResponseHandler(ChatLLM *cllm, QElapsedTimer *totalTime, ChatLLM::PromptResult *result)
-        : m_cllm(cllm), m_totalTime(totalTime), m_result(result) {}
+    ChatViewResponseHandler(ChatLLM *cllm, QElapsedTimer *totalTime, ChatLLM::PromptResult *result,
+                            const ChatLLM::ResponseChunkCallback &onChunk, const ChatLLM::CancelCallback &isCancelled)
+        : m_cllm(cllm), m_totalTime(totalTime), m_result(result), m_onChunk(onChunk), m_isCancelled(isCancelled) {}
 
     void onSplitIntoTwo(const QString &startTag, const QString &firstBuffer, const QString &secondBuffer) override
     {
+        if (!m_cllm->m_chatModel)
+            return;
         if (startTag == ToolCallConstants::ThinkStartTag)
             m_cllm->m_chatModel->splitThinking({ firstBuffer, secondBuffer });
         else
@@ -970,6 +1019,8 @@ public:
 
     void onSplitIntoThree(const QString &secondBuffer, const QString &thirdBuffer) override
     {
+        if (!m_cllm->m_chatModel)
+            return;
         m_cllm->m_chatModel->endThinking({ secondBuffer, thirdBuffer }, m_totalTime->elapsed());
     }
 
@@ -978,11 +1029,15 @@ public:
         m_result->responseTokens++;
         m_cllm->m_timer->inc();
         m_result->response.append(chunk);
+        if (m_onChunk)
+            m_onChunk(std::string_view(chunk.constData(), chunk.size()));
     }
 
     bool onBufferResponse(const QString &response, int bufferIdx) override
     {
         Q_UNUSED(bufferIdx)
+        if (!m_cllm->m_chatModel)
+            return true; // nothing to show the response in
         try {
             QString r = response;
             m_cllm->m_chatModel->setResponseValue(removeLeadingWhitespace(r));
@@ -999,23 +1054,29 @@ public:
 
     bool onRegularResponse() override
     {
+        if (!m_cllm->m_chatModel)
+            return !getStopGenerating(); // do not convert the whole response on every token
         auto respStr = QString::fromUtf8(m_result->response);
         return onBufferResponse(respStr, 0);
     }
 
     bool getStopGenerating() const override
-    { return m_cllm->m_stopGenerating; }
+    { return m_cllm->m_stopGenerating || (m_isCancelled && m_isCancelled()); }
 
 private:
-    ChatLLM               *m_cllm;
-    QElapsedTimer         *m_totalTime;
-    ChatLLM::PromptResult *m_result;
+    ChatLLM                              *m_cllm;
+    QElapsedTimer                        *m_totalTime;
+    ChatLLM::PromptResult                *m_result;
+    const ChatLLM::ResponseChunkCallback &m_onChunk;
+    const ChatLLM::CancelCallback        &m_isCancelled;
 };
 
 auto ChatLLM::promptInternal(
     const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
     const LLModel::PromptContext &ctx,
-    bool usedLocalDocs
+    bool usedLocalDocs,
+    const ResponseChunkCallback &onChunk,
+    const CancelCallback &isCancelled
 ) -> PromptResult
 {
     Q_ASSERT(isModelLoaded());
@@ -1052,17 +1113,30 @@ auto ChatLLM::promptInternal(
 
     PromptResult result {};
 
-    auto handlePrompt = [this, &result](std::span<const LLModel::Token> batch, bool cached) -> bool {
-        Q_UNUSED(cached)
+    QElapsedTimer totalTime;
+    totalTime.start();
+    ChatViewResponseHandler respHandler(this, &totalTime, &result, onChunk, isCancelled);
+
+    // Each decode reports the prefix it reused from the KV cache as one cached batch before the tokens it decodes. When
+    // the prompt does not fit, the tokens it drops are reported as cached first, so only the last of consecutive
+    // cached batches is the reused prefix. The reused prefix is reported before anything is decoded, so a cancellation
+    // stops the prompt before its decoding starts. It is seen through isCancelled, as m_stopGenerating is reset below.
+    int lastCachedBatch = -1; // none since the last decoded token
+    auto handlePrompt = [this, &result, &lastCachedBatch, &respHandler](std::span<const LLModel::Token> batch,
+                                                                        bool cached) -> bool {
         result.promptTokens += batch.size();
+        if (cached) {
+            if (lastCachedBatch >= 0)
+                result.cachedPromptTokens -= lastCachedBatch;
+            lastCachedBatch = int(batch.size());
+            result.cachedPromptTokens += lastCachedBatch;
+        } else {
+            lastCachedBatch = -1;
+        }
         m_timer->start();
-        return !m_stopGenerating;
+        return !respHandler.getStopGenerating();
     };
 
-    QElapsedTimer totalTime;
-    totalTime.start();
-    ChatViewResponseHandler respHandler(this, &totalTime, &result);
-
     m_timer->start();
     QStringList finalBuffers;
     bool        shouldExecuteTool;
@@ -1085,7 +1159,7 @@ auto ChatLLM::promptInternal(
 
     // trim trailing whitespace
     auto respStr = QString::fromUtf8(result.response);
-    if (!respStr.isEmpty() && (std::as_const(respStr).back().isSpace() || finalBuffers.size() > 1)) {
+    if (m_chatModel && !respStr.isEmpty() && (std::as_const(respStr).back().isSpace() || finalBuffers.size() > 1)) {
         if (finalBuffers.size() > 1)
             m_chatModel->setResponseValue(finalBuffers.last().trimmed());
         else
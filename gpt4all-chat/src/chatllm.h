@@ -20,6 +20,7 @@
 #include <QtNumeric>
 
 #include <atomic>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <span>
@@ -149,6 +150,11 @@ class ChatLLM : public QObject
     Q_PROPERTY(QString device READ device NOTIFY loadedModelInfoChanged)
     Q_PROPERTY(QString fallbackReason READ fallbackReason NOTIFY loadedModelInfoChanged)
 public:
+    // receives raw pieces of the response as they are generated
+    using ResponseChunkCallback = std::function<void(std::string_view chunk)>;
+    // tells whether the response is no longer wanted, e.g. because the client that asked for it went away
+    using CancelCallback = std::function<bool()>;
+
     ChatLLM(Chat *parent, bool isServer = false);
     virtual ~ChatLLM();
 
@@ -231,7 +237,6 @@ Q_SIGNALS:
     void shouldBeLoadedChanged();
     void trySwitchContextRequested(const ModelInfo &modelInfo);
     void trySwitchContextOfLoadedModelCompleted(int value);
-    void requestRetrieveFromDB(const QList<QString> &collections, const QString &text, int retrievalSize, QList<ResultInfo> *results);
     void reportSpeed(const QString &speed);
     void reportDevice(const QString &device);
     void reportFallbackReason(const QString &fallbackReason);
@@ -239,36 +244,53 @@ Q_SIGNALS:
     void modelInfoChanged(const ModelInfo &modelInfo);
 
 protected:
+    // used by server workers that keep their conversations out of the chat's model
+    ChatLLM(Chat *parent, ChatModel *chatModel, bool isServer);
+
     struct PromptResult {
         QByteArray response;       // raw UTF-8
         int        promptTokens;   // note: counts *entire* history, even if cached
+        int        cachedPromptTokens; // prompt tokens reused from the KV cache
         int        responseTokens;
     };
 
     struct ChatPromptResult : PromptResult {
         QList<ResultInfo> databaseResults;
+        qint64            retrievalMs = -1; // time spent searching LocalDocs, or -1 if it was not searched
     };
 
     ChatPromptResult promptInternalChat(const QStringList &enabledCollections, const LLModel::PromptContext &ctx,
-                                        qsizetype startOffset = 0);
-    // passing a string_view directly skips templating and uses the raw string
+                                        qsizetype startOffset = 0, const ResponseChunkCallback &onChunk = {});
+    // Like promptInternalChat, but for a conversation that is not stored in the chat model. The conversation does not
+    // include the new response. Sources retrieved for its last prompt are attached to that prompt.
+    ChatPromptResult promptInternalConversation(std::vector<MessageItem> &conversation,
+                                                const QStringList &enabledCollections,
+                                                const LLModel::PromptContext &ctx,
+                                                const ResponseChunkCallback &onChunk = {},
+                                                const CancelCallback &isCancelled = {});
+    // Passing a string_view directly skips templating and uses the raw string. Generation stops as soon as isCancelled
+    // returns true, which is checked while the prompt is decoded as well as for each token of the response.
     PromptResult promptInternal(const std::variant<std::span<const MessageItem>, std::string_view> &prompt,
                                 const LLModel::PromptContext &ctx,
-                                bool usedLocalDocs);
+                                bool usedLocalDocs,
+                                const ResponseChunkCallback &onChunk = {},
+                                const CancelCallback &isCancelled = {});
+
+    // Applies the Jinja template. Query mode returns only the last message without special tokens.
+    // Returns a (# of messages, rendered prompt) pair.
+    std::string applyJinjaTemplate(std::span<const MessageItem> items) const;
 
 private:
     bool loadNewModel(const ModelInfo &modelInfo, QVariantMap &modelLoadProps);
 
     std::vector<MessageItem> forkConversation(const QString &prompt) const;
 
-    // Applies the Jinja template. Query mode returns only the last message without special tokens.
-    // Returns a (# of messages, rendered prompt) pair.
-    std::string applyJinjaTemplate(std::span<const MessageItem> items) const;
+    QList<ResultInfo> retrieveSources(const QStringList &enabledCollections, const QString &query, qint64 *elapsedMs);
 
     void generateQuestions(qint64 elapsed);
 
 protected:
-    QPointer<ChatModel> m_chatModel;
+    QPointer<ChatModel> m_chatModel; // may be null for the server, which then only returns the response
 
 private:
     const Chat *m_chat;
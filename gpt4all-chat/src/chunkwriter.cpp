@@ -0,0 +1,146 @@
+#include "chunkwriter.h"
+
+#include <QSet>
+#include <QStringList>
+#include <QVariant>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// SQLite allows 32766 parameters per statement, this stays well below it for all of the statements
+static constexpr std::size_t ROWS_PER_STATEMENT = 32;
+
+static const QString INSERT_CHUNKS_SQL = uR"(
+    insert into chunks(document_id, chunk_text,
+        file, title, author, subject, keywords, page, line_from, line_to, words, tokens, text_hash)
+        values %1
+        returning id;
+)"_s;
+
+// insert embeddings only if still needed
+static const QString INSERT_EMBEDDINGS_SQL = uR"(
+    insert into embeddings(model, folder_id, chunk_id, embedding)
+    select v.column1, d.folder_id, v.column2, v.column3
+    from (values %1) v
+    join chunks c on c.id = v.column2
+    join documents d on d.id = c.document_id
+    where exists (
+        select 1
+        from collection_items ci
+        join collections co on co.id = ci.collection_id
+        where ci.folder_id = d.folder_id and co.embedding_model = v.column1
+    )
+    returning model, chunk_id;
+)"_s;
+
+// "(?, ?), (?, ?), ..."
+static QString valuesPlaceholders(int nColumns, std::size_t nRows)
+{
+    QStringList columns(nColumns, u"?"_s);
+    QString row = u'(' + columns.join(u", ") + u')';
+    QStringList rows(qsizetype(nRows), row);
+    return rows.join(u", ");
+}
+
+ChunkWriter::ChunkWriter(const QSqlDatabase &db)
+    : m_db(db) {}
+
+bool ChunkWriter::prepare(Statements &statements, const QString &sql, int nColumns)
+{
+    if (statements.prepared)
+        return true;
+    auto prepareOne = [&](QSqlQuery &q, std::size_t nRows) {
+        q = QSqlQuery(m_db);
+        q.setForwardOnly(true);
+        return q.prepare(sql.arg(valuesPlaceholders(nColumns, nRows))) || fail(q);
+    };
+    statements.prepared = prepareOne(statements.many, ROWS_PER_STATEMENT) && prepareOne(statements.one, 1);
+    return statements.prepared;
+}
+
+bool ChunkWriter::fail(const QSqlQuery &q)
+{
+    m_lastError = q.lastError();
+    return false;
+}
+
+bool ChunkWriter::addChunks(std::span<const Chunk> chunks, QList<int> &chunkIds)
+{
+    if (!prepare(m_insertChunks, INSERT_CHUNKS_SQL, 13))
+        return false;
+
+    for (std::size_t i = 0; i < chunks.size();) {
+        const std::size_t nRows = chunks.size() - i >= ROWS_PER_STATEMENT ? ROWS_PER_STATEMENT : 1;
+        const auto rows = chunks.subspan(i, nRows);
+
+        QSqlQuery &q = nRows > 1 ? m_insertChunks.many : m_insertChunks.one;
+        int param = 0;
+        for (const Chunk &c: rows) {
+            q.bindValue(param++, c.documentId);
+            q.bindValue(param++, c.text);
+            q.bindValue(param++, c.file);
+            q.bindValue(param++, c.title);
+            q.bindValue(param++, c.author);
+            q.bindValue(param++, c.subject);
+            q.bindValue(param++, c.keywords);
+            q.bindValue(param++, c.page);
+            q.bindValue(param++, c.lineFrom);
+            q.bindValue(param++, c.lineTo);
+            q.bindValue(param++, c.words);
+            q.bindValue(param++, c.tokens);
+            q.bindValue(param++, c.textHash);
+        }
+        if (!q.exec())
+            return fail(q);
+        // the rows of returning come in no particular order, but the new IDs increase in the order of the values
+        QList<int> ids;
+        ids.reserve(qsizetype(nRows));
+        while (q.next())
+            ids << q.value(0).toInt();
+        q.finish();
+        if (ids.size() != qsizetype(nRows)) {
+            m_lastError = QSqlError(u"ChunkWriter"_s, u"expected %1 new chunks, got %2"_s.arg(nRows).arg(ids.size()),
+                                    QSqlError::StatementError);
+            return false;
+        }
+        std::sort(ids.begin(), ids.end());
+
+        chunkIds << ids;
+        i += nRows;
+    }
+    return true;
+}
+
+bool ChunkWriter::addEmbeddings(std::span<const Embedding> embeddings, QList<bool> &added)
+{
+    if (!prepare(m_insertEmbeddings, INSERT_EMBEDDINGS_SQL, 3))
+        return false;
+
+    for (std::size_t i = 0; i < embeddings.size();) {
+        const std::size_t nRows = embeddings.size() - i >= ROWS_PER_STATEMENT ? ROWS_PER_STATEMENT : 1;
+        const auto rows = embeddings.subspan(i, nRows);
+
+        QSqlQuery &q = nRows > 1 ? m_insertEmbeddings.many : m_insertEmbeddings.one;
+        int param = 0;
+        for (const Embedding &e: rows) {
+            q.bindValue(param++, e.model);
+            q.bindValue(param++, e.chunkId);
+            q.bindValue(param++, e.data);
+        }
+        if (!q.exec())
+            return fail(q);
+        QSet<std::pair<QString, int>> inserted;
+        while (q.next())
+            inserted.insert({ q.value(0).toString(), q.value(1).toInt() });
+        q.finish();
+
+        for (const Embedding &e: rows)
+            added << inserted.contains({ e.model, e.chunkId });
+        i += nRows;
+    }
+    return true;
+}
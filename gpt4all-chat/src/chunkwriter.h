@@ -0,0 +1,70 @@
+#ifndef CHUNKWRITER_H
+#define CHUNKWRITER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+
+#include <span>
+
+
+// Inserts LocalDocs chunks and their embeddings, many rows per statement. The full-text index follows the chunks table
+// by triggers. The statements are prepared on first use and kept for the life of the writer, so the writer must not
+// outlive the connection it was made for. Database keeps one per connection, on the database thread.
+class ChunkWriter
+{
+public:
+    struct Chunk {
+        int        documentId;
+        QString    text;
+        QString    file;
+        QString    title;
+        QString    author;
+        QString    subject;
+        QString    keywords;
+        int        page;
+        int        lineFrom;
+        int        lineTo;
+        int        words;
+        int        tokens;
+        QByteArray textHash;
+    };
+
+    struct Embedding {
+        QString    model;
+        int        chunkId;
+        QByteArray data;
+    };
+
+    explicit ChunkWriter(const QSqlDatabase &db);
+
+    // appends the IDs of the new chunks to chunkIds, in the order of chunks
+    bool addChunks(std::span<const Chunk> chunks, QList<int> &chunkIds);
+    // Appends whether each embedding was added to added. It is not if its chunk was removed, or is no longer in a
+    // collection that uses its model.
+    bool addEmbeddings(std::span<const Embedding> embeddings, QList<bool> &added);
+
+    // of the last failed call
+    QSqlError lastError() const { return m_lastError; }
+
+private:
+    // a statement for rowsPerStatement rows at a time and one for the rest, one by one
+    struct Statements {
+        QSqlQuery many;
+        QSqlQuery one;
+        bool      prepared = false;
+    };
+
+    bool prepare(Statements &statements, const QString &sql, int nColumns);
+    bool fail(const QSqlQuery &q);
+
+    QSqlDatabase m_db;
+    Statements   m_insertChunks;
+    Statements   m_insertEmbeddings;
+    QSqlError    m_lastError;
+};
+
+#endif // CHUNKWRITER_H
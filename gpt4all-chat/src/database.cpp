@@ -1,36 +1,47 @@
 #include "database.h"
 
+#include "chunkwriter.h"
+#include "embeddingindex.h"
+#include "embeddingstore.h"
+#include "folderwatcher.h"
 #include "mysettings.h"
 #include "utils.h" // IWYU pragma: keep
 
 #include <duckx/duckx.hpp>
 #include <fmt/format.h>
-#include <usearch/index.hpp>
-#include <usearch/index_plugins.hpp>
 
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QDir>
 #include <QDirIterator>
 #include <QFile>
-#include <QFileSystemWatcher>
 #include <QFlags>
 #include <QIODevice>
 #include <QKeyValueIterator>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QReadLocker>
 #include <QRegularExpression>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QStandardPaths>
 #include <QTextStream>
 #include <QTimer>
 #include <QMap>
 #include <QUtf8StringView>
 #include <QVariant>
+#include <QWriteLocker>
 #include <QtLogging>
 #include <QtMinMax>
 #include <QtTypes>
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <latch>
 #include <optional>
+#include <span>
 #include <stdexcept>
 
 #ifdef GPT4ALL_USE_QTPDF
@@ -43,8 +54,8 @@
 #endif
 
 using namespace Qt::Literals::StringLiterals;
+using namespace std::chrono_literals;
 namespace ranges = std::ranges;
-namespace us = unum::usearch;
 
 //#define DEBUG
 //#define DEBUG_EXAMPLE
@@ -95,7 +106,37 @@ private:
 
 } // namespace
 
-static int s_batchSize = 100;
+// the number of searches that read the database at the same time, each with a connection of its own
+static constexpr int RETRIEVAL_THREADS = 4;
+
+// the number of threads that list the directories of a folder when it is scanned, mostly waiting for the disk
+static constexpr int SCAN_THREADS = 8;
+
+// Requests to the embedding model are sized to keep it busy for a few passes. Each of its contexts gets one, and one
+// more is in flight, so that the next one is ready as soon as a context is done with its current one.
+static constexpr int EMBEDDING_REQUEST_PASSES = 4;
+
+// the generation of the embeddings of each folder, see SELECT_STORE_GENERATION_SQL
+static const QString CREATE_EMBEDDING_STORES_SQL = uR"(
+    create table embedding_stores(
+        model      text not null,
+        folder_id  integer not null,
+        generation integer not null,
+        primary key(model, folder_id),
+        foreign key(folder_id) references folders(id)
+    );
+)"_s;
+
+// A random id of the database, for the files that are saved next to it. Those of another database at the same path,
+// such as one that replaced it, do not have its id.
+static const QString CREATE_DATABASE_ID_SQL[] = {
+    u"create table database_id(id text not null);"_s,
+    u"insert into database_id(id) values(lower(hex(randomblob(16))));"_s,
+};
+
+static const QString SELECT_DATABASE_ID_SQL = uR"(
+    select id from database_id;
+)"_s;
 
 static const QString INIT_DB_SQL[] = {
     // automatically free unused disk space
@@ -116,22 +157,9 @@ static const QString INIT_DB_SQL[] = {
             line_to       integer,
             words         integer default 0 not null,
             tokens        integer default 0 not null,
+            text_hash     blob,
             foreign key(document_id) references documents(id)
         );
-    )"_s, uR"(
-        create virtual table chunks_fts using fts5(
-            id unindexed,
-            document_id unindexed,
-            chunk_text,
-            file,
-            title,
-            author,
-            subject,
-            keywords,
-            content='chunks',
-            content_rowid='id',
-            tokenize='porter'
-        );
     )"_s, uR"(
         create table collections(
             id                  integer primary key,
@@ -159,6 +187,7 @@ static const QString INIT_DB_SQL[] = {
             folder_id     integer not null,
             document_time integer not null,
             document_path text unique not null,
+            content_hash  blob,
             foreign key(folder_id) references folders(id)
         );
     )"_s, uR"(
@@ -173,39 +202,102 @@ static const QString INIT_DB_SQL[] = {
             unique(model, chunk_id)
         );
     )"_s,
+    CREATE_EMBEDDING_STORES_SQL,
+    CREATE_DATABASE_ID_SQL[0],
+    CREATE_DATABASE_ID_SQL[1],
+    uR"(
+        create index chunks_text_hash on chunks(text_hash);
+    )"_s,
 };
 
-static const QString INSERT_CHUNK_SQL = uR"(
-    insert into chunks(document_id, chunk_text,
-        file, title, author, subject, keywords, page, line_from, line_to, words)
-        values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
-        returning id;
+// the columns, tables and index that version 4 added to those of version 3
+static const QString MIGRATE_V3_SQL[] = {
+    u"alter table chunks add column text_hash blob;"_s,
+    u"alter table documents add column content_hash blob;"_s,
+    CREATE_EMBEDDING_STORES_SQL,
+    CREATE_DATABASE_ID_SQL[0],
+    CREATE_DATABASE_ID_SQL[1],
+    u"create index chunks_text_hash on chunks(text_hash);"_s,
+};
+
+static const QString SELECT_CHUNK_TEXTS_SQL = uR"(
+    select id, chunk_text from chunks where id > ? order by id limit 1000;
 )"_s;
 
-static const QString INSERT_CHUNK_FTS_SQL = uR"(
-        insert into chunks_fts(document_id, chunk_text,
-            file, title, author, subject, keywords)
-            values(?, ?, ?, ?, ?, ?, ?);
+static const QString UPDATE_CHUNK_TEXT_HASH_SQL = uR"(
+    update chunks set text_hash = ? where id = ?;
 )"_s;
 
-static const QString SELECT_CHUNKED_DOCUMENTS_SQL[] = {
+// the full-text index of the chunks, kept in sync with them by triggers
+static const QString CHUNKS_FTS_SQL[] = {
     uR"(
-        select distinct document_id from chunks;
+        create virtual table chunks_fts using fts5(
+            document_id unindexed,
+            chunk_text,
+            file,
+            title,
+            author,
+            subject,
+            keywords,
+            content='chunks',
+            content_rowid='id',
+            tokenize='porter'
+        );
+    )"_s, uR"(
+        create trigger chunks_fts_insert after insert on chunks begin
+            insert into chunks_fts(rowid, document_id, chunk_text, file, title, author, subject, keywords)
+                values(new.id, new.document_id, new.chunk_text, new.file, new.title, new.author, new.subject,
+                       new.keywords);
+        end;
     )"_s, uR"(
-        select distinct document_id from chunks_fts;
+        create trigger chunks_fts_delete after delete on chunks begin
+            insert into chunks_fts(chunks_fts, rowid, document_id, chunk_text, file, title, author, subject, keywords)
+                values('delete', old.id, old.document_id, old.chunk_text, old.file, old.title, old.author,
+                       old.subject, old.keywords);
+        end;
+    )"_s, uR"(
+        create trigger chunks_fts_update
+        after update of document_id, chunk_text, file, title, author, subject, keywords on chunks begin
+            insert into chunks_fts(chunks_fts, rowid, document_id, chunk_text, file, title, author, subject, keywords)
+                values('delete', old.id, old.document_id, old.chunk_text, old.file, old.title, old.author,
+                       old.subject, old.keywords);
+            insert into chunks_fts(rowid, document_id, chunk_text, file, title, author, subject, keywords)
+                values(new.id, new.document_id, new.chunk_text, new.file, new.title, new.author, new.subject,
+                       new.keywords);
+        end;
     )"_s,
 };
 
+static const QString DROP_CHUNKS_FTS_SQL = uR"(
+    drop table chunks_fts;
+)"_s;
+
+static const QString FTS_REBUILD_SQL = uR"(
+    insert into chunks_fts(chunks_fts) values('rebuild');
+)"_s;
+
+static bool createChunksFts(QSqlQuery &q)
+{
+    for (const auto &cmd: CHUNKS_FTS_SQL) {
+        if (!q.exec(cmd))
+            return false;
+    }
+    return true;
+}
+
+static const QString SELECT_CHUNKED_DOCUMENTS_SQL = uR"(
+    select distinct document_id from chunks;
+)"_s;
+
+// the full-text index is updated by a trigger
 static const QString DELETE_CHUNKS_SQL[] = {
     uR"(
         delete from embeddings
         where chunk_id in (
-            select id from chunks where document_id = ?
+            select id from chunks where document_id = ? and id < ?
         );
     )"_s, uR"(
-        delete from chunks where document_id = ?;
-    )"_s, uR"(
-        delete from chunks_fts where document_id = ?;
+        delete from chunks where document_id = ? and id < ?;
     )"_s,
 };
 
@@ -224,7 +316,7 @@ static const QString SELECT_CHUNKS_SQL = uR"(
 )"_s;
 
 static const QString SELECT_UNCOMPLETED_CHUNKS_SQL = uR"(
-    select co.name, co.embedding_model, c.id, d.folder_id, c.chunk_text
+    select co.name, co.embedding_model, c.id, d.folder_id, c.chunk_text, c.tokens
     from chunks c
     join documents d on d.id = c.document_id
     join folders f on f.id = d.folder_id
@@ -245,7 +337,7 @@ static const QString SELECT_COUNT_CHUNKS_SQL = uR"(
 )"_s;
 
 static const QString SELECT_CHUNKS_FTS_SQL = uR"(
-    select fts.id, bm25(chunks_fts) as score
+    select fts.rowid, bm25(chunks_fts) as score
     from chunks_fts fts
     join documents d on fts.document_id = d.id
     join collection_items ci on d.folder_id = ci.folder_id
@@ -265,7 +357,7 @@ static const QString SELECT_CHUNKS_FTS_SQL = uR"(
 NAMED_PAIR(EmbeddingKey, QString, embedding_model, int, chunk_id)
 
 namespace {
-    struct IncompleteChunk: EmbeddingKey { int folder_id; QString text; };
+    struct IncompleteChunk: EmbeddingKey { int folder_id; QString text; int tokens; };
 } // namespace
 
 static bool selectAllUncompletedChunks(QSqlQuery &q, QHash<IncompleteChunk, QStringList> &chunks)
@@ -281,6 +373,7 @@ static bool selectAllUncompletedChunks(QSqlQuery &q, QHash<IncompleteChunk, QStr
             },
             /*folder_id =*/ q.value(3).toInt(),
             /*text      =*/ q.value(4).toString(),
+            /*tokens    =*/ q.value(5).toInt(),
         };
         chunks[ic] << collection;
     }
@@ -362,14 +455,6 @@ static const QString UPDATE_LAST_UPDATE_TIME_SQL = uR"(
     update collections set last_update_time = ? where id = ?;
 )"_s;
 
-static const QString FTS_INTEGRITY_SQL = uR"(
-    insert into chunks_fts(chunks_fts, rank) values('integrity-check', 1);
-)"_s;
-
-static const QString FTS_REBUILD_SQL = uR"(
-    insert into chunks_fts(chunks_fts) values('rebuild');
-)"_s;
-
 static bool addCollection(QSqlQuery &q, const QString &collection_name, const QDateTime &start_update,
                           const QDateTime &last_update, const QString &embedding_model, CollectionItem &item)
 {
@@ -444,6 +529,7 @@ static bool selectAllFromCollections(QSqlQuery &q, QList<CollectionItem> *collec
         break;
     case 2:
     case 3:
+    case 4:
         if (!q.prepare(SELECT_COLLECTIONS_SQL_V2))
             return false;
         break;
@@ -508,6 +594,10 @@ static const QString DELETE_FOLDERS_SQL = uR"(
     delete from folders where id = ?;
     )"_s;
 
+static const QString DELETE_FOLDER_STORE_GENERATIONS_SQL = uR"(
+    delete from embedding_stores where folder_id = ?;
+    )"_s;
+
 static const QString SELECT_FOLDERS_FROM_PATH_SQL = uR"(
     select id from folders where path = ?;
     )"_s;
@@ -561,6 +651,11 @@ static bool addFolderToDB(QSqlQuery &q, const QString &folder_path, int *folder_
 
 static bool removeFolderFromDB(QSqlQuery &q, int folder_id)
 {
+    if (!q.prepare(DELETE_FOLDER_STORE_GENERATIONS_SQL))
+        return false;
+    q.addBindValue(folder_id);
+    if (!q.exec())
+        return false;
     if (!q.prepare(DELETE_FOLDERS_SQL))
         return false;
     q.addBindValue(folder_id);
@@ -643,8 +738,8 @@ static const QString INSERT_DOCUMENTS_SQL = uR"(
     insert into documents(folder_id, document_time, document_path) values(?, ?, ?);
     )"_s;
 
-static const QString UPDATE_DOCUMENT_TIME_SQL = uR"(
-    update documents set document_time = ? where id = ?;
+static const QString UPDATE_DOCUMENT_SQL = uR"(
+    update documents set document_time = ?, content_hash = ? where id = ?;
     )"_s;
 
 static const QString DELETE_DOCUMENTS_SQL = uR"(
@@ -652,7 +747,7 @@ static const QString DELETE_DOCUMENTS_SQL = uR"(
     )"_s;
 
 static const QString SELECT_DOCUMENT_SQL = uR"(
-    select id, document_time from documents where document_path = ?;
+    select id, document_time, content_hash from documents where document_path = ?;
     )"_s;
 
 static const QString SELECT_DOCUMENTS_SQL = uR"(
@@ -660,7 +755,13 @@ static const QString SELECT_DOCUMENTS_SQL = uR"(
     )"_s;
 
 static const QString SELECT_ALL_DOCUMENTS_SQL = uR"(
-    select id, document_path from documents;
+    select id, document_path, folder_id from documents;
+    )"_s;
+
+// the document at a path, or those under it if it is a directory
+static const QString SELECT_DOCUMENTS_UNDER_PATH_SQL = uR"(
+    select id, document_path from documents
+    where folder_id = ? and (document_path = ? or (document_path >= ? and document_path < ?));
     )"_s;
 
 static const QString SELECT_COUNT_STATISTICS_SQL = uR"(
@@ -691,16 +792,18 @@ static bool removeDocument(QSqlQuery &q, int document_id)
     return q.exec();
 }
 
-static bool updateDocument(QSqlQuery &q, int id, qint64 document_time)
+static bool updateDocument(QSqlQuery &q, int id, qint64 document_time, const QByteArray &content_hash)
 {
-    if (!q.prepare(UPDATE_DOCUMENT_TIME_SQL))
+    if (!q.prepare(UPDATE_DOCUMENT_SQL))
         return false;
     q.addBindValue(document_time);
+    q.addBindValue(content_hash);
     q.addBindValue(id);
     return q.exec();
 }
 
-static bool selectDocument(QSqlQuery &q, const QString &document_path, int *id, qint64 *document_time)
+static bool selectDocument(QSqlQuery &q, const QString &document_path, int *id, qint64 *document_time,
+                           QByteArray *content_hash)
 {
     if (!q.prepare(SELECT_DOCUMENT_SQL))
         return false;
@@ -711,6 +814,7 @@ static bool selectDocument(QSqlQuery &q, const QString &document_path, int *id,
     if (q.next()) {
         *id = q.value(0).toInt();
         *document_time = q.value(1).toLongLong();
+        *content_hash = q.value(2).toByteArray();
     }
     return true;
 }
@@ -727,6 +831,22 @@ static bool selectDocuments(QSqlQuery &q, int folder_id, QList<int> *documentIds
     return true;
 }
 
+static bool selectDocumentsUnderPath(QSqlQuery &q, int folder_id, const QString &path,
+                                     QList<std::pair<int, QString>> *documents)
+{
+    if (!q.prepare(SELECT_DOCUMENTS_UNDER_PATH_SQL))
+        return false;
+    q.addBindValue(folder_id);
+    q.addBindValue(path);
+    q.addBindValue(path + u'/');
+    q.addBindValue(path + u'0'); // the character after '/'
+    if (!q.exec())
+        return false;
+    while (q.next())
+        documents->append({ q.value(0).toInt(), q.value(1).toString() });
+    return true;
+}
+
 static bool selectCountStatistics(QSqlQuery &q, int folder_id, int *total_docs, int *total_words, int *total_tokens)
 {
     if (!q.prepare(SELECT_COUNT_STATISTICS_SQL))
@@ -742,31 +862,65 @@ static bool selectCountStatistics(QSqlQuery &q, int folder_id, int *total_docs,
     return true;
 }
 
-// insert embedding only if still needed
-static const QString INSERT_EMBEDDING_SQL = uR"(
-    insert into embeddings(model, folder_id, chunk_id, embedding)
-    select :model, d.folder_id, :chunk_id, :embedding
-    from chunks c
-    join documents d on d.id = c.document_id
-    join folders f on f.id = d.folder_id
-    join collection_items ci on ci.folder_id = f.id
-    join collections co on co.id = ci.collection_id
-    where co.embedding_model = :model and c.id = :chunk_id
-    limit 1;
+static const QString GET_COLLECTION_FOLDERS_SQL = uR"(
+    select distinct co.embedding_model, ci.folder_id
+    from collections co
+    join collection_items ci on ci.collection_id = co.id
+    where co.name in ('%1') and co.embedding_model is not null;
 )"_s;
 
-static const QString GET_COLLECTION_EMBEDDINGS_SQL = uR"(
-    select e.chunk_id, e.embedding
-    from embeddings e
-    join collections co on co.embedding_model = e.model
-    join collection_items ci on ci.folder_id = e.folder_id and ci.collection_id = co.id
-    where co.name in ('%1');
+static const QString GET_ALL_COLLECTION_FOLDERS_SQL = uR"(
+    select distinct co.embedding_model, ci.folder_id
+    from collections co
+    join collection_items ci on ci.collection_id = co.id
+    where co.embedding_model is not null;
+)"_s;
+
+static const QString GET_FOLDER_EMBEDDINGS_SQL = uR"(
+    select chunk_id, embedding from embeddings where model = ? and folder_id = ?;
+)"_s;
+
+// The generation of the embeddings of a folder is advanced by each transaction that changes them, and saved in their
+// store once it commits, so that a store that missed a change, or saw one that was rolled back, is told apart.
+static const QString SELECT_STORE_GENERATION_SQL = uR"(
+    select generation from embedding_stores where model = ? and folder_id = ?;
+)"_s;
+
+static const QString SELECT_ALL_STORE_GENERATIONS_SQL = uR"(
+    select model, folder_id, generation from embedding_stores;
 )"_s;
 
-static const QString GET_CHUNK_EMBEDDINGS_SQL = uR"(
-    select e.chunk_id, e.embedding
+static const QString ADVANCE_STORE_GENERATION_SQL = uR"(
+    insert into embedding_stores(model, folder_id, generation) values(?, ?, 1)
+    on conflict(model, folder_id) do update set generation = generation + 1
+    returning generation;
+)"_s;
+
+static const QString GET_DOCUMENT_EMBEDDINGS_SQL = uR"(
+    select e.model, e.folder_id, e.chunk_id
     from embeddings e
-    where e.chunk_id in (%1);
+    join chunks c on c.id = e.chunk_id
+    where c.document_id = ? and c.id < ?;
+)"_s;
+
+static const QString SELECT_EMBEDDINGS_BY_TEXT_SQL = uR"(
+    select c.text_hash, e.embedding
+    from chunks c
+    cross join embeddings e on e.chunk_id = c.id -- look up the few chunks by text first
+    where e.model = ? and c.text_hash in (%1);
+)"_s;
+
+// the chunks of a batch are written under a savepoint, so that a batch that fails leaves the rest of the transaction
+static const QString SAVEPOINT_CHUNK_BATCH_SQL = uR"(
+    savepoint chunk_batch;
+)"_s;
+
+static const QString RELEASE_CHUNK_BATCH_SQL = uR"(
+    release chunk_batch;
+)"_s;
+
+static const QString ROLLBACK_CHUNK_BATCH_SQL = uR"(
+    rollback to chunk_batch;
 )"_s;
 
 static const QString GET_CHUNK_FILE_SQL = uR"(
@@ -774,27 +928,29 @@ static const QString GET_CHUNK_FILE_SQL = uR"(
 )"_s;
 
 namespace {
-    struct Embedding { QString model; int folder_id; int chunk_id; QByteArray data; };
+    struct Embedding { QString model; int folder_id; int chunk_id; QByteArray data; bool added = false; };
     struct EmbeddingStat { QString lastFile; int nAdded; int nSkipped; };
 } // namespace
 
 NAMED_PAIR(EmbeddingFolder, QString, embedding_model, int, folder_id)
 
-static bool sqlAddEmbeddings(QSqlQuery &q, const QList<Embedding> &embeddings, QHash<EmbeddingFolder, EmbeddingStat> &embeddingStats)
+static bool sqlAddEmbeddings(ChunkWriter &writer, QSqlQuery &q, QList<Embedding> &embeddings,
+                             QHash<EmbeddingFolder, EmbeddingStat> &embeddingStats)
 {
-    if (!q.prepare(INSERT_EMBEDDING_SQL))
-        return false;
+    QList<ChunkWriter::Embedding> rows;
+    rows.reserve(embeddings.size());
+    for (const auto &e: std::as_const(embeddings))
+        rows.append({ e.model, e.chunk_id, e.data });
 
     // insert embedding if needed
-    for (const auto &e: embeddings) {
-        q.bindValue(":model", e.model);
-        q.bindValue(":chunk_id", e.chunk_id);
-        q.bindValue(":embedding", e.data);
-        if (!q.exec())
-            return false;
-
+    QList<bool> added;
+    if (!writer.addEmbeddings(rows, added))
+        return false;
+    for (qsizetype i = 0; i < embeddings.size(); i++) {
+        auto &e = embeddings[i];
         auto &stat = embeddingStats[{ e.model, e.folder_id }];
-        if (q.numRowsAffected()) {
+        e.added = added[i];
+        if (e.added) {
             stat.nAdded++; // embedding added
         } else {
             stat.nSkipped++; // embedding no longer needed
@@ -818,82 +974,180 @@ static bool sqlAddEmbeddings(QSqlQuery &q, const QList<Embedding> &embeddings, Q
     return true;
 }
 
+// finds an embedding by the model for each of the text hashes that has one, e.g. of a chunk of another document
+static bool selectEmbeddingsByText(QSqlQuery &q, const QString &model, const QList<QByteArray> &textHashes,
+                                   QHash<QByteArray, QByteArray> &embeddings)
+{
+    if (textHashes.isEmpty())
+        return true;
+    if (!q.prepare(SELECT_EMBEDDINGS_BY_TEXT_SQL.arg(QStringList(textHashes.size(), u"?"_s).join(u", "))))
+        return false;
+    q.addBindValue(model);
+    for (const auto &hash: textHashes)
+        q.addBindValue(hash);
+    if (!q.exec())
+        return false;
+    while (q.next())
+        embeddings.insert(q.value(0).toByteArray(), q.value(1).toByteArray());
+    return true;
+}
+
+static QByteArray chunkTextHash(const QString &text)
+{
+    return QCryptographicHash::hash(text.toUtf8(), QCryptographicHash::Sha1);
+}
+
+// empty if the file cannot be read
+static QByteArray fileContentHash(const QFileInfo &info)
+{
+    QFile file(info.filePath());
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!file.open(QIODevice::ReadOnly) || !hash.addData(&file))
+        return {};
+    return hash.result();
+}
+
+static bool selectDatabaseId(QSqlQuery &q, QString *id)
+{
+    if (!q.exec(SELECT_DATABASE_ID_SQL) || !q.next())
+        return false;
+    *id = q.value(0).toString();
+    q.finish(); // the query is used again after transactions
+    return true;
+}
+
+static bool selectStoreGeneration(QSqlQuery &q, const QString &model, int folder_id, qint64 *generation)
+{
+    if (!q.prepare(SELECT_STORE_GENERATION_SQL))
+        return false;
+    q.addBindValue(model);
+    q.addBindValue(folder_id);
+    if (!q.exec())
+        return false;
+    *generation = q.next() ? q.value(0).toLongLong() : 0;
+    return true;
+}
+
+static bool advanceStoreGeneration(QSqlQuery &q, const QString &model, int folder_id, qint64 *generation)
+{
+    if (!q.prepare(ADVANCE_STORE_GENERATION_SQL))
+        return false;
+    q.addBindValue(model);
+    q.addBindValue(folder_id);
+    if (!q.exec() || !q.next())
+        return false;
+    *generation = q.value(0).toLongLong();
+    return true;
+}
+
 void Database::transaction()
 {
     bool ok = m_db.transaction();
     Q_ASSERT(ok);
+    m_inTransaction = true;
+    m_embeddingsInTransaction.clear();
 }
 
 void Database::commit()
 {
+    // the stores that the transaction changed are confirmed once it is saved, with the generation that it advanced
+    QList<std::pair<EmbeddingStore *, qint64>> confirmed;
+    QSqlQuery q(m_db);
+    for (const auto &key: m_embeddingsInTransaction) {
+        auto it = m_folderEmbeddings.find(key);
+        if (it == m_folderEmbeddings.end())
+            continue;
+        qint64 generation;
+        if (!advanceStoreGeneration(q, key.first, key.second, &generation)) {
+            // left unconfirmed, to be rebuilt when it is next opened
+            qWarning() << "Database ERROR: failed to advance embedding store generation:" << q.lastError();
+            continue;
+        }
+        confirmed.append({ it->second.store.get(), generation });
+    }
+    q.finish();
+
     bool ok = m_db.commit();
     Q_ASSERT(ok);
+    if (ok) {
+        for (const auto &[store, generation]: std::as_const(confirmed))
+            store->setGeneration(generation);
+    }
+    m_inTransaction = false;
+    m_embeddingsInTransaction.clear();
 }
 
 void Database::rollback()
 {
     bool ok = m_db.rollback();
     Q_ASSERT(ok);
+    m_inTransaction = false;
+
+    // these no longer match the embeddings table, they will be rebuilt when next needed
+    for (const auto &[model, folder_id]: m_embeddingsInTransaction)
+        dropFolderEmbeddings(model, folder_id);
+    m_embeddingsInTransaction.clear();
 }
 
 bool Database::refreshDocumentIdCache(QSqlQuery &q)
 {
     m_documentIdCache.clear();
-    for (const auto &cmd: SELECT_CHUNKED_DOCUMENTS_SQL) {
-        if (!q.exec(cmd))
-            return false;
-        while (q.next())
-            m_documentIdCache << q.value(0).toInt();
-    }
+    if (!q.exec(SELECT_CHUNKED_DOCUMENTS_SQL))
+        return false;
+    while (q.next())
+        m_documentIdCache << q.value(0).toInt();
     return true;
 }
 
-bool Database::addChunk(QSqlQuery &q, int document_id, const QString &chunk_text, const QString &file,
-                        const QString &title, const QString &author, const QString &subject, const QString &keywords,
-                        int page, int from, int to, int words, int *chunk_id)
+ChunkWriter &Database::chunkWriter()
 {
-    if (!q.prepare(INSERT_CHUNK_SQL))
-        return false;
-    q.addBindValue(document_id);
-    q.addBindValue(chunk_text);
-    q.addBindValue(file);
-    q.addBindValue(title);
-    q.addBindValue(author);
-    q.addBindValue(subject);
-    q.addBindValue(keywords);
-    q.addBindValue(page);
-    q.addBindValue(from);
-    q.addBindValue(to);
-    q.addBindValue(words);
-    if (!q.exec() || !q.next())
-        return false;
-    *chunk_id = q.value(0).toInt();
+    if (!m_chunkWriter)
+        m_chunkWriter = std::make_unique<ChunkWriter>(m_db);
+    return *m_chunkWriter;
+}
 
-    if (!q.prepare(INSERT_CHUNK_FTS_SQL))
+// Removes the chunks of a document, or only the ones before before_chunk_id, which newer chunks of the document
+// replace. Removing all of them also cancels reading the document.
+bool Database::removeChunksByDocumentId(QSqlQuery &q, int document_id, int before_chunk_id)
+{
+    // find the embeddings to remove from the stores and indexes
+    if (!q.prepare(GET_DOCUMENT_EMBEDDINGS_SQL))
         return false;
     q.addBindValue(document_id);
-    q.addBindValue(chunk_text);
-    q.addBindValue(file);
-    q.addBindValue(title);
-    q.addBindValue(author);
-    q.addBindValue(subject);
-    q.addBindValue(keywords);
+    q.addBindValue(before_chunk_id);
     if (!q.exec())
         return false;
-    m_documentIdCache << document_id;
-    return true;
-}
+    std::map<FolderEmbeddingsKey, QList<int>> indexedChunks;
+    while (q.next())
+        indexedChunks[{ q.value(0).toString(), q.value(1).toInt() }] << q.value(2).toInt();
 
-bool Database::removeChunksByDocumentId(QSqlQuery &q, int document_id)
-{
     for (const auto &cmd: DELETE_CHUNKS_SQL) {
         if (!q.prepare(cmd))
             return false;
         q.addBindValue(document_id);
+        q.addBindValue(before_chunk_id);
         if (!q.exec())
             return false;
     }
-    m_documentIdCache.remove(document_id);
+    if (before_chunk_id == INT_MAX) {
+        m_documentIdCache.remove(document_id);
+        cancelChunkingJobs(/*folder_id*/ -1, document_id); // chunks that are still being read are stale too
+    }
+
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    for (const auto &[key, chunkIds]: indexedChunks) {
+        // a store or index that does not exist yet will be built without these chunks
+        EmbeddingStore *store = embeddingStore(key.first, key.second, /*build*/ false);
+        if (!store)
+            continue;
+        EmbeddingIndex *index = embeddingIndex(key.first, key.second, /*build*/ false);
+        for (int chunkId: chunkIds) {
+            store->remove(chunkId);
+            if (index)
+                index->remove(chunkId);
+        }
+        markFolderEmbeddingsChanged(key.first, key.second);
+    }
     return true;
 }
 
@@ -914,15 +1168,21 @@ bool Database::hasContent()
     return m_db.tables().contains("chunks", Qt::CaseInsensitive);
 }
 
+static QString databasePath(const QString &modelPath, int ver)
+{
+    return u"%1/localdocs_v%2.db"_s.arg(modelPath).arg(ver);
+}
+
 int Database::openDatabase(const QString &modelPath, bool create, int ver)
 {
     if (!QFileInfo(modelPath).isDir()) {
         qWarning() << "ERROR: invalid download path" << modelPath;
         return -1;
     }
+    m_chunkWriter.reset(); // its statements belong to the connection
     if (m_db.isOpen())
         m_db.close();
-    auto dbPath = u"%1/localdocs_v%2.db"_s.arg(modelPath).arg(ver);
+    auto dbPath = databasePath(modelPath, ver);
     if (!create && !QFileInfo::exists(dbPath))
         return 0;
     m_db.setDatabaseName(dbPath);
@@ -956,6 +1216,13 @@ bool Database::openLatestDb(const QString &modelPath, QList<CollectionItem> &old
 
     if (dbVer == LOCALDOCS_VERSION) return true; // already up-to-date
 
+    if (dbVer == 3) {
+        if (migrateFromV3(modelPath))
+            return true; // nothing to index again
+        if (openDatabase(modelPath, false, dbVer) != 1)
+            return false;
+    }
+
     // If we're upgrading, then we need to do a select on the current version of the collections table,
     // then create the new one and populate the collections table and mark them as needing forced
     // indexing
@@ -975,6 +1242,77 @@ bool Database::openLatestDb(const QString &modelPath, QList<CollectionItem> &old
     return true;
 }
 
+/* Upgrades a copy of the open version 3 database in place of a version 4 one, leaving the old one to older versions of
+ * GPT4All. Its chunks and embeddings carry over. The full-text index is recreated, because it was updated by hand
+ * and could disagree with the chunks table, which the triggers of version 4 rule out, and the text hashes of the
+ * chunks are filled in. The content hashes of the documents are left to the next time they are read. Closes the
+ * database. */
+bool Database::migrateFromV3(const QString &modelPath)
+{
+    const QString oldPath = databasePath(modelPath, 3);
+    const QString newPath = databasePath(modelPath, LOCALDOCS_VERSION);
+    const QString tmpPath = newPath + u".tmp";
+
+    m_chunkWriter.reset();
+    m_db.close();
+    QFile::remove(tmpPath);
+    if (!QFile::copy(oldPath, tmpPath)) {
+        qWarning() << "ERROR: failed to copy" << oldPath << "to" << tmpPath;
+        return false;
+    }
+
+    m_db.setDatabaseName(tmpPath);
+    if (!m_db.open()) {
+        qWarning() << "ERROR: opening db" << tmpPath << m_db.lastError();
+        QFile::remove(tmpPath);
+        return false;
+    }
+
+    transaction();
+    QSqlQuery q(m_db);
+    bool ok = q.exec(DROP_CHUNKS_FTS_SQL) && createChunksFts(q) && q.exec(FTS_REBUILD_SQL);
+    for (const auto &cmd: MIGRATE_V3_SQL)
+        ok = ok && q.exec(cmd);
+
+    // the chunks that are already embedded can provide the embeddings of new chunks of the same text
+    QSqlQuery update(m_db);
+    ok = ok && q.prepare(SELECT_CHUNK_TEXTS_SQL) && update.prepare(UPDATE_CHUNK_TEXT_HASH_SQL);
+    for (int lastId = 0, nRows = -1; ok && nRows != 0;) {
+        // a page at a time, since the table must not change under an active select
+        QList<std::pair<int, QByteArray>> hashes;
+        q.addBindValue(lastId);
+        ok = q.exec();
+        while (ok && q.next())
+            hashes.append({ q.value(0).toInt(), chunkTextHash(q.value(1).toString()) });
+        q.finish();
+        for (const auto &[id, hash]: std::as_const(hashes)) {
+            update.addBindValue(hash);
+            update.addBindValue(id);
+            ok = ok && update.exec();
+            lastId = id;
+        }
+        nRows = hashes.size();
+    }
+
+    if (ok) {
+        commit();
+    } else {
+        qWarning() << "ERROR: failed to migrate database" << q.lastError() << update.lastError();
+        rollback();
+    }
+    q.finish();
+    update.finish();
+    m_db.close();
+
+    if (ok && !QFile::rename(tmpPath, newPath)) {
+        qWarning() << "ERROR: failed to rename" << tmpPath << "to" << newPath;
+        ok = false;
+    }
+    if (!ok)
+        QFile::remove(tmpPath);
+    return ok;
+}
+
 bool Database::initDb(const QString &modelPath, const QList<CollectionItem> &oldCollections)
 {
     if (!m_db.isOpen()) {
@@ -995,6 +1333,11 @@ bool Database::initDb(const QString &modelPath, const QList<CollectionItem> &old
             return false;
         }
     }
+    if (!createChunksFts(q)) {
+        qWarning() << "ERROR: failed to create full-text index" << q.lastError();
+        rollback();
+        return false;
+    }
 
     /* These are collection items that came from an older version of localdocs which
      * require forced indexing that should only be done when the user has explicitly asked
@@ -1016,16 +1359,28 @@ Database::Database(int chunkSize, QStringList extensions)
     , m_chunkSize(chunkSize)
     , m_scannedFileExtensions(std::move(extensions))
     , m_scanIntervalTimer(new QTimer(this))
-    , m_watcher(new QFileSystemWatcher(this))
+    , m_watcher(new FolderWatcher(this))
     , m_embLLM(new EmbeddingLLM)
     , m_databaseValid(true)
-    , m_chunkStreamer(this)
+    , m_chunkQueue(4 * QThread::idealThreadCount())
+    , m_embeddingsMaintenanceTimer(new QTimer(this))
 {
     m_db = QSqlDatabase::database(QSqlDatabase::defaultConnection, false);
     if (!m_db.isValid())
         m_db = QSqlDatabase::addDatabase("QSQLITE");
     Q_ASSERT(m_db.isValid());
 
+    // indexes are saved and stores compacted in the background, indexes also on exit
+    m_embeddingsMaintenanceTimer->setSingleShot(true);
+    m_embeddingsMaintenanceTimer->setInterval(30s);
+
+    // leave a core for the database thread, which writes what the workers read
+    m_chunkingPool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+
+    // the threads keep their connections for as long as the pool exists
+    m_retrievalPool.setMaxThreadCount(RETRIEVAL_THREADS);
+    m_retrievalPool.setExpiryTimeout(-1);
+
     moveToThread(&m_dbThread);
     m_dbThread.setObjectName("database");
     m_dbThread.start();
@@ -1033,8 +1388,17 @@ Database::Database(int chunkSize, QStringList extensions)
 
 Database::~Database()
 {
+    m_retrievalPool.waitForDone();
     m_dbThread.quit();
     m_dbThread.wait();
+
+    // the workers may be waiting for room in the queue, which is no longer drained
+    for (auto &job: std::as_const(m_chunkingJobs))
+        job->cancelled = true;
+    m_chunkQueue.close();
+    m_chunkingPool.waitForDone();
+
+    saveEmbeddingIndexes();
     delete m_embLLM;
 }
 
@@ -1094,13 +1458,17 @@ void Database::updateFolderToIndex(int folder_id, size_t countForFolder, bool se
     item.currentDocsToIndex = countForFolder;
     if (!countForFolder) {
         if (sendChunks && !m_chunkList.isEmpty())
-            sendChunkList(); // send any remaining embedding chunks to llm
+            sendChunkList(); // send the remaining embedding chunks to llm, once it has room for them
         item.indexing = false;
         item.installed = true;
 
         // Set the last update if we are done
         if (item.startUpdate > item.lastUpdate && item.currentEmbeddingsToIndex == 0)
             setLastUpdateTime(item);
+
+        // after the transaction that wrote the last of the documents
+        if (m_unsavedSnapshots.contains(folder_id))
+            QMetaObject::invokeMethod(this, [this, folder_id] { saveFolderSnapshot(folder_id); }, Qt::QueuedConnection);
     }
     updateGuiForCollectionItem(item);
 }
@@ -1113,7 +1481,7 @@ static void handleDocumentError(const QString &errorMessage, int document_id, co
 
 class DocumentReader {
 public:
-    struct Metadata { QString title, author, subject, keywords; };
+    using Metadata = DocumentMetadata;
 
     static std::unique_ptr<DocumentReader> fromDocument(DocumentInfo info);
 
@@ -1145,11 +1513,107 @@ protected:
 
 namespace {
 
+/* Extracts the text of the pages of a PDF ahead of the reader, in page order, on a thread of its own. Reading and
+ * chunking the words of a page thus overlaps with extracting the next pages. Subclasses call startReading() once the
+ * document is loaded, and stopPrefetch() before they close it. */
+class PdfDocumentReaderBase : public DocumentReader {
+public:
+    int page() const override { return m_currentPage; }
+
+protected:
+    explicit PdfDocumentReaderBase(DocumentInfo info)
+        : DocumentReader(std::move(info)) {}
+
+    ~PdfDocumentReaderBase() override { Q_ASSERT(!m_prefetchDone); }
+
+    virtual int pageCount() = 0;
+    virtual QString extractPage(int page) = 0; // throws std::runtime_error
+
+    void startReading(Metadata &&metadata)
+    {
+        static QThreadPool s_pool;
+
+        m_prefetchDone.emplace(1);
+        s_pool.start([this] {
+            prefetch();
+            m_prefetchDone->count_down();
+        });
+
+        try {
+            postInit(std::move(metadata));
+        } catch (...) {
+            stopPrefetch();
+            throw;
+        }
+    }
+
+    void stopPrefetch()
+    {
+        if (!m_prefetchDone)
+            return;
+        m_pages.close();
+        m_prefetchDone->wait();
+        m_prefetchDone.reset();
+    }
+
+private:
+    struct Page {
+        int         number; // 1-based
+        QStringList words;
+        QString     error;  // set if the page could not be read
+    };
+
+    void prefetch()
+    {
+        const int nPages = pageCount();
+        for (int i = 0; i < nPages; i++) {
+            Page page { .number = i + 1 };
+            try {
+                QString text = extractPage(i);
+                QTextStream stream(&text);
+                while (!stream.atEnd()) {
+                    QString word;
+                    stream >> word;
+                    if (!word.isEmpty())
+                        page.words << word;
+                }
+            } catch (const std::runtime_error &e) {
+                page.error = QString::fromUtf8(e.what());
+            }
+            const bool failed = !page.error.isEmpty();
+            if (!m_pages.push(std::move(page)) || failed)
+                break; // stopped, or the pages after this one are not wanted
+        }
+        m_pages.close();
+    }
+
+    std::optional<QString> advance() override
+    {
+        while (m_nextWord >= m_words.size()) {
+            std::optional<Page> page = m_pages.pop();
+            if (!page)
+                return std::nullopt;
+            if (!page->error.isEmpty())
+                throw std::runtime_error(page->error.toStdString());
+            m_currentPage = page->number;
+            m_words = std::move(page->words);
+            m_nextWord = 0;
+        }
+        return m_words[m_nextWord++];
+    }
+
+    BoundedQueue<Page>        m_pages { 16 };
+    std::optional<std::latch> m_prefetchDone;
+    int                       m_currentPage = 0;
+    QStringList               m_words;
+    qsizetype                 m_nextWord = 0;
+};
+
 #ifdef GPT4ALL_USE_QTPDF
-class PdfDocumentReader final : public DocumentReader {
+class PdfDocumentReader final : public PdfDocumentReaderBase {
 public:
     explicit PdfDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
+        : PdfDocumentReaderBase(std::move(info))
     {
         QString path = info.file.canonicalFilePath();
         if (m_doc.load(path) != QPdfDocument::Error::None)
@@ -1160,38 +1624,27 @@ public:
             .subject  = m_doc.metaData(QPdfDocument::MetaDataField::Subject ).toString(),
             .keywords = m_doc.metaData(QPdfDocument::MetaDataField::Keywords).toString(),
         };
-        postInit(std::move(metadata));
+        startReading(std::move(metadata));
     }
 
-    int page() const override { return m_currentPage; }
+    ~PdfDocumentReader() override { stopPrefetch(); }
 
 private:
-    std::optional<QString> advance() override
-    {
-        QString word;
-        do {
-            while (!m_stream || m_stream->atEnd()) {
-                if (m_currentPage >= m_doc.pageCount())
-                    return std::nullopt;
-                m_pageText = m_doc.getAllText(m_currentPage++).text();
-                m_stream.emplace(&m_pageText);
-            }
-            *m_stream >> word;
-        } while (word.isEmpty());
-        return word;
-    }
+    int pageCount() override { return m_doc.pageCount(); }
+    QString extractPage(int page) override { return m_doc.getAllText(page).text(); }
 
-    QPdfDocument               m_doc;
-    int                        m_currentPage = 0;
-    QString                    m_pageText;
-    std::optional<QTextStream> m_stream;
+    QPdfDocument m_doc;
 };
 #else
-class PdfDocumentReader final : public DocumentReader {
+// PDFium must not be called from more than one thread at a time, QtPdf has a lock of its own
+QMutex s_pdfiumMutex;
+
+class PdfDocumentReader final : public PdfDocumentReaderBase {
 public:
     explicit PdfDocumentReader(DocumentInfo info)
-        : DocumentReader(std::move(info))
+        : PdfDocumentReaderBase(std::move(info))
     {
+        QMutexLocker locker(&s_pdfiumMutex);
         QString path = info.file.canonicalFilePath();
         m_doc = FPDF_LoadDocument(path.toUtf8().constData(), nullptr);
         if (!m_doc)
@@ -1204,40 +1657,50 @@ public:
             .subject  = getMetadata("Subject" ),
             .keywords = getMetadata("Keywords"),
         };
-        postInit(std::move(metadata));
+        locker.unlock();
+        try {
+            startReading(std::move(metadata));
+        } catch (...) {
+            closeDocument(); // not done by the destructor of a partially constructed reader
+            throw;
+        }
     }
 
     ~PdfDocumentReader() override
     {
-        if (m_page)
-            FPDF_ClosePage(m_page);
-        if (m_doc)
-            FPDF_CloseDocument(m_doc);
+        stopPrefetch();
+        closeDocument();
     }
 
-    int page() const override { return m_currentPage; }
-
 private:
-    std::optional<QString> advance() override
+    int pageCount() override
     {
-        QString word;
-        do {
-            while (!m_stream || m_stream->atEnd()) {
-                if (m_currentPage >= FPDF_GetPageCount(m_doc))
-                    return std::nullopt;
-
-                if (m_page)
-                    FPDF_ClosePage(std::exchange(m_page, nullptr));
-                m_page = FPDF_LoadPage(m_doc, m_currentPage++);
-                if (!m_page)
-                    throw std::runtime_error("Failed to load page.");
-
-                m_pageText = extractTextFromPage(m_page);
-                m_stream.emplace(&m_pageText);
-            }
-            *m_stream >> word;
-        } while (word.isEmpty());
-        return word;
+        QMutexLocker locker(&s_pdfiumMutex);
+        return FPDF_GetPageCount(m_doc);
+    }
+
+    QString extractPage(int page) override
+    {
+        QMutexLocker locker(&s_pdfiumMutex);
+        FPDF_PAGE pdfPage = FPDF_LoadPage(m_doc, page);
+        if (!pdfPage)
+            throw std::runtime_error("Failed to load page.");
+        QString text;
+        try {
+            text = extractTextFromPage(pdfPage);
+        } catch (...) {
+            FPDF_ClosePage(pdfPage);
+            throw;
+        }
+        FPDF_ClosePage(pdfPage);
+        return text;
+    }
+
+    void closeDocument()
+    {
+        QMutexLocker locker(&s_pdfiumMutex);
+        if (m_doc)
+            FPDF_CloseDocument(std::exchange(m_doc, nullptr));
     }
 
     QString getMetadata(FPDF_BYTESTRING key)
@@ -1271,11 +1734,7 @@ private:
         return QString::fromUtf16(reinterpret_cast<const char16_t *>(buffer.data()), nResultChars - 1);
     }
 
-    FPDF_DOCUMENT              m_doc = nullptr;
-    FPDF_PAGE                  m_page = nullptr;
-    int                        m_currentPage = 0;
-    QString                    m_pageText;
-    std::optional<QTextStream> m_stream;
+    FPDF_DOCUMENT m_doc = nullptr;
 };
 #endif // !defined(GPT4ALL_USE_QTPDF)
 
@@ -1425,58 +1884,18 @@ std::unique_ptr<DocumentReader> DocumentReader::fromDocument(DocumentInfo doc)
     return std::make_unique<TxtDocumentReader>(std::move(doc));
 }
 
-ChunkStreamer::ChunkStreamer(Database *database)
-    : m_database(database) {}
-
-ChunkStreamer::~ChunkStreamer() = default;
-
-void ChunkStreamer::setDocument(DocumentInfo doc, int documentId, const QString &embeddingModel)
-{
-    auto docKey = doc.key();
-    if (!m_docKey || *m_docKey != docKey) {
-        m_docKey         = docKey;
-        m_reader         = DocumentReader::fromDocument(std::move(doc));
-        m_documentId     = documentId;
-        m_embeddingModel = embeddingModel;
-        m_chunk.clear();
-        m_page = 0;
-
-        // make sure the document doesn't already have any chunks
-        if (m_database->m_documentIdCache.contains(documentId)) {
-            QSqlQuery q(m_database->m_db);
-            if (!m_database->removeChunksByDocumentId(q, documentId))
-                handleDocumentError("ERROR: Cannot remove chunks of document",
-                                    documentId, m_reader->doc().file.canonicalPath(), q.lastError());
-        }
-    }
-}
-
-std::optional<DocumentInfo::key_type> ChunkStreamer::currentDocKey() const
-{
-    return m_docKey;
-}
+ChunkStreamer::ChunkStreamer(DocumentReader *reader, int chunkSize)
+    : m_reader(reader)
+    , m_chunkSize(chunkSize) {}
 
-void ChunkStreamer::reset()
+std::optional<DocumentChunk> ChunkStreamer::next()
 {
-    m_docKey.reset();
-}
-
-ChunkStreamer::Status ChunkStreamer::step()
-{
-    // TODO: implement line_from/line_to
-    constexpr int line_from = -1;
-    constexpr int line_to = -1;
-    const int folderId = m_reader->doc().folder;
-    const int maxChunkSize = m_database->m_chunkSize;
-    int nChunks = 0;
-    int nAddedWords = 0;
-    Status retval;
+    const int maxChunkSize = m_chunkSize;
 
     for (;;) {
         if (auto error = m_reader->getError()) {
-            m_docKey.reset(); // done processing
-            retval = *error;
-            break;
+            m_status = *error;
+            return std::nullopt;
         }
 
         // get a word, if needed
@@ -1534,85 +1953,88 @@ ChunkStreamer::Status ChunkStreamer::step()
                 }
                 Q_ASSERT(chunk.length() <= maxChunkSize);
 
-                QSqlQuery q(m_database->m_db);
-                int chunkId = 0;
-                auto &metadata = m_reader->metadata();
-                if (!m_database->addChunk(q,
-                    m_documentId,
-                    chunk,
-                    m_reader->doc().file.fileName(), // basename
-                    metadata.title,
-                    metadata.author,
-                    metadata.subject,
-                    metadata.keywords,
-                    m_page,
-                    line_from,
-                    line_to,
-                    nThisChunkWords,
-                    &chunkId
-                )) {
-                    qWarning() << "ERROR: Could not insert chunk into db" << q.lastError();
-                }
-
-                nAddedWords += nThisChunkWords;
-
-                EmbeddingChunk toEmbed;
-                toEmbed.model = m_embeddingModel;
-                toEmbed.folder_id = folderId;
-                toEmbed.chunk_id = chunkId;
-                toEmbed.chunk = chunk;
-                m_database->appendChunk(toEmbed);
-                ++nChunks;
+                return DocumentChunk { std::move(chunk), m_page, nThisChunkWords };
             }
 
             if (!word) {
-                retval = Status::DOC_COMPLETE;
-                m_docKey.reset(); // done processing
-                break;
+                m_status = Status::DOC_COMPLETE;
+                return std::nullopt;
             }
         }
-
-        if (m_database->scanQueueInterrupted()) {
-            retval = Status::INTERRUPTED;
-            break;
-        }
-    }
-
-    if (nChunks) {
-        CollectionItem item = m_database->guiCollectionItem(folderId);
-
-        // Set the start update if we haven't done so already
-        if (item.startUpdate <= item.lastUpdate && item.currentEmbeddingsToIndex == 0)
-            m_database->setStartUpdateTime(item);
-
-        item.currentEmbeddingsToIndex += nChunks;
-        item.totalEmbeddingsToIndex += nChunks;
-        item.totalWords += nAddedWords;
-        m_database->updateGuiForCollectionItem(item);
     }
-
-    return retval;
 }
 
-void Database::appendChunk(const EmbeddingChunk &chunk)
+void Database::appendChunk(const EmbeddingChunk &chunk, const QByteArray &textHash)
 {
-    m_chunkList.reserve(s_batchSize);
+    // a chunk of the same text that is being embedded already provides the embedding of this one
+    std::pair text(chunk.model, textHash);
+    if (auto it = m_pendingTexts.constFind(text); it != m_pendingTexts.cend()) {
+        m_pendingEmbeddings[*it].duplicates << chunk;
+        return;
+    }
+    m_pendingTexts.insert(text, chunk.chunk_id);
+    m_pendingEmbeddings.insert(chunk.chunk_id, { textHash, {} });
+
     m_chunkList.append(chunk);
-    if (m_chunkList.size() >= s_batchSize)
+    m_chunkListTokens += chunk.tokens;
+    if (m_chunkListTokens >= EmbeddingLLM::batchTokens() * EMBEDDING_REQUEST_PASSES)
         sendChunkList();
 }
 
+// Sends the chunks to embed to the model, as many requests as there is room for. A request that is not full is only
+// sent if a context of the model would be idle otherwise.
 void Database::sendChunkList()
 {
-    m_embLLM->generateDocEmbeddingsAsync(m_chunkList);
-    m_chunkList.clear();
+    const int requestTokens = EmbeddingLLM::batchTokens() * EMBEDDING_REQUEST_PASSES;
+    const int nContexts = m_embLLM->docContextCount();
+    while (m_embeddingRequests < nContexts + 1 && !m_chunkList.isEmpty()) {
+        if (m_chunkListTokens < requestTokens && m_embeddingRequests >= nContexts)
+            break;
+        qsizetype n = 0;
+        int nTokens = 0;
+        for (; n < m_chunkList.size() && (!n || nTokens + m_chunkList[n].tokens <= requestTokens); n++)
+            nTokens += m_chunkList[n].tokens;
+        m_embLLM->generateDocEmbeddingsAsync(m_chunkList.first(n));
+        m_chunkList.remove(0, n);
+        m_chunkListTokens -= nTokens;
+        m_embeddingRequests++;
+    }
 }
 
 void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings)
 {
     Q_ASSERT(!embeddings.isEmpty());
+    Q_ASSERT(m_embeddingRequests > 0);
+    m_embeddingRequests--;
 
+    // the chunks that waited for these embeddings get them too
+    QVector<EmbeddingResult> results = embeddings;
+    for (const auto &e: embeddings) {
+        auto it = m_pendingEmbeddings.find(e.chunk_id);
+        if (it == m_pendingEmbeddings.end())
+            continue;
+        m_pendingTexts.remove({ e.model, it->textHash });
+        for (const auto &c: std::as_const(it->duplicates))
+            results.append({ c.model, c.folder_id, c.chunk_id, e.embedding });
+        m_pendingEmbeddings.erase(it);
+    }
+
+    transaction();
+    if (addEmbeddings(results)) {
+        commit();
+    } else {
+        rollback();
+    }
+
+    sendChunkList();
+}
+
+// Adds embeddings and updates the stores, indexes and statistics for them. Must be called in a transaction, which the
+// caller rolls back if this fails.
+bool Database::addEmbeddings(const QVector<EmbeddingResult> &embeddings)
+{
     QList<Embedding> sqlEmbeddings;
+    sqlEmbeddings.reserve(embeddings.size());
     for (const auto &e: embeddings) {
         auto data = QByteArray::fromRawData(
             reinterpret_cast<const char *>(e.embedding.data()),
@@ -1621,16 +2043,31 @@ void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddi
         sqlEmbeddings.append({e.model, e.folder_id, e.chunk_id, std::move(data)});
     }
 
-    transaction();
-
     QSqlQuery q(m_db);
     QHash<EmbeddingFolder, EmbeddingStat> stats;
-    if (!sqlAddEmbeddings(q, sqlEmbeddings, stats)) {
-        qWarning() << "Database ERROR: failed to add embeddings:" << q.lastError();
-        return rollback();
+    if (!sqlAddEmbeddings(chunkWriter(), q, sqlEmbeddings, stats)) {
+        qWarning() << "Database ERROR: failed to add embeddings:" << chunkWriter().lastError() << q.lastError();
+        return false;
     }
 
-    commit();
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    for (const auto &e: std::as_const(sqlEmbeddings)) {
+        if (!e.added)
+            continue;
+        // a store or index built just now already has the embeddings that were inserted above
+        std::span embedding(reinterpret_cast<const float *>(e.data.constData()), e.data.size() / sizeof(float));
+        EmbeddingStore *store = embeddingStore(e.model, e.folder_id);
+        if (!store)
+            continue;
+        if (!store->contains(e.chunk_id) && !store->add(e.chunk_id, embedding)) {
+            dropFolderEmbeddings(e.model, e.folder_id);
+            continue;
+        }
+        if (EmbeddingIndex *index = embeddingIndex(e.model, e.folder_id); index && !index->contains(e.chunk_id))
+            index->add(e.chunk_id, embedding);
+        markFolderEmbeddingsChanged(e.model, e.folder_id);
+    }
+    locker.unlock();
 
     // FIXME(jared): embedding counts are per-collectionitem, not per-folder
     for (const auto &[key, stat]: std::as_const(stats).asKeyValueRange()) {
@@ -1662,6 +2099,7 @@ void Database::handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddi
 
         updateGuiForCollectionItem(item);
     }
+    return true;
 }
 
 void Database::handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error)
@@ -1670,22 +2108,37 @@ void Database::handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const
      * on the embedding model, but this sets the error on all collections for a given
      * folder */
 
+    Q_ASSERT(m_embeddingRequests > 0);
+    m_embeddingRequests--;
+
     QSet<int> folder_ids;
     for (const auto &c: chunks) { folder_ids << c.folder_id; }
 
+    // like these chunks, the ones that waited for them are left to scheduleUncompletedEmbeddings()
+    for (const auto &c: chunks) {
+        if (auto it = m_pendingEmbeddings.find(c.chunk_id); it != m_pendingEmbeddings.end()) {
+            m_pendingTexts.remove({ c.model, it->textHash });
+            m_pendingEmbeddings.erase(it);
+        }
+    }
+
     for (int fid: folder_ids) {
         if (!m_collectionMap.contains(fid)) continue;
         CollectionItem item = guiCollectionItem(fid);
         item.error = error;
         updateGuiForCollectionItem(item);
     }
+
+    sendChunkList();
 }
 
 size_t Database::countOfDocuments(int folder_id) const
 {
+    // documents that are being read are still to index
+    auto count = size_t(ranges::count_if(m_chunkingJobs, [folder_id](auto &j) { return j->doc.folder == folder_id; }));
     if (auto it = m_docsToScan.find(folder_id); it != m_docsToScan.end())
-        return it->second.size();
-    return 0;
+        count += it->second.size();
+    return count;
 }
 
 size_t Database::countOfBytes(int folder_id) const
@@ -1714,20 +2167,9 @@ DocumentInfo Database::dequeueDocument()
 
 void Database::removeFolderFromDocumentQueue(int folder_id)
 {
-    if (auto queueIt = m_docsToScan.find(folder_id); queueIt != m_docsToScan.end()) {
-        if (auto key = m_chunkStreamer.currentDocKey()) {
-            if (ranges::any_of(queueIt->second, [&key](auto &d) { return d.key() == key; }))
-                m_chunkStreamer.reset(); // done with this document
-        }
-        // remove folder from queue
-        m_docsToScan.erase(queueIt);
-    }
-}
-
-void Database::enqueueDocumentInternal(DocumentInfo &&info, bool prepend)
-{
-    auto &queue = m_docsToScan[info.folder];
-    queue.insert(prepend ? queue.begin() : queue.end(), std::move(info));
+    cancelChunkingJobs(folder_id);
+    // remove folder from queue
+    m_docsToScan.erase(folder_id);
 }
 
 void Database::enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos)
@@ -1737,7 +2179,7 @@ void Database::enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos)
     queue.splice(queue.end(), std::move(infos));
 
     CollectionItem item = guiCollectionItem(folder_id);
-    item.currentDocsToIndex = queue.size();
+    item.currentDocsToIndex = countOfDocuments(folder_id);
     item.totalDocsToIndex = queue.size();
     const size_t bytes = countOfBytes(folder_id);
     item.currentBytesToIndex = bytes;
@@ -1751,14 +2193,20 @@ bool Database::scanQueueInterrupted() const
     return m_scanDurationTimer.elapsed() >= 100;
 }
 
+int Database::maxChunkingJobs() const
+{
+    // enough to keep the workers busy while the database thread catches up
+    return 2 * m_chunkingPool.maxThreadCount();
+}
+
 void Database::scanQueueBatch()
 {
     transaction();
 
     m_scanDurationTimer.start();
 
-    // scan for up to the maximum scan duration or until we run out of documents
-    while (!m_docsToScan.empty()) {
+    // scan for up to the maximum scan duration, until we run out of documents or the workers are busy
+    while (!m_docsToScan.empty() && m_nChunkingJobs < maxChunkingJobs()) {
         scanQueue();
         if (scanQueueInterrupted())
             break;
@@ -1766,7 +2214,8 @@ void Database::scanQueueBatch()
 
     commit();
 
-    if (m_docsToScan.empty())
+    // restarted by writeChunks() when the workers are done with a document
+    if (m_docsToScan.empty() || m_nChunkingJobs >= maxChunkingJobs())
         m_scanIntervalTimer->stop();
 }
 
@@ -1786,13 +2235,13 @@ void Database::scanQueue()
 
     const qint64 document_time = info.file.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch();
     const QString document_path = info.file.canonicalFilePath();
-    const bool currentlyProcessing = info.currentlyProcessing;
 
     // Check and see if we already have this document
     QSqlQuery q(m_db);
     int existing_id = -1;
     qint64 existing_time = -1;
-    if (!selectDocument(q, document_path, &existing_id, &existing_time)) {
+    QByteArray existing_hash;
+    if (!selectDocument(q, document_path, &existing_id, &existing_time, &existing_hash)) {
         handleDocumentError("ERROR: Cannot select document",
             existing_id, document_path, q.lastError());
         return updateFolderToIndex(folder_id, countForFolder);
@@ -1800,40 +2249,28 @@ void Database::scanQueue()
 
     // If we have the document, we need to compare the last modification time and if it is newer
     // we must rescan the document, otherwise return
-    if (existing_id != -1 && !currentlyProcessing) {
+    if (existing_id != -1) {
         Q_ASSERT(existing_time != -1);
         if (document_time == existing_time) {
             // No need to rescan, but we do have to schedule next
             return updateFolderToIndex(folder_id, countForFolder);
         }
-        if (!removeChunksByDocumentId(q, existing_id)) {
-            handleDocumentError("ERROR: Cannot remove chunks of document",
-                existing_id, document_path, q.lastError());
-            return updateFolderToIndex(folder_id, countForFolder);
-        }
-        updateCollectionStatistics();
+        // the worker compares the content hash, the chunks are replaced by writeChunkBatch() if it changed
+        cancelChunkingJobs(/*folder_id*/ -1, existing_id);
     }
 
-    // Update the document_time for an existing document, or add it for the first time now
+    // Add the document for the first time now, an existing one is updated once it is read
     int document_id = existing_id;
-    if (!currentlyProcessing) {
-        if (document_id != -1) {
-            if (!updateDocument(q, document_id, document_time)) {
-                handleDocumentError("ERROR: Could not update document_time",
-                    document_id, document_path, q.lastError());
-                return updateFolderToIndex(folder_id, countForFolder);
-            }
-        } else {
-            if (!addDocument(q, folder_id, document_time, document_path, &document_id)) {
-                handleDocumentError("ERROR: Could not add document",
-                    document_id, document_path, q.lastError());
-                return updateFolderToIndex(folder_id, countForFolder);
-            }
-
-            CollectionItem item = guiCollectionItem(folder_id);
-            item.totalDocs += 1;
-            updateGuiForCollectionItem(item);
+    if (document_id == -1) {
+        if (!addDocument(q, folder_id, document_time, document_path, &document_id)) {
+            handleDocumentError("ERROR: Could not add document",
+                document_id, document_path, q.lastError());
+            return updateFolderToIndex(folder_id, countForFolder);
         }
+
+        CollectionItem item = guiCollectionItem(folder_id);
+        item.totalDocs += 1;
+        updateGuiForCollectionItem(item);
     }
 
     // Get the embedding model for this folder
@@ -1847,20 +2284,244 @@ void Database::scanQueue()
 
     Q_ASSERT(document_id != -1);
 
-    {
-        try {
-            m_chunkStreamer.setDocument(info, document_id, embedding_model);
-        } catch (const std::runtime_error &e) {
-            qWarning() << "LocalDocs ERROR:" << e.what();
-            goto dequeue;
+    // the document is read and chunked by a worker, writeChunks() takes it from there
+    auto job = std::make_shared<ChunkingJob>(std::move(info), document_id, embedding_model, m_chunkSize, existing_hash,
+                                             /*replacesChunks*/ existing_id != -1);
+    m_chunkingJobs << job;
+    ++m_nChunkingJobs;
+    m_chunkingPool.start([this, job] { chunkDocument(job); });
+    return updateFolderToIndex(folder_id, countForFolder + 1);
+}
+
+// Runs on a worker of m_chunkingPool. The chunks are queued in batches, which waits while the queue is full, so the
+// workers cannot get ahead of the database thread by more than the capacity of the queue.
+void Database::chunkDocument(const std::shared_ptr<ChunkingJob> &job)
+{
+    constexpr qsizetype CHUNKS_PER_BATCH = 64;
+
+    ChunkBatch batch { .job = job, .contentHash = fileContentHash(job->doc.file) };
+    auto queueBatch = [this, &batch] {
+        ChunkBatch next { .job = batch.job, .metadata = batch.metadata, .contentHash = batch.contentHash };
+        m_chunkQueue.push(std::exchange(batch, std::move(next)));
+        if (!m_chunksQueued.exchange(true))
+            QMetaObject::invokeMethod(this, &Database::writeChunks, Qt::QueuedConnection);
+    };
+
+    // a document that was only touched, or changed back, is not read again
+    if (!batch.contentHash.isEmpty() && batch.contentHash == job->indexedHash) {
+        batch.unchanged = true;
+        batch.status = ChunkStreamer::Status::DOC_COMPLETE;
+        return queueBatch();
+    }
+
+    try {
+        auto reader = DocumentReader::fromDocument(job->doc);
+        batch.metadata = reader->metadata();
+        ChunkStreamer streamer(reader.get(), job->chunkSize);
+        while (!job->cancelled) {
+            std::optional<DocumentChunk> chunk = streamer.next();
+            if (!chunk) {
+                batch.status = streamer.status();
+                break;
+            }
+            chunk->tokens = EmbeddingLLM::estimatedTokenCount(chunk->text);
+            chunk->textHash = chunkTextHash(chunk->text);
+            batch.chunks << std::move(*chunk);
+            if (batch.chunks.size() >= CHUNKS_PER_BATCH)
+                queueBatch();
+        }
+    } catch (const std::runtime_error &e) {
+        qWarning() << "LocalDocs ERROR:" << e.what();
+        batch.status = ChunkStreamer::Status::ERROR;
+    }
+
+    // the last batch is queued even if the job was cancelled, so that the database thread can account for it
+    if (!batch.status)
+        batch.status = ChunkStreamer::Status::ERROR;
+    queueBatch();
+}
+
+void Database::writeChunks()
+{
+    m_chunksQueued = false;
+
+    // everything the workers have read so far is written in one transaction, for up to the maximum scan duration
+    transaction();
+    m_scanDurationTimer.start();
+    while (!scanQueueInterrupted()) {
+        std::optional<ChunkBatch> batch = m_chunkQueue.tryPop();
+        if (!batch)
+            break;
+        writeChunkBatch(*batch);
+    }
+    commit();
+
+    // the model may be waiting for the chunks that were just written
+    sendChunkList();
+
+    if (!m_chunkQueue.isEmpty() && !m_chunksQueued.exchange(true))
+        QMetaObject::invokeMethod(this, &Database::writeChunks, Qt::QueuedConnection);
+
+    // the workers may have room for more documents now
+    if (!m_docsToScan.empty() && m_nChunkingJobs < maxChunkingJobs())
+        m_scanIntervalTimer->start();
+}
+
+// Adds the chunks of a batch, and the embeddings of those with a text that was embedded before. Either all of it is
+// added or, if this fails, none of it.
+bool Database::addChunkBatch(const ChunkBatch &batch)
+{
+    // TODO: implement line_from/line_to
+    constexpr int line_from = -1;
+    constexpr int line_to = -1;
+    ChunkingJob &job = *batch.job;
+    const int folder_id = job.doc.folder;
+
+    QSqlQuery q(m_db);
+    if (!q.exec(SAVEPOINT_CHUNK_BATCH_SQL)) {
+        qWarning() << "ERROR: Could not start writing chunks" << q.lastError();
+        return false;
+    }
+    auto rollbackBatch = [&] {
+        if (!q.exec(ROLLBACK_CHUNK_BATCH_SQL) || !q.exec(RELEASE_CHUNK_BATCH_SQL))
+            qWarning() << "ERROR: Could not roll back chunks" << q.lastError();
+        return false;
+    };
+
+    QList<ChunkWriter::Chunk> rows;
+    rows.reserve(batch.chunks.size());
+    int nAddedWords = 0;
+    for (const DocumentChunk &chunk: batch.chunks) {
+        rows.append({
+            .documentId = job.documentId,
+            .text       = chunk.text,
+            .file       = job.doc.file.fileName(), // basename
+            .title      = batch.metadata.title,
+            .author     = batch.metadata.author,
+            .subject    = batch.metadata.subject,
+            .keywords   = batch.metadata.keywords,
+            .page       = chunk.page,
+            .lineFrom   = line_from,
+            .lineTo     = line_to,
+            .words      = chunk.words,
+            .tokens     = chunk.tokens,
+            .textHash   = chunk.textHash,
+        });
+        nAddedWords += chunk.words;
+    }
+
+    QList<int> chunkIds;
+    if (!chunkWriter().addChunks(rows, chunkIds)) {
+        qWarning() << "ERROR: Could not insert chunks into db" << chunkWriter().lastError();
+        return rollbackBatch();
+    }
+
+    // chunks of a text that the model has embedded before, in this document or another, are not embedded again
+    QList<QByteArray> textHashes;
+    for (const DocumentChunk &chunk: batch.chunks)
+        textHashes << chunk.textHash;
+    QHash<QByteArray, QByteArray> embedded;
+    if (!selectEmbeddingsByText(q, job.embeddingModel, textHashes, embedded)) {
+        qWarning() << "ERROR: Could not look up existing embeddings" << q.lastError();
+        embedded.clear();
+    }
+
+    QVector<EmbeddingResult> reused;
+    QList<std::pair<EmbeddingChunk, QByteArray>> toEmbed;
+    for (qsizetype i = 0; i < chunkIds.size(); i++) {
+        const DocumentChunk &chunk = batch.chunks[i];
+        if (auto it = embedded.constFind(chunk.textHash); it != embedded.cend()) {
+            auto *data = reinterpret_cast<const float *>(it->constData());
+            reused.append({ job.embeddingModel, folder_id, chunkIds[i],
+                            std::vector<float>(data, data + it->size() / sizeof(float)) });
+            continue;
         }
+        EmbeddingChunk chunkToEmbed;
+        chunkToEmbed.model = job.embeddingModel;
+        chunkToEmbed.folder_id = folder_id;
+        chunkToEmbed.chunk_id = chunkIds[i];
+        chunkToEmbed.chunk = chunk.text;
+        chunkToEmbed.tokens = chunk.tokens;
+        toEmbed.append({ chunkToEmbed, chunk.textHash });
+    }
+
+    const CollectionItem itemBefore = guiCollectionItem(folder_id);
+    CollectionItem item = itemBefore;
+
+    // Set the start update if we haven't done so already
+    if (item.startUpdate <= item.lastUpdate && item.currentEmbeddingsToIndex == 0)
+        setStartUpdateTime(item);
+
+    item.currentEmbeddingsToIndex += chunkIds.size();
+    item.totalEmbeddingsToIndex += chunkIds.size();
+    item.totalWords += nAddedWords;
+    updateGuiForCollectionItem(item);
+
+    // counted as embedded right away, addEmbeddings() changes nothing else if it fails
+    if (!reused.isEmpty() && !addEmbeddings(reused)) {
+        qWarning() << "ERROR: Could not reuse embeddings of chunks with the same text";
+        updateGuiForCollectionItem(itemBefore);
+        return rollbackBatch();
+    }
+
+    if (!q.exec(RELEASE_CHUNK_BATCH_SQL)) {
+        qWarning() << "ERROR: Could not write chunks" << q.lastError();
+        updateGuiForCollectionItem(itemBefore);
+        return rollbackBatch();
+    }
+
+    m_documentIdCache << job.documentId;
+    if (job.firstChunkId == -1)
+        job.firstChunkId = chunkIds.front();
+    for (const auto &[chunk, textHash]: std::as_const(toEmbed))
+        appendChunk(chunk, textHash);
+    return true;
+}
+
+void Database::writeChunkBatch(const ChunkBatch &batch)
+{
+    ChunkingJob &job = *batch.job;
+    const int folder_id = job.doc.folder;
+
+    if (batch.status) {
+        --m_nChunkingJobs;
+        m_chunkingJobs.removeOne(batch.job);
+    }
+
+    // the chunks of a document that was removed or changed in the meantime are not wanted
+    if (job.cancelled) {
+        if (batch.status && m_collectionMap.contains(folder_id))
+            updateFolderToIndex(folder_id, countOfDocuments(folder_id));
+        return;
     }
 
-    switch (m_chunkStreamer.step()) {
-    case ChunkStreamer::Status::INTERRUPTED:
-        info.currentlyProcessing = true;
-        enqueueDocumentInternal(std::move(info), /*prepend*/ true);
-        return updateFolderToIndex(folder_id, countForFolder + 1);
+    // a batch that cannot be written is rolled back, the rest of the document is dropped and it is read again once
+    // it changes
+    if (!job.failed && !batch.chunks.isEmpty() && !addChunkBatch(batch))
+        job.failed = true;
+
+    if (!batch.status)
+        return; // more to come
+
+    QSqlQuery q(m_db);
+    const QString document_path = job.doc.file.canonicalFilePath();
+    if (!batch.unchanged && job.replacesChunks) {
+        // the chunks of the previous version of the document, which the reused embeddings were copied from already
+        const int before_chunk_id = job.firstChunkId == -1 ? INT_MAX : job.firstChunkId;
+        if (!removeChunksByDocumentId(q, job.documentId, before_chunk_id))
+            handleDocumentError("ERROR: Cannot remove chunks of document", job.documentId, document_path,
+                                q.lastError());
+        updateCollectionStatistics();
+    }
+
+    // a document that could not be read or written completely is read again when it next changes
+    const qint64 document_time = job.doc.file.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch();
+    const bool readError = *batch.status == ChunkStreamer::Status::ERROR || job.failed;
+    const QByteArray content_hash = readError ? QByteArray() : batch.contentHash;
+    if (!updateDocument(q, job.documentId, document_time, content_hash))
+        handleDocumentError("ERROR: Could not update document", job.documentId, document_path, q.lastError());
+
+    switch (*batch.status) {
     case ChunkStreamer::Status::BINARY_SEEN:
         /* When we see a binary file, we treat it like an empty file so we know not to
          * scan it again. All existing chunks are removed, and in-progress embeddings
@@ -1868,8 +2529,9 @@ void Database::scanQueue()
         qInfo() << "LocalDocs: Ignoring file with binary data:" << document_path;
 
         // this will also ensure in-flight embeddings are ignored
-        if (!removeChunksByDocumentId(q, existing_id))
-            handleDocumentError("ERROR: Cannot remove chunks of document", existing_id, document_path, q.lastError());
+        if (!removeChunksByDocumentId(q, job.documentId))
+            handleDocumentError("ERROR: Cannot remove chunks of document", job.documentId, document_path,
+                                q.lastError());
         updateCollectionStatistics();
         break;
     case ChunkStreamer::Status::ERROR:
@@ -1879,17 +2541,30 @@ void Database::scanQueue()
         ;
     }
 
-dequeue:
     auto item = guiCollectionItem(folder_id);
-    Q_ASSERT(item.currentBytesToIndex >= info.file.size());
-    if (item.currentBytesToIndex < info.file.size()) {
+    Q_ASSERT(item.currentBytesToIndex >= job.doc.file.size());
+    if (item.currentBytesToIndex < job.doc.file.size()) {
         qWarning() << "Database ERROR: underflow in current bytes to index statistics";
         item.currentBytesToIndex = 0;
     } else {
-        item.currentBytesToIndex -= info.file.size();
+        item.currentBytesToIndex -= job.doc.file.size();
     }
     updateGuiForCollectionItem(item);
-    return updateFolderToIndex(folder_id, countForFolder);
+    updateFolderToIndex(folder_id, countOfDocuments(folder_id));
+}
+
+// Cancels the jobs of a folder and/or document, -1 matches any. Their workers stop early and their chunks are dropped.
+void Database::cancelChunkingJobs(int folder_id, int document_id)
+{
+    for (auto it = m_chunkingJobs.begin(); it != m_chunkingJobs.end();) {
+        ChunkingJob &job = **it;
+        if ((folder_id == -1 || job.doc.folder == folder_id) && (document_id == -1 || job.documentId == document_id)) {
+            job.cancelled = true;
+            it = m_chunkingJobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
 }
 
 void Database::scanDocuments(int folder_id, const QString &folder_path)
@@ -1898,22 +2573,38 @@ void Database::scanDocuments(int folder_id, const QString &folder_path)
     qDebug() << "scanning folder for documents" << folder_path;
 #endif
 
-    QDirIterator it(folder_path, QDir::Readable | QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot,
-                    QDirIterator::Subdirectories);
-    std::list<DocumentInfo> infos;
-    while (it.hasNext()) {
-        it.next();
-        QFileInfo fileInfo = it.fileInfo();
-        if (fileInfo.isDir()) {
-            addFolderToWatch(fileInfo.canonicalFilePath());
-            continue;
-        }
+    const QString root = QFileInfo(folder_path).canonicalFilePath();
+    if (root.isEmpty())
+        return updateFolderToIndex(folder_id, 0, false); // removed, cleanDB will remove its documents
 
-        if (!m_scannedFileExtensions.contains(fileInfo.suffix(), Qt::CaseInsensitive))
-            continue;
+    DirectorySnapshot snapshot = DirectorySnapshot::take(root, SCAN_THREADS);
+    std::optional<DirectorySnapshot> saved;
+    if (auto it = m_savedSnapshots.find(folder_id); it != m_savedSnapshots.end()) {
+        saved = std::move(it->second);
+        m_savedSnapshots.erase(it);
+    } else {
+        saved = DirectorySnapshot::load(folderSnapshotPath(folder_id), folderSnapshotKey());
+    }
+    if (saved && saved->root() != snapshot.root())
+        saved.reset();
 
-        infos.push_back({ folder_id, fileInfo });
+    std::list<DocumentInfo> infos;
+    if (saved) {
+        // only the files that changed since the last scan was indexed, including those that were removed
+        const QStringList changed = snapshot.changedSince(*saved);
+        if (collectChangedPaths(folder_id, changed, infos))
+            updateCollectionStatistics();
+        if (!changed.isEmpty())
+            m_unsavedSnapshots.insert(folder_id);
+    } else {
+        for (const QString &path: snapshot.files()) {
+            QFileInfo fileInfo(path);
+            if (m_scannedFileExtensions.contains(fileInfo.suffix(), Qt::CaseInsensitive))
+                infos.push_back({ folder_id, fileInfo });
+        }
+        m_unsavedSnapshots.insert(folder_id);
     }
+    m_folderSnapshots.insert_or_assign(folder_id, std::move(snapshot));
 
     if (!infos.empty()) {
         CollectionItem item = guiCollectionItem(folder_id);
@@ -1927,10 +2618,11 @@ void Database::scanDocuments(int folder_id, const QString &folder_path)
 
 void Database::start()
 {
-    connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, &Database::directoryChanged);
+    connect(m_watcher, &FolderWatcher::pathsChanged, this, &Database::pathsChanged);
     connect(m_embLLM, &EmbeddingLLM::embeddingsGenerated, this, &Database::handleEmbeddingsGenerated);
     connect(m_embLLM, &EmbeddingLLM::errorGenerated, this, &Database::handleErrorGenerated);
     m_scanIntervalTimer->callOnTimeout(this, &Database::scanQueueBatch);
+    m_embeddingsMaintenanceTimer->callOnTimeout(this, &Database::maintainFolderEmbeddings);
 
     const QString modelPath = MySettings::globalInstance()->modelPath();
     QList<CollectionItem> oldCollections;
@@ -1939,14 +2631,46 @@ void Database::start()
         m_databaseValid = false;
     } else if (!initDb(modelPath, oldCollections)) {
         m_databaseValid = false;
+    } else if (QSqlQuery q(m_db); !selectDatabaseId(q, &m_databaseId)) {
+        qWarning() << "ERROR: Cannot select the database id" << q.lastError();
+        m_databaseValid = false;
     } else {
-        cleanDB();
-        ftsIntegrityCheck();
-        QSqlQuery q(m_db);
+        cleanDB(/*useSavedSnapshots*/ true);
         if (!refreshDocumentIdCache(q)) {
             m_databaseValid = false;
         } else {
             addCurrentFolders();
+            enableReaders();
+        }
+    }
+
+    if (!m_databaseValid)
+        emit databaseValidChanged();
+}
+
+// Opens the database of the chat application only to retrieve from it, for gpt4all-server. The database is not
+// created, upgraded or cleaned, and its folders are neither watched nor indexed. The embeddings of the folders are
+// loaded into a directory of this process, see indexDirPath(), and reloaded by retrieval once the chat application has
+// changed them, see refreshFolderEmbeddings().
+void Database::startReadOnly()
+{
+    m_readOnly = true;
+    const QString dbPath = databasePath(MySettings::globalInstance()->modelPath(), LOCALDOCS_VERSION);
+    if (!QFileInfo::exists(dbPath)) {
+        qWarning() << "LocalDocs: there are no collections to retrieve from, the chat application has not created"
+                   << dbPath;
+        m_databaseValid = false;
+    } else {
+        m_db.setConnectOptions(u"QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=5000"_s);
+        m_db.setDatabaseName(dbPath);
+        if (!m_db.open()) {
+            qWarning() << "ERROR: opening db for reading" << dbPath << m_db.lastError();
+            m_databaseValid = false;
+        } else if (QSqlQuery q(m_db); !selectDatabaseId(q, &m_databaseId)) {
+            qWarning() << "ERROR: Cannot select the database id" << q.lastError();
+            m_databaseValid = false;
+        } else {
+            enableReaders();
         }
     }
 
@@ -2025,13 +2749,14 @@ void Database::scheduleUncompletedEmbeddings()
         updateGuiForCollectionItem(item);
     }
 
-    for (auto it = chunkList.keyBegin(), end = chunkList.keyEnd(); it != end;) {
-        QList<EmbeddingChunk> batch;
-        for (; it != end && batch.size() < s_batchSize; ++it)
-            batch.append({ /*model*/ it->embedding_model, /*folder_id*/ it->folder_id, /*chunk_id*/ it->chunk_id, /*chunk*/ it->text });
-        Q_ASSERT(!batch.isEmpty());
-        m_embLLM->generateDocEmbeddingsAsync(batch);
+    for (auto it = chunkList.keyBegin(), end = chunkList.keyEnd(); it != end; ++it) {
+        // chunks made before the token counts were estimated have none
+        const int tokens = it->tokens > 0 ? it->tokens : EmbeddingLLM::estimatedTokenCount(it->text);
+        m_chunkList.append({ /*model*/ it->embedding_model, /*folder_id*/ it->folder_id, /*chunk_id*/ it->chunk_id,
+                             /*chunk*/ it->text, /*tokens*/ tokens });
+        m_chunkListTokens += tokens;
     }
+    sendChunkList();
 }
 
 void Database::updateCollectionStatistics()
@@ -2077,9 +2802,13 @@ int Database::checkAndAddFolderToDB(const QString &path)
     }
 
     // Add the folder
-    if (folder_id == -1 && !addFolderToDB(q, path, &folder_id)) {
-        qWarning() << "ERROR: Cannot add folder to db with path" << path << q.lastError();
-        return -1;
+    if (folder_id == -1) {
+        if (!addFolderToDB(q, path, &folder_id)) {
+            qWarning() << "ERROR: Cannot add folder to db with path" << path << q.lastError();
+            return -1;
+        }
+        // a folder that was removed may have had the same id
+        dropFolderSnapshot(folder_id);
     }
 
     Q_ASSERT(folder_id != -1);
@@ -2109,6 +2838,7 @@ void Database::forceIndexing(const QString &collection, const QString &embedding
         item.forceIndexing = false;
         updateGuiForCollectionItem(item);
         addFolderToWatch(folder.second);
+        dropFolderSnapshot(folder.first); // look at every file, as the first scan of a folder does
         scanDocuments(folder.first, folder.second);
     }
 }
@@ -2133,6 +2863,7 @@ void Database::forceRebuildFolder(const QString &path)
 
     commit();
 
+    dropFolderEmbeddings(folder_id);
     updateCollectionStatistics();
 
     // We now have zero embeddings. Document progress will be updated by scanDocuments.
@@ -2210,7 +2941,7 @@ void Database::removeFolder(const QString &collection, const QString &path)
     Q_ASSERT(folder_id != -1);
     if (folder_id == -1) {
         qWarning() << "ERROR: Collected folder does not exist in db" << path;
-        m_watcher->removePath(path);
+        m_watcher->removeFolder(path);
         return;
     }
 
@@ -2248,6 +2979,8 @@ bool Database::removeFolderInternal(const QString &collection, int folder_id, co
 
     // First remove all upcoming jobs associated with this folder
     removeFolderFromDocumentQueue(folder_id);
+    dropFolderEmbeddings(folder_id);
+    dropFolderSnapshot(folder_id);
 
     // Get a list of all documents associated with folder
     QList<int> documentIds;
@@ -2284,13 +3017,7 @@ void Database::addFolderToWatch(const QString &path)
 #if defined(DEBUG)
     qDebug() << "addFolderToWatch" << path;
 #endif
-    // pre-check because addPath returns false for already watched paths
-    if (!m_watchedPaths.contains(path)) {
-        if (!m_watcher->addPath(path))
-            qWarning() << "Database::addFolderToWatch: failed to watch" << path;
-        // add unconditionally to suppress repeated warnings
-        m_watchedPaths << path;
-    }
+    m_watcher->addFolder(path);
 }
 
 void Database::removeFolderFromWatch(const QString &path)
@@ -2298,111 +3025,412 @@ void Database::removeFolderFromWatch(const QString &path)
 #if defined(DEBUG)
     qDebug() << "removeFolderFromWatch" << path;
 #endif
-    QDirIterator it(path, QDir::Readable | QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
-    QStringList children { path };
-    while (it.hasNext())
-        children.append(it.next());
+    m_watcher->removeFolder(path);
+}
+
+// The directory of the files that are kept next to the database. A read-only database gets one of its own in the
+// cache, for the embeddings that it loads, since the directory of the database belongs to the process that writes it.
+QString Database::indexDirPath() const
+{
+    if (m_readOnly) {
+        return u"%1/localdocs_%2"_s.arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation),
+                                        m_databaseId);
+    }
+    QFileInfo dbInfo(m_db.databaseName());
+    return u"%1/%2_index"_s.arg(dbInfo.path(), dbInfo.completeBaseName());
+}
 
-    m_watcher->removePaths(children);
-    m_watchedPaths -= QSet(children.begin(), children.end());
+// next to the embeddings of the folder, so that dropFolderEmbeddings(folder_id) removes it too
+QString Database::folderSnapshotPath(int folder_id) const
+{
+    return u"%1/%2_files.snapshot"_s.arg(indexDirPath(), QString::number(folder_id));
 }
 
-QList<int> Database::searchEmbeddingsHelper(const std::vector<float> &query, QSqlQuery &q, int nNeighbors)
+// the database and the settings that decide which documents a snapshot stands for, a snapshot saved with others is
+// not used
+QString Database::folderSnapshotKey() const
 {
-    constexpr int BATCH_SIZE = 2048;
+    return u"%1;%2;%3"_s.arg(m_databaseId, m_scannedFileExtensions.join(u','), QString::number(m_chunkSize));
+}
 
-    const int n_embd = query.size();
-    const us::metric_punned_t metric(n_embd, us::metric_kind_t::ip_k); // inner product
+void Database::saveFolderSnapshot(int folder_id)
+{
+    auto it = m_folderSnapshots.find(folder_id);
+    if (it == m_folderSnapshots.end() || !m_unsavedSnapshots.contains(folder_id) || countOfDocuments(folder_id))
+        return; // removed, saved or changed again since
+    if (it->second.save(folderSnapshotPath(folder_id), folderSnapshotKey()))
+        m_unsavedSnapshots.erase(folder_id);
+}
 
-    us::executor_default_t executor(std::thread::hardware_concurrency());
-    us::exact_search_t search;
+// The next scan of the folder will look at all of its files.
+void Database::dropFolderSnapshot(int folder_id)
+{
+    m_folderSnapshots.erase(folder_id);
+    m_unsavedSnapshots.erase(folder_id);
+    m_savedSnapshots.erase(folder_id);
+    QFile::remove(folderSnapshotPath(folder_id));
+}
 
-    QList<int> batchChunkIds;
-    QList<float> batchEmbeddings;
-    batchChunkIds.reserve(BATCH_SIZE);
-    batchEmbeddings.reserve(BATCH_SIZE * n_embd);
+QString Database::folderEmbeddingsPath(const QString &embedding_model, int folder_id, QStringView suffix) const
+{
+    auto modelHash = QCryptographicHash::hash(embedding_model.toUtf8(), QCryptographicHash::Sha1).toHex().left(16);
+    return u"%1/%2_%3%4"_s.arg(indexDirPath(), QString::number(folder_id), QString::fromLatin1(modelHash), suffix);
+}
 
-    struct Result { int chunkId; us::distance_punned_t dist; };
-    QList<Result> results;
+// Returns the store of the embeddings of a folder, opening it if needed. If there is no usable store file, it is
+// created from the embeddings table, unless build is false. Returns null if there is nothing to store.
+EmbeddingStore *Database::embeddingStore(const QString &embedding_model, int folder_id, bool build)
+{
+    FolderEmbeddingsKey key(embedding_model, folder_id);
+    if (auto it = m_folderEmbeddings.find(key); it != m_folderEmbeddings.end())
+        return it->second.store.get();
 
-    // The q parameter is expected to be the result of a QSqlQuery returning (chunk_id, embedding) pairs
-    while (q.at() != QSql::AfterLastRow) { // batches
-        batchChunkIds.clear();
-        batchEmbeddings.clear();
-
-        while (batchChunkIds.count() < BATCH_SIZE && q.next()) { // batch
-            batchChunkIds << q.value(0).toInt();
-            batchEmbeddings.resize(batchEmbeddings.size() + n_embd);
-            QVariant embdCol = q.value(1);
-            if (embdCol.userType() != QMetaType::QByteArray) {
-                qWarning() << "Database ERROR: Expected embedding to be blob, got" << embdCol.userType();
-                return {};
-            }
-            auto *embd = static_cast<const QByteArray *>(embdCol.constData());
-            const int embd_stride = n_embd * sizeof(float);
-            if (embd->size() != embd_stride) {
-                qWarning() << "Database ERROR: Expected embedding to be" << embd_stride << "bytes, got"
-                           << embd->size();
-                return {};
+    QString path = folderEmbeddingsPath(embedding_model, folder_id, u".vectors");
+    QSqlQuery q(m_db);
+
+    if (auto store = EmbeddingStore::open(path)) {
+        // a store that missed a change to the embeddings table, or was changed by one that was not saved, cannot be
+        // trusted
+        qint64 generation;
+        if (!selectStoreGeneration(q, embedding_model, folder_id, &generation)) {
+            qWarning() << "Database ERROR: failed to select embedding store generation:" << q.lastError();
+            return nullptr;
+        }
+        if (store->generation() == generation) {
+            QWriteLocker locker(&m_folderEmbeddingsLock);
+            m_emptyFolderEmbeddings.erase(key);
+            return (m_folderEmbeddings[key].store = std::move(store)).get();
+        }
+        qWarning() << "LocalDocs: discarding out-of-date embedding store" << path;
+        store.reset();
+        QFile::remove(path);
+    }
+
+    if (!build)
+        return nullptr;
+
+    if (!q.prepare(GET_FOLDER_EMBEDDINGS_SQL))
+        return nullptr;
+    q.addBindValue(embedding_model);
+    q.addBindValue(folder_id);
+    if (!q.exec()) {
+        qWarning() << "Database ERROR: failed to select embeddings:" << q.lastError();
+        return nullptr;
+    }
+
+    std::unique_ptr<EmbeddingStore> store;
+    while (q.next()) {
+        QByteArray blob = q.value(1).toByteArray();
+        std::span embedding(reinterpret_cast<const float *>(blob.constData()), blob.size() / sizeof(float));
+        if (!store) {
+            if (!QDir().mkpath(QFileInfo(path).path())) {
+                qWarning() << "LocalDocs: failed to create directory for" << path;
+                return nullptr;
             }
-            memcpy(&*(batchEmbeddings.end() - n_embd), embd->constData(), embd_stride);
+            if (!(store = EmbeddingStore::create(path, int(embedding.size()))))
+                return nullptr;
+        }
+        if (!store->add(q.value(0).toInt(), embedding)) {
+            store.reset();
+            QFile::remove(path);
+            return nullptr;
         }
+    }
+    if (!store)
+        return nullptr;
 
-        int nBatch = batchChunkIds.count();
-        if (!nBatch)
-            break;
+    // it matches the saved embeddings, unless it was built in a transaction, which confirms it when it commits
+    if (!m_inTransaction) {
+        qint64 generation;
+        if (selectStoreGeneration(q, embedding_model, folder_id, &generation))
+            store->setGeneration(generation);
+        else
+            qWarning() << "Database ERROR: failed to select embedding store generation:" << q.lastError();
+    }
 
-        // get top-k nearest neighbors of this batch
-        int kBatch = qMin(nNeighbors, nBatch);
-        us::exact_search_results_t batchResults = search(
-            (us::byte_t const *)batchEmbeddings.data(), nBatch, n_embd * sizeof(float),
-            (us::byte_t const *)query.data(),           1,      n_embd * sizeof(float),
-            kBatch, metric
-        );
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    m_emptyFolderEmbeddings.erase(key);
+    m_folderEmbeddings[key].store = std::move(store);
+    markFolderEmbeddingsChanged(embedding_model, folder_id);
+    return m_folderEmbeddings[key].store.get();
+}
+
+// Returns the index of the embeddings of a folder, loading it if needed. If there is no usable saved index, it is
+// built from the store, unless build is false. Returns null if there is nothing to index.
+EmbeddingIndex *Database::embeddingIndex(const QString &embedding_model, int folder_id, bool build)
+{
+    EmbeddingStore *store = embeddingStore(embedding_model, folder_id, build);
+    if (!store)
+        return nullptr;
+    FolderEmbeddings &embeddings = m_folderEmbeddings.at({ embedding_model, folder_id });
+    if (embeddings.index)
+        return embeddings.index.get();
 
-        for (int i = 0; i < kBatch; ++i) {
-            auto offset = batchResults.at(0)[i].offset;
-            us::distance_punned_t distance = batchResults.at(0)[i].distance;
-            results.append({batchChunkIds[offset], distance});
+    QString path = folderEmbeddingsPath(embedding_model, folder_id, u".usearch");
+    if (auto index = EmbeddingIndex::load(path)) {
+        // an index that was not saved after its last change cannot be trusted
+        if (index->size() == store->size()) {
+            QWriteLocker locker(&m_folderEmbeddingsLock);
+            return (embeddings.index = std::move(index)).get();
         }
+        qWarning() << "LocalDocs: discarding out-of-date embedding index" << path;
+        QFile::remove(path);
     }
 
-    // get top-k nearest neighbors of combined results
-    nNeighbors = qMin(nNeighbors, results.size());
-    std::partial_sort(
-        results.begin(), results.begin() + nNeighbors, results.end(),
-        [](const Result &a, const Result &b) { return a.dist < b.dist; }
-    );
+    if (!build)
+        return nullptr;
+
+    auto index = EmbeddingIndex::create(store->dimensions());
+    for (qsizetype row = 0; row < store->rowCount(); row++) {
+        if (store->isRemoved(row))
+            continue;
+        std::span embedding(store->rows() + row * store->dimensions(), size_t(store->dimensions()));
+        if (!index->add(store->chunkId(row), embedding))
+            return nullptr;
+    }
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    embeddings.index = std::move(index);
+    markFolderEmbeddingsChanged(embedding_model, folder_id);
+    return embeddings.index.get();
+}
+
+void Database::markFolderEmbeddingsChanged(const QString &embedding_model, int folder_id)
+{
+    FolderEmbeddingsKey key(embedding_model, folder_id);
+    m_folderEmbeddings.at(key).indexDirty = true;
+    m_embeddingsInTransaction.insert(key);
+    if (!m_embeddingsMaintenanceTimer->isActive())
+        m_embeddingsMaintenanceTimer->start();
+}
+
+void Database::saveEmbeddingIndexes()
+{
+    for (auto &[key, embeddings]: m_folderEmbeddings) {
+        if (!embeddings.index || !embeddings.indexDirty)
+            continue;
+        if (embeddings.index->save(folderEmbeddingsPath(key.first, key.second, u".usearch")))
+            embeddings.indexDirty = false;
+    }
+}
+
+void Database::maintainFolderEmbeddings()
+{
+    saveEmbeddingIndexes();
+
+    // reclaim the rows of removed chunks, which exact search still has to skip over
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    for (auto it = m_folderEmbeddings.begin(); it != m_folderEmbeddings.end();) {
+        EmbeddingStore *store = it->second.store.get();
+        if (!store->needsCompaction() || store->compact()) {
+            ++it;
+            continue;
+        }
+        QFile::remove(folderEmbeddingsPath(it->first.first, it->first.second, u".vectors"));
+        it = m_folderEmbeddings.erase(it);
+    }
+}
+
+void Database::dropFolderEmbeddings(const QString &embedding_model, int folder_id)
+{
+    QWriteLocker locker(&m_folderEmbeddingsLock);
+    m_folderEmbeddings.erase({ embedding_model, folder_id });
+    m_emptyFolderEmbeddings.erase({ embedding_model, folder_id });
+    QFile::remove(folderEmbeddingsPath(embedding_model, folder_id, u".vectors"));
+    QFile::remove(folderEmbeddingsPath(embedding_model, folder_id, u".usearch"));
+}
+
+void Database::dropFolderEmbeddings(int folder_id)
+{
+    {
+        QWriteLocker locker(&m_folderEmbeddingsLock);
+        std::erase_if(m_folderEmbeddings, [folder_id](const auto &entry) { return entry.first.second == folder_id; });
+        std::erase_if(m_emptyFolderEmbeddings, [folder_id](const auto &key) { return key.second == folder_id; });
+    }
+
+    // also remove the files of stores and indexes that were never loaded
+    QDir dir(QFileInfo(folderEmbeddingsPath({}, folder_id, {})).path());
+    for (auto &file : dir.entryList({ u"%1_*"_s.arg(folder_id) }, QDir::Files))
+        dir.remove(file);
+}
+
+// Loads the stores of the folders, and their indexes if asked for, or builds them if needed. Runs on the database
+// thread, which is the only one that changes them.
+void Database::loadFolderEmbeddings(const QList<FolderEmbeddingsKey> &folders, bool withIndexes)
+{
+    for (const auto &[model, folder_id]: folders) {
+        if (!embeddingStore(model, folder_id)) {
+            QWriteLocker locker(&m_folderEmbeddingsLock);
+            m_emptyFolderEmbeddings.insert({ model, folder_id });
+        } else if (withIndexes) {
+            embeddingIndex(model, folder_id);
+        }
+    }
+}
+
+// Has the database thread load what retrieval needs of the folders and is not loaded yet. This waits for the database
+// thread, but only the first time a folder is searched after it was opened or its store dropped.
+void Database::ensureFolderEmbeddings(const QList<FolderEmbeddingsKey> &folders, bool withIndexes)
+{
+    QList<FolderEmbeddingsKey> missing;
+    {
+        QReadLocker locker(&m_folderEmbeddingsLock);
+        for (const auto &key: folders) {
+            auto it = m_folderEmbeddings.find(key);
+            if (it == m_folderEmbeddings.end() ? !m_emptyFolderEmbeddings.contains(key)
+                                               : withIndexes && !it->second.index)
+                missing << key;
+        }
+    }
+    if (!missing.isEmpty()) {
+        QMetaObject::invokeMethod(this, [&] { loadFolderEmbeddings(missing, withIndexes); },
+                                  Qt::BlockingQueuedConnection);
+    }
+}
+
+// A read-only database is changed by another process, which does not update the stores that this one has loaded. The
+// stores of the folders whose generation in the snapshot that q reads is not that of the loaded store are reloaded
+// from the embeddings table, so that the search sees the same chunks as the rest of the retrieval.
+void Database::refreshFolderEmbeddings(QSqlQuery &q, const QList<FolderEmbeddingsKey> &folders)
+{
+    Q_ASSERT(m_readOnly);
+    if (!q.exec(SELECT_ALL_STORE_GENERATIONS_SQL)) {
+        qWarning() << "Database ERROR: failed to select embedding store generations:" << q.lastError();
+        return;
+    }
+    std::map<FolderEmbeddingsKey, qint64> generations; // none for a folder whose embeddings never changed
+    while (q.next())
+        generations[{ q.value(0).toString(), q.value(1).toInt() }] = q.value(2).toLongLong();
+
+    // a store that another retrieval reloaded from a later snapshot is not stale
+    auto isStale = [&](const FolderEmbeddingsKey &key) {
+        auto gen = generations.find(key);
+        if (auto it = m_folderEmbeddings.find(key); it != m_folderEmbeddings.end()) {
+            qint64 loaded = it->second.store->generation();
+            return gen == generations.end() ? loaded != 0 : loaded < gen->second;
+        }
+        return m_emptyFolderEmbeddings.contains(key) && gen != generations.end();
+    };
+
+    QList<FolderEmbeddingsKey> stale;
+    {
+        QReadLocker locker(&m_folderEmbeddingsLock);
+        for (const auto &key: folders) {
+            if (isStale(key))
+                stale << key;
+        }
+    }
+    if (stale.isEmpty())
+        return;
+
+    QMetaObject::invokeMethod(this, [&] {
+        QList<FolderEmbeddingsKey> reload;
+        for (const auto &key: std::as_const(stale)) {
+            if (isStale(key)) {
+                dropFolderEmbeddings(key.first, key.second);
+                reload << key;
+            }
+        }
+        loadFolderEmbeddings(reload, /*withIndexes*/ false);
+    }, Qt::BlockingQueuedConnection);
+}
 
+QList<int> Database::searchEmbeddingsHelper(const std::vector<float> &query,
+    const QList<const EmbeddingStore *> &stores, int nNeighbors)
+{
     QList<int> chunkIds;
     chunkIds.reserve(nNeighbors);
-    for (int i = 0; i < nNeighbors; i++)
-        chunkIds << results[i].chunkId;
+    for (const auto &match: EmbeddingStore::search(query, stores, nNeighbors))
+        chunkIds << match.chunkId;
     return chunkIds;
 }
 
-QList<int> Database::searchEmbeddings(const std::vector<float> &query, const QList<QString> &collections,
+QList<int> Database::searchEmbeddings(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
     int nNeighbors)
 {
-    QSqlQuery q(m_db);
-    if (!q.exec(GET_COLLECTION_EMBEDDINGS_SQL.arg(collections.join("', '")))) {
-        qWarning() << "Database ERROR: Failed to exec embeddings query:" << q.lastError();
-        return {};
+    // below this size, an exact search is fast enough and gives better results
+    constexpr qsizetype EXACT_SEARCH_MAX_EMBEDDINGS = 20000;
+
+    ensureFolderEmbeddings(folders, /*withIndexes*/ false);
+    QReadLocker locker(&m_folderEmbeddingsLock);
+
+    qsizetype nEmbeddings = 0;
+    for (const auto &key: folders) {
+        if (auto it = m_folderEmbeddings.find(key); it != m_folderEmbeddings.end())
+            nEmbeddings += it->second.store->size();
+    }
+
+    if (nEmbeddings > EXACT_SEARCH_MAX_EMBEDDINGS) {
+        locker.unlock();
+        ensureFolderEmbeddings(folders, /*withIndexes*/ true);
+        locker.relock();
+
+        QList<EmbeddingIndex::Match> matches;
+        bool ok = true;
+        for (const auto &key: folders) {
+            auto it = m_folderEmbeddings.find(key);
+            if (it == m_folderEmbeddings.end())
+                continue; // no embeddings
+            const EmbeddingIndex *index = it->second.index.get();
+            if (!index) {
+                ok = false;
+                break;
+            }
+            matches << index->search(query, nNeighbors);
+        }
+
+        if (ok) {
+            // chunk IDs are unique across folders, so merging the results is enough
+            int k = qMin(nNeighbors, matches.size());
+            std::partial_sort(matches.begin(), matches.begin() + k, matches.end(),
+                              [](auto &a, auto &b) { return a.distance < b.distance; });
+            QList<int> chunkIds;
+            chunkIds.reserve(k);
+            for (int i = 0; i < k; i++)
+                chunkIds << matches[i].chunkId;
+            return chunkIds;
+        }
+        qWarning() << "LocalDocs: embedding index unavailable, falling back to exact search";
+    }
+
+    QList<const EmbeddingStore *> stores;
+    for (const auto &key: folders) {
+        if (auto it = m_folderEmbeddings.find(key); it != m_folderEmbeddings.end())
+            stores << it->second.store.get();
     }
-    return searchEmbeddingsHelper(query, q, nNeighbors);
+    return searchEmbeddingsHelper(query, stores, nNeighbors);
 }
 
-QList<int> Database::scoreChunks(const std::vector<float> &query, const QList<int> &chunks)
+QList<int> Database::scoreChunks(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
+    const QList<int> &chunks)
 {
-    QList<QString> chunkStrings;
-    for (int id : chunks)
-        chunkStrings << QString::number(id);
-    QSqlQuery q(m_db);
-    if (!q.exec(GET_CHUNK_EMBEDDINGS_SQL.arg(chunkStrings.join(", ")))) {
-        qWarning() << "Database ERROR: Failed to exec embeddings query:" << q.lastError();
-        return {};
+    const int n_embd = query.size();
+    QReadLocker locker(&m_folderEmbeddingsLock);
+    QList<const EmbeddingStore *> stores;
+    for (const auto &key: folders) {
+        auto it = m_folderEmbeddings.find(key);
+        if (it != m_folderEmbeddings.end() && it->second.store->dimensions() == n_embd)
+            stores << it->second.store.get();
+    }
+
+    struct Result { int chunkId; float dist; };
+    QList<Result> results;
+    for (int chunkId: chunks) {
+        for (const EmbeddingStore *store: std::as_const(stores)) {
+            std::span embedding = store->embedding(chunkId);
+            if (embedding.empty())
+                continue;
+            results.append({chunkId, EmbeddingStore::distance(query, embedding)});
+            break;
+        }
     }
-    return searchEmbeddingsHelper(query, q, chunks.size());
+
+    std::sort(results.begin(), results.end(), [](const Result &a, const Result &b) { return a.dist < b.dist; });
+
+    QList<int> chunkIds;
+    chunkIds.reserve(results.size());
+    for (const auto &r: std::as_const(results))
+        chunkIds << r.chunkId;
+    return chunkIds;
 }
 
 QList<Database::BM25Query> Database::queriesForFTS5(const QString &input)
@@ -2449,12 +3477,13 @@ QList<Database::BM25Query> Database::queriesForFTS5(const QString &input)
     return queries;
 }
 
-QList<int> Database::searchBM25(const QString &query, const QList<QString> &collections, BM25Query &bm25q, int k)
+QList<int> Database::searchBM25(const QSqlDatabase &db, const QString &query, const QList<QString> &collections,
+    BM25Query &bm25q, int k)
 {
     struct SearchResult { int chunkId; float score; };
     QList<BM25Query> bm25Queries = queriesForFTS5(query);
 
-    QSqlQuery sqlQuery(m_db);
+    QSqlQuery sqlQuery(db);
     sqlQuery.prepare(SELECT_CHUNKS_FTS_SQL.arg(collections.join("', '"), QString::number(k)));
 
     QList<SearchResult> results;
@@ -2528,8 +3557,8 @@ float Database::computeBM25Weight(const Database::BM25Query &bm25q)
     return bmWeight;
 }
 
-QList<int> Database::reciprocalRankFusion(const std::vector<float> &query, const QList<int> &embeddingResults,
-    const QList<int> &bm25Results, const BM25Query &bm25q, int k)
+QList<int> Database::reciprocalRankFusion(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
+    const QList<int> &embeddingResults, const QList<int> &bm25Results, const BM25Query &bm25q, int k)
 {
     // We default to the embedding results and augment with bm25 if any
     QList<int> results = embeddingResults;
@@ -2543,7 +3572,7 @@ QList<int> Database::reciprocalRankFusion(const std::vector<float> &query, const
     }
 
     if (!missingScores.isEmpty()) {
-        QList<int> scored = scoreChunks(query, missingScores);
+        QList<int> scored = scoreChunks(query, folders, missingScores);
         results << scored;
     }
 
@@ -2586,7 +3615,8 @@ QList<int> Database::reciprocalRankFusion(const std::vector<float> &query, const
     return results;
 }
 
-QList<int> Database::searchDatabase(const QString &query, const QList<QString> &collections, int k)
+QList<int> Database::searchDatabase(const QSqlDatabase &db, const QString &query, const QList<QString> &collections,
+    int k)
 {
     std::vector<float> queryEmbd = m_embLLM->generateQueryEmbedding(query);
     if (queryEmbd.empty()) {
@@ -2594,26 +3624,123 @@ QList<int> Database::searchDatabase(const QString &query, const QList<QString> &
         return { };
     }
 
-    const QList<int> embeddingResults = searchEmbeddings(queryEmbd, collections, k);
+    QList<FolderEmbeddingsKey> folders;
+    QSqlQuery q(db);
+    if (!q.exec(GET_COLLECTION_FOLDERS_SQL.arg(collections.join("', '")))) {
+        qWarning() << "Database ERROR: Failed to exec collection folders query:" << q.lastError();
+        return {};
+    }
+    while (q.next())
+        folders << FolderEmbeddingsKey(q.value(0).toString(), q.value(1).toInt());
+    if (m_readOnly)
+        refreshFolderEmbeddings(q, folders);
+
+    const QList<int> embeddingResults = searchEmbeddings(queryEmbd, folders, k);
     BM25Query bm25q;
-    const QList<int> bm25Results = searchBM25(query, collections, bm25q, k);
-    return reciprocalRankFusion(queryEmbd, embeddingResults, bm25Results, bm25q, k);
+    const QList<int> bm25Results = searchBM25(db, query, collections, bm25q, k);
+    return reciprocalRankFusion(queryEmbd, folders, embeddingResults, bm25Results, bm25q, k);
+}
+
+// The read-only connection of the calling thread of m_retrievalPool. It is opened on first use, and again when the
+// database thread has moved to another file since. Not open if the database cannot be read.
+QSqlDatabase Database::readConnection()
+{
+    struct Connection {
+        QString name;
+        ~Connection() { if (!name.isEmpty()) QSqlDatabase::removeDatabase(name); }
+    };
+    static std::atomic<int> s_nConnections = 0;
+    thread_local Connection connection;
+
+    QString path;
+    auto readPath = [&] {
+        QMutexLocker locker(&m_readMutex);
+        path = m_readDbPath;
+    };
+    readPath();
+    if (path.isEmpty()) {
+        // the database thread may not be done opening the database yet
+        QMetaObject::invokeMethod(this, readPath, Qt::BlockingQueuedConnection);
+        if (path.isEmpty())
+            return {};
+    }
+
+    if (connection.name.isEmpty()) {
+        connection.name = u"localdocs-read-%1"_s.arg(s_nConnections++);
+        QSqlDatabase::addDatabase(u"QSQLITE"_s, connection.name);
+    }
+    QSqlDatabase db = QSqlDatabase::database(connection.name, /*open*/ false);
+    if (db.isOpen() && db.databaseName() == path)
+        return db;
+
+    db.close();
+    db.setDatabaseName(path);
+    db.setConnectOptions(u"QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=5000"_s);
+    if (!db.open())
+        qWarning() << "ERROR: opening db for reading" << path << db.lastError();
+    return db;
+}
+
+// Lets retrieval read the database with connections of its own. In WAL mode, they read the last committed state
+// without waiting for the transactions of the database thread, and it does not wait for them.
+void Database::enableReaders()
+{
+    QSqlQuery q(m_db);
+    if (m_readOnly) {
+        // the journal mode is up to the process that writes the database
+    } else if (!q.exec(u"pragma journal_mode = wal;"_s) || !q.next() || q.value(0).toString() != u"wal"_s) {
+        qWarning() << "WARNING: LocalDocs retrieval will wait for indexing, cannot enable WAL mode:" << q.lastError();
+    }
+
+    // the stores and indexes are loaded now, so that searching does not wait for the database thread to load them
+    if (q.exec(GET_ALL_COLLECTION_FOLDERS_SQL)) {
+        QList<FolderEmbeddingsKey> folders;
+        while (q.next())
+            folders << FolderEmbeddingsKey(q.value(0).toString(), q.value(1).toInt());
+        loadFolderEmbeddings(folders, /*withIndexes*/ false);
+        for (const auto &[model, folder_id]: std::as_const(folders))
+            embeddingIndex(model, folder_id, /*build*/ false);
+    } else {
+        qWarning() << "Database ERROR: Failed to exec collection folders query:" << q.lastError();
+    }
+
+    QMutexLocker locker(&m_readMutex);
+    m_readDbPath = m_db.databaseName();
 }
 
 void Database::retrieveFromDB(const QList<QString> &collections, const QString &text, int retrievalSize,
     QList<ResultInfo> *results)
+{
+    Q_ASSERT(QThread::currentThread() != &m_dbThread);
+    std::latch done(1);
+    m_retrievalPool.start([&] {
+        retrieve(collections, text, retrievalSize, results);
+        done.count_down();
+    });
+    done.wait();
+}
+
+// Runs on a thread of m_retrievalPool.
+void Database::retrieve(const QList<QString> &collections, const QString &text, int retrievalSize,
+    QList<ResultInfo> *results)
 {
 #if defined(DEBUG)
     qDebug() << "retrieveFromDB" << collections << text << retrievalSize;
 #endif
 
-    QList<int> searchResults = searchDatabase(text, collections, retrievalSize);
-    if (searchResults.isEmpty())
+    QSqlDatabase db = readConnection();
+    if (!db.isOpen())
         return;
 
-    QSqlQuery q(m_db);
-    if (!selectChunk(q, searchResults)) {
-        qDebug() << "ERROR: selecting chunks:" << q.lastError();
+    // all of the reads see the same snapshot of the database, which has the chunks that the search finds unless they
+    // were removed or not committed yet
+    db.transaction();
+    QList<int> searchResults = searchDatabase(db, text, collections, retrievalSize);
+    QSqlQuery q(db);
+    if (searchResults.isEmpty() || !selectChunk(q, searchResults)) {
+        if (!searchResults.isEmpty())
+            qDebug() << "ERROR: selecting chunks:" << q.lastError();
+        db.rollback();
         return;
     }
 
@@ -2648,35 +3775,21 @@ void Database::retrieveFromDB(const QList<QString> &collections, const QString &
 #endif
     }
 
+    q.finish();
+    db.rollback(); // nothing to commit
+
     for (int id : searchResults)
         if (tempResults.contains(id))
             results->append(tempResults.value(id));
 }
 
-bool Database::ftsIntegrityCheck()
-{
-    QSqlQuery q(m_db);
-
-    // Returns an error executing sql if it the integrity check fails
-    // See: https://www.sqlite.org/fts5.html#the_integrity_check_command
-    const bool success = q.exec(FTS_INTEGRITY_SQL);
-    if (!success && q.lastError().nativeErrorCode() != "267" /*SQLITE_CORRUPT_VTAB from sqlite header*/) {
-        qWarning() << "ERROR: Cannot prepare sql for fts integrity check" << q.lastError();
-        return false;
-    }
-
-    if (!success && !q.exec(FTS_REBUILD_SQL)) {
-        qWarning() << "ERROR: Cannot exec sql for fts rebuild" << q.lastError();
-        return false;
-    }
-
-    return true;
-}
-
 // FIXME This is very slow and non-interruptible and when we close the application and we're
 // cleaning a large table this can cause the app to take forever to shut down. This would ideally be
 // interruptible and we'd continue 'cleaning' when we restart
-bool Database::cleanDB()
+//
+// If useSavedSnapshots is set, the documents of the folders with a saved snapshot are left to their next scan, which
+// removes those that are gone since the snapshot was saved without looking at the others.
+bool Database::cleanDB(bool useSavedSnapshots)
 {
 #if defined(DEBUG)
     qDebug() << "cleanDB";
@@ -2703,6 +3816,10 @@ bool Database::cleanDB()
                 rollback();
                 return false;
             }
+        } else if (useSavedSnapshots && !m_savedSnapshots.contains(i.folder_id)) {
+            auto saved = DirectorySnapshot::load(folderSnapshotPath(i.folder_id), folderSnapshotKey());
+            if (saved && saved->root() == info.canonicalFilePath())
+                m_savedSnapshots.insert_or_assign(i.folder_id, std::move(*saved));
         }
     }
 
@@ -2722,6 +3839,8 @@ bool Database::cleanDB()
     while (q.next()) {
         int document_id = q.value(0).toInt();
         QString document_path = q.value(1).toString();
+        if (m_savedSnapshots.contains(q.value(2).toInt()))
+            continue;
         QFileInfo info(document_path);
         if (info.exists() && info.isReadable() && m_scannedFileExtensions.contains(info.suffix(), Qt::CaseInsensitive))
             continue;
@@ -2758,6 +3877,8 @@ void Database::changeChunkSize(int chunkSize)
     qDebug() << "changeChunkSize" << chunkSize;
 #endif
 
+    m_savedSnapshots.clear(); // saved with the chunk size before
+
     QSqlQuery q(m_db);
     // Scan all documents in db to make sure they still exist
     if (!q.prepare(SELECT_ALL_DOCUMENTS_SQL)) {
@@ -2801,6 +3922,7 @@ void Database::changeFileExtensions(const QStringList &extensions)
 #endif
 
     m_scannedFileExtensions = extensions;
+    m_savedSnapshots.clear(); // saved with the extensions before
 
     if (cleanDB())
         updateCollectionStatistics();
@@ -2818,39 +3940,107 @@ void Database::changeFileExtensions(const QStringList &extensions)
     }
 }
 
-void Database::directoryChanged(const QString &path)
+void Database::pathsChanged(const QString &folder_path, const QStringList &paths)
 {
 #if defined(DEBUG)
-    qDebug() << "directoryChanged" << path;
+    qDebug() << "pathsChanged" << folder_path << paths.size();
 #endif
 
-    // search for a collection that contains this folder (we watch subdirectories)
+    QSqlQuery q(m_db);
     int folder_id = -1;
-    QDir dir(path);
-    for (;;) {
-        QSqlQuery q(m_db);
-        if (!selectFolder(q, dir.path(), &folder_id)) {
-            qWarning() << "ERROR: Cannot select folder from path" << dir.path() << q.lastError();
-            return;
+    if (!selectFolder(q, folder_path, &folder_id)) {
+        qWarning() << "ERROR: Cannot select folder from path" << folder_path << q.lastError();
+        return;
+    }
+    if (folder_id == -1) {
+        qWarning() << "ERROR: Watched folder does not exist in db" << folder_path;
+        m_watcher->removeFolder(folder_path);
+        return;
+    }
+
+    if (!QFileInfo(folder_path).isDir()) {
+        // the whole folder is gone
+        if (cleanDB())
+            updateCollectionStatistics();
+        return;
+    }
+
+    // the saved snapshot no longer stands for the folder, it is saved again once the changes are indexed
+    if (auto it = m_folderSnapshots.find(folder_id); it != m_folderSnapshots.end()) {
+        it->second.update(paths);
+        m_unsavedSnapshots.insert(folder_id);
+    }
+    QFile::remove(folderSnapshotPath(folder_id));
+
+    std::list<DocumentInfo> infos;
+    if (collectChangedPaths(folder_id, paths, infos))
+        updateCollectionStatistics();
+
+    // unchanged documents are skipped when they are dequeued
+    if (!infos.empty()) {
+        CollectionItem item = guiCollectionItem(folder_id);
+        item.indexing = true;
+        updateGuiForCollectionItem(item);
+        enqueueDocuments(folder_id, std::move(infos));
+    } else {
+        saveFolderSnapshot(folder_id);
+    }
+}
+
+// Removes the documents at or under the paths that are no longer files, and collects the files to index at or under
+// the others. Returns whether any documents were removed.
+bool Database::collectChangedPaths(int folder_id, const QStringList &paths, std::list<DocumentInfo> &infos)
+{
+    QSqlQuery q(m_db);
+    QStringList dirs;
+    bool removed = false;
+
+    transaction();
+
+    for (const QString &path: paths) {
+        QFileInfo info(path);
+        if (info.isFile()) {
+            if (info.isReadable() && m_scannedFileExtensions.contains(info.suffix(), Qt::CaseInsensitive))
+                infos.push_back({ folder_id, info });
+            continue;
         }
-        if (folder_id != -1)
-            break;
+        if (info.isDir())
+            dirs << path; // scanned below, documents under it may have been removed too
 
-        // check next parent
-        if (!dir.cdUp()) {
-            if (!dir.isRoot()) break; // folder removed
-            Q_ASSERT(false);
-            qWarning() << "ERROR: Watched folder does not exist in db" << path;
-            m_watcher->removePath(path);
-            return;
+        QList<std::pair<int, QString>> documents;
+        if (!selectDocumentsUnderPath(q, folder_id, path, &documents)) {
+            qWarning() << "ERROR: Cannot select documents under" << path << q.lastError();
+            rollback();
+            return false;
+        }
+        for (const auto &[document_id, document_path]: std::as_const(documents)) {
+            if (QFileInfo(document_path).isFile())
+                continue;
+            if (!removeChunksByDocumentId(q, document_id)) {
+                qWarning() << "ERROR: Cannot remove chunks of document_id" << document_id << q.lastError();
+                rollback();
+                return false;
+            }
+            if (!removeDocument(q, document_id)) {
+                qWarning() << "ERROR: Cannot remove document_id" << document_id << q.lastError();
+                rollback();
+                return false;
+            }
+            removed = true;
         }
     }
 
-    // Clean the database
-    if (cleanDB())
-        updateCollectionStatistics();
+    commit();
 
-    // Rescan the documents associated with the folder
-    if (folder_id != -1)
-        scanDocuments(folder_id, path);
+    // a directory that was added or reported as a whole may have files that were not reported
+    for (const QString &dir: std::as_const(dirs)) {
+        QDirIterator it(dir, QDir::Readable | QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            it.next();
+            QFileInfo fileInfo = it.fileInfo();
+            if (m_scannedFileExtensions.contains(fileInfo.suffix(), Qt::CaseInsensitive))
+                infos.push_back({ folder_id, fileInfo });
+        }
+    }
+    return removed;
 }
@@ -1,6 +1,8 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "boundedqueue.h"
+#include "directorysnapshot.h"
 #include "embllm.h"
 
 #include <QByteArray>
@@ -11,30 +13,38 @@
 #include <QHash>
 #include <QLatin1String>
 #include <QList>
+#include <QMutex>
 #include <QObject>
+#include <QReadWriteLock>
 #include <QSet>
 #include <QSqlDatabase>
 #include <QString>
 #include <QStringList> // IWYU pragma: keep
+#include <QStringView>
 #include <QThread>
+#include <QThreadPool>
 #include <QUrl>
 #include <QVector> // IWYU pragma: keep
 #include <QtAssert>
 
 #include <atomic>
+#include <climits>
 #include <cstddef>
 #include <list>
 #include <map>
 #include <memory>
 #include <optional>
+#include <set>
 #include <utility>
 #include <vector> // IWYU pragma: keep
 
 using namespace Qt::Literals::StringLiterals;
 
-class Database;
+class ChunkWriter;
 class DocumentReader;
-class QFileSystemWatcher;
+class EmbeddingIndex;
+class EmbeddingStore;
+class FolderWatcher;
 class QSqlQuery;
 class QTextStream;
 class QTimer;
@@ -44,20 +54,14 @@ class QTimer;
  * Version 1: GPT4All v2.5.3, embeddings in hsnwlib
  * Version 2: GPT4All v3.0.0, embeddings in sqlite
  * Version 3: GPT4All v3.4.0, hybrid search
+ * Version 4: full-text index kept in sync by triggers, content hashes of documents and chunks
  */
 
 // minimum supported version
 static const int LOCALDOCS_MIN_VER = 1;
 
-// FIXME: (Adam) The next time we bump the version we should add triggers to manage the fts external
-// content table as recommended in the official documentation to keep the fts index in sync
-// See: https://www.sqlite.org/fts5.html#external_content_tables
-
-// FIXME: (Adam) The fts virtual table should include the chunk_id explicitly instead of relying upon
-// the id of the two tables to be in sync
-
 // current version
-static const int LOCALDOCS_VERSION = 3;
+static const int LOCALDOCS_VERSION = 4;
 
 struct DocumentInfo
 {
@@ -65,7 +69,6 @@ struct DocumentInfo
 
     int       folder;
     QFileInfo file;
-    bool      currentlyProcessing = false;
 
     key_type key() const { return {folder, file.canonicalFilePath()}; } // for comparison
 
@@ -165,34 +168,60 @@ struct CollectionItem {
 };
 Q_DECLARE_METATYPE(CollectionItem)
 
+struct DocumentMetadata { QString title, author, subject, keywords; };
+
+struct DocumentChunk {
+    QString    text;
+    int        page;  // of the first word, -1 if the document has no pages
+    int        words;
+    int        tokens = 0; // estimated, for sizing the requests to the embedding model
+    QByteArray textHash; // identifies chunks of the same text, whose embeddings are the same
+};
+
+// Splits the words read from a document into chunks of at most chunkSize characters.
 class ChunkStreamer {
 public:
-    enum class Status { DOC_COMPLETE, INTERRUPTED, ERROR, BINARY_SEEN };
-
-    explicit ChunkStreamer(Database *database);
-    ~ChunkStreamer();
+    enum class Status { DOC_COMPLETE, ERROR, BINARY_SEEN };
 
-    void setDocument(DocumentInfo doc, int documentId, const QString &embeddingModel);
-    std::optional<DocumentInfo::key_type> currentDocKey() const;
-    void reset();
+    ChunkStreamer(DocumentReader *reader, int chunkSize);
 
-    Status step();
+    // returns nullopt when there are no chunks left, see status() for why
+    std::optional<DocumentChunk> next();
+    Status status() const { return m_status; }
 
 private:
-    Database                              *m_database;
-    std::optional<DocumentInfo::key_type>  m_docKey;
-    std::unique_ptr<DocumentReader>        m_reader; // may be invalid, always compare key first
-    int                                    m_documentId;
-    QString                                m_embeddingModel;
-    QString                                m_title;
-    QString                                m_author;
-    QString                                m_subject;
-    QString                                m_keywords;
+    DocumentReader *m_reader;
+    int             m_chunkSize;
+    Status          m_status = Status::DOC_COMPLETE;
 
     // working state
-    QString                                m_chunk; // has a trailing space for convenience
-    int                                    m_nChunkWords = 0;
-    int                                    m_page = 0;
+    QString         m_chunk; // has a trailing space for convenience
+    int             m_nChunkWords = 0;
+    int             m_page = 0;
+};
+
+// A document that is read and chunked on the thread pool of Database. Cancelled if the database no longer wants its
+// chunks, e.g. because the document was removed in the meantime.
+struct ChunkingJob {
+    DocumentInfo      doc;
+    int               documentId;
+    QString           embeddingModel;
+    int               chunkSize;
+    QByteArray        indexedHash; // content hash of the version of the document that has chunks, if known
+    bool              replacesChunks; // the document was read before
+    std::atomic<bool> cancelled = false;
+    bool              failed = false; // a batch could not be written, the rest of the document is dropped
+    int               firstChunkId = -1; // of the new chunks, older chunks of the document are replaced by them
+};
+
+// Chunks of a document, in order, on their way from a worker to the database thread.
+struct ChunkBatch {
+    std::shared_ptr<ChunkingJob>         job;
+    DocumentMetadata                     metadata;
+    QList<DocumentChunk>                 chunks;
+    std::optional<ChunkStreamer::Status> status; // set on the last batch of the document
+    QByteArray                           contentHash; // of the whole document, empty if it could not be read
+    bool                                 unchanged = false; // content is as indexed, the document is not chunked
 };
 
 class Database : public QObject
@@ -204,8 +233,14 @@ public:
 
     bool isValid() const { return m_databaseValid; }
 
+    // Searches the collections for the text on a thread of the retrieval pool, with a read-only connection that does
+    // not wait for the database thread. Blocks until done, must not be called on the database thread.
+    void retrieveFromDB(const QList<QString> &collections, const QString &text, int retrievalSize,
+                        QList<ResultInfo> *results);
+
 public Q_SLOTS:
     void start();
+    void startReadOnly();
     bool scanQueueInterrupted() const;
     void scanQueueBatch();
     void scanDocuments(int folder_id, const QString &folder_path);
@@ -213,7 +248,6 @@ public Q_SLOTS:
     void forceRebuildFolder(const QString &path);
     bool addFolder(const QString &collection, const QString &path, const QString &embedding_model);
     void removeFolder(const QString &collection, const QString &path);
-    void retrieveFromDB(const QList<QString> &collections, const QString &text, int retrievalSize, QList<ResultInfo> *results);
     void changeChunkSize(int chunkSize);
     void changeFileExtensions(const QStringList &extensions);
 
@@ -226,7 +260,7 @@ Q_SIGNALS:
     void databaseValidChanged();
 
 private Q_SLOTS:
-    void directoryChanged(const QString &path);
+    void pathsChanged(const QString &folder_path, const QStringList &paths);
     void addCurrentFolders();
     void handleEmbeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
     void handleErrorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
@@ -236,38 +270,61 @@ private:
     void commit();
     void rollback();
 
-    bool addChunk(QSqlQuery &q, int document_id, const QString &chunk_text, const QString &file,
-                  const QString &title, const QString &author, const QString &subject, const QString &keywords,
-                  int page, int from, int to, int words, int *chunk_id);
+    ChunkWriter &chunkWriter();
     bool refreshDocumentIdCache(QSqlQuery &q);
-    bool removeChunksByDocumentId(QSqlQuery &q, int document_id);
+    bool removeChunksByDocumentId(QSqlQuery &q, int document_id, int before_chunk_id = INT_MAX);
     bool sqlRemoveDocsByFolderPath(QSqlQuery &q, const QString &path);
     bool hasContent();
     // not found -> 0, , exists and has content -> 1, error -> -1
     int openDatabase(const QString &modelPath, bool create = true, int ver = LOCALDOCS_VERSION);
     bool openLatestDb(const QString &modelPath, QList<CollectionItem> &oldCollections);
+    bool migrateFromV3(const QString &modelPath);
     bool initDb(const QString &modelPath, const QList<CollectionItem> &oldCollections);
     int checkAndAddFolderToDB(const QString &path);
     bool removeFolderInternal(const QString &collection, int folder_id, const QString &path);
     size_t chunkStream(QTextStream &stream, int folder_id, int document_id, const QString &embedding_model,
         const QString &file, const QString &title, const QString &author, const QString &subject,
         const QString &keywords, int page, int maxChunks = -1);
-    void appendChunk(const EmbeddingChunk &chunk);
+    void appendChunk(const EmbeddingChunk &chunk, const QByteArray &textHash);
+    bool addEmbeddings(const QVector<EmbeddingResult> &embeddings);
     void sendChunkList();
     void updateFolderToIndex(int folder_id, size_t countForFolder, bool sendChunks = true);
     size_t countOfDocuments(int folder_id) const;
     size_t countOfBytes(int folder_id) const;
     DocumentInfo dequeueDocument();
     void removeFolderFromDocumentQueue(int folder_id);
-    void enqueueDocumentInternal(DocumentInfo &&info, bool prepend = false);
     void enqueueDocuments(int folder_id, std::list<DocumentInfo> &&infos);
     void scanQueue();
-    bool ftsIntegrityCheck();
-    bool cleanDB();
+    int maxChunkingJobs() const;
+    void chunkDocument(const std::shared_ptr<ChunkingJob> &job);
+    void writeChunks();
+    void writeChunkBatch(const ChunkBatch &batch);
+    bool addChunkBatch(const ChunkBatch &batch);
+    void cancelChunkingJobs(int folder_id, int document_id = -1);
+    bool cleanDB(bool useSavedSnapshots = false);
     void addFolderToWatch(const QString &path);
     void removeFolderFromWatch(const QString &path);
-    static QList<int> searchEmbeddingsHelper(const std::vector<float> &query, QSqlQuery &q, int nNeighbors);
-    QList<int> searchEmbeddings(const std::vector<float> &query, const QList<QString> &collections,
+    bool collectChangedPaths(int folder_id, const QStringList &paths, std::list<DocumentInfo> &infos);
+    QString indexDirPath() const;
+    QString folderSnapshotPath(int folder_id) const;
+    QString folderSnapshotKey() const;
+    void saveFolderSnapshot(int folder_id);
+    void dropFolderSnapshot(int folder_id);
+    using FolderEmbeddingsKey = std::pair<QString, int>; // (embedding model, folder id)
+    QString folderEmbeddingsPath(const QString &embedding_model, int folder_id, QStringView suffix) const;
+    EmbeddingStore *embeddingStore(const QString &embedding_model, int folder_id, bool build = true);
+    EmbeddingIndex *embeddingIndex(const QString &embedding_model, int folder_id, bool build = true);
+    void markFolderEmbeddingsChanged(const QString &embedding_model, int folder_id);
+    void saveEmbeddingIndexes();
+    void maintainFolderEmbeddings();
+    void dropFolderEmbeddings(const QString &embedding_model, int folder_id);
+    void dropFolderEmbeddings(int folder_id);
+    void loadFolderEmbeddings(const QList<FolderEmbeddingsKey> &folders, bool withIndexes);
+    void ensureFolderEmbeddings(const QList<FolderEmbeddingsKey> &folders, bool withIndexes);
+    void refreshFolderEmbeddings(QSqlQuery &q, const QList<FolderEmbeddingsKey> &folders);
+    static QList<int> searchEmbeddingsHelper(const std::vector<float> &query,
+        const QList<const EmbeddingStore *> &stores, int nNeighbors);
+    QList<int> searchEmbeddings(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
         int nNeighbors);
     struct BM25Query {
         QString input;
@@ -278,12 +335,18 @@ private:
         int rlength = 0;
     };
     QList<Database::BM25Query> queriesForFTS5(const QString &input);
-    QList<int> searchBM25(const QString &query, const QList<QString> &collections, BM25Query &bm25q, int k);
-    QList<int> scoreChunks(const std::vector<float> &query, const QList<int> &chunks);
+    QList<int> searchBM25(const QSqlDatabase &db, const QString &query, const QList<QString> &collections,
+        BM25Query &bm25q, int k);
+    QList<int> scoreChunks(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
+        const QList<int> &chunks);
     float computeBM25Weight(const BM25Query &bm25q);
-    QList<int> reciprocalRankFusion(const std::vector<float> &query, const QList<int> &embeddingResults,
-        const QList<int> &bm25Results, const BM25Query &bm25q, int k);
-    QList<int> searchDatabase(const QString &query, const QList<QString> &collections, int k);
+    QList<int> reciprocalRankFusion(const std::vector<float> &query, const QList<FolderEmbeddingsKey> &folders,
+        const QList<int> &embeddingResults, const QList<int> &bm25Results, const BM25Query &bm25q, int k);
+    QList<int> searchDatabase(const QSqlDatabase &db, const QString &query, const QList<QString> &collections, int k);
+    QSqlDatabase readConnection();
+    void enableReaders();
+    void retrieve(const QList<QString> &collections, const QString &text, int retrievalSize,
+        QList<ResultInfo> *results);
 
     void setStartUpdateTime(CollectionItem &item);
     void setLastUpdateTime(CollectionItem &item);
@@ -298,23 +361,60 @@ private:
 
 private:
     QSqlDatabase m_db;
+    std::unique_ptr<ChunkWriter> m_chunkWriter; // created on demand for m_db
     int m_chunkSize;
     QStringList m_scannedFileExtensions;
     QTimer *m_scanIntervalTimer;
     QElapsedTimer m_scanDurationTimer;
     std::map<int, std::list<DocumentInfo>> m_docsToScan;
+    QString m_databaseId; // see CREATE_DATABASE_ID_SQL
+    // taken by the last scan and updated with the changes since, saved once its documents are indexed
+    std::map<int, DirectorySnapshot> m_folderSnapshots;
+    std::set<int> m_unsavedSnapshots; // of m_folderSnapshots, changed since they were saved
+    std::map<int, DirectorySnapshot> m_savedSnapshots; // loaded by cleanDB() for the first scan of their folders
     QList<ResultInfo> m_retrieve;
     QThread m_dbThread;
-    QFileSystemWatcher *m_watcher;
-    QSet<QString> m_watchedPaths;
+    FolderWatcher *m_watcher;
     EmbeddingLLM *m_embLLM;
-    QVector<EmbeddingChunk> m_chunkList;
+    QVector<EmbeddingChunk> m_chunkList; // to send to m_embLLM
+    qsizetype m_chunkListTokens = 0;
+    int m_embeddingRequests = 0; // sent to m_embLLM and not answered yet
+    // Chunks of the same text as a chunk that is being embedded, with the same model, wait for its embedding instead of
+    // being embedded again.
+    struct PendingEmbedding { QByteArray textHash; QList<EmbeddingChunk> duplicates; };
+    QHash<int, PendingEmbedding> m_pendingEmbeddings; // by the ID of the chunk that is being embedded
+    QHash<std::pair<QString, QByteArray>, int> m_pendingTexts; // (model, text hash) -> chunk that is being embedded
     QHash<int, CollectionItem> m_collectionMap; // used only for tracking indexing/embedding progress
     std::atomic<bool> m_databaseValid;
-    ChunkStreamer m_chunkStreamer;
     QSet<int> m_documentIdCache; // cached list of documents with chunks for fast lookup
 
-    friend class ChunkStreamer;
+    // documents are read and chunked by the workers of the pool, and their chunks written by the database thread
+    QThreadPool m_chunkingPool;
+    QList<std::shared_ptr<ChunkingJob>> m_chunkingJobs; // not cancelled and not yet written
+    int m_nChunkingJobs = 0; // started and not yet written, including the cancelled ones
+    BoundedQueue<ChunkBatch> m_chunkQueue;
+    std::atomic<bool> m_chunksQueued = false; // writeChunks() is pending
+
+    // copies of the embeddings table for searching, loaded on demand
+    struct FolderEmbeddings {
+        std::unique_ptr<EmbeddingStore> store;
+        std::unique_ptr<EmbeddingIndex> index;              // approximate, loaded when a search needs it
+        bool                            indexDirty = false; // index differs from its file
+    };
+    std::map<FolderEmbeddingsKey, FolderEmbeddings> m_folderEmbeddings;
+    std::set<FolderEmbeddingsKey> m_emptyFolderEmbeddings; // known to have no embeddings to load
+    // Only the database thread changes m_folderEmbeddings, m_emptyFolderEmbeddings and the stores and indexes in them,
+    // with this locked for writing. Retrieval reads them with it locked for reading.
+    QReadWriteLock m_folderEmbeddingsLock { QReadWriteLock::Recursive };
+    std::set<FolderEmbeddingsKey> m_embeddingsInTransaction; // modified since transaction(), dropped by rollback()
+    bool m_inTransaction = false;
+    bool m_readOnly = false; // see startReadOnly()
+    QTimer *m_embeddingsMaintenanceTimer;
+
+    // retrieval runs on these threads, each with a read-only connection of its own
+    QThreadPool m_retrievalPool;
+    QMutex m_readMutex;
+    QString m_readDbPath; // guarded by m_readMutex, empty while the database cannot be read
 };
 
 #endif // DATABASE_H
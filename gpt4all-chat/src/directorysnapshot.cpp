@@ -0,0 +1,240 @@
+#include "directorysnapshot.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QSet>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtLogging>
+#include <QtMinMax>
+
+#ifdef Q_OS_UNIX
+#   include <sys/stat.h>
+#endif
+
+#include <latch>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+static constexpr quint32 SNAPSHOT_FORMAT_MAGIC   = 0x534E4150; // "SNAP"
+static constexpr qint32  SNAPSHOT_FORMAT_VERSION = 1;
+
+static std::optional<DirectorySnapshot::Entry> fileEntry(const QFileInfo &info)
+{
+#ifdef Q_OS_UNIX
+    // one stat for all three, QFileInfo does not have the inode
+    struct stat st;
+    if (stat(QFile::encodeName(info.filePath()).constData(), &st))
+        return std::nullopt; // removed since it was listed
+#   ifdef Q_OS_DARWIN
+    const auto &mtime = st.st_mtimespec;
+#   else
+    const auto &mtime = st.st_mtim;
+#   endif
+    return DirectorySnapshot::Entry {
+        .size  = qint64(st.st_size),
+        .mtime = qint64(mtime.tv_sec) * 1000 + mtime.tv_nsec / 1'000'000,
+        .inode = quint64(st.st_ino),
+    };
+#else
+    return DirectorySnapshot::Entry {
+        .size  = info.size(),
+        .mtime = info.fileTime(QFile::FileModificationTime).toMSecsSinceEpoch(),
+        .inode = 0,
+    };
+#endif
+}
+
+// Lists the files of a directory into entries, and the directories in it into subdirs.
+static void listDirectory(const QString &dir, QHash<QString, DirectorySnapshot::Entry> &entries, QStringList &subdirs)
+{
+    QDirIterator it(dir, QDir::Readable | QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        if (info.isDir()) {
+            if (!info.isSymLink())
+                subdirs << info.filePath();
+        } else if (auto entry = fileEntry(info)) {
+            entries.insert(info.filePath(), *entry);
+        }
+    }
+}
+
+DirectorySnapshot DirectorySnapshot::take(const QString &root, int nThreads)
+{
+    DirectorySnapshot snapshot;
+    snapshot.m_root = root;
+
+    // the directories still to list are shared, a walker that runs out waits until the others have listed theirs
+    QMutex mutex;
+    QWaitCondition listed;
+    QStringList dirs { root };
+    int nListing = 0;
+
+    auto walk = [&] {
+        QHash<QString, Entry> entries;
+        QMutexLocker locker(&mutex);
+        for (;;) {
+            while (dirs.isEmpty() && nListing)
+                listed.wait(&mutex);
+            if (dirs.isEmpty())
+                break;
+            const QString dir = dirs.takeLast();
+            ++nListing;
+            locker.unlock();
+
+            QStringList subdirs;
+            listDirectory(dir, entries, subdirs);
+
+            locker.relock();
+            --nListing;
+            dirs << subdirs;
+            listed.wakeAll();
+        }
+        snapshot.m_entries.insert(entries);
+    };
+
+    // the calling thread walks too, so small trees do not wait for the pool
+    static QThreadPool s_pool;
+    const int nHelpers = qBound(0, nThreads - 1, s_pool.maxThreadCount());
+    std::latch helpersDone(nHelpers);
+    for (int i = 0; i < nHelpers; i++) {
+        s_pool.start([&] {
+            walk();
+            helpersDone.count_down();
+        });
+    }
+    walk();
+    helpersDone.wait();
+    return snapshot;
+}
+
+std::optional<DirectorySnapshot> DirectorySnapshot::load(const QString &path, const QString &key)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return std::nullopt;
+
+    QDataStream in(&file);
+    quint32 magic;
+    qint32 version;
+    in >> magic >> version;
+    if (magic != SNAPSHOT_FORMAT_MAGIC || version != SNAPSHOT_FORMAT_VERSION)
+        return std::nullopt;
+    in.setVersion(QDataStream::Qt_6_5);
+
+    QString savedKey;
+    DirectorySnapshot snapshot;
+    qint64 count;
+    in >> savedKey >> snapshot.m_root >> count;
+    if (in.status() != QDataStream::Ok || savedKey != key || count < 0 || count > file.size())
+        return std::nullopt;
+
+    // paths are saved relative to the root
+    snapshot.m_entries.reserve(count);
+    const QString prefix = snapshot.m_root + u'/';
+    for (qint64 i = 0; i < count; i++) {
+        QString relativePath;
+        Entry entry;
+        in >> relativePath >> entry.size >> entry.mtime >> entry.inode;
+        snapshot.m_entries.insert(prefix + relativePath, entry);
+    }
+    if (in.status() != QDataStream::Ok) {
+        qWarning() << "DirectorySnapshot: cannot read" << path;
+        return std::nullopt;
+    }
+    return snapshot;
+}
+
+bool DirectorySnapshot::save(const QString &path, const QString &key) const
+{
+    if (!QFileInfo(path).dir().mkpath(u"."_s)) {
+        qWarning() << "DirectorySnapshot: cannot create the directory of" << path;
+        return false;
+    }
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "DirectorySnapshot: cannot write" << path << file.errorString();
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << SNAPSHOT_FORMAT_MAGIC << SNAPSHOT_FORMAT_VERSION;
+    out.setVersion(QDataStream::Qt_6_5);
+    out << key << m_root << qint64(m_entries.size());
+    const qsizetype prefixLength = m_root.size() + 1;
+    for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+        out << it.key().sliced(prefixLength) << it->size << it->mtime << it->inode;
+
+    if (out.status() != QDataStream::Ok || !file.commit()) {
+        qWarning() << "DirectorySnapshot: cannot write" << path << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+void DirectorySnapshot::update(const QStringList &paths)
+{
+    // The entries at or under the paths are replaced by what is there now. A path that had an entry was a file, the
+    // others may be directories with entries under them, which are looked for in a single pass.
+    QSet<QString> dirs;
+    for (const QString &path: paths) {
+        if (!m_entries.remove(path))
+            dirs.insert(path);
+    }
+    if (!dirs.isEmpty()) {
+        auto isUnderDirs = [&dirs](const QString &path) {
+            for (qsizetype i = path.lastIndexOf(u'/'); i > 0; i = path.lastIndexOf(u'/', i - 1)) {
+                if (dirs.contains(path.left(i)))
+                    return true;
+            }
+            return false;
+        };
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            if (isUnderDirs(it.key()))
+                it = m_entries.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    for (const QString &path: paths) {
+        const QFileInfo info(path);
+        if (info.isHidden())
+            continue; // as in take()
+        if (info.isDir() && !info.isSymLink()) {
+            QStringList subdirs { path };
+            while (!subdirs.isEmpty())
+                listDirectory(subdirs.takeLast(), m_entries, subdirs);
+        } else if (info.isFile()) {
+            if (auto entry = fileEntry(info))
+                m_entries.insert(path, *entry);
+        }
+    }
+}
+
+QStringList DirectorySnapshot::changedSince(const DirectorySnapshot &older) const
+{
+    QStringList changed;
+    for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it) {
+        auto old = older.m_entries.constFind(it.key());
+        if (old == older.m_entries.cend() || *old != *it)
+            changed << it.key();
+    }
+    for (auto it = older.m_entries.cbegin(); it != older.m_entries.cend(); ++it) {
+        if (!m_entries.contains(it.key()))
+            changed << it.key();
+    }
+    return changed;
+}
@@ -0,0 +1,50 @@
+#ifndef DIRECTORYSNAPSHOT_H
+#define DIRECTORYSNAPSHOT_H
+
+#include <QHash>
+#include <QString>
+#include <QStringList> // IWYU pragma: keep
+#include <QtTypes>
+
+#include <optional>
+
+
+// The files of a directory tree, with the size, modification time and inode of each, to tell which of them changed
+// since another snapshot of the same tree was taken. Snapshots can be saved, so that the next session only has to
+// look at the files that changed while it was not running.
+class DirectorySnapshot
+{
+public:
+    struct Entry {
+        qint64  size;
+        qint64  mtime; // in milliseconds since the epoch
+        quint64 inode; // 0 where there is none
+
+        bool operator==(const Entry &other) const = default;
+    };
+
+    // Walks the tree under root, which should be a canonical path, listing directories on up to nThreads threads.
+    // Hidden files and symbolic links to directories are skipped.
+    static DirectorySnapshot take(const QString &root, int nThreads = 1);
+
+    // Loads a snapshot that was saved with the same key, which should describe whatever else the snapshot was taken
+    // for, such as settings that decide which of the files are used.
+    static std::optional<DirectorySnapshot> load(const QString &path, const QString &key);
+    bool save(const QString &path, const QString &key) const;
+
+    // the files that were added, changed or removed since the older snapshot was taken
+    QStringList changedSince(const DirectorySnapshot &older) const;
+    // Looks at the paths again, which are files or directories under the root that changed since the snapshot was
+    // taken, such as those that a FolderWatcher reported.
+    void update(const QStringList &paths);
+
+    const QString &root() const { return m_root; }
+    QStringList files() const { return m_entries.keys(); }
+    qsizetype size() const { return m_entries.size(); }
+
+private:
+    QString m_root;
+    QHash<QString, Entry> m_entries; // by path
+};
+
+#endif // DIRECTORYSNAPSHOT_H
@@ -0,0 +1,142 @@
+#include "embeddingbatcher.h"
+
+#include "embllm.h"
+
+#include <QMetaObject>
+#include <QtTypes>
+
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+
+// how long to wait for more requests before embedding, if the model is idle
+static constexpr auto BATCH_WINDOW    = 5ms;
+// requests are not split, so a single request may be larger than this
+static constexpr int  MAX_BATCH_TEXTS = 64;
+
+EmbeddingBatcher::EmbeddingBatcher(QObject *parent)
+    : QObject(parent)
+    , m_worker(EmbeddingLLMWorker::shared())
+{
+    m_pool.setMaxThreadCount(1);
+    m_timer.setSingleShot(true);
+    m_timer.setInterval(BATCH_WINDOW);
+    connect(&m_timer, &QTimer::timeout, this, &EmbeddingBatcher::flush);
+}
+
+// destroying the pool waits for any batch in progress, whose results are then dropped
+EmbeddingBatcher::~EmbeddingBatcher() = default;
+
+void EmbeddingBatcher::submit(const QStringList &texts, int dimensions, Callback callback)
+{
+    if (auto result = cachedResult(texts, dimensions)) {
+        // still asynchronous, like a result from the model
+        QMetaObject::invokeMethod(this, [callback = std::move(callback), result = std::move(*result)] {
+            callback(result);
+        }, Qt::QueuedConnection);
+        return;
+    }
+
+    m_pending << Request { texts, dimensions, std::move(callback) };
+    if (m_busy)
+        return; // flushed when the current batch is done
+
+    qsizetype pendingTexts = 0;
+    for (auto &req : std::as_const(m_pending))
+        pendingTexts += req.texts.size();
+    if (pendingTexts >= MAX_BATCH_TEXTS) {
+        m_timer.stop();
+        flush();
+    } else if (!m_timer.isActive()) {
+        m_timer.start();
+    }
+}
+
+auto EmbeddingBatcher::cachedResult(const QStringList &texts, int dimensions) -> std::optional<Result>
+{
+    auto *cache = EmbeddingCache::globalInstance();
+    Result result;
+    result.cached = true;
+    for (auto &text : texts) {
+        auto entry = cache->find(EmbeddingLLM::model(), EmbeddingLLM::documentTask(), dimensions, text);
+        if (!entry)
+            return std::nullopt;
+        result.dimensions = int(entry->embedding.size());
+        result.embeddings.insert(result.embeddings.end(), entry->embedding.begin(), entry->embedding.end());
+        result.tokens += entry->tokens;
+    }
+    return result;
+}
+
+void EmbeddingBatcher::flush()
+{
+    if (m_busy || m_pending.isEmpty())
+        return;
+
+    // A batch has a single size, so take the oldest request and others of the same size that fit.
+    const int dimensions = m_pending.constFirst().dimensions;
+    QList<Request> batch;
+    std::vector<std::string> texts;
+    for (auto it = m_pending.begin(); it < m_pending.end();) {
+        bool fits = batch.isEmpty() || qsizetype(texts.size()) + it->texts.size() <= MAX_BATCH_TEXTS;
+        if (it->dimensions != dimensions || !fits) {
+            ++it;
+            continue;
+        }
+        for (auto &text : std::as_const(it->texts))
+            texts.push_back(text.toStdString());
+        batch << std::move(*it);
+        it = m_pending.erase(it);
+    }
+
+    m_busy = true;
+    m_pool.start([this, dimensions, texts = std::move(texts), batch] {
+        Result result;
+        std::vector<int> tokenCounts;
+        try {
+            result.embeddings = m_worker->generateEmbeddings(texts, dimensions, &tokenCounts);
+            result.dimensions = int(result.embeddings.size() / texts.size());
+        } catch (const std::out_of_range &e) { // unsupported dimensions
+            result.error        = QString::fromUtf8(e.what());
+            result.invalidInput = true;
+        } catch (const RemoteEmbeddingModelError &e) {
+            result.error       = QString::fromUtf8(e.what());
+            result.remoteModel = true;
+        } catch (const std::exception &e) {
+            result.error = QString::fromUtf8(e.what());
+        }
+
+        QMetaObject::invokeMethod(this, [this, dimensions, result = std::move(result), tokenCounts, batch] {
+            // split the batch back into the requests
+            auto *cache = EmbeddingCache::globalInstance();
+            size_t offset = 0;
+            for (auto &req : batch) {
+                Result reqResult;
+                reqResult.dimensions   = result.dimensions;
+                reqResult.error        = result.error;
+                reqResult.invalidInput = result.invalidInput;
+                reqResult.remoteModel  = result.remoteModel;
+                if (result.error.isEmpty()) {
+                    auto begin = result.embeddings.begin() + offset * result.dimensions;
+                    reqResult.embeddings.assign(begin, begin + req.texts.size() * result.dimensions);
+                    for (qsizetype i = 0; i < req.texts.size(); i++) {
+                        reqResult.tokens += tokenCounts[offset + i];
+                        auto embedding = begin + i * result.dimensions;
+                        cache->insert(EmbeddingLLM::model(), EmbeddingLLM::documentTask(), dimensions, req.texts[i],
+                                      { { embedding, embedding + result.dimensions }, tokenCounts[offset + i] });
+                    }
+                }
+                offset += req.texts.size();
+                req.callback(std::move(reqResult));
+            }
+
+            m_busy = false;
+            flush(); // whatever arrived in the meantime has waited long enough
+        });
+    });
+}
@@ -0,0 +1,60 @@
+#ifndef EMBEDDINGBATCHER_H
+#define EMBEDDINGBATCHER_H
+
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+class EmbeddingLLMWorker;
+
+
+// Embeds texts for the API server with the local embedding model. Texts from requests that arrive close together are
+// embedded in a single call, which is much faster than one call per request. Requests whose texts are all in the
+// EmbeddingCache do not use the model at all. The model is the one that LocalDocs embeds queries with.
+// Must be used from the thread it lives on. The embeddings are computed on a thread of its own.
+class EmbeddingBatcher : public QObject
+{
+public:
+    struct Result {
+        std::vector<float> embeddings; // dimensions floats per text
+        int                dimensions  = 0;
+        int                tokens      = 0;
+        QString            error;        // empty on success
+        bool               invalidInput = false; // error was caused by the request
+        bool               remoteModel  = false; // error was caused by LocalDocs embedding with Nomic Atlas
+        bool               cached       = false; // all of the texts were in the EmbeddingCache
+    };
+    using Callback = std::function<void(Result result)>;
+
+    explicit EmbeddingBatcher(QObject *parent = nullptr);
+    ~EmbeddingBatcher() override;
+
+    // dimensions is -1 for the model's own size. The callback is called on this object's thread.
+    void submit(const QStringList &texts, int dimensions, Callback callback);
+
+private:
+    struct Request {
+        QStringList texts;
+        int         dimensions;
+        Callback    callback;
+    };
+
+    static std::optional<Result> cachedResult(const QStringList &texts, int dimensions);
+    void flush();
+
+    std::shared_ptr<EmbeddingLLMWorker> m_worker;
+    QThreadPool                         m_pool; // of one thread, which embeds the batches
+    QList<Request>                      m_pending;
+    QTimer                              m_timer;
+    bool                                m_busy = false; // a batch is being embedded
+};
+
+#endif // EMBEDDINGBATCHER_H
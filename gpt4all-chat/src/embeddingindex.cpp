@@ -0,0 +1,139 @@
+#include "embeddingindex.h"
+
+#include <usearch/index.hpp>
+#include <usearch/index_dense.hpp>
+#include <usearch/index_plugins.hpp>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QtLogging>
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace us = unum::usearch;
+
+
+struct EmbeddingIndex::Impl {
+    us::index_dense_t index;
+};
+
+EmbeddingIndex::EmbeddingIndex(std::unique_ptr<Impl> impl)
+    : m_impl(std::move(impl))
+{}
+
+EmbeddingIndex::~EmbeddingIndex() = default;
+
+std::unique_ptr<EmbeddingIndex> EmbeddingIndex::create(int dimensions)
+{
+    const us::metric_punned_t metric(dimensions, us::metric_kind_t::ip_k); // inner product
+    auto impl = std::make_unique<Impl>(us::index_dense_t::make(metric));
+    return std::unique_ptr<EmbeddingIndex>(new EmbeddingIndex(std::move(impl)));
+}
+
+std::unique_ptr<EmbeddingIndex> EmbeddingIndex::load(const QString &path)
+{
+    if (!QFileInfo::exists(path))
+        return nullptr;
+
+    auto impl = std::make_unique<Impl>();
+    auto result = impl->index.load(QFile::encodeName(path).constData());
+    if (!result) {
+        qWarning() << "EmbeddingIndex: failed to load" << path << result.error.what();
+        result.error.release();
+        return nullptr;
+    }
+    return std::unique_ptr<EmbeddingIndex>(new EmbeddingIndex(std::move(impl)));
+}
+
+bool EmbeddingIndex::save(const QString &path) const
+{
+    // write a new file and swap it in, so that a crash leaves either the old index or the new one
+    const QString tmpPath = path + u".tmp";
+    auto result = m_impl->index.save(QFile::encodeName(tmpPath).constData());
+    if (!result) {
+        qWarning() << "EmbeddingIndex: failed to save" << tmpPath << result.error.what();
+        result.error.release();
+        return false;
+    }
+    QFile::remove(path);
+    if (!QFile::rename(tmpPath, path)) {
+        qWarning() << "EmbeddingIndex: failed to rename" << tmpPath << "to" << path;
+        return false;
+    }
+    return true;
+}
+
+int EmbeddingIndex::dimensions() const
+{
+    return int(m_impl->index.dimensions());
+}
+
+qsizetype EmbeddingIndex::size() const
+{
+    return qsizetype(m_impl->index.size());
+}
+
+bool EmbeddingIndex::contains(int chunkId) const
+{
+    return m_impl->index.contains(us::default_key_t(chunkId));
+}
+
+bool EmbeddingIndex::add(int chunkId, std::span<const float> embedding)
+{
+    auto &index = m_impl->index;
+    if (embedding.size() != index.dimensions()) {
+        qWarning() << "EmbeddingIndex: expected an embedding of size" << index.dimensions() << "got"
+                   << embedding.size();
+        return false;
+    }
+
+    // usearch does not grow the index by itself
+    if (index.size() + 1 > index.capacity() && !index.reserve(std::max<std::size_t>(1024, index.capacity() * 2))) {
+        qWarning() << "EmbeddingIndex: failed to grow the index beyond" << index.capacity();
+        return false;
+    }
+
+    auto result = index.add(us::default_key_t(chunkId), embedding.data());
+    if (!result) {
+        qWarning() << "EmbeddingIndex: failed to add chunk" << chunkId << result.error.what();
+        result.error.release();
+        return false;
+    }
+    return true;
+}
+
+void EmbeddingIndex::remove(int chunkId)
+{
+    auto result = m_impl->index.remove(us::default_key_t(chunkId));
+    if (!result) {
+        qWarning() << "EmbeddingIndex: failed to remove chunk" << chunkId << result.error.what();
+        result.error.release();
+    }
+}
+
+auto EmbeddingIndex::search(std::span<const float> query, int k) const -> QList<Match>
+{
+    auto &index = m_impl->index;
+    if (query.size() != index.dimensions() || k <= 0 || !index.size())
+        return {};
+
+    auto result = index.search(query.data(), std::size_t(k));
+    if (!result) {
+        qWarning() << "EmbeddingIndex: search failed" << result.error.what();
+        result.error.release();
+        return {};
+    }
+
+    std::vector<us::default_key_t>      keys(result.size());
+    std::vector<us::distance_punned_t>  distances(result.size());
+    std::size_t found = result.dump_to(keys.data(), distances.data());
+
+    QList<Match> matches;
+    matches.reserve(qsizetype(found));
+    for (std::size_t i = 0; i < found; i++)
+        matches << Match { int(keys[i]), float(distances[i]) };
+    return matches;
+}
@@ -0,0 +1,46 @@
+#ifndef EMBEDDINGINDEX_H
+#define EMBEDDINGINDEX_H
+
+#include <QList>
+#include <QString>
+#include <QtTypes>
+
+#include <memory>
+#include <span>
+
+
+// An approximate nearest-neighbour (HNSW) index of embeddings, keyed by chunk ID and ranked by inner product. Database
+// keeps one per LocalDocs folder and embedding model, saved next to the database file.
+class EmbeddingIndex
+{
+public:
+    struct Match {
+        int   chunkId;
+        float distance; // smaller is closer
+    };
+
+    ~EmbeddingIndex();
+
+    static std::unique_ptr<EmbeddingIndex> create(int dimensions);
+    // returns null if the file cannot be read
+    static std::unique_ptr<EmbeddingIndex> load(const QString &path);
+    bool save(const QString &path) const;
+
+    int dimensions() const;
+    qsizetype size() const;
+    bool contains(int chunkId) const;
+    bool add(int chunkId, std::span<const float> embedding);
+    void remove(int chunkId);
+
+    // best first
+    QList<Match> search(std::span<const float> query, int k) const;
+
+private:
+    struct Impl;
+
+    explicit EmbeddingIndex(std::unique_ptr<Impl> impl);
+
+    std::unique_ptr<Impl> m_impl;
+};
+
+#endif // EMBEDDINGINDEX_H
@@ -0,0 +1,434 @@
+#include "embeddingstore.h"
+
+#include <QFileInfo>
+#include <QIODevice>
+#include <QThreadPool>
+#include <QtAssert>
+#include <QtLogging>
+#include <QtMinMax>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <latch>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#   include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+using namespace Qt::Literals::StringLiterals;
+
+
+static constexpr char      STORE_MAGIC[8]   = { 'G', '4', 'A', 'E', 'M', 'B', 'D', 'S' };
+static constexpr quint32   STORE_VERSION    = 2;
+static constexpr qsizetype INITIAL_CAPACITY = 1024;
+static constexpr qint64    SECTION_ALIGN    = 64; // cache line, also enough for AVX-512 loads
+
+struct EmbeddingStoreHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 dimensions;
+    qint64  capacity;
+    qint64  rowCount;     // rows in use, including removed ones
+    qint64  removedCount;
+    qint64  generation;   // see EmbeddingStore::generation()
+};
+
+namespace {
+    // offsets of the sections of a file
+    struct Layout { qint64 chunkIds; qint64 removed; qint64 vectors; qint64 fileSize; };
+} // namespace
+
+static Layout layout(qint64 capacity, int dimensions)
+{
+    auto align = [](qint64 offset) { return (offset + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN; };
+    Layout l;
+    l.chunkIds = align(sizeof(EmbeddingStoreHeader));
+    l.removed  = align(l.chunkIds + capacity * qint64(sizeof(qint32)));
+    l.vectors  = align(l.removed + (capacity + 63) / 64 * qint64(sizeof(quint64)));
+    l.fileSize = l.vectors + capacity * dimensions * qint64(sizeof(float));
+    return l;
+}
+
+// writes an empty store, the sections are zero-filled by resizing the file
+static bool initFile(const QString &path, int dimensions, qint64 capacity)
+{
+    EmbeddingStoreHeader header {};
+    std::memcpy(header.magic, STORE_MAGIC, sizeof header.magic);
+    header.version    = STORE_VERSION;
+    header.dimensions = quint32(dimensions);
+    header.capacity   = capacity;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate)
+        || !file.resize(layout(capacity, dimensions).fileSize)
+        || file.write(reinterpret_cast<const char *>(&header), sizeof header) != sizeof header) {
+        qWarning() << "EmbeddingStore: failed to write" << path << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+EmbeddingStore::EmbeddingStore(const QString &path)
+    : m_file(path)
+{}
+
+EmbeddingStore::~EmbeddingStore() = default; // closing the file unmaps it
+
+std::unique_ptr<EmbeddingStore> EmbeddingStore::create(const QString &path, int dimensions)
+{
+    if (dimensions <= 0 || !initFile(path, dimensions, INITIAL_CAPACITY))
+        return nullptr;
+    return open(path);
+}
+
+std::unique_ptr<EmbeddingStore> EmbeddingStore::open(const QString &path)
+{
+    if (!QFileInfo::exists(path))
+        return nullptr;
+    std::unique_ptr<EmbeddingStore> store(new EmbeddingStore(path));
+    if (!store->map())
+        return nullptr;
+    return store;
+}
+
+bool EmbeddingStore::map()
+{
+    auto fail = [this](const char *error) {
+        qWarning() << "EmbeddingStore:" << error << m_file.fileName() << m_file.errorString();
+        unmap();
+        return false;
+    };
+
+    if (!m_file.open(QIODevice::ReadWrite))
+        return fail("failed to open");
+    if (m_file.size() < qint64(sizeof(EmbeddingStoreHeader)))
+        return fail("truncated file");
+    uchar *data = m_file.map(0, m_file.size());
+    if (!data)
+        return fail("failed to map");
+
+    m_header = reinterpret_cast<EmbeddingStoreHeader *>(data);
+    const auto &h = *m_header;
+    if (std::memcmp(h.magic, STORE_MAGIC, sizeof h.magic) || h.version != STORE_VERSION || !h.dimensions
+        || h.rowCount < 0 || h.rowCount > h.capacity || h.removedCount < 0 || h.removedCount > h.rowCount)
+        return fail("invalid header in");
+    Layout l = layout(h.capacity, int(h.dimensions));
+    if (l.fileSize != m_file.size())
+        return fail("unexpected size of");
+
+    m_chunkIds = reinterpret_cast<qint32  *>(data + l.chunkIds);
+    m_removed  = reinterpret_cast<quint64 *>(data + l.removed);
+    m_vectors  = reinterpret_cast<float   *>(data + l.vectors);
+
+    m_rows.clear();
+    m_rows.reserve(h.rowCount - h.removedCount);
+    for (qsizetype row = 0; row < h.rowCount; row++) {
+        if (!isRemoved(row))
+            m_rows.insert(m_chunkIds[row], row);
+    }
+    if (m_rows.size() != h.rowCount - h.removedCount)
+        return fail("inconsistent rows in");
+    return true;
+}
+
+void EmbeddingStore::unmap()
+{
+    m_file.close();
+    m_header   = nullptr;
+    m_chunkIds = nullptr;
+    m_removed  = nullptr;
+    m_vectors  = nullptr;
+    m_rows.clear();
+}
+
+int EmbeddingStore::dimensions() const
+{
+    return int(m_header->dimensions);
+}
+
+qsizetype EmbeddingStore::capacity() const
+{
+    return m_header->capacity;
+}
+
+qsizetype EmbeddingStore::rowCount() const
+{
+    return m_header->rowCount;
+}
+
+qsizetype EmbeddingStore::removedCount() const
+{
+    return m_header->removedCount;
+}
+
+qint64 EmbeddingStore::generation() const
+{
+    return m_header->generation;
+}
+
+void EmbeddingStore::setGeneration(qint64 generation)
+{
+    m_header->generation = generation;
+}
+
+std::span<const float> EmbeddingStore::embedding(int chunkId) const
+{
+    auto it = m_rows.constFind(chunkId);
+    if (it == m_rows.constEnd())
+        return {};
+    return { m_vectors + *it * dimensions(), size_t(dimensions()) };
+}
+
+void EmbeddingStore::append(int chunkId, const float *embedding)
+{
+    qsizetype row = m_header->rowCount;
+    Q_ASSERT(row < m_header->capacity);
+    m_chunkIds[row] = chunkId;
+    std::memcpy(m_vectors + row * dimensions(), embedding, dimensions() * sizeof(float));
+    m_header->rowCount++; // after the row is complete
+    m_rows.insert(chunkId, row);
+}
+
+bool EmbeddingStore::add(int chunkId, std::span<const float> embedding)
+{
+    if (embedding.size() != size_t(dimensions())) {
+        qWarning() << "EmbeddingStore: expected an embedding of size" << dimensions() << "got" << embedding.size();
+        return false;
+    }
+
+    remove(chunkId); // replace
+    m_header->generation = NO_GENERATION;
+    if (rowCount() == capacity() && !rewrite(qMax(INITIAL_CAPACITY, size() * 2)))
+        return false;
+    append(chunkId, embedding.data());
+    return true;
+}
+
+bool EmbeddingStore::remove(int chunkId)
+{
+    auto it = m_rows.constFind(chunkId);
+    if (it == m_rows.constEnd())
+        return false;
+    qsizetype row = *it;
+    m_header->generation = NO_GENERATION;
+    m_removed[row / 64] |= quint64(1) << (row % 64);
+    m_header->removedCount++;
+    m_rows.erase(it);
+    return true;
+}
+
+bool EmbeddingStore::needsCompaction() const
+{
+    return removedCount() > rowCount() / 4;
+}
+
+bool EmbeddingStore::compact()
+{
+    return rewrite(qMin(capacity(), qMax(INITIAL_CAPACITY, size() * 2)));
+}
+
+// Copies the rows that are not removed to a new file with the given capacity, and replaces this one with it. If the
+// file cannot be replaced, the store is left unusable.
+bool EmbeddingStore::rewrite(qsizetype capacity)
+{
+    Q_ASSERT(capacity >= size());
+    const QString path = m_file.fileName();
+    const QString tmpPath = path + u".tmp"_s;
+
+    if (!initFile(tmpPath, dimensions(), capacity))
+        return false;
+    {
+        EmbeddingStore tmp(tmpPath);
+        if (!tmp.map()) {
+            QFile::remove(tmpPath);
+            return false;
+        }
+        for (qsizetype row = 0; row < rowCount(); row++) {
+            if (!isRemoved(row))
+                tmp.append(m_chunkIds[row], m_vectors + row * dimensions());
+        }
+        tmp.setGeneration(generation()); // the same embeddings
+    }
+
+    // the old file must be unmapped before it can be replaced on Windows
+    unmap();
+    QFile::remove(path);
+    if (!QFile::rename(tmpPath, path)) {
+        qWarning() << "EmbeddingStore: failed to rename" << tmpPath << "to" << path;
+        return false;
+    }
+    return map();
+}
+
+// -- Exact search --
+
+#if !(defined(__x86_64__) || defined(_M_X64))
+    // irrelevant on non-x86_64
+    #define cpu_supports_avx2_fma() false
+    #define cpu_supports_avx512f()  false
+#elif defined(_MSC_VER)
+    // MSVC
+    static int get_cpu_info(int func_id, int reg_id) {
+        int info[4];
+        __cpuidex(info, func_id, 0);
+        return info[reg_id];
+    }
+
+    // AVX2 via EAX=7, ECX=0: Extended Features, bit 5 of EBX; FMA via EAX=1, bit 12 of ECX
+    #define cpu_supports_avx2_fma() (!!(get_cpu_info(7, 1) & (1 <<  5)) && !!(get_cpu_info(1, 2) & (1 << 12)))
+    // AVX-512 Foundation via EAX=7, ECX=0: Extended Features, bit 16 of EBX
+    #define cpu_supports_avx512f()  !!(get_cpu_info(7, 1) & (1 << 16))
+    #define TARGET_AVX2_FMA
+    #define TARGET_AVX512F
+#else
+    // gcc/clang
+    #define cpu_supports_avx2_fma() (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    #define cpu_supports_avx512f()  !!__builtin_cpu_supports("avx512f")
+    #define TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+    #define TARGET_AVX512F  __attribute__((target("avx512f")))
+#endif
+
+static float dotScalar(const float *a, const float *b, qsizetype n)
+{
+    // independent sums, so that the compiler can vectorize this for the baseline instruction set
+    float sum[4] {};
+    qsizetype i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; j++)
+            sum[j] += a[i + j] * b[i + j];
+    }
+    for (; i < n; i++)
+        sum[0] += a[i] * b[i];
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+TARGET_AVX2_FMA static float dotAvx2(const float *a, const float *b, qsizetype n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    qsizetype i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum) + dotScalar(a + i, b + i, n - i);
+}
+
+TARGET_AVX512F static float dotAvx512(const float *a, const float *b, qsizetype n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    qsizetype i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16)
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)) + dotScalar(a + i, b + i, n - i);
+}
+#endif
+
+using DotKernel = float (*)(const float *a, const float *b, qsizetype n);
+
+static DotKernel dotKernel()
+{
+    static const DotKernel kernel = [] () -> DotKernel {
+#if defined(__x86_64__) || defined(_M_X64)
+        if (cpu_supports_avx512f())
+            return dotAvx512;
+        if (cpu_supports_avx2_fma())
+            return dotAvx2;
+#endif
+        return dotScalar;
+    }();
+    return kernel;
+}
+
+float EmbeddingStore::distance(std::span<const float> a, std::span<const float> b)
+{
+    Q_ASSERT(a.size() == b.size());
+    return 1.0f - dotKernel()(a.data(), b.data(), qsizetype(a.size()));
+}
+
+auto EmbeddingStore::search(std::span<const float> query, const QList<const EmbeddingStore *> &stores, int k)
+    -> QList<Match>
+{
+    constexpr qsizetype SHARD_ROWS = 1024;
+
+    // split the stores into shards of rows that are scanned by any thread that is free
+    struct Shard { const EmbeddingStore *store; qsizetype begin; qsizetype end; };
+    QList<Shard> shards;
+    for (const EmbeddingStore *store: stores) {
+        if (store->dimensions() != int(query.size())) {
+            qWarning() << "EmbeddingStore: expected a query of size" << store->dimensions() << "got" << query.size();
+            continue;
+        }
+        for (qsizetype begin = 0; begin < store->rowCount(); begin += SHARD_ROWS)
+            shards.append({ store, begin, qMin(begin + SHARD_ROWS, store->rowCount()) });
+    }
+    if (k <= 0 || shards.isEmpty())
+        return {};
+
+    // each thread keeps its own top-k, with the farthest match on top
+    auto farther = [](const Match &a, const Match &b) { return a.distance < b.distance; };
+    using TopK = std::vector<Match>;
+    const DotKernel dot = dotKernel();
+    std::atomic<qsizetype> nextShard = 0;
+
+    auto scan = [&](TopK &top) {
+        top.reserve(k);
+        for (qsizetype s; (s = nextShard.fetch_add(1, std::memory_order_relaxed)) < shards.size();) {
+            const auto &[store, begin, end] = shards.at(s);
+            const qsizetype dims = store->dimensions();
+            for (qsizetype row = begin; row < end; row++) {
+                if (store->isRemoved(row))
+                    continue;
+                float dist = 1.0f - dot(query.data(), store->rows() + row * dims, dims);
+                if (top.size() < size_t(k)) {
+                    top.push_back({ store->chunkId(row), dist });
+                    std::push_heap(top.begin(), top.end(), farther);
+                } else if (dist < top.front().distance) {
+                    std::pop_heap(top.begin(), top.end(), farther);
+                    top.back() = { store->chunkId(row), dist };
+                    std::push_heap(top.begin(), top.end(), farther);
+                }
+            }
+        }
+    };
+
+    // the calling thread scans too, so small searches do not wait for the pool
+    static QThreadPool s_pool;
+    const int nHelpers = int(qMin<qsizetype>(s_pool.maxThreadCount() - 1, shards.size() - 1));
+    std::vector<TopK> tops(nHelpers + 1);
+    std::latch helpersDone(nHelpers);
+    for (int i = 0; i < nHelpers; i++) {
+        s_pool.start([&, i] {
+            scan(tops[i + 1]);
+            helpersDone.count_down();
+        });
+    }
+    scan(tops[0]);
+    helpersDone.wait();
+
+    QList<Match> matches;
+    for (const auto &top: tops)
+        matches.append(top.begin(), top.end());
+    k = int(qMin<qsizetype>(k, matches.size()));
+    std::partial_sort(matches.begin(), matches.begin() + k, matches.end(), farther);
+    matches.resize(k);
+    return matches;
+}
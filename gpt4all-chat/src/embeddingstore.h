@@ -0,0 +1,88 @@
+#ifndef EMBEDDINGSTORE_H
+#define EMBEDDINGSTORE_H
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QtTypes>
+
+#include <memory>
+#include <span>
+
+struct EmbeddingStoreHeader;
+
+
+// A memory-mapped file of embeddings, keyed by chunk ID. Database keeps one per LocalDocs folder and embedding model,
+// next to the database file, so that searches can read embeddings in place instead of selecting them from SQLite.
+//
+// The file holds a chunk ID column, a bitmap of removed rows and a row-major float matrix, each with room for
+// capacity() rows. Removing a chunk only marks its row, compact() rewrites the file without them. Pointers into the
+// file are invalidated by add() and compact().
+//
+// The header also holds a generation, which the owner sets once the embeddings that the rows came from are saved, and
+// compares with theirs when the file is opened again. Adding or removing a row resets it to NO_GENERATION first, so
+// that a file that was changed and not confirmed, such as by a crash before the owner saved, is never trusted.
+class EmbeddingStore
+{
+public:
+    struct Match {
+        int   chunkId;
+        float distance; // 1 - inner product, smaller is closer
+    };
+
+    static constexpr qint64 NO_GENERATION = -1;
+
+    ~EmbeddingStore();
+
+    static std::unique_ptr<EmbeddingStore> create(const QString &path, int dimensions);
+    // returns null if the file is missing or cannot be read
+    static std::unique_ptr<EmbeddingStore> open(const QString &path);
+
+    QString path() const { return m_file.fileName(); }
+    int dimensions() const;
+    qsizetype capacity() const;
+    qsizetype size() const { return m_rows.size(); }
+    bool contains(int chunkId) const { return m_rows.contains(chunkId); }
+    std::span<const float> embedding(int chunkId) const; // empty if not found
+
+    bool add(int chunkId, std::span<const float> embedding);
+    bool remove(int chunkId);
+
+    // rows, including removed ones, for scanning the whole matrix at once
+    qsizetype rowCount() const;
+    qsizetype removedCount() const;
+    const float *rows() const { return m_vectors; }
+    int chunkId(qsizetype row) const { return m_chunkIds[row]; }
+    bool isRemoved(qsizetype row) const { return m_removed[row / 64] >> (row % 64) & 1; }
+
+    // 0 in a new file
+    qint64 generation() const;
+    void setGeneration(qint64 generation);
+
+    // Exact nearest neighbours of query among the rows of all of the stores, best first. The rows are read in place, by
+    // the calling thread and a thread pool, with the widest SIMD instructions the CPU supports.
+    static QList<Match> search(std::span<const float> query, const QList<const EmbeddingStore *> &stores, int k);
+    static float distance(std::span<const float> a, std::span<const float> b);
+
+    bool needsCompaction() const;
+    // add() and compact() return false if the file could not be rewritten, the store should then be discarded
+    bool compact();
+
+private:
+    explicit EmbeddingStore(const QString &path);
+
+    bool map();
+    void unmap();
+    void append(int chunkId, const float *embedding);
+    bool rewrite(qsizetype capacity);
+
+    QFile                   m_file;
+    EmbeddingStoreHeader   *m_header   = nullptr;
+    qint32                 *m_chunkIds = nullptr;
+    quint64                *m_removed  = nullptr;
+    float                  *m_vectors  = nullptr;
+    QHash<int, qsizetype>   m_rows; // chunk ID -> row
+};
+
+#endif // EMBEDDINGSTORE_H
@@ -5,14 +5,16 @@
 #include <gpt4all-backend/llmodel.h>
 
 #include <QCoreApplication>
+#include <QCryptographicHash>
 #include <QDebug>
 #include <QFileInfo>
-#include <QGuiApplication>
+#include <QGlobalStatic>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QList>
+#include <QMetaObject>
 #include <QMutexLocker> // IWYU pragma: keep
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
@@ -22,16 +24,178 @@
 #include <QtAssert>
 #include <QtLogging>
 
+#include <algorithm>
 #include <exception>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
 using namespace Qt::Literals::StringLiterals;
+namespace ranges = std::ranges;
 
 
 static const QString EMBEDDING_MODEL_NAME = u"nomic-embed-text-v1.5"_s;
 static const QString LOCAL_EMBEDDING_MODEL = u"nomic-embed-text-v1.5.f16.gguf"_s;
+static const QString ATLAS_EMBEDDING_MODEL = u"nomic-embed-text-v1"_s;
+static const QString QUERY_TASK            = u"search_query"_s;
+static const QString DOCUMENT_TASK         = u"search_document"_s;
+
+// the local model decodes up to n_ctx tokens of input at a time
+static constexpr int EMBEDDING_CONTEXT_LENGTH = 2048;
+// the task prefix and the special tokens that the model adds to each text
+static constexpr int SEQUENCE_OVERHEAD_TOKENS = 8;
+
+class MyEmbeddingCache : public EmbeddingCache { };
+Q_GLOBAL_STATIC(MyEmbeddingCache, embeddingCacheInstance)
+EmbeddingCache *EmbeddingCache::globalInstance()
+{
+    return embeddingCacheInstance();
+}
+
+QByteArray EmbeddingCache::key(const QString &model, const QString &prefix, int dimensions, const QString &text)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    for (auto &part : { model, prefix, QString::number(dimensions), text }) {
+        hash.addData(part.toUtf8());
+        hash.addData(QByteArrayView("\0", 1)); // separator
+    }
+    return hash.result();
+}
+
+auto EmbeddingCache::find(const QString &model, const QString &prefix, int dimensions, const QString &text)
+    -> std::optional<Entry>
+{
+    QByteArray k = key(model, prefix, dimensions, text);
+    QMutexLocker locker(&m_mutex);
+    if (auto it = m_index.constFind(k); it != m_index.constEnd()) {
+        m_lru.splice(m_lru.begin(), m_lru, *it);
+        return m_lru.front().second;
+    }
+    return std::nullopt;
+}
+
+void EmbeddingCache::insert(const QString &model, const QString &prefix, int dimensions, const QString &text,
+                            const Entry &entry)
+{
+    const qsizetype capacity = MySettings::globalInstance()->localDocsEmbeddingCacheSize();
+    QByteArray k = key(model, prefix, dimensions, text);
+
+    QMutexLocker locker(&m_mutex);
+    if (auto it = m_index.constFind(k); it != m_index.constEnd()) {
+        m_lru.erase(*it);
+        m_index.erase(it);
+    }
+    if (capacity) {
+        m_lru.emplace_front(k, entry);
+        m_index.insert(k, m_lru.begin());
+    }
+    while (m_index.size() > capacity) {
+        m_index.remove(m_lru.back().first);
+        m_lru.pop_back();
+    }
+}
+
+// Embeds the chunks as documents, as many texts at a time as fill a pass of the model, by the token counts estimated
+// when the chunks were made. A mutex, if given, is held for each pass only, so that others can use the model between
+// passes. Throws if the backend fails.
+static QVector<EmbeddingResult> embedDocuments(LLModel *model, const QVector<EmbeddingChunk> &chunks,
+                                               QMutex *mutex = nullptr)
+{
+    const size_t embeddingSize = model->embeddingSize();
+    std::vector<std::string> texts;
+    texts.reserve(chunks.size());
+    for (const auto &c: chunks)
+        texts.push_back(c.chunk.toStdString());
+
+    std::vector<float> result(chunks.size() * embeddingSize);
+    for (qsizetype j = 0; j < chunks.size();) {
+        qsizetype end = j;
+        for (int nTokens = 0; end < chunks.size(); end++) {
+            const auto &c = chunks[end];
+            nTokens += (c.tokens > 0 ? c.tokens : EmbeddingLLM::estimatedTokenCount(c.chunk))
+                     + SEQUENCE_OVERHEAD_TOKENS;
+            if (end > j && nTokens > EMBEDDING_CONTEXT_LENGTH)
+                break;
+        }
+        QMutexLocker locker(mutex);
+        std::vector batchTexts(texts.begin() + j, texts.begin() + end);
+        model->embed(batchTexts, result.data() + j * embeddingSize, /*isRetrieval*/ false);
+        j = end;
+    }
+
+    QVector<EmbeddingResult> results;
+    results.reserve(chunks.size());
+    for (qsizetype i = 0; i < chunks.size(); i++) {
+        const auto &c = chunks[i];
+        auto first = result.begin() + i * embeddingSize;
+        results.append({ c.model, c.folder_id, c.chunk_id, std::vector(first, first + embeddingSize) });
+    }
+    return results;
+}
+
+// Embeds texts as documents, dimensionality floats each (-1 for the model's own size), and sets the tokens that each
+// text was embedded as. Throws if the backend rejects the request.
+static std::vector<float> embedTexts(LLModel *model, const std::vector<std::string> &texts, int dimensionality,
+                                     std::vector<int> *tokenCounts)
+{
+    size_t size = dimensionality < 0 ? model->embeddingSize() : size_t(dimensionality);
+    std::vector<float> embeddings(texts.size() * size);
+    std::vector<size_t> textTokens;
+    model->embed(texts, embeddings.data(), DOCUMENT_TASK.toStdString(), dimensionality, /*tokenCount*/ nullptr,
+                 /*doMean*/ true, /*atlas*/ false, /*cancelCb*/ nullptr, tokenCounts ? &textTokens : nullptr);
+    if (tokenCounts)
+        tokenCounts->assign(textTokens.begin(), textTokens.end());
+    return embeddings;
+}
+
+EmbeddingContext::EmbeddingContext(LLModel *model, const QString &name)
+    : QObject(nullptr)
+    , m_model(model)
+{
+    moveToThread(&m_thread);
+    m_thread.setObjectName(name);
+    m_thread.start();
+}
+
+EmbeddingContext::~EmbeddingContext()
+{
+    m_thread.quit();
+    m_thread.wait();
+    delete m_model;
+}
+
+void EmbeddingContext::embed(const QVector<EmbeddingChunk> &chunks)
+{
+    QVector<EmbeddingResult> results;
+    try {
+        results = embedDocuments(m_model, chunks);
+    } catch (const std::exception &e) {
+        qWarning() << "WARNING: LLModel::embed failed:" << e.what();
+        emit errorGenerated(chunks, u"ERROR: Could not embed documents: %1"_s.arg(e.what()));
+        return;
+    }
+    emit embeddingsGenerated(results);
+}
+
+std::vector<float> EmbeddingContext::embedTexts(const std::vector<std::string> &texts, int dimensionality,
+                                                std::vector<int> *tokenCounts)
+{
+    Q_ASSERT(QThread::currentThread() != &m_thread);
+    std::vector<float> embeddings;
+    std::exception_ptr error;
+    QMetaObject::invokeMethod(this, [&] {
+        try {
+            embeddings = ::embedTexts(m_model, texts, dimensionality, tokenCounts);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }, Qt::BlockingQueuedConnection);
+    if (error)
+        std::rethrow_exception(error);
+    return embeddings;
+}
 
 EmbeddingLLMWorker::EmbeddingLLMWorker()
     : QObject(nullptr)
@@ -51,12 +215,26 @@ EmbeddingLLMWorker::~EmbeddingLLMWorker()
     m_workerThread.quit();
     m_workerThread.wait();
 
+    m_docContexts.clear();
     if (m_model) {
         delete m_model;
         m_model = nullptr;
     }
 }
 
+std::shared_ptr<EmbeddingLLMWorker> EmbeddingLLMWorker::shared()
+{
+    static QMutex s_mutex;
+    static std::weak_ptr<EmbeddingLLMWorker> s_worker;
+    QMutexLocker locker(&s_mutex);
+    auto worker = s_worker.lock();
+    if (!worker) {
+        worker = std::make_shared<EmbeddingLLMWorker>();
+        s_worker = worker;
+    }
+    return worker;
+}
+
 void EmbeddingLLMWorker::wait()
 {
     m_workerThread.wait();
@@ -64,7 +242,7 @@ void EmbeddingLLMWorker::wait()
 
 bool EmbeddingLLMWorker::loadModel()
 {
-    constexpr int n_ctx = 2048;
+    constexpr int n_ctx = EMBEDDING_CONTEXT_LENGTH;
 
     m_nomicAPIKey.clear();
     m_model = nullptr;
@@ -153,6 +331,7 @@ bool EmbeddingLLMWorker::loadModel()
         }
 
         success = m_model->loadModel(filePath.toStdString(), n_ctx, 0);
+        actualDeviceIsCPU = true;
     }
 
     if (!success) {
@@ -172,12 +351,51 @@ bool EmbeddingLLMWorker::loadModel()
     // FIXME(jared): the user may want this to take effect without having to restart
     int n_threads = MySettings::globalInstance()->threadCount();
     m_model->setThreadCount(n_threads);
+    m_modelOnCPU = actualDeviceIsCPU;
 
     return true;
 }
 
+// Documents are embedded by contexts of their own, so that query embeddings, which the user waits for, need not wait
+// for them. The contexts share the weights of m_model and split the threads between them. A GPU is kept busy by one
+// context while another prepares its next pass. On the CPU, a context does not make use of more than a few threads,
+// more contexts use the rest.
+void EmbeddingLLMWorker::createDocContexts()
+{
+    const int threadCount = MySettings::globalInstance()->threadCount();
+    const int nContexts = m_modelOnCPU ? std::clamp(threadCount / 4, 1, 4) : 2;
+    const int nThreads = std::max(1, threadCount / nContexts);
+    for (int i = 0; i < nContexts; i++) {
+        LLModel *model = m_model->newContext(EMBEDDING_CONTEXT_LENGTH);
+        if (!model)
+            break;
+        model->setThreadCount(nThreads);
+        auto *context = new EmbeddingContext(model, u"embedding%1"_s.arg(i + 1));
+        connect(context, &EmbeddingContext::embeddingsGenerated, this,
+                [this, i](const QVector<EmbeddingResult> &embeddings) {
+                    m_docContextRequests[i]--;
+                    emit embeddingsGenerated(embeddings);
+                });
+        connect(context, &EmbeddingContext::errorGenerated, this,
+                [this, i](const QVector<EmbeddingChunk> &chunks, const QString &error) {
+                    m_docContextRequests[i]--;
+                    emit errorGenerated(chunks, error);
+                });
+        m_docContexts.emplace_back(context);
+        m_docContextRequests.push_back(0);
+    }
+    if (m_docContexts.empty())
+        qWarning() << "embllm WARNING: Could not make contexts for documents, they are embedded with queries";
+    m_docContextCount = std::max(1, int(m_docContexts.size()));
+}
+
 std::vector<float> EmbeddingLLMWorker::generateQueryEmbedding(const QString &text)
 {
+    // whitespace does not change what is being searched for, so it should not cause a cache miss
+    const QString query = text.simplified();
+    auto *cache = EmbeddingCache::globalInstance();
+    QString model;
+
     {
         QMutexLocker locker(&m_mutex);
 
@@ -186,30 +404,65 @@ std::vector<float> EmbeddingLLMWorker::generateQueryEmbedding(const QString &tex
             return {};
         }
 
+        model = isNomic() ? ATLAS_EMBEDDING_MODEL : EMBEDDING_MODEL_NAME;
+        if (auto cached = cache->find(model, QUERY_TASK, -1, query))
+            return cached->embedding;
+
         if (!isNomic()) {
             std::vector<float> embedding(m_model->embeddingSize());
 
             try {
-                m_model->embed({text.toStdString()}, embedding.data(), /*isRetrieval*/ true);
+                m_model->embed({query.toStdString()}, embedding.data(), /*isRetrieval*/ true);
             } catch (const std::exception &e) {
                 qWarning() << "WARNING: LLModel::embed failed:" << e.what();
                 return {};
             }
 
+            cache->insert(model, QUERY_TASK, -1, query, { embedding });
             return embedding;
         }
     }
 
     EmbeddingLLMWorker worker;
-    emit worker.requestAtlasQueryEmbedding(text);
+    emit worker.requestAtlasQueryEmbedding(query);
     worker.wait();
-    return worker.lastResponse();
+    std::vector<float> embedding = worker.lastResponse();
+    if (!embedding.empty())
+        cache->insert(model, QUERY_TASK, -1, query, { embedding });
+    return embedding;
+}
+
+std::vector<float> EmbeddingLLMWorker::generateEmbeddings(const std::vector<std::string> &texts, int dimensionality,
+                                                          std::vector<int> *tokenCounts)
+{
+    EmbeddingContext *context;
+    {
+        QMutexLocker locker(&m_mutex);
+
+        if (!hasModel() && !loadModel())
+            throw std::runtime_error("Could not load the embedding model");
+        if (isNomic())
+            throw RemoteEmbeddingModelError("embeddings are only served with the local embedding model, which is not "
+                                            "in use while LocalDocs is set to use the Nomic Embed API");
+
+        if (!m_docContextsCreated) {
+            createDocContexts();
+            m_docContextsCreated = true;
+        }
+        // like documents, these are embedded with queries only if there are no contexts for documents
+        if (m_docContexts.empty())
+            return ::embedTexts(m_model, texts, dimensionality, tokenCounts);
+        context = m_docContexts[m_nextTextsContext++ % m_docContexts.size()].get();
+    }
+
+    // m_model is left to queries, so that they do not wait for these
+    return context->embedTexts(texts, dimensionality, tokenCounts);
 }
 
 void EmbeddingLLMWorker::sendAtlasRequest(const QStringList &texts, const QString &taskType, const QVariant &userData)
 {
     QJsonObject root;
-    root.insert("model", "nomic-embed-text-v1");
+    root.insert("model", ATLAS_EMBEDDING_MODEL);
     root.insert("texts", QJsonArray::fromStringList(texts));
     root.insert("task_type", taskType);
 
@@ -222,7 +475,7 @@ void EmbeddingLLMWorker::sendAtlasRequest(const QStringList &texts, const QStrin
     request.setRawHeader("Authorization", authorization.toUtf8());
     request.setAttribute(QNetworkRequest::User, userData);
     QNetworkReply *reply = m_networkManager->post(request, doc.toJson(QJsonDocument::Compact));
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
     connect(reply, &QNetworkReply::finished, this, &EmbeddingLLMWorker::handleFinished);
 }
 
@@ -243,7 +496,7 @@ void EmbeddingLLMWorker::atlasQueryEmbeddingRequested(const QString &text)
         Q_ASSERT(hasModel());
     }
 
-    sendAtlasRequest({text}, "search_query");
+    sendAtlasRequest({text}, QUERY_TASK);
 }
 
 void EmbeddingLLMWorker::docEmbeddingsRequested(const QVector<EmbeddingChunk> &chunks)
@@ -251,56 +504,49 @@ void EmbeddingLLMWorker::docEmbeddingsRequested(const QVector<EmbeddingChunk> &c
     if (m_stopGenerating)
         return;
 
+    // every request is answered with either embeddingsGenerated() or errorGenerated()
     bool isNomic;
     {
         QMutexLocker locker(&m_mutex);
         if (!hasModel() && !loadModel()) {
             qWarning() << "WARNING: Could not load model for embeddings";
+            emit errorGenerated(chunks, u"ERROR: Could not load the embedding model"_s);
             return;
         }
 
         isNomic = this->isNomic();
-    }
-
-    if (!isNomic) {
-        QVector<EmbeddingResult> results;
-        results.reserve(chunks.size());
-        std::vector<std::string> texts;
-        texts.reserve(chunks.size());
-        for (const auto &c: chunks) {
-            EmbeddingResult result;
-            result.model = c.model;
-            result.folder_id = c.folder_id;
-            result.chunk_id = c.chunk_id;
-            result.embedding.resize(m_model->embeddingSize());
-            results << result;
-            texts.push_back(c.chunk.toStdString());
+        if (!isNomic && !m_docContextsCreated) {
+            createDocContexts();
+            m_docContextsCreated = true;
         }
+    }
 
-        constexpr int BATCH_SIZE = 4;
-        std::vector<float> result;
-        result.resize(chunks.size() * m_model->embeddingSize());
-        for (int j = 0; j < chunks.size(); j += BATCH_SIZE) {
-            QMutexLocker locker(&m_mutex);
-            std::vector batchTexts(texts.begin() + j, texts.begin() + std::min(j + BATCH_SIZE, int(texts.size())));
-            try {
-                m_model->embed(batchTexts, result.data() + j * m_model->embeddingSize(), /*isRetrieval*/ false);
-            } catch (const std::exception &e) {
-                qWarning() << "WARNING: LLModel::embed failed:" << e.what();
-                return;
-            }
-        }
-        for (int i = 0; i < chunks.size(); i++)
-            memcpy(results[i].embedding.data(), &result[i * m_model->embeddingSize()], m_model->embeddingSize() * sizeof(float));
+    if (isNomic) {
+        QStringList texts;
+        for (auto &c: chunks)
+            texts.append(c.chunk);
+        sendAtlasRequest(texts, DOCUMENT_TASK, QVariant::fromValue(chunks));
+        return;
+    }
 
-        emit embeddingsGenerated(results);
+    // the context with the fewest requests gets this one
+    if (!m_docContexts.empty()) {
+        auto least = ranges::min_element(m_docContextRequests);
+        auto *context = m_docContexts[least - m_docContextRequests.begin()].get();
+        ++*least;
+        QMetaObject::invokeMethod(context, [context, chunks] { context->embed(chunks); }, Qt::QueuedConnection);
         return;
-    };
+    }
 
-    QStringList texts;
-    for (auto &c: chunks)
-        texts.append(c.chunk);
-    sendAtlasRequest(texts, "search_document", QVariant::fromValue(chunks));
+    QVector<EmbeddingResult> results;
+    try {
+        results = embedDocuments(m_model, chunks, &m_mutex);
+    } catch (const std::exception &e) {
+        qWarning() << "WARNING: LLModel::embed failed:" << e.what();
+        emit errorGenerated(chunks, u"ERROR: Could not embed documents: %1"_s.arg(e.what()));
+        return;
+    }
+    emit embeddingsGenerated(results);
 }
 
 std::vector<float> jsonArrayToVector(const QJsonArray &jsonArray)
@@ -386,6 +632,8 @@ void EmbeddingLLMWorker::handleFinished()
     QJsonDocument document = QJsonDocument::fromJson(jsonData, &err);
     if (err.error != QJsonParseError::NoError) {
         qWarning() << "ERROR: Couldn't parse Nomic Atlas response:" << jsonData << err.errorString();
+        if (!chunks.isEmpty())
+            emit errorGenerated(chunks, u"ERROR: Couldn't parse Nomic Atlas response"_s);
         return;
     }
 
@@ -393,7 +641,12 @@ void EmbeddingLLMWorker::handleFinished()
     const QJsonArray embeddings = root.value("embeddings").toArray();
 
     if (!chunks.isEmpty()) {
-        emit embeddingsGenerated(jsonArrayToEmbeddingResults(chunks, embeddings));
+        QVector<EmbeddingResult> results = jsonArrayToEmbeddingResults(chunks, embeddings);
+        if (results.isEmpty()) {
+            emit errorGenerated(chunks, u"ERROR: Nomic Atlas returned the wrong number of embeddings"_s);
+        } else {
+            emit embeddingsGenerated(results);
+        }
     } else {
         m_lastResponse = jsonArrayToVector(embeddings);
         emit finished();
@@ -404,20 +657,21 @@ void EmbeddingLLMWorker::handleFinished()
 
 EmbeddingLLM::EmbeddingLLM()
     : QObject(nullptr)
-    , m_embeddingWorker(new EmbeddingLLMWorker)
+    , m_embeddingWorker(EmbeddingLLMWorker::shared())
 {
-    connect(this, &EmbeddingLLM::requestDocEmbeddings, m_embeddingWorker,
+    connect(this, &EmbeddingLLM::requestDocEmbeddings, m_embeddingWorker.get(),
         &EmbeddingLLMWorker::docEmbeddingsRequested, Qt::QueuedConnection);
-    connect(m_embeddingWorker, &EmbeddingLLMWorker::embeddingsGenerated, this,
+    connect(m_embeddingWorker.get(), &EmbeddingLLMWorker::embeddingsGenerated, this,
         &EmbeddingLLM::embeddingsGenerated, Qt::QueuedConnection);
-    connect(m_embeddingWorker, &EmbeddingLLMWorker::errorGenerated, this,
+    connect(m_embeddingWorker.get(), &EmbeddingLLMWorker::errorGenerated, this,
         &EmbeddingLLM::errorGenerated, Qt::QueuedConnection);
 }
 
 EmbeddingLLM::~EmbeddingLLM()
 {
-    delete m_embeddingWorker;
-    m_embeddingWorker = nullptr;
+    // the worker is destroyed with the last user
+    disconnect(m_embeddingWorker.get(), nullptr, this, nullptr);
+    m_embeddingWorker.reset();
 }
 
 QString EmbeddingLLM::model()
@@ -425,6 +679,36 @@ QString EmbeddingLLM::model()
     return EMBEDDING_MODEL_NAME;
 }
 
+QString EmbeddingLLM::documentTask()
+{
+    return DOCUMENT_TASK;
+}
+
+int EmbeddingLLM::batchTokens()
+{
+    return EMBEDDING_CONTEXT_LENGTH;
+}
+
+int EmbeddingLLM::docContextCount() const
+{
+    return m_embeddingWorker->docContextCount();
+}
+
+int EmbeddingLLM::estimatedTokenCount(QStringView text)
+{
+    // WordPiece splits English into a token per four or so characters, and makes a token of each punctuation mark and
+    // of most characters outside of ASCII
+    qsizetype nWordChars = 0;
+    qsizetype nOtherChars = 0;
+    for (QChar c: text) {
+        if (c.unicode() < 0x80 && (c.isLetterOrNumber() || c.isSpace()))
+            nWordChars++;
+        else
+            nOtherChars++;
+    }
+    return int((nWordChars + 3) / 4 + nOtherChars);
+}
+
 // TODO(jared): embed using all necessary embedding models given collection
 std::vector<float> EmbeddingLLM::generateQueryEmbedding(const QString &text)
 {
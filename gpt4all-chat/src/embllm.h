@@ -2,15 +2,23 @@
 #define EMBLLM_H
 
 #include <QByteArray>
+#include <QHash>
 #include <QMutex>
 #include <QObject>
 #include <QString>
 #include <QStringList> // IWYU pragma: keep
+#include <QStringView>
 #include <QThread>
 #include <QVariant>
 #include <QVector> // IWYU pragma: keep
 
 #include <atomic>
+#include <list>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 class LLModel;
@@ -22,6 +30,7 @@ struct EmbeddingChunk {
     int folder_id;
     int chunk_id;
     QString chunk;
+    int tokens = 0; // in chunk, as estimated by EmbeddingLLM::estimatedTokenCount(), 0 if unknown
 };
 
 Q_DECLARE_METATYPE(EmbeddingChunk)
@@ -33,12 +42,76 @@ struct EmbeddingResult {
     std::vector<float> embedding;
 };
 
+// The most recently used embeddings of LocalDocs queries and API server inputs, so that repeating one does not run the
+// embedding model again. Thread-safe.
+class EmbeddingCache
+{
+public:
+    struct Entry {
+        std::vector<float> embedding;
+        int                tokens = 0; // in the text, if known
+    };
+
+    static EmbeddingCache *globalInstance();
+
+    // prefix is the task that the text was embedded for, as applied by the model, such as "search_query". dimensions
+    // is as requested, -1 for the model's own size.
+    std::optional<Entry> find(const QString &model, const QString &prefix, int dimensions, const QString &text);
+    void insert(const QString &model, const QString &prefix, int dimensions, const QString &text, const Entry &entry);
+
+private:
+    using LruList = std::list<std::pair<QByteArray, Entry>>; // most recently used first
+
+    EmbeddingCache() = default;
+    ~EmbeddingCache() = default;
+
+    static QByteArray key(const QString &model, const QString &prefix, int dimensions, const QString &text);
+
+    QMutex                               m_mutex;
+    LruList                              m_lru;
+    QHash<QByteArray, LruList::iterator> m_index;
+
+    friend class MyEmbeddingCache;
+};
+
+// A context of the local embedding model that embeds documents on a thread of its own. Owns the model.
+class EmbeddingContext : public QObject {
+    Q_OBJECT
+public:
+    explicit EmbeddingContext(LLModel *model, const QString &name);
+    ~EmbeddingContext() override;
+
+    // Embeds texts as documents on the thread of the context, in turn with its chunks, and waits for the result. As
+    // EmbeddingLLMWorker::generateEmbeddings().
+    std::vector<float> embedTexts(const std::vector<std::string> &texts, int dimensionality,
+                                  std::vector<int> *tokenCounts);
+
+public Q_SLOTS:
+    void embed(const QVector<EmbeddingChunk> &chunks);
+
+Q_SIGNALS:
+    void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
+    void errorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
+
+private:
+    LLModel *m_model;
+    QThread m_thread;
+};
+
+// thrown by EmbeddingLLMWorker::generateEmbeddings() if LocalDocs is set to embed with Nomic Atlas
+class RemoteEmbeddingModelError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
 class EmbeddingLLMWorker : public QObject {
     Q_OBJECT
 public:
     EmbeddingLLMWorker();
     ~EmbeddingLLMWorker() override;
 
+    // The worker of the process, made on first use, so that LocalDocs and the API server load one copy of the model.
+    static std::shared_ptr<EmbeddingLLMWorker> shared();
+
     void wait();
 
     std::vector<float> lastResponse() const { return m_lastResponse; }
@@ -46,8 +119,15 @@ public:
     bool loadModel();
     bool isNomic() const { return !m_nomicAPIKey.isEmpty(); }
     bool hasModel() const { return isNomic() || m_model; }
+    // the number of contexts that embed documents, 1 until the model is loaded
+    int docContextCount() const { return m_docContextCount; }
 
     std::vector<float> generateQueryEmbedding(const QString &text);
+    // Embeds texts as documents (EmbeddingLLM::documentTask()) with the local model, dimensionality floats each (-1 for
+    // the model's own size), and sets the tokens that each text was embedded as. They take turns with documents on the
+    // contexts for documents. Throws if there is no local model or the backend rejects the request.
+    std::vector<float> generateEmbeddings(const std::vector<std::string> &texts, int dimensionality,
+                                          std::vector<int> *tokenCounts = nullptr);
 
 public Q_SLOTS:
     void atlasQueryEmbeddingRequested(const QString &text);
@@ -64,11 +144,18 @@ private Q_SLOTS:
 
 private:
     void sendAtlasRequest(const QStringList &texts, const QString &taskType, const QVariant &userData = {});
+    void createDocContexts();
 
     QString m_nomicAPIKey;
     QNetworkAccessManager *m_networkManager;
     std::vector<float> m_lastResponse;
-    LLModel *m_model = nullptr;
+    LLModel *m_model = nullptr; // embeds queries, and other texts only if there are no m_docContexts
+    std::vector<std::unique_ptr<EmbeddingContext>> m_docContexts; // over the weights of m_model
+    std::vector<int> m_docContextRequests; // not answered yet, by context
+    size_t m_nextTextsContext = 0; // the context for the next texts of generateEmbeddings(), guarded by m_mutex
+    bool m_docContextsCreated = false;
+    std::atomic<int> m_docContextCount = 1;
+    bool m_modelOnCPU = true; // the device m_model was actually loaded on, whatever the setting asked for
     std::atomic<bool> m_stopGenerating;
     QThread m_workerThread;
     QMutex m_mutex; // guards m_model and m_nomicAPIKey
@@ -82,6 +169,16 @@ public:
     ~EmbeddingLLM() override;
 
     static QString model();
+    // the task that documents and API server inputs are embedded for, which their cached embeddings are keyed by
+    static QString documentTask();
+    // the number of tokens that the local model embeds in one pass
+    static int batchTokens();
+    // the number of contexts of the local model that embed documents at the same time, which depends on the device
+    // that it was loaded on
+    int docContextCount() const;
+    // A guess at the number of tokens that the embedding model splits text into, without its tokenizer. It errs on the
+    // high side, so that batches sized by it do not overflow a pass.
+    static int estimatedTokenCount(QStringView text);
     bool loadModel();
     bool hasModel() const;
 
@@ -95,7 +192,7 @@ Q_SIGNALS:
     void errorGenerated(const QVector<EmbeddingChunk> &chunks, const QString &error);
 
 private:
-    EmbeddingLLMWorker *m_embeddingWorker;
+    std::shared_ptr<EmbeddingLLMWorker> m_embeddingWorker;
 };
 
 #endif // EMBLLM_H
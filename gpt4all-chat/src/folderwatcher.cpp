@@ -0,0 +1,353 @@
+#include "folderwatcher.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QTimer>
+#include <QtLogging>
+
+#ifdef Q_OS_LINUX
+#   include <QSocketNotifier>
+
+#   include <sys/inotify.h>
+#   include <unistd.h>
+
+#   include <cerrno>
+#   include <cstdint>
+#else
+#   include <QFileSystemWatcher>
+#endif
+
+#include <chrono>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+
+// changes are reported once there were none for this long, or once they have kept coming for the longer time
+static constexpr auto CHANGE_DEBOUNCE   = 1s;
+static constexpr auto MAX_CHANGE_DELAY  = 10s;
+// how often a folder that cannot be watched is compared with its snapshot
+static constexpr auto POLL_INTERVAL     = 60s;
+
+#ifdef Q_OS_LINUX
+static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                     | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+#endif
+
+static bool isAtOrUnder(const QString &path, const QString &dir)
+{
+    return path.startsWith(dir) && (path.size() == dir.size() || path[dir.size()] == u'/');
+}
+
+FolderWatcher::FolderWatcher(QObject *parent)
+    : QObject(parent)
+#ifndef Q_OS_LINUX
+    , m_watcher(new QFileSystemWatcher(this))
+#endif
+    , m_changeTimer(new QTimer(this))
+    , m_pollTimer(new QTimer(this))
+{
+#ifdef Q_OS_LINUX
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotifyFd < 0) {
+        qWarning() << "LocalDocs: cannot watch folders, inotify_init1 failed with errno" << errno;
+    } else {
+        m_notifier = new QSocketNotifier(m_inotifyFd, QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &FolderWatcher::readEvents);
+    }
+#else
+    // only directories are watched, a change to one means that its entries changed
+    connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, [this](const QString &dir) {
+        if (!QFileInfo(dir).isDir())
+            unwatchTree(dir, /*keepShared*/ false); // removed, the watcher has dropped it already
+        directoryMayHaveChanged(dir, dir);
+    });
+#endif
+
+    m_changeTimer->setSingleShot(true);
+    m_changeTimer->setInterval(CHANGE_DEBOUNCE);
+    m_changeTimer->callOnTimeout(this, &FolderWatcher::reportChanges);
+    m_pollTimer->setInterval(POLL_INTERVAL);
+    m_pollTimer->callOnTimeout(this, &FolderWatcher::pollFolders);
+    m_pollPool.setMaxThreadCount(1);
+}
+
+FolderWatcher::~FolderWatcher()
+{
+    m_pollPool.clear();
+    m_pollPool.waitForDone();
+#ifdef Q_OS_LINUX
+    if (m_inotifyFd >= 0)
+        close(m_inotifyFd);
+#endif
+}
+
+void FolderWatcher::addFolder(const QString &path)
+{
+    const QString root = QFileInfo(path).canonicalFilePath();
+    if (root.isEmpty() || m_folders.contains(root))
+        return;
+    m_folders.insert(root, path);
+    if (!watchTree(root))
+        pollInstead(root);
+}
+
+void FolderWatcher::removeFolder(const QString &path)
+{
+    QString root;
+    for (auto it = m_folders.cbegin(); it != m_folders.cend(); ++it) {
+        if (*it == path) {
+            root = it.key();
+            break;
+        }
+    }
+    if (root.isNull())
+        return;
+
+    m_folders.remove(root);
+    m_changes.remove(root);
+    if (m_polledFolders.remove(root)) {
+        if (m_polledFolders.isEmpty())
+            m_pollTimer->stop();
+    } else {
+        unwatchTree(root, /*keepShared*/ true);
+    }
+}
+
+#ifdef Q_OS_LINUX
+
+bool FolderWatcher::addWatch(const QString &dir, bool *limitReached)
+{
+    if (m_inotifyFd < 0)
+        return false;
+    const int wd = inotify_add_watch(m_inotifyFd, QFile::encodeName(dir).constData(), WATCH_MASK);
+    if (wd < 0) {
+        // fs.inotify.max_user_watches, otherwise the directory is gone or unreadable
+        *limitReached = errno == ENOSPC || errno == ENOMEM;
+        return false;
+    }
+    m_watches.insert(dir, wd);
+    m_watchedDirs.insert(wd, dir);
+    return true;
+}
+
+void FolderWatcher::removeWatch(const QString &dir)
+{
+    const int wd = m_watches.take(dir);
+    m_watchedDirs.remove(wd);
+    inotify_rm_watch(m_inotifyFd, wd);
+}
+
+void FolderWatcher::readEvents()
+{
+    alignas(inotify_event) char buffer[64 * 1024];
+    for (;;) {
+        const ssize_t n = read(m_inotifyFd, buffer, sizeof buffer);
+        if (n <= 0)
+            break; // EAGAIN once there are no more events
+
+        for (const char *p = buffer; p < buffer + n;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, so anything may have changed
+                qWarning() << "LocalDocs: too many changes to watch, checking the folders again";
+                for (const QString &root: m_folders.keys()) {
+                    if (!m_polledFolders.contains(root))
+                        pathChanged(root);
+                }
+                continue;
+            }
+
+            auto it = m_watchedDirs.constFind(event->wd);
+            if (it == m_watchedDirs.cend())
+                continue; // removed since
+            const QString dir = *it;
+
+            if (event->mask & IN_IGNORED) {
+                m_watchedDirs.erase(it);
+                if (m_watches.value(dir) == event->wd)
+                    m_watches.remove(dir);
+                continue;
+            }
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // the parent reports the entry, unless this is a folder itself
+                if (event->mask & IN_MOVE_SELF)
+                    removeWatch(dir);
+                pathChanged(dir);
+                continue;
+            }
+
+            const QString path = dir + u'/' + QFile::decodeName(event->name);
+            if (event->mask & IN_ISDIR) {
+                // the watches of a directory that moved away have the wrong paths, they are added again if it moved
+                // to somewhere else in the folder
+                if (event->mask & IN_MOVED_FROM)
+                    unwatchTree(path, /*keepShared*/ false);
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    directoryMayHaveChanged(path, path);
+            }
+            pathChanged(path);
+        }
+    }
+}
+
+#else // !Q_OS_LINUX
+
+bool FolderWatcher::addWatch(const QString &dir, bool *limitReached)
+{
+    if (!m_watcher->addPath(dir)) {
+        // the limits of the platform are not known, a directory that still exists hit one
+        *limitReached = QFileInfo(dir).isDir();
+        return false;
+    }
+    m_watches.insert(dir, 0);
+    return true;
+}
+
+void FolderWatcher::removeWatch(const QString &dir)
+{
+    m_watches.remove(dir);
+    m_watcher->removePath(dir);
+}
+
+#endif // !Q_OS_LINUX
+
+// Watches a directory and the directories under it that are not watched yet. Returns false if the limit on watches
+// was reached.
+bool FolderWatcher::watchTree(const QString &dir)
+{
+    QStringList dirs { dir };
+    QDirIterator it(dir, QDir::Readable | QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext())
+        dirs << it.next();
+
+    for (const QString &d: std::as_const(dirs)) {
+        bool limitReached = false;
+        if (!m_watches.contains(d) && !addWatch(d, &limitReached) && limitReached)
+            return false;
+    }
+    return true;
+}
+
+// Stops watching a directory and the directories under it, except for those that another folder still needs if
+// keepShared is set.
+void FolderWatcher::unwatchTree(const QString &dir, bool keepShared)
+{
+    QStringList dirs;
+    for (auto it = m_watches.cbegin(); it != m_watches.cend(); ++it) {
+        if (isAtOrUnder(it.key(), dir) && !(keepShared && isWatchedByOtherFolder(it.key(), dir)))
+            dirs << it.key();
+    }
+    for (const QString &d: std::as_const(dirs))
+        removeWatch(d);
+}
+
+// whether a watched folder other than root contains dir
+bool FolderWatcher::isWatchedByOtherFolder(const QString &dir, const QString &root) const
+{
+    for (auto it = m_folders.cbegin(); it != m_folders.cend(); ++it) {
+        if (it.key() != root && isAtOrUnder(dir, it.key()) && !m_polledFolders.contains(it.key()))
+            return true;
+    }
+    return false;
+}
+
+void FolderWatcher::pollInstead(const QString &root)
+{
+    if (m_polledFolders.contains(root))
+        return;
+#ifdef Q_OS_LINUX
+    qWarning().noquote() << "LocalDocs: too many directories to watch in" << m_folders.value(root)
+                         << "(see fs.inotify.max_user_watches), checking it for changes every"
+                         << std::chrono::seconds(POLL_INTERVAL).count() << "seconds instead";
+#else
+    qWarning().noquote() << "LocalDocs: too many directories to watch in" << m_folders.value(root)
+                         << ", checking it for changes every" << std::chrono::seconds(POLL_INTERVAL).count()
+                         << "seconds instead";
+#endif
+
+    m_polledFolders.insert(root, std::nullopt);
+    unwatchTree(root, /*keepShared*/ true);
+    pollFolder(root);
+    if (!m_pollTimer->isActive())
+        m_pollTimer->start();
+}
+
+// Takes a snapshot of the folder in the background, and reports what changed since the last one.
+void FolderWatcher::pollFolder(const QString &root)
+{
+    m_pollsRunning.insert(root);
+    m_pollPool.start([this, root] {
+        const DirectorySnapshot snapshot = DirectorySnapshot::take(root);
+        QMetaObject::invokeMethod(this, [this, root, snapshot] {
+            m_pollsRunning.remove(root);
+            auto it = m_polledFolders.find(root);
+            if (it == m_polledFolders.end())
+                return; // removed since
+            if (*it) {
+                for (const QString &path: snapshot.changedSince(**it))
+                    pathChanged(path);
+            }
+            *it = snapshot;
+        }, Qt::QueuedConnection);
+    });
+}
+
+void FolderWatcher::pollFolders()
+{
+    for (auto it = m_polledFolders.cbegin(); it != m_polledFolders.cend(); ++it) {
+        if (!m_pollsRunning.contains(it.key()))
+            pollFolder(it.key());
+    }
+}
+
+// Watches the directories under dir that are new, and reports path as changed. If there are too many, the folders
+// that contain dir are polled instead.
+void FolderWatcher::directoryMayHaveChanged(const QString &dir, const QString &path)
+{
+    if (QFileInfo(dir).isDir() && !watchTree(dir)) {
+        for (const QString &root: m_folders.keys()) {
+            if (isAtOrUnder(dir, root))
+                pollInstead(root);
+        }
+    }
+    pathChanged(path);
+}
+
+void FolderWatcher::pathChanged(const QString &path)
+{
+    bool added = false;
+    for (auto it = m_folders.cbegin(); it != m_folders.cend(); ++it) {
+        if (isAtOrUnder(path, it.key())) {
+            m_changes[it.key()].insert(path);
+            added = true;
+        }
+    }
+    if (!added)
+        return;
+
+    if (!m_changesSince.isValid())
+        m_changesSince.start();
+    // changes that keep coming put off the report only for so long
+    if (!m_changeTimer->isActive() || m_changesSince.durationElapsed() < MAX_CHANGE_DELAY)
+        m_changeTimer->start();
+}
+
+void FolderWatcher::reportChanges()
+{
+    const auto changes = std::exchange(m_changes, {});
+    m_changesSince.invalidate();
+    for (auto it = changes.cbegin(); it != changes.cend(); ++it) {
+        QStringList paths(it->cbegin(), it->cend());
+        paths.sort();
+        emit pathsChanged(m_folders.value(it.key()), paths);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef FOLDERWATCHER_H
+#define FOLDERWATCHER_H
+
+#include "directorysnapshot.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList> // IWYU pragma: keep
+#include <QThreadPool>
+
+#include <optional>
+
+class QTimer;
+#ifdef Q_OS_LINUX
+class QSocketNotifier;
+#else
+class QFileSystemWatcher;
+#endif
+
+
+// Watches LocalDocs folders with all of the directories in them, and reports the paths that changed in batches once
+// the changes have stopped for a moment, so that a burst of them, such as from a checkout or an unpacked archive, is
+// handled once. On Linux, it reads inotify events, which name the files that changed. Elsewhere, it uses a
+// QFileSystemWatcher, which only names the directories. A folder with more directories than can be watched is
+// compared with a snapshot of it periodically instead.
+class FolderWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FolderWatcher(QObject *parent = nullptr);
+    ~FolderWatcher() override;
+
+    void addFolder(const QString &path);
+    void removeFolder(const QString &path);
+
+Q_SIGNALS:
+    // Canonical paths at or under a folder, given as it was added, that changed: files that were added, modified or
+    // removed, and directories that were added or removed, or whose entries changed in a way that was not reported by
+    // file. A removed path is as it was when it still existed.
+    void pathsChanged(const QString &folder, const QStringList &paths);
+
+private:
+    friend class FolderWatcherTest;
+
+    bool addWatch(const QString &dir, bool *limitReached);
+    void removeWatch(const QString &dir);
+    bool watchTree(const QString &dir);
+    void unwatchTree(const QString &dir, bool keepShared);
+    bool isWatchedByOtherFolder(const QString &dir, const QString &root) const;
+    void pollInstead(const QString &root);
+    void pollFolder(const QString &root);
+    void pollFolders();
+    void directoryMayHaveChanged(const QString &dir, const QString &path);
+    void pathChanged(const QString &path);
+    void reportChanges();
+#ifdef Q_OS_LINUX
+    void readEvents();
+#endif
+
+    QHash<QString, QString> m_folders; // by canonical path, as added
+    // by canonical path, the snapshot that the next one is compared with, none before the first one is taken
+    QHash<QString, std::optional<DirectorySnapshot>> m_polledFolders;
+    QSet<QString> m_pollsRunning;
+    QHash<QString, int> m_watches; // by directory, the inotify watch descriptor on Linux
+#ifdef Q_OS_LINUX
+    int m_inotifyFd = -1;
+    QSocketNotifier *m_notifier = nullptr;
+    QHash<int, QString> m_watchedDirs; // by watch descriptor
+#else
+    QFileSystemWatcher *m_watcher;
+#endif
+    QHash<QString, QSet<QString>> m_changes; // by canonical folder path, not reported yet
+    QElapsedTimer m_changesSince;
+    QTimer *m_changeTimer;
+    QTimer *m_pollTimer;
+    QThreadPool m_pollPool;
+};
+
+#endif // FOLDERWATCHER_H
@@ -7,8 +7,8 @@
 #include <QCoreApplication>
 #include <QDebug>
 #include <QGlobalStatic>
-#include <QGuiApplication>
 #include <QList>
+#include <QMetaObject>
 #include <QUrl>
 #include <Qt>
 #include <QtLogging>
@@ -60,7 +60,16 @@ LocalDocs::LocalDocs()
     connect(m_database, &Database::requestGuiCollectionListUpdated,
         m_localDocsModel, &LocalDocsModel::collectionListUpdated, Qt::QueuedConnection);
 
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, this, &LocalDocs::aboutToQuit);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, this, &LocalDocs::aboutToQuit);
+}
+
+// Retrieves from the collections of the chat application without changing them, for gpt4all-server. Instead of
+// requestStart().
+void LocalDocs::startReadOnly()
+{
+    disconnect(MySettings::globalInstance(), nullptr, this, nullptr);
+    disconnect(this, nullptr, m_database, nullptr);
+    QMetaObject::invokeMethod(m_database, &Database::startReadOnly, Qt::QueuedConnection);
 }
 
 void LocalDocs::aboutToQuit()
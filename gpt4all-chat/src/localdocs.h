@@ -27,6 +27,7 @@ public:
     Q_INVOKABLE void forceIndexing(const QString &collection);
 
     Database *database() const { return m_database; }
+    void startReadOnly();
 
     bool databaseValid() const { return m_database->isValid(); }
 
@@ -18,7 +18,6 @@
 #include <QFile>
 #include <QFileInfo>
 #include <QGlobalStatic>
-#include <QGuiApplication>
 #include <QIODevice>
 #include <QJsonArray>
 #include <QJsonDocument>
@@ -1492,7 +1491,7 @@ void ModelList::updateModelsFromJson()
     conf.setPeerVerifyMode(QSslSocket::VerifyNone);
     request.setSslConfiguration(conf);
     QNetworkReply *jsonReply = m_networkManager.get(request);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
     QEventLoop loop;
     connect(jsonReply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
     QTimer::singleShot(1500, &loop, &QEventLoop::quit);
@@ -1535,7 +1534,7 @@ void ModelList::updateModelsFromJsonAsync()
     conf.setPeerVerifyMode(QSslSocket::VerifyNone);
     request.setSslConfiguration(conf);
     QNetworkReply *jsonReply = m_networkManager.get(request);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
     connect(jsonReply, &QNetworkReply::finished, this, &ModelList::handleModelsJsonDownloadFinished);
     connect(jsonReply, &QNetworkReply::errorOccurred, this, &ModelList::handleModelsJsonDownloadErrorOccurred);
 }
@@ -2149,7 +2148,7 @@ void ModelList::discoverSearch(const QString &search)
     QNetworkRequest request(hfUrl);
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QNetworkReply *reply = m_networkManager.get(request);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
     connect(reply, &QNetworkReply::finished, this, &ModelList::handleDiscoveryFinished);
     connect(reply, &QNetworkReply::errorOccurred, this, &ModelList::handleDiscoveryErrorOccurred);
 }
@@ -2257,7 +2256,7 @@ void ModelList::parseDiscoveryJsonFile(const QByteArray &jsonData)
         request.setAttribute(QNetworkRequest::User, jsonData);
         request.setAttribute(QNetworkRequest::UserMax, filename);
         QNetworkReply *reply = m_networkManager.head(request);
-        connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+        connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
         connect(reply, &QNetworkReply::finished, this, &ModelList::handleDiscoveryItemFinished);
         connect(reply, &QNetworkReply::errorOccurred, this, &ModelList::handleDiscoveryItemErrorOccurred);
     }
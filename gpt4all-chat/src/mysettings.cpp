@@ -5,12 +5,12 @@
 
 #include <gpt4all-backend/llmodel.h>
 
+#include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <QGlobalStatic>
-#include <QGuiApplication>
 #include <QIODevice> // IWYU pragma: keep
 #include <QMap>
 #include <QMetaObject>
@@ -63,6 +63,14 @@ static const QVariantMap basicDefaults {
     { "networkPort",              4891, },
     { "systemTray",               false },
     { "serverChat",               false },
+    { "server/listenAddress",     "127.0.0.1" },
+    { "server/concurrency",       1 },
+    { "server/maxQueueDepth",     64 },
+    { "server/requestTimeout",    0 },
+    { "server/mirrorToChat",      true },
+    { "server/responseCache",     false },
+    { "server/responseCacheSize", 1024 },
+    { "server/responseCacheOnDisk", false },
     { "userDefaultModel",         "Application default" },
     { "suggestionMode",           QVariant::fromValue(SuggestionMode::LocalDocsOnly) },
     { "localdocs/chunkSize",      512 },
@@ -72,6 +80,7 @@ static const QVariantMap basicDefaults {
     { "localdocs/useRemoteEmbed", false },
     { "localdocs/nomicAPIKey",    "" },
     { "localdocs/embedDevice",    "Auto" },
+    { "localdocs/embeddingCacheSize", 1024 },
     { "network/attribution",      "" },
 };
 
@@ -207,8 +216,15 @@ void MySettings::onModelInfoChanged(const QModelIndex &topLeft, const QModelInde
     }
 }
 
+void MySettings::setOverride(const QString &name, const QVariant &value)
+{
+    m_overrides.insert(name, value);
+}
+
 QVariant MySettings::getBasicSetting(const QString &name) const
 {
+    if (auto it = m_overrides.constFind(name); it != m_overrides.constEnd())
+        return *it;
     return m_settings.value(name, basicDefaults.value(name));
 }
 
@@ -254,6 +270,14 @@ void MySettings::restoreApplicationDefaults()
     setSystemTray(basicDefaults.value("systemTray").toBool());
     setServerChat(basicDefaults.value("serverChat").toBool());
     setNetworkPort(basicDefaults.value("networkPort").toInt());
+    setServerListenAddress(basicDefaults.value("server/listenAddress").toString());
+    setServerConcurrency(basicDefaults.value("server/concurrency").toInt());
+    setServerMaxQueueDepth(basicDefaults.value("server/maxQueueDepth").toInt());
+    setServerRequestTimeout(basicDefaults.value("server/requestTimeout").toInt());
+    setServerMirrorToChat(basicDefaults.value("server/mirrorToChat").toBool());
+    setServerResponseCache(basicDefaults.value("server/responseCache").toBool());
+    setServerResponseCacheSize(basicDefaults.value("server/responseCacheSize").toInt());
+    setServerResponseCacheOnDisk(basicDefaults.value("server/responseCacheOnDisk").toBool());
     setModelPath(defaultLocalModelsPath());
     setUserDefaultModel(basicDefaults.value("userDefaultModel").toString());
     setForceMetal(defaults::forceMetal);
@@ -270,6 +294,7 @@ void MySettings::restoreLocalDocsDefaults()
     setLocalDocsUseRemoteEmbed(basicDefaults.value("localdocs/useRemoteEmbed").toBool());
     setLocalDocsNomicAPIKey(basicDefaults.value("localdocs/nomicAPIKey").toString());
     setLocalDocsEmbedDevice(basicDefaults.value("localdocs/embedDevice").toString());
+    setLocalDocsEmbeddingCacheSize(basicDefaults.value("localdocs/embeddingCacheSize").toInt());
 }
 
 void MySettings::eraseModel(const ModelInfo &info)
@@ -596,7 +621,7 @@ void MySettings::setModelSuggestedFollowUpPrompt(const ModelInfo &info, const QS
 
 int MySettings::threadCount() const
 {
-    int c = m_settings.value("threadCount", defaults::threadCount).toInt();
+    int c = m_overrides.value("threadCount", m_settings.value("threadCount", defaults::threadCount)).toInt();
     // The old thread setting likely left many people with 0 in settings config file, which means
     // we should reset it to the default going forward
     if (c <= 0)
@@ -620,6 +645,14 @@ void MySettings::setThreadCount(int value)
 bool        MySettings::systemTray() const              { return getBasicSetting("systemTray"              ).toBool(); }
 bool        MySettings::serverChat() const              { return getBasicSetting("serverChat"              ).toBool(); }
 int         MySettings::networkPort() const             { return getBasicSetting("networkPort"             ).toInt(); }
+QString     MySettings::serverListenAddress() const     { return getBasicSetting("server/listenAddress"    ).toString(); }
+int         MySettings::serverConcurrency() const       { return std::max(getBasicSetting("server/concurrency").toInt(), 1); }
+int         MySettings::serverMaxQueueDepth() const     { return std::max(getBasicSetting("server/maxQueueDepth").toInt(), 0); }
+int         MySettings::serverRequestTimeout() const    { return std::max(getBasicSetting("server/requestTimeout").toInt(), 0); }
+bool        MySettings::serverMirrorToChat() const      { return getBasicSetting("server/mirrorToChat"    ).toBool(); }
+bool        MySettings::serverResponseCache() const     { return getBasicSetting("server/responseCache"   ).toBool(); }
+int         MySettings::serverResponseCacheSize() const { return std::max(getBasicSetting("server/responseCacheSize").toInt(), 1); }
+bool        MySettings::serverResponseCacheOnDisk() const { return getBasicSetting("server/responseCacheOnDisk").toBool(); }
 QString     MySettings::userDefaultModel() const        { return getBasicSetting("userDefaultModel"        ).toString(); }
 QString     MySettings::lastVersionStarted() const      { return getBasicSetting("lastVersionStarted"      ).toString(); }
 int         MySettings::localDocsChunkSize() const      { return getBasicSetting("localdocs/chunkSize"     ).toInt(); }
@@ -629,6 +662,7 @@ QStringList MySettings::localDocsFileExtensions() const { return getBasicSetting
 bool        MySettings::localDocsUseRemoteEmbed() const { return getBasicSetting("localdocs/useRemoteEmbed").toBool(); }
 QString     MySettings::localDocsNomicAPIKey() const    { return getBasicSetting("localdocs/nomicAPIKey"   ).toString(); }
 QString     MySettings::localDocsEmbedDevice() const    { return getBasicSetting("localdocs/embedDevice"   ).toString(); }
+int         MySettings::localDocsEmbeddingCacheSize() const { return std::max(getBasicSetting("localdocs/embeddingCacheSize").toInt(), 0); }
 QString     MySettings::networkAttribution() const      { return getBasicSetting("network/attribution"     ).toString(); }
 
 ChatTheme      MySettings::chatTheme() const      { return ChatTheme     (getEnumSetting("chatTheme", chatThemeNames)); }
@@ -638,6 +672,14 @@ SuggestionMode MySettings::suggestionMode() const { return SuggestionMode(getEnu
 void MySettings::setSystemTray(bool value)                            { setBasicSetting("systemTray",               value); }
 void MySettings::setServerChat(bool value)                            { setBasicSetting("serverChat",               value); }
 void MySettings::setNetworkPort(int value)                            { setBasicSetting("networkPort",              value); }
+void MySettings::setServerListenAddress(const QString &value)          { setBasicSetting("server/listenAddress",     value, "serverListenAddress"); }
+void MySettings::setServerConcurrency(int value)                      { setBasicSetting("server/concurrency",       value, "serverConcurrency"); }
+void MySettings::setServerMaxQueueDepth(int value)                    { setBasicSetting("server/maxQueueDepth",     value, "serverMaxQueueDepth"); }
+void MySettings::setServerRequestTimeout(int value)                   { setBasicSetting("server/requestTimeout",    value, "serverRequestTimeout"); }
+void MySettings::setServerMirrorToChat(bool value)                    { setBasicSetting("server/mirrorToChat",      value, "serverMirrorToChat"); }
+void MySettings::setServerResponseCache(bool value)                   { setBasicSetting("server/responseCache",     value, "serverResponseCache"); }
+void MySettings::setServerResponseCacheSize(int value)                { setBasicSetting("server/responseCacheSize", value, "serverResponseCacheSize"); }
+void MySettings::setServerResponseCacheOnDisk(bool value)             { setBasicSetting("server/responseCacheOnDisk", value, "serverResponseCacheOnDisk"); }
 void MySettings::setUserDefaultModel(const QString &value)            { setBasicSetting("userDefaultModel",         value); }
 void MySettings::setLastVersionStarted(const QString &value)          { setBasicSetting("lastVersionStarted",       value); }
 void MySettings::setLocalDocsChunkSize(int value)                     { setBasicSetting("localdocs/chunkSize",      value, "localDocsChunkSize"); }
@@ -647,6 +689,7 @@ void MySettings::setLocalDocsFileExtensions(const QStringList &value) { setBasic
 void MySettings::setLocalDocsUseRemoteEmbed(bool value)               { setBasicSetting("localdocs/useRemoteEmbed", value, "localDocsUseRemoteEmbed"); }
 void MySettings::setLocalDocsNomicAPIKey(const QString &value)        { setBasicSetting("localdocs/nomicAPIKey",    value, "localDocsNomicAPIKey"); }
 void MySettings::setLocalDocsEmbedDevice(const QString &value)        { setBasicSetting("localdocs/embedDevice",    value, "localDocsEmbedDevice"); }
+void MySettings::setLocalDocsEmbeddingCacheSize(int value)            { setBasicSetting("localdocs/embeddingCacheSize", value, "localDocsEmbeddingCacheSize"); }
 void MySettings::setNetworkAttribution(const QString &value)          { setBasicSetting("network/attribution",      value, "networkAttribution"); }
 
 void MySettings::setChatTheme(ChatTheme value)           { setBasicSetting("chatTheme",      chatThemeNames     .value(int(value))); }
@@ -655,6 +698,9 @@ void MySettings::setSuggestionMode(SuggestionMode value) { setBasicSetting("sugg
 
 QString MySettings::modelPath()
 {
+    if (auto it = m_overrides.constFind("modelPath"); it != m_overrides.constEnd())
+        return it->toString();
+
     // We have to migrate the old setting because I changed the setting key recklessly in v2.4.11
     // which broke a lot of existing installs
     const bool containsOldSetting = m_settings.contains("modelPaths");
@@ -809,7 +855,7 @@ void MySettings::setLanguageAndLocale(const QString &bcp47Name)
 
     // If we previously installed a translator, then remove it
     if (m_translator) {
-        if (!qGuiApp->removeTranslator(m_translator.get())) {
+        if (!QCoreApplication::removeTranslator(m_translator.get())) {
             qDebug() << "ERROR: Failed to remove the previous translator";
         } else {
             m_translator.reset();
@@ -831,7 +877,7 @@ void MySettings::setLanguageAndLocale(const QString &bcp47Name)
         }
 
         // If we've successfully loaded it, then try and install it
-        if (!qGuiApp->installTranslator(m_translator.get())) {
+        if (!QCoreApplication::installTranslator(m_translator.get())) {
             qDebug() << "ERROR: Failed to install the translator:" << filePath;
             m_translator.reset();
         }
@@ -4,6 +4,7 @@
 #include "modellist.h" // IWYU pragma: keep
 
 #include <QDateTime>
+#include <QHash>
 #include <QLatin1StringView> // IWYU pragma: keep
 #include <QList>
 #include <QModelIndex>
@@ -71,6 +72,7 @@ class MySettings : public QObject
     Q_PROPERTY(bool localDocsUseRemoteEmbed READ localDocsUseRemoteEmbed WRITE setLocalDocsUseRemoteEmbed NOTIFY localDocsUseRemoteEmbedChanged)
     Q_PROPERTY(QString localDocsNomicAPIKey READ localDocsNomicAPIKey WRITE setLocalDocsNomicAPIKey NOTIFY localDocsNomicAPIKeyChanged)
     Q_PROPERTY(QString localDocsEmbedDevice READ localDocsEmbedDevice WRITE setLocalDocsEmbedDevice NOTIFY localDocsEmbedDeviceChanged)
+    Q_PROPERTY(int localDocsEmbeddingCacheSize READ localDocsEmbeddingCacheSize WRITE setLocalDocsEmbeddingCacheSize NOTIFY localDocsEmbeddingCacheSizeChanged)
     Q_PROPERTY(QString networkAttribution READ networkAttribution WRITE setNetworkAttribution NOTIFY networkAttributionChanged)
     Q_PROPERTY(bool networkIsActive READ networkIsActive WRITE setNetworkIsActive NOTIFY networkIsActiveChanged)
     Q_PROPERTY(bool networkUsageStatsActive READ networkUsageStatsActive WRITE setNetworkUsageStatsActive NOTIFY networkUsageStatsActiveChanged)
@@ -78,6 +80,14 @@ class MySettings : public QObject
     Q_PROPERTY(QStringList deviceList MEMBER m_deviceList CONSTANT)
     Q_PROPERTY(QStringList embeddingsDeviceList MEMBER m_embeddingsDeviceList CONSTANT)
     Q_PROPERTY(int networkPort READ networkPort WRITE setNetworkPort NOTIFY networkPortChanged)
+    Q_PROPERTY(QString serverListenAddress READ serverListenAddress WRITE setServerListenAddress NOTIFY serverListenAddressChanged)
+    Q_PROPERTY(int serverConcurrency READ serverConcurrency WRITE setServerConcurrency NOTIFY serverConcurrencyChanged)
+    Q_PROPERTY(int serverMaxQueueDepth READ serverMaxQueueDepth WRITE setServerMaxQueueDepth NOTIFY serverMaxQueueDepthChanged)
+    Q_PROPERTY(bool serverResponseCache READ serverResponseCache WRITE setServerResponseCache NOTIFY serverResponseCacheChanged)
+    Q_PROPERTY(int serverResponseCacheSize READ serverResponseCacheSize WRITE setServerResponseCacheSize NOTIFY serverResponseCacheSizeChanged)
+    Q_PROPERTY(bool serverResponseCacheOnDisk READ serverResponseCacheOnDisk WRITE setServerResponseCacheOnDisk NOTIFY serverResponseCacheOnDiskChanged)
+    Q_PROPERTY(bool serverMirrorToChat READ serverMirrorToChat WRITE setServerMirrorToChat NOTIFY serverMirrorToChatChanged)
+    Q_PROPERTY(int serverRequestTimeout READ serverRequestTimeout WRITE setServerRequestTimeout NOTIFY serverRequestTimeoutChanged)
     Q_PROPERTY(SuggestionMode suggestionMode READ suggestionMode WRITE setSuggestionMode NOTIFY suggestionModeChanged)
     Q_PROPERTY(QStringList uiLanguages MEMBER m_uiLanguages CONSTANT)
 
@@ -93,6 +103,10 @@ public:
 
     Q_INVOKABLE static QVariant checkJinjaTemplateError(const QString &tmpl);
 
+    // Overrides a setting for the lifetime of this process, without saving it. Used by the headless server, which is
+    // configured on the command line.
+    void setOverride(const QString &name, const QVariant &value);
+
     // Restore methods
     Q_INVOKABLE void restoreModelDefaults(const ModelInfo &info);
     Q_INVOKABLE void restoreApplicationDefaults();
@@ -205,6 +219,8 @@ public:
     void setLocalDocsNomicAPIKey(const QString &value);
     QString localDocsEmbedDevice() const;
     void setLocalDocsEmbedDevice(const QString &value);
+    int localDocsEmbeddingCacheSize() const; // in embeddings of queries and API requests, 0 to disable
+    void setLocalDocsEmbeddingCacheSize(int value);
 
     // Network settings
     QString networkAttribution() const;
@@ -218,6 +234,24 @@ public:
     int networkPort() const;
     void setNetworkPort(int value);
 
+    // API server settings
+    QString serverListenAddress() const;
+    void setServerListenAddress(const QString &value);
+    int serverConcurrency() const; // number of requests generated at once, each with its own copy of the model
+    void setServerConcurrency(int value);
+    int serverMaxQueueDepth() const;
+    void setServerMaxQueueDepth(int value);
+    int serverRequestTimeout() const; // in seconds, 0 for no limit
+    void setServerRequestTimeout(int value);
+    bool serverMirrorToChat() const; // show API requests in the server chat
+    void setServerMirrorToChat(bool value);
+    bool serverResponseCache() const; // reuse responses to identical requests at temperature 0
+    void setServerResponseCache(bool value);
+    int serverResponseCacheSize() const; // in responses kept in memory
+    void setServerResponseCacheSize(int value);
+    bool serverResponseCacheOnDisk() const;
+    void setServerResponseCacheOnDisk(bool value);
+
 Q_SIGNALS:
     void nameChanged(const ModelInfo &info);
     void filenameChanged(const ModelInfo &info);
@@ -252,10 +286,19 @@ Q_SIGNALS:
     void localDocsUseRemoteEmbedChanged();
     void localDocsNomicAPIKeyChanged();
     void localDocsEmbedDeviceChanged();
+    void localDocsEmbeddingCacheSizeChanged();
     void networkAttributionChanged();
     void networkIsActiveChanged();
     void networkPortChanged();
     void networkUsageStatsActiveChanged();
+    void serverListenAddressChanged();
+    void serverConcurrencyChanged();
+    void serverMaxQueueDepthChanged();
+    void serverRequestTimeoutChanged();
+    void serverMirrorToChatChanged();
+    void serverResponseCacheChanged();
+    void serverResponseCacheSizeChanged();
+    void serverResponseCacheOnDiskChanged();
     void attemptModelLoadChanged();
     void deviceChanged();
     void suggestionModeChanged();
@@ -287,6 +330,7 @@ private:
 
 private:
     QSettings m_settings;
+    QHash<QString, QVariant> m_overrides;
     bool m_forceMetal;
     const QStringList m_deviceList;
     const QStringList m_embeddingsDeviceList;
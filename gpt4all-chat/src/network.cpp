@@ -193,7 +193,8 @@ bool Network::packageAndSendJson(const QString &ingestId, const QString &json)
     }
 
     auto *currentChat = ChatListModel::globalInstance()->currentChat();
-    Q_ASSERT(currentChat);
+    if (!currentChat)
+        return false; // gpt4all-server has no chats
     auto modelInfo = currentChat->modelInfo();
 
     Q_ASSERT(doc.isObject());
@@ -227,7 +228,7 @@ bool Network::packageAndSendJson(const QString &ingestId, const QString &json)
     QByteArray body(newDoc.toJson(QJsonDocument::Compact));
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QNetworkReply *jsonReply = m_networkManager.post(request, body);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, jsonReply, &QNetworkReply::abort);
     connect(jsonReply, &QNetworkReply::finished, this, &Network::handleJsonUploadFinished);
     m_activeUploads.append(jsonReply);
     return true;
@@ -324,8 +325,7 @@ void Network::sendStartup()
     // only chance to enable usage stats is at the start of a new session
     m_sendUsageStats = true;
 
-    const auto *display = QGuiApplication::primaryScreen();
-    trackEvent("startup", {
+    QVariantMap props {
         // Build info
         { "build_compiler",     COMPILER_NAME                                                         },
         { "build_compiler_ver", COMPILER_VER                                                          },
@@ -349,14 +349,18 @@ void Network::sendStartup()
 #ifdef Q_OS_MAC
         { "sys_hw_model",       getSysctl("hw.model").value_or(u"(unknown)"_s)                        },
 #endif
-        { "$screen_dpi",        std::round(display->physicalDotsPerInch())                            },
-        { "display",            u"%1x%2"_s.arg(display->size().width()).arg(display->size().height()) },
         { "ram",                LLM::globalInstance()->systemTotalRAMInGB()                           },
         { "cpu",                getCPUModel()                                                         },
         { "cpu_supports_avx2",  LLModel::Implementation::cpuSupportsAVX2()                            },
         // Datalake status
         { "datalake_active",    mySettings->networkIsActive()                                         },
-    });
+    };
+    // gpt4all-server runs without a QGuiApplication, and so without screens
+    if (const auto *display = qGuiApp ? QGuiApplication::primaryScreen() : nullptr) {
+        props.insert("$screen_dpi", std::round(display->physicalDotsPerInch()));
+        props.insert("display", u"%1x%2"_s.arg(display->size().width()).arg(display->size().height()));
+    }
+    trackEvent("startup", props);
     sendIpify();
 
     // mirror opt-out logic so the ratio can be used to infer totals
@@ -369,7 +373,8 @@ void Network::sendStartup()
 void Network::trackChatEvent(const QString &ev, QVariantMap props)
 {
     auto *curChat = ChatListModel::globalInstance()->currentChat();
-    Q_ASSERT(curChat);
+    if (!curChat)
+        return; // gpt4all-server has no chats
     if (!props.contains("model"))
         props.insert("model", curChat->modelInfo().filename());
     props.insert("device_backend", curChat->deviceBackend());
@@ -432,7 +437,7 @@ void Network::sendIpify()
     conf.setPeerVerifyMode(QSslSocket::VerifyNone);
     request.setSslConfiguration(conf);
     QNetworkReply *reply = m_networkManager.get(request);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, reply, &QNetworkReply::abort);
     connect(reply, &QNetworkReply::finished, this, &Network::handleIpifyFinished);
 }
 
@@ -445,7 +450,7 @@ void Network::sendMixpanel(const QByteArray &json)
     request.setSslConfiguration(conf);
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
     QNetworkReply *trackReply = m_networkManager.post(request, json);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, trackReply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, trackReply, &QNetworkReply::abort);
     connect(trackReply, &QNetworkReply::finished, this, &Network::handleMixpanelFinished);
 }
 
@@ -517,7 +522,7 @@ void Network::sendHealth()
     conf.setPeerVerifyMode(QSslSocket::VerifyNone);
     request.setSslConfiguration(conf);
     QNetworkReply *healthReply = m_networkManager.get(request);
-    connect(qGuiApp, &QCoreApplication::aboutToQuit, healthReply, &QNetworkReply::abort);
+    connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit, healthReply, &QNetworkReply::abort);
     connect(healthReply, &QNetworkReply::finished, this, &Network::handleHealthFinished);
 }
 
@@ -0,0 +1,142 @@
+#include "responsecache.h"
+
+#include "mysettings.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QGlobalStatic>
+#include <QIODevice>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QJsonValue>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtLogging>
+#include <QtTypes>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// the disk tier holds this many times as many entries as memory
+static constexpr int DISK_ENTRIES_PER_MEMORY_ENTRY = 64;
+// how many entries are written between scans for old ones to delete
+static constexpr int DISK_PRUNE_INTERVAL = 64;
+
+class MyResponseCache : public ResponseCache { };
+Q_GLOBAL_STATIC(MyResponseCache, responseCacheInstance)
+ResponseCache *ResponseCache::globalInstance()
+{
+    return responseCacheInstance();
+}
+
+auto ResponseCache::find(const QByteArray &key) -> std::optional<Entry>
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (auto it = m_index.constFind(key); it != m_index.constEnd()) {
+            m_lru.splice(m_lru.begin(), m_lru, *it);
+            return m_lru.front().second;
+        }
+    }
+
+    if (!MySettings::globalInstance()->serverResponseCacheOnDisk())
+        return std::nullopt;
+    auto entry = readFromDisk(key);
+    if (entry) {
+        QMutexLocker locker(&m_mutex);
+        insertInMemory(key, *entry);
+    }
+    return entry;
+}
+
+void ResponseCache::insert(const QByteArray &key, const Entry &entry)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        insertInMemory(key, entry);
+    }
+    if (MySettings::globalInstance()->serverResponseCacheOnDisk())
+        writeToDisk(key, entry);
+}
+
+void ResponseCache::insertInMemory(const QByteArray &key, const Entry &entry)
+{
+    if (auto it = m_index.constFind(key); it != m_index.constEnd()) {
+        m_lru.erase(*it);
+        m_index.erase(it);
+    }
+    m_lru.emplace_front(key, entry);
+    m_index.insert(key, m_lru.begin());
+
+    const qsizetype capacity = MySettings::globalInstance()->serverResponseCacheSize();
+    while (m_index.size() > capacity) {
+        m_index.remove(m_lru.back().first);
+        m_lru.pop_back();
+    }
+}
+
+QString ResponseCache::diskPath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + u"/server-responses"_s;
+}
+
+auto ResponseCache::readFromDisk(const QByteArray &key) -> std::optional<Entry>
+{
+    QFile file(u"%1/%2.json"_s.arg(diskPath(), QString::fromLatin1(key.toHex())));
+    if (!file.open(QIODevice::ReadOnly))
+        return std::nullopt; // not cached
+
+    QJsonParseError err;
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &err);
+    if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+        qWarning() << "ResponseCache: ignoring corrupt entry" << file.fileName();
+        return std::nullopt;
+    }
+
+    QJsonObject obj = doc.object();
+    Entry entry { .promptTokens = obj["promptTokens"].toInt() };
+    for (const QJsonValue &choice : obj["choices"].toArray()) {
+        entry.choices << Choice {
+            .text           = choice["text"].toString(),
+            .responseTokens = choice["responseTokens"].toInt(),
+        };
+    }
+    return entry;
+}
+
+void ResponseCache::writeToDisk(const QByteArray &key, const Entry &entry)
+{
+    QDir dir(diskPath());
+    if (!dir.mkpath(u"."_s)) {
+        qWarning() << "ResponseCache: failed to create" << dir.path();
+        return;
+    }
+
+    QJsonArray choices;
+    for (auto &choice : entry.choices)
+        choices << QJsonObject { { "text", choice.text }, { "responseTokens", choice.responseTokens } };
+    QJsonObject obj { { "promptTokens", entry.promptTokens }, { "choices", choices } };
+
+    // written atomically, as other workers may be reading the same entry
+    QSaveFile file(dir.filePath(QString::fromLatin1(key.toHex()) + u".json"_s));
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(obj).toJson(QJsonDocument::Compact)) < 0
+        || !file.commit()) {
+        qWarning() << "ResponseCache: failed to write" << file.fileName() << file.errorString();
+        return;
+    }
+
+    if (++m_diskWrites % DISK_PRUNE_INTERVAL)
+        return;
+
+    // delete the oldest entries beyond the limit
+    const qsizetype limit = qsizetype(MySettings::globalInstance()->serverResponseCacheSize())
+                          * DISK_ENTRIES_PER_MEMORY_ENTRY;
+    const QFileInfoList entries = dir.entryInfoList({ u"*.json"_s }, QDir::Files, QDir::Time);
+    for (qsizetype i = limit; i < entries.size(); i++)
+        QFile::remove(entries[i].filePath());
+}
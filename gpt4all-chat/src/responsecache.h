@@ -0,0 +1,58 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+#include <atomic>
+#include <list>
+#include <optional>
+#include <utility>
+
+
+// An exact-match cache of API server responses, for requests whose response does not depend on chance. The most
+// recently used entries are kept in memory, and optionally on disk so that they survive a restart. Thread-safe.
+class ResponseCache
+{
+public:
+    struct Choice {
+        QString text;
+        int     responseTokens;
+    };
+
+    struct Entry {
+        int           promptTokens = 0;
+        QList<Choice> choices;
+    };
+
+    static ResponseCache *globalInstance();
+
+    // Keys are opaque, see ServerWorker::responseCacheKey. They identify the model file and the rendered prompt, so
+    // changing either of them, or the chat template, means that the old entries are never found again.
+    std::optional<Entry> find(const QByteArray &key);
+    void insert(const QByteArray &key, const Entry &entry);
+
+private:
+    using LruList = std::list<std::pair<QByteArray, Entry>>; // most recently used first
+
+    ResponseCache() = default;
+    ~ResponseCache() = default;
+
+    void insertInMemory(const QByteArray &key, const Entry &entry);
+
+    static QString diskPath();
+    static std::optional<Entry> readFromDisk(const QByteArray &key);
+    void writeToDisk(const QByteArray &key, const Entry &entry);
+
+    QMutex                                 m_mutex;
+    LruList                                m_lru;
+    QHash<QByteArray, LruList::iterator>   m_index;
+    std::atomic<int>                       m_diskWrites = 0; // since the disk tier was last pruned
+
+    friend class MyResponseCache;
+};
+
+#endif // RESPONSECACHE_H
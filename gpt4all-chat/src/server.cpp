@@ -2,43 +2,71 @@
 
 #include "chat.h"
 #include "chatmodel.h"
+#include "embeddingbatcher.h"
+#include "embllm.h"
 #include "modellist.h"
 #include "mysettings.h"
+#include "responsecache.h"
+#include "servermetrics.h"
 #include "utils.h" // IWYU pragma: keep
 
 #include <fmt/format.h>
 #include <gpt4all-backend/llmodel.h>
 
+#include <QAbstractSocket>
 #include <QByteArray>
+#include <QByteArrayView>
 #include <QCborArray>
 #include <QCborMap>
 #include <QCborValue>
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
 #include <QHostAddress>
 #include <QHttpHeaders>
 #include <QHttpServer>
 #include <QHttpServerRequest>
 #include <QHttpServerResponder>
+#include <QIODevice>
+#include <QIODeviceBase>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QJsonParseError>
 #include <QJsonValue>
 #include <QLatin1StringView>
+#include <QMetaObject>
 #include <QPair> // IWYU pragma: keep
+#include <QRegularExpression>
+#include <QRegularExpressionMatch>
+#include <QSet>
+#include <QStringList>
 #include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUuid>
 #include <QVariant>
 #include <Qt>
 #include <QtAssert>
 #include <QtCborCommon>
+#include <QtEndian>
 #include <QtLogging>
 #include <QtMinMax>
 #include <QtPreprocessorSupport>
 #include <QtTypes>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <span>
 #include <stdexcept>
@@ -51,6 +79,7 @@
 
 using namespace std::string_literals;
 using namespace Qt::Literals::StringLiterals;
+namespace ranges = std::ranges;
 
 //#define DEBUG
 
@@ -122,86 +151,202 @@ static inline QJsonObject resultToJson(const ResultInfo &info)
     return result;
 }
 
-class BaseCompletionRequest {
+static void addCorsHeader(QHttpServerResponse &resp)
+{
+    auto headers = resp.headers();
+    headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
+    resp.setHeaders(std::move(headers));
+}
+
+// Owns the responder of a request that is being handled on the LLM thread. It lives on the HTTP thread, and all of
+// its methods may be called from the LLM thread - they are forwarded to the HTTP thread in order.
+class ServerReply : public QObject {
 public:
-    QString model; // required
-    // NB: some parameters are not supported yet
-    int32_t max_tokens = 16;
-    qint64 n = 1;
-    float temperature = 1.f;
-    float top_p = 1.f;
-    float min_p = 0.f;
+    ServerReply(const QString &endpoint, QHttpServerResponder &&responder, QObject *parent)
+        : QObject(parent), m_responder(std::move(responder)), m_endpoint(endpoint)
+    { m_received.start(); }
+
+    // for a request of a batch, whose response is written to the batch's output file rather than sent
+    ServerReply(const QString &endpoint, QObject *parent)
+        : QObject(parent), m_endpoint(endpoint)
+    { m_received.start(); }
+
+    bool isStreaming() const { return m_streaming; }
 
-    BaseCompletionRequest() = default;
-    virtual ~BaseCompletionRequest() = default;
+    const QString &endpoint() const { return m_endpoint; }
+    double secondsSinceReceived() const { return m_received.nsecsElapsed() / 1e9; }
 
-    virtual BaseCompletionRequest &parse(QCborMap request)
+    // labels the request in the metrics once the model is known
+    void setModel(const QString &model)
+    { QMetaObject::invokeMethod(this, [this, model] { m_model = model; }); }
+
+    // set when the client disconnects or the request times out, so that the worker stops generating for it
+    void cancel() { m_cancelled = true; }
+    bool isCancelled() const { return m_cancelled; }
+
+    void beginStream()
     {
-        parseImpl(request);
-        if (!request.isEmpty())
-            throw InvalidRequestError(fmt::format(
-                "Unrecognized request argument supplied: {}", request.keys().constFirst().toString()
-            ));
-        return *this;
+        Q_ASSERT(!m_streaming && m_responder);
+        m_streaming = true;
+        QMetaObject::invokeMethod(this, [this] {
+            QHttpHeaders headers;
+            headers.append(QHttpHeaders::WellKnownHeader::ContentType,  "text/event-stream"_L1);
+            headers.append(QHttpHeaders::WellKnownHeader::CacheControl, "no-cache"_L1);
+            headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
+            m_responder->writeBeginChunked(headers);
+        });
     }
 
-protected:
-    virtual void parseImpl(QCborMap &request)
+    void sendEvent(const QJsonObject &event)
     {
-        using enum Type;
-
-        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
-        QCborValue value;
+        Q_ASSERT(m_streaming);
+        QByteArray data = "data: "_ba + QJsonDocument(event).toJson(QJsonDocument::Compact) + "\n\n"_ba;
+        QMetaObject::invokeMethod(this, [this, data] { m_responder->writeChunk(data); });
+    }
 
-        this->model = reqValue("model", String, /*required*/ true).toString();
+    // Completes the request. A stream is terminated and the response is not sent, as any error has already been sent
+    // as an event, but its status is still what the request is recorded with.
+    void finish(QHttpServerResponse &&response)
+    {
+        if (m_streaming) {
+            QMetaObject::invokeMethod(this, [this, status = int(response.statusCode())] {
+                m_responder->writeEndChunked("data: [DONE]\n\n"_ba);
+                recordRequest(status);
+                deleteLater();
+            });
+            return;
+        }
+        auto resp = std::make_shared<QHttpServerResponse>(std::move(response));
+        QMetaObject::invokeMethod(this, [this, resp] {
+            if (m_responder) {
+                addCorsHeader(*resp);
+                m_responder->sendResponse(*resp);
+            }
+            recordRequest(int(resp->statusCode()));
+            deleteLater();
+        });
+    }
 
-        value = reqValue("frequency_penalty", Number, false, /*min*/ -2, /*max*/ 2);
-        if (value.isDouble() || value.toInteger() != 0)
-            throw InvalidRequestError("'frequency_penalty' is not supported");
+    // Completes a request whose client has disconnected, without sending anything.
+    void abandon()
+    {
+        QMetaObject::invokeMethod(this, [this] {
+            recordRequest(499); // nginx's "client closed request"
+            deleteLater();
+        });
+    }
 
-        value = reqValue("max_tokens", Integer, false, /*min*/ 1);
-        if (!value.isNull())
-            this->max_tokens = int32_t(qMin(value.toInteger(), INT32_MAX));
+private:
+    void recordRequest(int status)
+    { ServerMetrics::globalInstance()->observeRequest(m_endpoint, m_model, status, secondsSinceReceived()); }
+
+    std::optional<QHttpServerResponder> m_responder;
+    bool                                m_streaming = false; // only accessed by the LLM thread
+    const QString                       m_endpoint;
+    QString                             m_model;             // only accessed by the HTTP thread
+    QElapsedTimer                       m_received;
+    std::atomic<bool>                   m_cancelled = false;
+};
 
-        value = reqValue("n", Integer, false, /*min*/ 1);
-        if (!value.isNull())
-            this->n = value.toInteger();
+// Keeps track of the open connections, so that a request can be cancelled if its client disconnects.
+// QHttpServerRequest does not expose its socket, so a connection is found by the client's address and port.
+class ConnectionTracker : public QTcpServer {
+public:
+    using QTcpServer::QTcpServer;
 
-        value = reqValue("presence_penalty", Number);
-        if (value.isDouble() || value.toInteger() != 0)
-            throw InvalidRequestError("'presence_penalty' is not supported");
+    QTcpSocket *connection(const QHostAddress &address, quint16 port) const
+    { return m_connections.value({ address, port }); }
 
-        value = reqValue("seed", Integer);
-        if (!value.isNull())
-            throw InvalidRequestError("'seed' is not supported");
+protected:
+    void incomingConnection(qintptr handle) override
+    {
+        auto *socket = new QTcpSocket(this);
+        if (!socket->setSocketDescriptor(handle)) {
+            delete socket;
+            return;
+        }
+        std::pair key(socket->peerAddress(), socket->peerPort());
+        m_connections.insert(key, socket);
+        connect(socket, &QObject::destroyed, this, [this, key, socket] {
+            if (m_connections.value(key) == socket) // the port may have been reused already
+                m_connections.remove(key);
+        });
+        addPendingConnection(socket);
+    }
 
-        value = reqValue("stop");
-        if (!value.isNull())
-            throw InvalidRequestError("'stop' is not supported");
+private:
+    QHash<std::pair<QHostAddress, quint16>, QTcpSocket *> m_connections;
+};
 
-        value = reqValue("stream", Boolean);
-        if (value.isTrue())
-            throw InvalidRequestError("'stream' is not supported");
+// Returns the length of the longest prefix of s that does not end with an incomplete UTF-8 sequence.
+static qsizetype completeUtf8Length(QByteArrayView s)
+{
+    for (qsizetype i = s.size() - 1; i >= 0 && s.size() - i <= 4; i--) {
+        auto c = uchar(s[i]);
+        if ((c & 0xC0) == 0x80)
+            continue; // continuation byte
+        qsizetype seqLen = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return s.size() - i >= seqLen ? s.size() : i;
+    }
+    return s.size();
+}
 
-        value = reqValue("stream_options", Object);
-        if (!value.isNull())
-            throw InvalidRequestError("'stream_options' is not supported");
+// Returns a callback that sends the response to the client as it is generated. Tokens may end partway through a
+// multi-byte character, so text is held back until it ends on a character boundary.
+static auto makeStreamCallback(ServerReply *reply, std::function<QJsonObject(const QString &text)> makeChunk)
+    -> ChatLLM::ResponseChunkCallback
+{
+    return [reply, makeChunk = std::move(makeChunk), pending = QByteArray()](std::string_view piece) mutable {
+        pending.append(piece.data(), piece.size());
+        if (qsizetype len = completeUtf8Length(pending)) {
+            reply->sendEvent(makeChunk(QString::fromUtf8(pending.first(len))));
+            pending.remove(0, len);
+        }
+    };
+}
 
-        value = reqValue("temperature", Number, false, /*min*/ 0, /*max*/ 2);
-        if (!value.isNull())
-            this->temperature = float(value.toDouble());
+// Records the time to the first token of the response in the metrics, then passes the chunks on.
+static auto timeFirstChunk(ServerReply *reply, const QString &model, ChatLLM::ResponseChunkCallback onChunk)
+    -> ChatLLM::ResponseChunkCallback
+{
+    return [reply, model, onChunk = std::move(onChunk), first = true](std::string_view piece) mutable {
+        if (std::exchange(first, false)) {
+            ServerMetrics::globalInstance()->observeTimeToFirstToken(reply->endpoint(), model,
+                                                                     reply->secondsSinceReceived());
+        }
+        if (onChunk)
+            onChunk(piece);
+    };
+}
 
-        value = reqValue("top_p", Number, false, /*min*/ 0, /*max*/ 1);
-        if (!value.isNull())
-            this->top_p = float(value.toDouble());
+static QJsonObject streamErrorEvent(const char *message)
+{
+    return QJsonObject {{ "error", QJsonObject {
+        { "message", message          },
+        { "type",    u"server_error"_s },
+        { "param",   QJsonValue::Null },
+        { "code",    QJsonValue::Null },
+    }}};
+}
 
-        value = reqValue("min_p", Number, false, /*min*/ 0, /*max*/ 1);
-        if (!value.isNull())
-            this->min_p = float(value.toDouble());
+class BaseRequest {
+public:
+    BaseRequest() = default;
+    virtual ~BaseRequest() = default;
 
-        reqValue("user", String); // validate but don't use
+    virtual BaseRequest &parse(QCborMap request)
+    {
+        parseImpl(request);
+        if (!request.isEmpty())
+            throw InvalidRequestError(fmt::format(
+                "Unrecognized request argument supplied: {}", request.keys().constFirst().toString()
+            ));
+        return *this;
     }
 
+protected:
+    virtual void parseImpl(QCborMap &request) = 0;
+
     enum class Type : uint8_t {
         Boolean,
         Integer,
@@ -249,7 +394,102 @@ protected:
     }
 
 private:
-    Q_DISABLE_COPY_MOVE(BaseCompletionRequest)
+    Q_DISABLE_COPY_MOVE(BaseRequest)
+};
+
+const std::unordered_map<BaseRequest::Type, const char *> BaseRequest::s_typeNames = {
+    { BaseRequest::Type::Boolean, "boolean" },
+    { BaseRequest::Type::Integer, "integer" },
+    { BaseRequest::Type::Number,  "number"  },
+    { BaseRequest::Type::String,  "string"  },
+    { BaseRequest::Type::Array,   "array"   },
+    { BaseRequest::Type::Object,  "object"  },
+};
+
+class BaseCompletionRequest : public BaseRequest {
+public:
+    QString model; // required
+    // NB: some parameters are not supported yet
+    int32_t max_tokens = 16;
+    qint64 n = 1;
+    float temperature = 1.f;
+    float top_p = 1.f;
+    float min_p = 0.f;
+    bool stream = false;
+    bool include_usage = false; // from stream_options
+
+    BaseCompletionRequest &parse(QCborMap request) override
+    {
+        BaseRequest::parse(std::move(request));
+        return *this;
+    }
+
+protected:
+    void parseImpl(QCborMap &request) override
+    {
+        using enum Type;
+
+        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
+        QCborValue value;
+
+        this->model = reqValue("model", String, /*required*/ true).toString();
+
+        value = reqValue("frequency_penalty", Number, false, /*min*/ -2, /*max*/ 2);
+        if (value.isDouble() || value.toInteger() != 0)
+            throw InvalidRequestError("'frequency_penalty' is not supported");
+
+        value = reqValue("max_tokens", Integer, false, /*min*/ 1);
+        if (!value.isNull())
+            this->max_tokens = int32_t(qMin(value.toInteger(), INT32_MAX));
+
+        value = reqValue("n", Integer, false, /*min*/ 1);
+        if (!value.isNull())
+            this->n = value.toInteger();
+
+        value = reqValue("presence_penalty", Number);
+        if (value.isDouble() || value.toInteger() != 0)
+            throw InvalidRequestError("'presence_penalty' is not supported");
+
+        value = reqValue("seed", Integer);
+        if (!value.isNull())
+            throw InvalidRequestError("'seed' is not supported");
+
+        value = reqValue("stop");
+        if (!value.isNull())
+            throw InvalidRequestError("'stop' is not supported");
+
+        value = reqValue("stream", Boolean);
+        if (value.isBool())
+            this->stream = value.toBool();
+
+        value = reqValue("stream_options", Object);
+        if (!value.isNull()) {
+            if (!this->stream)
+                throw InvalidRequestError("The 'stream_options' parameter is only allowed when 'stream' is enabled.");
+            QCborMap options = value.toMap();
+            value = takeValue(options, "include_usage", Boolean);
+            if (value.isBool())
+                this->include_usage = value.toBool();
+            if (!options.isEmpty())
+                throw InvalidRequestError(fmt::format(
+                    "Unrecognized stream_options argument supplied: {}", options.keys().constFirst().toString()
+                ));
+        }
+
+        value = reqValue("temperature", Number, false, /*min*/ 0, /*max*/ 2);
+        if (!value.isNull())
+            this->temperature = float(value.toDouble());
+
+        value = reqValue("top_p", Number, false, /*min*/ 0, /*max*/ 1);
+        if (!value.isNull())
+            this->top_p = float(value.toDouble());
+
+        value = reqValue("min_p", Number, false, /*min*/ 0, /*max*/ 1);
+        if (!value.isNull())
+            this->min_p = float(value.toDouble());
+
+        reqValue("user", String); // validate but don't use
+    }
 };
 
 class CompletionRequest : public BaseCompletionRequest {
@@ -309,15 +549,6 @@ protected:
     }
 };
 
-const std::unordered_map<BaseCompletionRequest::Type, const char *> BaseCompletionRequest::s_typeNames = {
-    { BaseCompletionRequest::Type::Boolean, "boolean" },
-    { BaseCompletionRequest::Type::Integer, "integer" },
-    { BaseCompletionRequest::Type::Number,  "number"  },
-    { BaseCompletionRequest::Type::String,  "string"  },
-    { BaseCompletionRequest::Type::Array,   "array"   },
-    { BaseCompletionRequest::Type::Object,  "object"  },
-};
-
 class ChatRequest : public BaseCompletionRequest {
 public:
     struct Message {
@@ -427,6 +658,117 @@ protected:
     }
 };
 
+class EmbeddingRequest : public BaseRequest {
+public:
+    QString     model;           // required
+    QStringList input;           // required
+    int         dimensions = -1; // -1 for the model's own size
+    bool        base64     = false;
+
+    EmbeddingRequest &parse(QCborMap request) override
+    {
+        BaseRequest::parse(std::move(request));
+        return *this;
+    }
+
+protected:
+    void parseImpl(QCborMap &request) override
+    {
+        using enum Type;
+
+        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
+        QCborValue value;
+
+        this->model = reqValue("model", String, /*required*/ true).toString();
+
+        value = reqValue("input", std::nullopt, /*required*/ true);
+        this->input.clear();
+        if (value.isString()) {
+            this->input << value.toString();
+        } else if (value.isArray() && !value.toArray().isEmpty()) {
+            QCborArray arr = value.toArray();
+            for (qsizetype i = 0; i < arr.size(); i++) {
+                if (!arr[i].isString())
+                    throw InvalidRequestError(fmt::format(
+                        "Invalid type for 'input[{}]': expected a string, but got '{}' instead.",
+                        i, arr[i].toVariant()
+                    ));
+                this->input << arr[i].toString();
+            }
+        } else {
+            throw InvalidRequestError(fmt::format(
+                "Invalid type for 'input': expected a string or a non-empty array of strings, but got '{}' instead.",
+                value.toVariant()
+            ));
+        }
+        if (this->input.size() > 2048)
+            throw InvalidRequestError(fmt::format(
+                "Invalid 'input': array too long. Expected an array with maximum length 2048, but got an array with "
+                "length {} instead.", this->input.size()
+            ));
+
+        value = reqValue("dimensions", Integer, false, /*min*/ 1);
+        if (!value.isNull())
+            this->dimensions = int(qMin(value.toInteger(), INT32_MAX));
+
+        value = reqValue("encoding_format", String);
+        if (!value.isNull()) {
+            QString format = value.toString();
+            if (format == u"base64"_s) {
+                this->base64 = true;
+            } else if (format != u"float"_s) {
+                throw InvalidRequestError(fmt::format(
+                    "Invalid value for 'encoding_format': expected one of 'float' or 'base64', but got '{}' instead.",
+                    format.toStdString()
+                ));
+            }
+        }
+
+        reqValue("user", String); // validate but don't use
+    }
+};
+
+class BatchRequest : public BaseRequest {
+public:
+    QString     input_file_id; // required
+    QString     endpoint;      // required
+    QJsonObject metadata;
+
+    BatchRequest &parse(QCborMap request) override
+    {
+        BaseRequest::parse(std::move(request));
+        return *this;
+    }
+
+protected:
+    void parseImpl(QCborMap &request) override
+    {
+        using enum Type;
+
+        auto reqValue = [&request](auto &&...args) { return takeValue(request, args...); };
+        QCborValue value;
+
+        this->input_file_id = reqValue("input_file_id", String, /*required*/ true).toString();
+
+        this->endpoint = reqValue("endpoint", String, /*required*/ true).toString();
+        if (this->endpoint != u"/v1/completions"_s && this->endpoint != u"/v1/chat/completions"_s)
+            throw InvalidRequestError(fmt::format(
+                "Invalid value for 'endpoint': expected one of '/v1/completions' or '/v1/chat/completions', but got "
+                "'{}' instead.", this->endpoint.toStdString()
+            ));
+
+        QString window = reqValue("completion_window", String, /*required*/ true).toString();
+        if (window != u"24h"_s)
+            throw InvalidRequestError(fmt::format(
+                "Invalid value for 'completion_window': expected '24h', but got '{}' instead.", window.toStdString()
+            ));
+
+        value = reqValue("metadata", Object);
+        if (!value.isNull())
+            this->metadata = value.toJsonValue().toObject();
+    }
+};
+
 template <typename T>
 T &parseRequest(T &request, QJsonObject &&obj)
 {
@@ -434,45 +776,262 @@ T &parseRequest(T &request, QJsonObject &&obj)
     return request.parse(QCborMap::fromJsonObject(obj));
 }
 
-Server::Server(Chat *chat)
-    : ChatLLM(chat, true /*isServer*/)
-    , m_chat(chat)
+ServerWorker::ServerWorker(Chat *chat, ChatModel *mirrorModel)
+    : ChatLLM(chat, nullptr, true /*isServer*/)
+    , m_mirrorModel(mirrorModel)
 {
-    connect(this, &Server::threadStarted, this, &Server::start);
-    connect(this, &Server::databaseResultsChanged, this, &Server::handleDatabaseResultsChanged);
-    connect(chat, &Chat::collectionListChanged, this, &Server::handleCollectionListChanged, Qt::QueuedConnection);
+    connect(this, &ServerWorker::databaseResultsChanged, this, &ServerWorker::handleDatabaseResultsChanged);
 }
 
-static QJsonObject requestFromJson(const QByteArray &request)
+ServerWorker::~ServerWorker()
 {
-    QJsonParseError err;
-    const QJsonDocument document = QJsonDocument::fromJson(request, &err);
-    if (err.error || !document.isObject())
-        throw InvalidRequestError(fmt::format(
-            "error parsing request JSON: {}",
-            err.error ? err.errorString().toStdString() : "not an object"s
-        ));
-    return document.object();
+    destroy();
+    ServerMetrics::globalInstance()->setLoadedModel(this, {}, 0);
 }
 
-void Server::start()
+bool ServerWorker::loadRequestedModel(const ModelInfo &modelInfo)
 {
-    m_server = std::make_unique<QHttpServer>(this);
-    auto *tcpServer = new QTcpServer(m_server.get());
+    auto *metrics = ServerMetrics::globalInstance();
 
-    auto port = MySettings::globalInstance()->networkPort();
-    if (!tcpServer->listen(QHostAddress::LocalHost, port)) {
-        qWarning() << "Server ERROR: Failed to listen on port" << port;
-        return;
+    // NB: this is a no-op if the model is already loaded, so the KV cache carries over between requests
+    bool alreadyLoaded = isModelLoaded() && this->modelInfo() == modelInfo;
+    QElapsedTimer timer;
+    timer.start();
+    if (!loadModel(modelInfo)) {
+        metrics->setLoadedModel(this, {}, 0);
+        return false;
     }
-    if (!m_server->bind(tcpServer)) {
-        qWarning() << "Server ERROR: Failed to HTTP server to socket" << port;
-        return;
+
+    if (!alreadyLoaded) {
+        metrics->observeModelLoad(modelInfo.name(), timer.nsecsElapsed() / 1e9);
+        metrics->setLoadedModel(this, modelInfo.name(), QFileInfo(modelInfo.dirpath + modelInfo.filename()).size());
+    }
+    return true;
+}
+
+bool ServerWorker::startMirroring()
+{
+    // The GUI's chat model keeps every request it is shown, so long-running servers may want this off.
+    bool mirror = m_mirrorModel && MySettings::globalInstance()->serverMirrorToChat();
+    m_chatModel = mirror ? m_mirrorModel : nullptr;
+    if (mirror) {
+        emit requestResetResponseState(); // blocks
+        qsizetype prevMsgIndex = m_chatModel->count() - 1;
+        if (prevMsgIndex >= 0)
+            m_chatModel->updateCurrentResponse(prevMsgIndex, false);
+    }
+    return mirror;
+}
+
+// A request waiting for, or running on, a worker.
+struct Server::Job {
+    QString                                                  client; // remote address, for fair scheduling
+    QString                                                  model;  // as requested, for worker affinity
+    ServerReply                                             *reply;
+    std::function<QHttpServerResponse(ServerWorker *worker)> run; // called on the worker's thread
+    ServerWorker                                            *worker = nullptr; // while running
+    std::atomic<bool>                                        timedOut = false;
+    std::atomic<bool>                                        disconnected = false;
+    bool                                                     background = false; // runs when nothing else waits
+    std::function<void()>                                    done; // called on the HTTP thread after it has run
+};
+
+// A batch that is being run. Its requests are sorted so that those sharing a prompt prefix are next to each other,
+// then split into lanes that each run one request at a time. Each request of a lane goes to the worker that ran the
+// previous one, which can reuse their common prefix from its KV cache.
+struct Server::BatchRun {
+    struct Item {
+        QString                            customId;
+        std::shared_ptr<CompletionRequest> completion; // one of these is set
+        std::shared_ptr<ChatRequest>       chat;
+    };
+
+    struct Lane {
+        QList<Item>          items; // in reverse order, so the next one is taken from the back
+        std::shared_ptr<Job> job;   // while one is queued or running
+    };
+
+    struct Result {
+        int         status    = 0;
+        QJsonObject body;
+        bool        cancelled = false;
+    };
+
+    QJsonObject batch; // as seen by the client
+    QList<Lane> lanes;
+    QFile       output;
+    QFile       errors;
+    bool        cancelling = false;
+
+    // writes a request's response to the output file, or the error file if it failed
+    void addResult(const QString &customId, const Result &result)
+    {
+        bool ok = result.status >= 200 && result.status < 300;
+        QJsonObject line {
+            { "id",        u"batch_req_"_s + QString::fromLatin1(QUuid::createUuid().toByteArray(QUuid::Id128)) },
+            { "custom_id", customId         },
+            { "response",  QJsonObject {
+                { "status_code", result.status },
+                { "body",        result.body   },
+            }},
+            { "error",     QJsonValue::Null },
+        };
+        QFile &file = ok ? output : errors;
+        file.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n');
+        file.flush(); // so that partial results survive a crash
+
+        QJsonObject counts = batch["request_counts"].toObject();
+        const char *key = ok ? "completed" : "failed";
+        counts[key] = counts[key].toInteger() + 1;
+        batch["request_counts"] = counts;
+    }
+};
+
+Server::Server(Chat *chat)
+    : ServerWorker(chat, chat ? chat->chatModel() : nullptr)
+    , m_chat(chat)
+{
+    connect(this, &Server::threadStarted, this, &Server::start);
+}
+
+Server::~Server()
+{
+    // stop the workers first, as they may be using pending replies
+    destroy();
+    for (auto &worker : m_extraWorkers)
+        worker->destroy();
+    m_httpThread.quit();
+    m_httpThread.wait();
+}
+
+static QJsonObject requestFromJson(const QByteArray &request)
+{
+    QJsonParseError err;
+    const QJsonDocument document = QJsonDocument::fromJson(request, &err);
+    if (err.error || !document.isObject())
+        throw InvalidRequestError(fmt::format(
+            "error parsing request JSON: {}",
+            err.error ? err.errorString().toStdString() : "not an object"s
+        ));
+    return document.object();
+}
+
+struct FormField {
+    QString    filename; // empty if the field is not a file
+    QByteArray data;
+};
+
+// Splits a multipart/form-data request into its fields, by name.
+static QHash<QString, FormField> formFromRequest(const QHttpServerRequest &request)
+{
+    static const QRegularExpression boundaryRe(uR"re(^multipart/form-data;.*\bboundary="?([^";]+)"?)re"_s,
+                                               QRegularExpression::CaseInsensitiveOption);
+    static const QRegularExpression nameRe(uR"re((?:^|;)\s*name="([^"]*)")re"_s);
+    static const QRegularExpression filenameRe(uR"re((?:^|;)\s*filename="([^"]*)")re"_s);
+
+    auto contentType = QString::fromUtf8(request.headers().value(QHttpHeaders::WellKnownHeader::ContentType));
+    auto match = boundaryRe.match(contentType);
+    if (!match.hasMatch())
+        throw InvalidRequestError("expected a multipart/form-data request");
+    const QByteArray delimiter = "\r\n--"_ba + match.captured(1).toUtf8();
+
+    // the first delimiter is not preceded by a line break
+    const QByteArray body = "\r\n"_ba + request.body();
+    qsizetype pos = body.indexOf(delimiter);
+    if (pos < 0)
+        throw InvalidRequestError("malformed multipart/form-data body");
+    pos += delimiter.size();
+
+    QHash<QString, FormField> fields;
+    while (!QByteArrayView(body).sliced(pos).startsWith("--")) {
+        qsizetype headersEnd = body.indexOf("\r\n\r\n"_ba, pos);
+        qsizetype next = headersEnd < 0 ? -1 : body.indexOf(delimiter, headersEnd);
+        if (!QByteArrayView(body).sliced(pos).startsWith("\r\n") || next < 0)
+            throw InvalidRequestError("malformed multipart/form-data body");
+
+        QString name;
+        FormField field;
+        for (const QByteArray &line : body.sliced(pos, headersEnd - pos).split('\n')) {
+            auto header = QString::fromUtf8(line).trimmed();
+            if (!header.startsWith(u"content-disposition:"_s, Qt::CaseInsensitive))
+                continue;
+            auto params = header.sliced(header.indexOf(u':') + 1);
+            name           = nameRe.match(params).captured(1);
+            field.filename = filenameRe.match(params).captured(1);
+        }
+        field.data = body.sliced(headersEnd + 4, next - headersEnd - 4);
+        fields.insert(name, field);
+        pos = next + delimiter.size();
+    }
+    return fields;
+}
+
+static QHttpServerResponse errorResponse(QHttpServerResponder::StatusCode status, const QString &message,
+                                         const QString &type, const QJsonValue &code = QJsonValue::Null)
+{
+    QJsonObject error {
+        { "message", message          },
+        { "type",    type             },
+        { "param",   QJsonValue::Null },
+        { "code",    code             },
+    };
+    return { QJsonObject {{ "error", error }}, status };
+}
+
+void Server::start()
+{
+    m_server = new QHttpServer;
+    m_server->moveToThread(&m_httpThread);
+    connect(&m_httpThread, &QThread::finished, m_server, &QObject::deleteLater);
+    if (m_chat)
+        connect(m_chat, &Chat::collectionListChanged, m_server,
+                [this](const QList<QString> &collectionList) { m_collections = collectionList; });
+    m_httpThread.setObjectName(u"server-http"_s);
+    m_httpThread.start();
+    QMetaObject::invokeMethod(m_server, [this] { setupHttpServer(); });
+
+    if (m_chat)
+        connect(this, &Server::requestResetResponseState, m_chat, &Chat::resetResponseState,
+                Qt::BlockingQueuedConnection);
+}
+
+void Server::setCollections(const QList<QString> &collections)
+{
+    Q_ASSERT(!m_server); // m_collections belongs to the HTTP thread once started
+    m_collections = collections;
+}
+
+bool Server::isEnabled() const
+{
+    return !m_chat || MySettings::globalInstance()->serverChat();
+}
+
+// runs on the HTTP thread
+void Server::setupHttpServer()
+{
+    m_idleWorkers << this;
+
+    auto *tcpServer = m_tcpServer = new ConnectionTracker(m_server);
+
+    auto *mySettings = MySettings::globalInstance();
+    auto port = mySettings->networkPort();
+    QHostAddress address(mySettings->serverListenAddress());
+    if (address.isNull()) {
+        qWarning() << "Server ERROR: Invalid listen address" << mySettings->serverListenAddress();
+        return;
+    }
+    if (!tcpServer->listen(address, port)) {
+        qWarning() << "Server ERROR: Failed to listen on" << address << "port" << port;
+        return;
+    }
+    if (!m_server->bind(tcpServer)) {
+        qWarning() << "Server ERROR: Failed to HTTP server to socket" << port;
+        return;
     }
 
     m_server->route("/v1/models", QHttpServerRequest::Method::Get,
-        [](const QHttpServerRequest &) {
-            if (!MySettings::globalInstance()->serverChat())
+        [this](const QHttpServerRequest &) {
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
 
             const QList<ModelInfo> modelList = ModelList::globalInstance()->selectableModelList();
@@ -491,8 +1050,8 @@ void Server::start()
     );
 
     m_server->route("/v1/models/<arg>", QHttpServerRequest::Method::Get,
-        [](const QString &model, const QHttpServerRequest &) {
-            if (!MySettings::globalInstance()->serverChat())
+        [this](const QString &model, const QHttpServerRequest &) {
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
 
             const QList<ModelInfo> modelList = ModelList::globalInstance()->selectableModelList();
@@ -511,59 +1070,306 @@ void Server::start()
         }
     );
 
+    // Completions are queued for a worker, which answers through a ServerReply once it is done, or as it generates
+    // if the response is streamed.
     m_server->route("/v1/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto *reply = new ServerReply(u"/v1/completions"_s, std::move(responder), m_server);
+            if (!isEnabled()) {
+                reply->finish(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
+                return;
+            }
 
+            auto req = std::make_shared<CompletionRequest>();
             try {
                 auto reqObj = requestFromJson(request.body());
 #if defined(DEBUG)
                 qDebug().noquote() << "/v1/completions request" << QJsonDocument(reqObj).toJson(QJsonDocument::Indented);
 #endif
-                CompletionRequest req;
-                parseRequest(req, std::move(reqObj));
-                auto [resp, respObj] = handleCompletionRequest(req);
+                parseRequest(*req, std::move(reqObj));
+            } catch (const InvalidRequestError &e) {
+                reply->finish(e.asResponse());
+                return;
+            }
+
+            auto job = std::make_shared<Job>();
+            job->client = request.remoteAddress().toString();
+            job->model  = req->model;
+            job->reply  = reply;
+            job->run    = [req, reply](ServerWorker *worker) {
+                auto [resp, respObj] = worker->handleCompletionRequest(*req, reply);
 #if defined(DEBUG)
                 if (respObj)
                     qDebug().noquote() << "/v1/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
 #endif
                 return std::move(resp);
-            } catch (const InvalidRequestError &e) {
-                return e.asResponse();
-            }
+            };
+            watchConnection(request, job);
+            enqueue(job);
         }
     );
 
     m_server->route("/v1/chat/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto *reply = new ServerReply(u"/v1/chat/completions"_s, std::move(responder), m_server);
+            if (!isEnabled()) {
+                reply->finish(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
+                return;
+            }
 
+            auto req = std::make_shared<ChatRequest>();
             try {
                 auto reqObj = requestFromJson(request.body());
 #if defined(DEBUG)
                 qDebug().noquote() << "/v1/chat/completions request" << QJsonDocument(reqObj).toJson(QJsonDocument::Indented);
 #endif
-                ChatRequest req;
-                parseRequest(req, std::move(reqObj));
-                auto [resp, respObj] = handleChatRequest(req);
+                parseRequest(*req, std::move(reqObj));
+            } catch (const InvalidRequestError &e) {
+                reply->finish(e.asResponse());
+                return;
+            }
+
+            auto job = std::make_shared<Job>();
+            job->client = request.remoteAddress().toString();
+            job->model  = req->model;
+            job->reply  = reply;
+            job->run    = [req, reply, collections = m_collections](ServerWorker *worker) {
+                auto [resp, respObj] = worker->handleChatRequest(*req, collections, reply);
                 (void)respObj;
 #if defined(DEBUG)
                 if (respObj)
                     qDebug().noquote() << "/v1/chat/completions reply" << QJsonDocument(*respObj).toJson(QJsonDocument::Indented);
 #endif
                 return std::move(resp);
+            };
+            watchConnection(request, job);
+            enqueue(job);
+        }
+    );
+
+    // Embeddings don't need an LLM worker. Inputs from concurrent requests are embedded together.
+    m_embeddings = new EmbeddingBatcher(m_server);
+    m_server->route("/v1/embeddings", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request, QHttpServerResponder &responder) {
+            auto *reply = new ServerReply(u"/v1/embeddings"_s, std::move(responder), m_server);
+            if (!isEnabled()) {
+                reply->finish(QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized));
+                return;
+            }
+
+            auto req = std::make_shared<EmbeddingRequest>();
+            try {
+                parseRequest(*req, requestFromJson(request.body()));
+            } catch (const InvalidRequestError &e) {
+                reply->finish(e.asResponse());
+                return;
+            }
+
+            if (req->model != EmbeddingLLM::model()) {
+                reply->finish(errorResponse(QHttpServerResponder::StatusCode::NotFound,
+                                            u"The model `%1` does not exist."_s.arg(req->model),
+                                            u"invalid_request_error"_s, u"model_not_found"_s));
+                return;
+            }
+
+            reply->setModel(req->model);
+            m_embeddings->submit(req->input, req->dimensions, [req, reply](EmbeddingBatcher::Result result) {
+                if (!result.error.isEmpty()) {
+                    if (result.invalidInput) {
+                        reply->finish(errorResponse(QHttpServerResponder::StatusCode::BadRequest, result.error,
+                                                    u"invalid_request_error"_s));
+                    } else if (result.remoteModel) {
+                        // texts sent to the API server are not passed on to Nomic Atlas
+                        reply->finish(errorResponse(QHttpServerResponder::StatusCode::NotImplemented, result.error,
+                                                    u"invalid_request_error"_s, u"model_not_available"_s));
+                    } else {
+                        reply->finish(errorResponse(QHttpServerResponder::StatusCode::InternalServerError,
+                                                    result.error, u"server_error"_s));
+                    }
+                    return;
+                }
+
+                ServerMetrics::globalInstance()->observeEmbeddingCache(result.cached);
+                ServerMetrics::globalInstance()->addTokens(req->model, result.tokens, 0, 0);
+
+                QJsonArray data;
+                for (qsizetype i = 0; i < req->input.size(); i++) {
+                    const float *embedding = result.embeddings.data() + i * result.dimensions;
+                    QJsonValue value;
+                    if (req->base64) {
+                        QByteArray bytes(qsizetype(result.dimensions * sizeof(float)), Qt::Uninitialized);
+                        qToLittleEndian<float>(embedding, result.dimensions, bytes.data());
+                        value = QString::fromLatin1(bytes.toBase64());
+                    } else {
+                        QJsonArray values;
+                        for (int j = 0; j < result.dimensions; j++)
+                            values << embedding[j];
+                        value = values;
+                    }
+                    data << QJsonObject {
+                        { "object",    "embedding" },
+                        { "index",     i           },
+                        { "embedding", value       },
+                    };
+                }
+
+                reply->finish(QHttpServerResponse(QJsonObject {
+                    { "object", "list"                },
+                    { "data",   data                  },
+                    { "model",  EmbeddingLLM::model() },
+                    { "usage",  QJsonObject {
+                        { "prompt_tokens", result.tokens },
+                        { "total_tokens",  result.tokens },
+                    }},
+                }));
+            });
+        }
+    );
+
+    m_server->route("/metrics", QHttpServerRequest::Method::Get,
+        [this](const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            auto *metrics = ServerMetrics::globalInstance();
+            metrics->setQueueState(m_queue.size(), m_busyWorkers);
+            return QHttpServerResponse("text/plain; version=0.0.4; charset=utf-8"_ba, metrics->render());
+        }
+    );
+
+    // Batches run offline with the same workers as other requests, whenever they have nothing else to do. Their
+    // requests are read from an uploaded file, and their responses are written to files that can be downloaded.
+    m_batchStore = std::make_unique<BatchStore>();
+    auto fileNotFound = [](const QString &id) {
+        return errorResponse(QHttpServerResponder::StatusCode::NotFound, u"No such File object: %1"_s.arg(id),
+                             u"invalid_request_error"_s);
+    };
+
+    m_server->route("/v1/files", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            QHash<QString, FormField> form;
+            try {
+                form = formFromRequest(request);
             } catch (const InvalidRequestError &e) {
                 return e.asResponse();
             }
+            QString purpose = QString::fromUtf8(form.value(u"purpose"_s).data);
+            if (purpose != u"batch"_s)
+                return errorResponse(QHttpServerResponder::StatusCode::BadRequest,
+                                     u"Invalid value for 'purpose': expected 'batch', but got '%1' instead."_s
+                                         .arg(purpose),
+                                     u"invalid_request_error"_s);
+            if (!form.contains(u"file"_s))
+                return errorResponse(QHttpServerResponder::StatusCode::BadRequest,
+                                     u"you must provide a file parameter"_s, u"invalid_request_error"_s);
+
+            const FormField &file = form[u"file"_s];
+            QJsonObject obj = m_batchStore->addFile(file.filename, purpose, file.data);
+            if (obj.isEmpty())
+                return errorResponse(QHttpServerResponder::StatusCode::InternalServerError,
+                                     u"Failed to store the file."_s, u"server_error"_s);
+            return QHttpServerResponse(obj);
+        }
+    );
+
+    m_server->route("/v1/files", QHttpServerRequest::Method::Get,
+        [this](const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            QJsonArray data;
+            for (auto &file : m_batchStore->files())
+                data << file;
+            return QHttpServerResponse(QJsonObject {{ "object", "list" }, { "data", data }});
+        }
+    );
+
+    m_server->route("/v1/files/<arg>", QHttpServerRequest::Method::Get,
+        [this, fileNotFound](const QString &id, const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            auto file = m_batchStore->file(id);
+            return file ? QHttpServerResponse(*file) : fileNotFound(id);
+        }
+    );
+
+    m_server->route("/v1/files/<arg>", QHttpServerRequest::Method::Delete,
+        [this, fileNotFound](const QString &id, const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            if (!m_batchStore->removeFile(id))
+                return fileNotFound(id);
+            return QHttpServerResponse(QJsonObject {{ "id", id }, { "object", "file" }, { "deleted", true }});
+        }
+    );
+
+    m_server->route("/v1/files/<arg>/content", QHttpServerRequest::Method::Get,
+        [this, fileNotFound](const QString &id, const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            QFile file(m_batchStore->filePath(id));
+            if (!m_batchStore->file(id) || !file.open(QIODevice::ReadOnly))
+                return fileNotFound(id);
+            return QHttpServerResponse("application/octet-stream"_ba, file.readAll());
+        }
+    );
+
+    m_server->route("/v1/batches", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            return createBatch(request);
+        }
+    );
+
+    m_server->route("/v1/batches", QHttpServerRequest::Method::Get,
+        [this](const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            QJsonArray data;
+            for (auto &batch : m_batchStore->batches())
+                data << batch;
+            return QHttpServerResponse(QJsonObject {
+                { "object",   "list"                                             },
+                { "data",     data                                               },
+                { "first_id", data.isEmpty() ? QJsonValue() : data.first()["id"] },
+                { "last_id",  data.isEmpty() ? QJsonValue() : data.last()["id"]  },
+                { "has_more", false                                              },
+            });
+        }
+    );
+
+    m_server->route("/v1/batches/<arg>", QHttpServerRequest::Method::Get,
+        [this](const QString &id, const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+
+            if (auto batch = m_batchStore->batch(id))
+                return QHttpServerResponse(*batch);
+            return errorResponse(QHttpServerResponder::StatusCode::NotFound, u"No such Batch object: %1"_s.arg(id),
+                                 u"invalid_request_error"_s);
+        }
+    );
+
+    m_server->route("/v1/batches/<arg>/cancel", QHttpServerRequest::Method::Post,
+        [this](const QString &id, const QHttpServerRequest &) {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            return cancelBatch(id);
         }
     );
 
     // Respond with code 405 to wrong HTTP methods:
     m_server->route("/v1/models",  QHttpServerRequest::Method::Post,
-        [] {
-            if (!MySettings::globalInstance()->serverChat())
+        [this] {
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
             return QHttpServerResponse(
                 QJsonDocument::fromJson("{\"error\": {\"message\": \"Not allowed to POST on /v1/models."
@@ -574,9 +1380,9 @@ void Server::start()
     );
 
     m_server->route("/v1/models/<arg>", QHttpServerRequest::Method::Post,
-        [](const QString &model) {
+        [this](const QString &model) {
             (void)model;
-            if (!MySettings::globalInstance()->serverChat())
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
             return QHttpServerResponse(
                 QJsonDocument::fromJson("{\"error\": {\"message\": \"Not allowed to POST on /v1/models/*."
@@ -587,8 +1393,19 @@ void Server::start()
     );
 
     m_server->route("/v1/completions", QHttpServerRequest::Method::Get,
-        [] {
-            if (!MySettings::globalInstance()->serverChat())
+        [this] {
+            if (!isEnabled())
+                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
+            return QHttpServerResponse(
+                QJsonDocument::fromJson("{\"error\": {\"message\": \"Only POST requests are accepted.\","
+                    " \"type\": \"invalid_request_error\", \"param\": null, \"code\": \"method_not_supported\"}}").object(),
+                QHttpServerResponder::StatusCode::MethodNotAllowed);
+        }
+    );
+
+    m_server->route("/v1/embeddings", QHttpServerRequest::Method::Get,
+        [this] {
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
             return QHttpServerResponse(
                 QJsonDocument::fromJson("{\"error\": {\"message\": \"Only POST requests are accepted.\","
@@ -598,8 +1415,8 @@ void Server::start()
     );
 
     m_server->route("/v1/chat/completions", QHttpServerRequest::Method::Get,
-        [] {
-            if (!MySettings::globalInstance()->serverChat())
+        [this] {
+            if (!isEnabled())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
             return QHttpServerResponse(
                 QJsonDocument::fromJson("{\"error\": {\"message\": \"Only POST requests are accepted.\","
@@ -608,14 +1425,438 @@ void Server::start()
         }
     );
 
-    m_server->addAfterRequestHandler(this, [](const QHttpServerRequest &req, QHttpServerResponse &resp) {
+    m_server->addAfterRequestHandler(m_server, [](const QHttpServerRequest &req, QHttpServerResponse &resp) {
         Q_UNUSED(req);
+        addCorsHeader(resp);
+    });
+}
+
+static QHttpServerResponse timeoutResponse()
+{
+    return errorResponse(QHttpServerResponder::StatusCode::ServiceUnavailable, u"The request timed out."_s,
+                         u"server_error"_s, u"timeout"_s);
+}
+
+void Server::enqueue(const std::shared_ptr<Job> &job)
+{
+    auto *mySettings = MySettings::globalInstance();
+
+    // batch jobs are queued a few at a time, and don't count against the limit
+    if (ranges::count_if(m_queue, [](auto &job) { return !job->background; }) >= mySettings->serverMaxQueueDepth()) {
+        auto resp = errorResponse(QHttpServerResponder::StatusCode::TooManyRequests,
+                                  u"The server has too many pending requests. Please try again later."_s,
+                                  u"requests"_s, u"rate_limit_exceeded"_s);
         auto headers = resp.headers();
-        headers.append("Access-Control-Allow-Origin"_L1, "*"_L1);
+        headers.append(QHttpHeaders::WellKnownHeader::RetryAfter, "1"_L1);
         resp.setHeaders(std::move(headers));
-    });
+        job->reply->finish(std::move(resp));
+        return;
+    }
+
+    if (int timeout = mySettings->serverRequestTimeout())
+        QTimer::singleShot(std::chrono::seconds(timeout), job->reply, [this, job] { handleTimeout(job); });
 
-    connect(this, &Server::requestResetResponseState, m_chat, &Chat::resetResponseState, Qt::BlockingQueuedConnection);
+    m_queue << job;
+    dispatch();
+}
+
+void Server::dispatch()
+{
+    while (!m_queue.isEmpty()) {
+        // find a worker, creating one if we are below the configured concurrency
+        int concurrency = MySettings::globalInstance()->serverConcurrency();
+        if (m_busyWorkers >= concurrency)
+            return;
+        if (m_idleWorkers.isEmpty()) {
+            if (1 + qsizetype(m_extraWorkers.size()) >= concurrency)
+                return;
+            auto *worker = m_extraWorkers.emplace_back(
+                std::make_unique<ServerWorker>(m_chat)
+            ).get();
+            m_idleWorkers << worker;
+        }
+
+        // Serve clients fairly: take the oldest job of the client that was least recently served. Jobs are queued
+        // in order, so ties go to the oldest one. Background jobs only run when no other job is waiting.
+        auto it = ranges::min_element(m_queue, {}, [this](auto &job) {
+            return std::pair(job->background, m_clientLastServed.value(job->client));
+        });
+        auto job = *it;
+        m_queue.erase(it);
+        m_clientLastServed[job->client] = ++m_dispatchCount;
+        if (m_queue.isEmpty())
+            m_clientLastServed.clear(); // nobody is waiting, so nobody needs to catch up
+
+        // Prefer a worker whose KV cache is likely to share a prefix with this request: one that last served the same
+        // client with the same model, then one with the same model loaded. Otherwise, the most recently used one.
+        auto affinity = [this, &job](ServerWorker *w) {
+            auto last = m_workerLastJob.value(w);
+            return (last.model == job->model) + (last.model == job->model && last.client == job->client);
+        };
+        qsizetype best = m_idleWorkers.size() - 1;
+        for (qsizetype i = best - 1; i >= 0; i--) {
+            if (affinity(m_idleWorkers[i]) > affinity(m_idleWorkers[best]))
+                best = i;
+        }
+        ServerWorker *worker = m_idleWorkers.takeAt(best);
+        m_busyWorkers++;
+        m_workerLastJob[worker] = { .client = job->client, .model = job->model };
+
+        job->worker = worker;
+        QMetaObject::invokeMethod(worker, [this, job, worker] {
+            auto *reply = job->reply;
+            std::optional<QHttpServerResponse> resp;
+            if (!job->timedOut && !job->disconnected)
+                resp = job->run(worker);
+            if (job->disconnected) {
+                reply->abandon(); // there is nobody to answer
+            } else if (job->timedOut) {
+                if (resp && reply->isStreaming())
+                    reply->sendEvent(streamErrorEvent("The request timed out."));
+                reply->finish(timeoutResponse());
+            } else {
+                reply->finish(std::move(*resp));
+            }
+
+            // back to the HTTP thread to pick up more work
+            QMetaObject::invokeMethod(m_server, [this, job, worker] {
+                job->worker = nullptr;
+                m_busyWorkers--;
+                m_idleWorkers << worker;
+                if (job->done)
+                    job->done();
+                dispatch();
+            });
+        });
+    }
+}
+
+void Server::handleTimeout(const std::shared_ptr<Job> &job)
+{
+    job->timedOut = true;
+    job->reply->cancel();
+    if (job->worker) {
+        job->worker->stopGenerating();
+    } else if (m_queue.removeOne(job)) {
+        job->reply->finish(timeoutResponse());
+    }
+}
+
+void Server::watchConnection(const QHttpServerRequest &request, const std::shared_ptr<Job> &job)
+{
+    if (auto *socket = m_tcpServer->connection(request.remoteAddress(), request.remotePort()))
+        connect(socket, &QAbstractSocket::disconnected, job->reply, [this, job] { handleDisconnect(job); });
+}
+
+void Server::handleDisconnect(const std::shared_ptr<Job> &job)
+{
+    // only this request's worker is stopped, the others keep generating
+    job->disconnected = true;
+    job->reply->cancel();
+    if (job->worker) {
+        job->worker->stopGenerating(); // the reply is abandoned once the worker returns
+    } else if (m_queue.removeOne(job)) {
+        job->reply->abandon();
+    }
+}
+
+QHttpServerResponse Server::createBatch(const QHttpServerRequest &request)
+{
+    BatchRequest req;
+    try {
+        parseRequest(req, requestFromJson(request.body()));
+    } catch (const InvalidRequestError &e) {
+        return e.asResponse();
+    }
+
+    auto inputFile = m_batchStore->file(req.input_file_id);
+    if (!inputFile)
+        return errorResponse(QHttpServerResponder::StatusCode::NotFound,
+                             u"No such File object: %1"_s.arg(req.input_file_id), u"invalid_request_error"_s);
+    if ((*inputFile)["purpose"].toString() != u"batch"_s)
+        return errorResponse(QHttpServerResponder::StatusCode::BadRequest,
+                             u"The input file must have purpose 'batch'."_s, u"invalid_request_error"_s);
+    QFile input(m_batchStore->filePath(req.input_file_id));
+    if (!input.open(QIODevice::ReadOnly))
+        return errorResponse(QHttpServerResponder::StatusCode::InternalServerError,
+                             u"Failed to read the input file."_s, u"server_error"_s);
+
+    auto run = std::make_shared<BatchRun>();
+    run->output.setFileName(m_batchStore->filePath(BatchStore::newFileId()));
+    run->errors.setFileName(m_batchStore->filePath(BatchStore::newFileId()));
+    if (!run->output.open(QIODevice::WriteOnly) || !run->errors.open(QIODevice::WriteOnly))
+        return errorResponse(QHttpServerResponder::StatusCode::InternalServerError,
+                             u"Failed to create the output files."_s, u"server_error"_s);
+
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    auto &batch = run->batch;
+    batch = QJsonObject {
+        { "id",                BatchStore::newBatchId()                                          },
+        { "object",            "batch"                                                           },
+        { "endpoint",          req.endpoint                                                      },
+        { "errors",            QJsonValue::Null                                                  },
+        { "input_file_id",     req.input_file_id                                                 },
+        { "completion_window", "24h"                                                             },
+        { "status",            "validating"                                                      },
+        { "output_file_id",    QJsonValue::Null                                                  },
+        { "error_file_id",     QJsonValue::Null                                                  },
+        { "created_at",        now                                                               },
+        { "in_progress_at",    QJsonValue::Null                                                  },
+        { "expires_at",        now + 24 * 60 * 60                                                },
+        { "finalizing_at",     QJsonValue::Null                                                  },
+        { "completed_at",      QJsonValue::Null                                                  },
+        { "failed_at",         QJsonValue::Null                                                  },
+        { "expired_at",        QJsonValue::Null                                                  },
+        { "cancelling_at",     QJsonValue::Null                                                  },
+        { "cancelled_at",      QJsonValue::Null                                                  },
+        { "request_counts",    QJsonObject {{ "total", 0 }, { "completed", 0 }, { "failed", 0 }} },
+        { "metadata",          req.metadata.isEmpty() ? QJsonValue() : QJsonValue(req.metadata)  },
+    };
+
+    // Like OpenAI's API, fail the whole batch if any of its requests is invalid, reporting the first few of them.
+    QList<std::pair<QString, BatchRun::Item>> items; // by sort key
+    QSet<QString> customIds;
+    QJsonArray errors;
+    qsizetype errorCount = 0;
+    auto addError = [&](qsizetype line, const QString &code, const QString &message) {
+        if (errorCount++ < 100) {
+            errors << QJsonObject {
+                { "code",    code                                   },
+                { "message", message                                },
+                { "param",   QJsonValue::Null                       },
+                { "line",    line ? QJsonValue(line) : QJsonValue() },
+            };
+        }
+    };
+    for (qsizetype lineNo = 1; !input.atEnd(); lineNo++) {
+        QByteArray line = input.readLine().trimmed();
+        if (line.isEmpty())
+            continue;
+
+        QJsonParseError err;
+        QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+        if (err.error || !doc.isObject()) {
+            addError(lineNo, u"invalid_json_line"_s, u"This line is not parseable as a JSON object."_s);
+            continue;
+        }
+        QJsonObject obj = doc.object();
+
+        BatchRun::Item item { .customId = obj["custom_id"].toString() };
+        if (item.customId.isEmpty()) {
+            addError(lineNo, u"missing_required_parameter"_s, u"The custom_id must be a non-empty string."_s);
+            continue;
+        }
+        if (customIds.contains(item.customId)) {
+            addError(lineNo, u"duplicate_custom_id"_s,
+                     u"The custom_id for this request is a duplicate of another request."_s);
+            continue;
+        }
+        customIds << item.customId;
+        if (obj["method"].toString() != u"POST"_s) {
+            addError(lineNo, u"invalid_method"_s, u"The method must be 'POST'."_s);
+            continue;
+        }
+        if (obj["url"].toString() != req.endpoint) {
+            addError(lineNo, u"invalid_url"_s, u"The url must match the endpoint of the batch."_s);
+            continue;
+        }
+
+        QString sortKey;
+        try {
+            if (!obj["body"].isObject())
+                throw InvalidRequestError("'body' is not of type 'object'");
+            BaseCompletionRequest *body;
+            if (req.endpoint == u"/v1/completions"_s) {
+                item.completion = std::make_shared<CompletionRequest>();
+                body = &parseRequest(*item.completion, obj["body"].toObject());
+                sortKey = item.completion->model + u'\0' + item.completion->prompt;
+            } else {
+                item.chat = std::make_shared<ChatRequest>();
+                body = &parseRequest(*item.chat, obj["body"].toObject());
+                sortKey = item.chat->model;
+                for (auto &message : item.chat->messages) {
+                    sortKey += u'\0';
+                    sortKey += QString::number(int(message.role));
+                    sortKey += message.content;
+                }
+            }
+            if (body->stream)
+                throw InvalidRequestError("'stream' is not supported in batches");
+        } catch (const InvalidRequestError &e) {
+            addError(lineNo, u"invalid_request"_s, QString::fromUtf8(e.what()));
+            continue;
+        }
+        items.emplace_back(std::move(sortKey), std::move(item));
+    }
+    if (!errorCount && items.isEmpty())
+        addError(0, u"empty_file"_s, u"The input file contains no requests."_s);
+
+    if (errorCount) {
+        run->output.remove();
+        run->errors.remove();
+        batch["status"]    = u"failed"_s;
+        batch["failed_at"] = now;
+        batch["errors"]    = QJsonObject {{ "object", "list" }, { "data", errors }};
+        m_batchStore->saveBatch(batch);
+        return QHttpServerResponse(batch);
+    }
+
+    // Requests that share a model and a prompt prefix end up next to each other, and mostly in the same lane. The
+    // backend decodes one sequence at a time, so the lanes are what runs in parallel.
+    ranges::stable_sort(items, {}, &std::pair<QString, BatchRun::Item>::first);
+    const qsizetype nLanes = qMin(qsizetype(MySettings::globalInstance()->serverConcurrency()), items.size());
+    for (qsizetype i = 0; i < nLanes; i++) {
+        auto &lane = run->lanes.emplace_back();
+        for (qsizetype j = (i + 1) * items.size() / nLanes - 1; j >= i * items.size() / nLanes; j--)
+            lane.items << std::move(items[j].second);
+    }
+
+    batch["status"]         = u"in_progress"_s;
+    batch["in_progress_at"] = now;
+    batch["request_counts"] = QJsonObject {{ "total", items.size() }, { "completed", 0 }, { "failed", 0 }};
+    m_batchStore->saveBatch(batch);
+
+    m_batchRuns.insert(batch["id"].toString(), run);
+    for (qsizetype i = 0; i < nLanes; i++)
+        runNextBatchItem(run, i);
+    return QHttpServerResponse(batch);
+}
+
+void Server::runNextBatchItem(const std::shared_ptr<BatchRun> &run, qsizetype laneIndex)
+{
+    auto &lane = run->lanes[laneIndex];
+    lane.job.reset();
+    if (run->cancelling)
+        lane.items.clear();
+    if (lane.items.isEmpty()) {
+        if (ranges::none_of(run->lanes, [](auto &l) { return bool(l.job); }))
+            finishBatch(run);
+        return;
+    }
+
+    auto item   = lane.items.takeLast();
+    auto result = std::make_shared<BatchRun::Result>();
+    auto *reply = new ServerReply(run->batch["endpoint"].toString(), m_server);
+
+    auto job = lane.job = std::make_shared<Job>();
+    job->client     = u"%1/%2"_s.arg(run->batch["id"].toString()).arg(laneIndex); // for worker affinity
+    job->model      = item.completion ? item.completion->model : item.chat->model;
+    job->reply      = reply;
+    job->background = true;
+    job->run        = [item, result, reply, collections = m_collections](ServerWorker *worker) {
+        auto [resp, respObj] = item.completion ? worker->handleCompletionRequest(*item.completion, reply)
+                                               : worker->handleChatRequest(*item.chat, collections, reply);
+        result->status    = int(resp.statusCode());
+        result->body      = respObj ? *respObj : QJsonDocument::fromJson(resp.data()).object();
+        result->cancelled = reply->isCancelled();
+        return std::move(resp);
+    };
+    job->done       = [this, run, laneIndex, customId = item.customId, result] {
+        if (!result->cancelled) {
+            run->addResult(customId, *result);
+            m_batchStore->saveBatch(run->batch);
+        }
+        runNextBatchItem(run, laneIndex);
+    };
+
+    m_queue << job; // no timeout, batches may take as long as they need
+    dispatch();
+}
+
+QHttpServerResponse Server::cancelBatch(const QString &id)
+{
+    auto run = m_batchRuns.value(id);
+    if (!run) {
+        auto batch = m_batchStore->batch(id);
+        if (!batch)
+            return errorResponse(QHttpServerResponder::StatusCode::NotFound, u"No such Batch object: %1"_s.arg(id),
+                                 u"invalid_request_error"_s);
+        return errorResponse(QHttpServerResponder::StatusCode::Conflict,
+                             u"Cannot cancel a batch with status '%1'."_s.arg((*batch)["status"].toString()),
+                             u"invalid_request_error"_s);
+    }
+
+    if (!run->cancelling) {
+        run->cancelling = true;
+        run->batch["status"]        = u"cancelling"_s;
+        run->batch["cancelling_at"] = QDateTime::currentSecsSinceEpoch();
+        m_batchStore->saveBatch(run->batch);
+
+        for (qsizetype i = 0; i < run->lanes.size(); i++) {
+            auto job = run->lanes[i].job;
+            if (!job)
+                continue;
+            job->reply->cancel();
+            if (job->worker) {
+                job->worker->stopGenerating(); // the lane stops once the worker returns
+            } else if (m_queue.removeOne(job)) {
+                job->reply->abandon();
+                runNextBatchItem(run, i);
+            }
+        }
+    }
+    return QHttpServerResponse(run->batch);
+}
+
+void Server::finishBatch(const std::shared_ptr<BatchRun> &run)
+{
+    auto &batch = run->batch;
+    const QString id = batch["id"].toString();
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    batch["finalizing_at"] = now;
+
+    auto addOutputFile = [this, &batch, &id](QFile &file, const char *key, const QString &suffix) {
+        file.close();
+        QString fileId = QFileInfo(file).completeBaseName();
+        if (!file.size()) {
+            file.remove();
+            return;
+        }
+        if (!m_batchStore->adoptFile(fileId, u"%1_%2.jsonl"_s.arg(id, suffix), u"batch_output"_s).isEmpty())
+            batch[key] = fileId;
+    };
+    addOutputFile(run->output, "output_file_id", u"output"_s);
+    addOutputFile(run->errors, "error_file_id",  u"error"_s);
+
+    if (run->cancelling) {
+        batch["status"]       = u"cancelled"_s;
+        batch["cancelled_at"] = now;
+    } else {
+        batch["status"]       = u"completed"_s;
+        batch["completed_at"] = now;
+    }
+    m_batchStore->saveBatch(batch);
+    m_batchRuns.remove(id);
+}
+
+static bool isResponseCacheable(const LLModel::PromptContext &ctx)
+{
+    // at temperature 0 the most likely token is always chosen, so the same prompt gets the same response
+    return MySettings::globalInstance()->serverResponseCache() && ctx.temp <= 0;
+}
+
+// Identifies a request in the response cache. The model file is identified by its path, size, and modification time,
+// so replacing it invalidates its responses. Chat prompts are rendered with their template and system message, so
+// changing either of those does as well.
+static std::optional<QByteArray> responseCacheKey(const QString &endpoint, const ModelInfo &modelInfo,
+                                                  std::string_view renderedPrompt, const LLModel::PromptContext &ctx,
+                                                  int n, bool echo)
+{
+    QFileInfo modelFile(modelInfo.dirpath + modelInfo.filename());
+    if (!modelFile.exists())
+        return std::nullopt; // remote models may change at any time
+
+    QByteArray params;
+    {
+        QDataStream stream(&params, QIODeviceBase::WriteOnly);
+        stream << endpoint << modelFile.canonicalFilePath() << modelFile.size() << modelFile.lastModified()
+               << ctx.n_predict << ctx.top_k << ctx.top_p << ctx.min_p << ctx.temp << ctx.repeat_penalty
+               << ctx.repeat_last_n << n << echo;
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(params);
+    hash.addData(QByteArrayView(renderedPrompt.data(), renderedPrompt.size()));
+    return hash.result();
 }
 
 static auto makeError(auto &&...args) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
@@ -623,11 +1864,9 @@ static auto makeError(auto &&...args) -> std::pair<QHttpServerResponse, std::opt
     return {QHttpServerResponse(args...), std::nullopt};
 }
 
-auto Server::handleCompletionRequest(const CompletionRequest &request)
+auto ServerWorker::handleCompletionRequest(const CompletionRequest &request, ServerReply *reply)
     -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
 {
-    Q_ASSERT(m_chatModel);
-
     auto *mySettings = MySettings::globalInstance();
 
     ModelInfo modelInfo = ModelList::globalInstance()->defaultModelInfo();
@@ -649,21 +1888,20 @@ auto Server::handleCompletionRequest(const CompletionRequest &request)
         std::cerr << "ERROR: couldn't load default model " << request.model.toStdString() << std::endl;
         return makeError(QHttpServerResponder::StatusCode::InternalServerError);
     }
+    reply->setModel(modelInfo.name());
 
-    emit requestResetResponseState(); // blocks
-    qsizetype prevMsgIndex = m_chatModel->count() - 1;
-    if (prevMsgIndex >= 0)
-        m_chatModel->updateCurrentResponse(prevMsgIndex, false);
+    bool mirror = startMirroring();
 
-    // NB: this resets the context, regardless of whether this model is already loaded
-    if (!loadModel(modelInfo)) {
+    if (!loadRequestedModel(modelInfo)) {
         std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
         return makeError(QHttpServerResponder::StatusCode::InternalServerError);
     }
 
     // add prompt/response items to GUI
-    m_chatModel->appendPrompt(request.prompt);
-    m_chatModel->appendResponse();
+    if (mirror) {
+        m_chatModel->appendPrompt(request.prompt);
+        m_chatModel->appendResponse();
+    }
 
     // FIXME(jared): taking parameters from the UI inhibits reproducibility of results
     LLModel::PromptContext promptCtx {
@@ -677,37 +1915,128 @@ auto Server::handleCompletionRequest(const CompletionRequest &request)
         .repeat_last_n  = mySettings->modelRepeatPenaltyTokens(modelInfo),
     };
 
+    QJsonObject responseObject {
+        { "id",      "placeholder"                      },
+        { "object",  "text_completion"                  },
+        { "created", QDateTime::currentSecsSinceEpoch() },
+        { "model",   modelInfo.name()                   },
+    };
+
+    auto makeChunk = [&](qint64 index, const QString &text, const QJsonValue &finishReason) {
+        QJsonObject chunk = responseObject;
+        chunk.insert("choices", QJsonArray { QJsonObject {
+            { "text",          text             },
+            { "index",         index            },
+            { "logprobs",      QJsonValue::Null },
+            { "finish_reason", finishReason     },
+        }});
+        if (request.include_usage)
+            chunk.insert("usage", QJsonValue::Null);
+        return chunk;
+    };
+
     auto promptUtf8 = request.prompt.toUtf8();
-    int promptTokens = 0;
+    std::optional<QByteArray> cacheKey;
+    std::optional<ResponseCache::Entry> cached;
+    if (isResponseCacheable(promptCtx)) {
+        cacheKey = responseCacheKey(reply->endpoint(), modelInfo,
+                                    std::string_view(promptUtf8.cbegin(), promptUtf8.cend()), promptCtx, request.n,
+                                    request.echo);
+        if (cacheKey) {
+            cached = ResponseCache::globalInstance()->find(*cacheKey);
+            ServerMetrics::globalInstance()->observeResponseCache(cached.has_value());
+        }
+    }
+    ResponseCache::Entry newEntry;
+
+    if (request.stream)
+        reply->beginStream();
+
+    // a disconnect or timeout stops the response, even one that comes before its prompt is decoded
+    const CancelCallback isCancelled = [reply] { return reply->isCancelled(); };
+    int promptTokens   = 0;
+    int cachedTokens   = 0;
     int responseTokens = 0;
     QStringList responses;
-    for (int i = 0; i < request.n; ++i) {
+    for (int i = 0; i < request.n && !reply->isCancelled(); ++i) {
+        ResponseChunkCallback onChunk;
+        if (request.stream) {
+            if (request.echo)
+                reply->sendEvent(makeChunk(i, request.prompt, QJsonValue::Null));
+            onChunk = makeStreamCallback(reply, [&makeChunk, i](const QString &text) {
+                return makeChunk(i, text, QJsonValue::Null);
+            });
+        }
+        if (i == 0)
+            onChunk = timeFirstChunk(reply, modelInfo.name(), std::move(onChunk));
+
         PromptResult result;
-        try {
-            result = promptInternal(std::string_view(promptUtf8.cbegin(), promptUtf8.cend()),
-                                    promptCtx,
-                                    /*usedLocalDocs*/ false);
-        } catch (const std::exception &e) {
-            m_chatModel->setResponseValue(e.what());
-            m_chatModel->setError();
-            emit responseStopped(0);
-            return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+        if (cached) {
+            // replayed as if it had just been generated, with all of the prompt reported as cached
+            auto &choice = cached->choices.at(i);
+            result = {
+                .response           = choice.text.toUtf8(),
+                .promptTokens       = cached->promptTokens,
+                .cachedPromptTokens = cached->promptTokens,
+                .responseTokens     = choice.responseTokens,
+            };
+            onChunk(std::string_view(result.response.cbegin(), result.response.cend()));
+            if (mirror)
+                m_chatModel->setResponseValue(choice.text);
+        } else {
+            try {
+                result = promptInternal(std::string_view(promptUtf8.cbegin(), promptUtf8.cend()),
+                                        promptCtx,
+                                        /*usedLocalDocs*/ false,
+                                        onChunk,
+                                        isCancelled);
+            } catch (const std::exception &e) {
+                if (mirror) {
+                    m_chatModel->setResponseValue(e.what());
+                    m_chatModel->setError();
+                }
+                emit responseStopped(0);
+                if (request.stream)
+                    reply->sendEvent(streamErrorEvent(e.what()));
+                return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+            }
+            newEntry.choices << ResponseCache::Choice { QString::fromUtf8(result.response), result.responseTokens };
         }
+        if (request.stream)
+            reply->sendEvent(makeChunk(i, u""_s, result.responseTokens == request.max_tokens ? "length" : "stop"));
         QString resp = QString::fromUtf8(result.response);
         if (request.echo)
             resp = request.prompt + resp;
         responses << resp;
-        if (i == 0)
+        if (i == 0) {
             promptTokens = result.promptTokens;
+            cachedTokens = result.cachedPromptTokens;
+        }
         responseTokens += result.responseTokens;
     }
 
-    QJsonObject responseObject {
-        { "id",      "placeholder"                      },
-        { "object",  "text_completion"                  },
-        { "created", QDateTime::currentSecsSinceEpoch() },
-        { "model",   modelInfo.name()                   },
+    QJsonObject usage {
+        { "prompt_tokens",     promptTokens                  },
+        { "completion_tokens", responseTokens                },
+        { "total_tokens",      promptTokens + responseTokens },
+        { "prompt_tokens_details", QJsonObject { { "cached_tokens", cachedTokens } } },
     };
+    if (!cached) {
+        ServerMetrics::globalInstance()->addTokens(modelInfo.name(), promptTokens, responseTokens, cachedTokens);
+        if (cacheKey && !reply->isCancelled()) {
+            newEntry.promptTokens = promptTokens;
+            ResponseCache::globalInstance()->insert(*cacheKey, newEntry);
+        }
+    }
+
+    if (request.stream) {
+        if (request.include_usage) {
+            responseObject.insert("choices", QJsonArray());
+            responseObject.insert("usage", usage);
+            reply->sendEvent(responseObject);
+        }
+        return {QHttpServerResponse(QHttpServerResponder::StatusCode::Ok), std::nullopt};
+    }
 
     QJsonArray choices;
     for (qsizetype i = 0; auto &resp : std::as_const(responses)) {
@@ -720,16 +2049,13 @@ auto Server::handleCompletionRequest(const CompletionRequest &request)
     }
 
     responseObject.insert("choices", choices);
-    responseObject.insert("usage", QJsonObject {
-        { "prompt_tokens",     promptTokens                  },
-        { "completion_tokens", responseTokens                },
-        { "total_tokens",      promptTokens + responseTokens },
-    });
+    responseObject.insert("usage", usage);
 
     return {QHttpServerResponse(responseObject), responseObject};
 }
 
-auto Server::handleChatRequest(const ChatRequest &request)
+auto ServerWorker::handleChatRequest(const ChatRequest &request, const QList<QString> &collections,
+                                     ServerReply *reply)
     -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>
 {
     auto *mySettings = MySettings::globalInstance();
@@ -753,30 +2079,45 @@ auto Server::handleChatRequest(const ChatRequest &request)
         std::cerr << "ERROR: couldn't load default model " << request.model.toStdString() << std::endl;
         return makeError(QHttpServerResponder::StatusCode::InternalServerError);
     }
+    reply->setModel(modelInfo.name());
 
-    emit requestResetResponseState(); // blocks
+    bool mirror = startMirroring();
 
-    // NB: this resets the context, regardless of whether this model is already loaded
-    if (!loadModel(modelInfo)) {
+    if (!loadRequestedModel(modelInfo)) {
         std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
         return makeError(QHttpServerResponder::StatusCode::InternalServerError);
     }
 
-    m_chatModel->updateCurrentResponse(m_chatModel->count() - 1, false);
-
     Q_ASSERT(!request.messages.isEmpty());
 
-    // adds prompt/response items to GUI
-    std::vector<MessageInput> messages;
-    for (auto &message : request.messages) {
+    std::vector<MessageItem> conversation;
+    conversation.reserve(request.messages.size());
+    for (qsizetype i = 0; auto &message : request.messages) {
         using enum ChatRequest::Message::Role;
         switch (message.role) {
-            case System:    messages.push_back({ MessageInput::Type::System,   message.content }); break;
-            case User:      messages.push_back({ MessageInput::Type::Prompt,   message.content }); break;
-            case Assistant: messages.push_back({ MessageInput::Type::Response, message.content }); break;
+            case System:    conversation.emplace_back(MessageItem::system_tag, message.content);        break;
+            case User:      conversation.emplace_back(i, MessageItem::Type::Prompt,   message.content); break;
+            case Assistant: conversation.emplace_back(i, MessageItem::Type::Response, message.content); break;
+        }
+        i++;
+    }
+
+    // adds prompt/response items to GUI
+    std::optional<qsizetype> mirroredPromptIndex; // where to show the sources
+    if (mirror) {
+        std::vector<MessageInput> messages;
+        for (auto &message : request.messages) {
+            using enum ChatRequest::Message::Role;
+            switch (message.role) {
+                case System:    messages.push_back({ MessageInput::Type::System,   message.content }); break;
+                case User:      messages.push_back({ MessageInput::Type::Prompt,   message.content }); break;
+                case Assistant: messages.push_back({ MessageInput::Type::Response, message.content }); break;
+            }
         }
+        auto startOffset = m_chatModel->appendResponseWithHistory(messages);
+        if (request.messages.constLast().role == ChatRequest::Message::Role::User)
+            mirroredPromptIndex = startOffset + request.messages.size() - 1;
     }
-    auto startOffset = m_chatModel->appendResponseWithHistory(messages);
 
     // FIXME(jared): taking parameters from the UI inhibits reproducibility of results
     LLModel::PromptContext promptCtx {
@@ -790,31 +2131,149 @@ auto Server::handleChatRequest(const ChatRequest &request)
         .repeat_last_n  = mySettings->modelRepeatPenaltyTokens(modelInfo),
     };
 
+    QJsonObject responseObject {
+        { "id",      "placeholder"                      },
+        { "object",  "chat.completion"                  },
+        { "created", QDateTime::currentSecsSinceEpoch() },
+        { "model",   modelInfo.name()                   },
+    };
+
+    auto makeChunk = [&](QJsonObject choice) {
+        QJsonObject chunk = responseObject;
+        chunk.insert("object", "chat.completion.chunk");
+        chunk.insert("choices", QJsonArray { choice });
+        if (request.include_usage)
+            chunk.insert("usage", QJsonValue::Null);
+        return chunk;
+    };
+    auto makeDeltaChunk = [&](qint64 index, QJsonObject delta) {
+        return makeChunk({
+            { "index",         index            },
+            { "delta",         delta            },
+            { "logprobs",      QJsonValue::Null },
+            { "finish_reason", QJsonValue::Null },
+        });
+    };
+
+    // Sources depend on the contents of the LocalDocs collections, so requests that use them are not cached.
+    std::optional<QByteArray> cacheKey;
+    std::optional<ResponseCache::Entry> cached;
+    if (collections.isEmpty() && isResponseCacheable(promptCtx)) {
+        try {
+            cacheKey = responseCacheKey(reply->endpoint(), modelInfo, applyJinjaTemplate(conversation), promptCtx,
+                                        request.n, /*echo*/ false);
+        } catch (const std::exception &) {
+            // the same error is reported when prompting
+        }
+        if (cacheKey) {
+            cached = ResponseCache::globalInstance()->find(*cacheKey);
+            ServerMetrics::globalInstance()->observeResponseCache(cached.has_value());
+        }
+    }
+    ResponseCache::Entry newEntry;
+
+    if (request.stream)
+        reply->beginStream();
+
+    // a disconnect or timeout stops the response, even one that comes before its prompt is decoded
+    const CancelCallback isCancelled = [reply] { return reply->isCancelled(); };
     int promptTokens   = 0;
+    int cachedTokens   = 0;
     int responseTokens = 0;
     QList<QPair<QString, QList<ResultInfo>>> responses;
-    for (int i = 0; i < request.n; ++i) {
+    for (int i = 0; i < request.n && !reply->isCancelled(); ++i) {
+        ResponseChunkCallback onChunk;
+        if (request.stream) {
+            reply->sendEvent(makeDeltaChunk(i, {{ "role", "assistant" }, { "content", "" }}));
+            onChunk = makeStreamCallback(reply, [&makeDeltaChunk, i](const QString &text) {
+                return makeDeltaChunk(i, {{ "content", text }});
+            });
+        }
+        if (i == 0)
+            onChunk = timeFirstChunk(reply, modelInfo.name(), std::move(onChunk));
+
         ChatPromptResult result;
-        try {
-            result = promptInternalChat(m_collections, promptCtx, startOffset);
-        } catch (const std::exception &e) {
-            m_chatModel->setResponseValue(e.what());
-            m_chatModel->setError();
-            emit responseStopped(0);
-            return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+        if (cached) {
+            // replayed as if it had just been generated, with all of the prompt reported as cached
+            auto &choice = cached->choices.at(i);
+            result.response           = choice.text.toUtf8();
+            result.promptTokens       = cached->promptTokens;
+            result.cachedPromptTokens = cached->promptTokens;
+            result.responseTokens     = choice.responseTokens;
+            onChunk(std::string_view(result.response.cbegin(), result.response.cend()));
+            if (mirror)
+                m_chatModel->setResponseValue(choice.text);
+        } else {
+            try {
+                // The sources retrieved for the first choice are kept on the prompt, so the other choices render the
+                // same prompt. Skip the retrieval for them, and the rest of the prompt is reused from the KV cache.
+                result = promptInternalConversation(conversation, i == 0 ? collections : QList<QString>(), promptCtx,
+                                                    onChunk, isCancelled);
+            } catch (const std::exception &e) {
+                if (mirror) {
+                    m_chatModel->setResponseValue(e.what());
+                    m_chatModel->setError();
+                }
+                emit responseStopped(0);
+                if (request.stream)
+                    reply->sendEvent(streamErrorEvent(e.what()));
+                return makeError(QHttpServerResponder::StatusCode::InternalServerError);
+            }
+            newEntry.choices << ResponseCache::Choice { QString::fromUtf8(result.response), result.responseTokens };
+        }
+        if (result.retrievalMs >= 0) {
+            ServerMetrics::globalInstance()->observeRetrieval(result.retrievalMs / 1e3);
+            if (mirroredPromptIndex)
+                m_chatModel->updateSources(*mirroredPromptIndex, result.databaseResults);
+        }
+        if (i > 0)
+            result.databaseResults = responses.first().second;
+        if (request.stream) {
+            QJsonObject choice {
+                { "index",         i                                                               },
+                { "delta",         QJsonObject()                                                   },
+                { "logprobs",      QJsonValue::Null                                                },
+                { "finish_reason", result.responseTokens == request.max_tokens ? "length" : "stop" },
+            };
+            if (MySettings::globalInstance()->localDocsShowReferences()) {
+                QJsonArray references;
+                for (const auto &ref : std::as_const(result.databaseResults))
+                    references.append(resultToJson(ref));
+                choice.insert("references", references.isEmpty() ? QJsonValue::Null : QJsonValue(references));
+            }
+            reply->sendEvent(makeChunk(choice));
         }
         responses.emplace_back(result.response, result.databaseResults);
-        if (i == 0)
+        if (i == 0) {
             promptTokens = result.promptTokens;
+            cachedTokens = result.cachedPromptTokens;
+        }
         responseTokens += result.responseTokens;
     }
 
-    QJsonObject responseObject {
-        { "id",      "placeholder"                      },
-        { "object",  "chat.completion"                  },
-        { "created", QDateTime::currentSecsSinceEpoch() },
-        { "model",   modelInfo.name()                   },
+    QJsonObject usage {
+        { "prompt_tokens",     promptTokens                  },
+        { "completion_tokens", responseTokens                },
+        { "total_tokens",      promptTokens + responseTokens },
+        { "prompt_tokens_details", QJsonObject { { "cached_tokens", cachedTokens } } },
     };
+    if (!cached) {
+        ServerMetrics::globalInstance()->addTokens(modelInfo.name(), promptTokens, responseTokens, cachedTokens);
+        if (cacheKey && !reply->isCancelled()) {
+            newEntry.promptTokens = promptTokens;
+            ResponseCache::globalInstance()->insert(*cacheKey, newEntry);
+        }
+    }
+
+    if (request.stream) {
+        if (request.include_usage) {
+            responseObject.insert("object", "chat.completion.chunk");
+            responseObject.insert("choices", QJsonArray());
+            responseObject.insert("usage", usage);
+            reply->sendEvent(responseObject);
+        }
+        return {QHttpServerResponse(QHttpServerResponder::StatusCode::Ok), std::nullopt};
+    }
 
     QJsonArray choices;
     {
@@ -843,11 +2302,7 @@ auto Server::handleChatRequest(const ChatRequest &request)
     }
 
     responseObject.insert("choices", choices);
-    responseObject.insert("usage", QJsonObject {
-        { "prompt_tokens",     promptTokens                  },
-        { "completion_tokens", responseTokens                },
-        { "total_tokens",      promptTokens + responseTokens },
-    });
+    responseObject.insert("usage", usage);
 
     return {QHttpServerResponse(responseObject), responseObject};
 }
@@ -1,52 +1,117 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "batchstore.h"
 #include "chatllm.h"
 #include "database.h"
 
+#include <QHash>
 #include <QHttpServer>
 #include <QHttpServerResponse>
 #include <QJsonObject>
 #include <QList>
 #include <QObject> // IWYU pragma: keep
 #include <QString>
+#include <QThread>
+#include <QtTypes>
 
 #include <memory>
 #include <optional>
 #include <utility>
+#include <vector>
 
 class Chat;
+class ChatModel;
 class ChatRequest;
 class CompletionRequest;
+class ConnectionTracker;
+class EmbeddingBatcher;
+class ServerReply;
 
 
-class Server : public ChatLLM
+// Handles completion requests on its own LLM thread. Each request is prompted from a conversation that lives only as
+// long as the request. If given a chat model, the worker can also show its requests in the server chat.
+class ServerWorker : public ChatLLM
 {
     Q_OBJECT
 
 public:
-    explicit Server(Chat *chat);
-    ~Server() override = default;
+    explicit ServerWorker(Chat *chat, ChatModel *mirrorModel = nullptr);
+    ~ServerWorker() override;
 
-public Q_SLOTS:
-    void start();
+    auto handleCompletionRequest(const CompletionRequest &request, ServerReply *reply) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
+    auto handleChatRequest(const ChatRequest &request, const QList<QString> &collections, ServerReply *reply) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
 
 Q_SIGNALS:
     void requestResetResponseState();
 
-private:
-    auto handleCompletionRequest(const CompletionRequest &request) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
-    auto handleChatRequest(const ChatRequest &request) -> std::pair<QHttpServerResponse, std::optional<QJsonObject>>;
-
 private Q_SLOTS:
     void handleDatabaseResultsChanged(const QList<ResultInfo> &results) { m_databaseResults = results; }
-    void handleCollectionListChanged(const QList<QString> &collectionList) { m_collections = collectionList; }
 
 private:
-    Chat *m_chat;
-    std::unique_ptr<QHttpServer> m_server;
+    // loads the model if needed, and records it in the metrics
+    bool loadRequestedModel(const ModelInfo &modelInfo);
+    // decides whether the current request is shown in the server chat, and sets m_chatModel accordingly
+    bool startMirroring();
+
+    ChatModel *m_mirrorModel;
     QList<ResultInfo> m_databaseResults;
+};
+
+class Server : public ServerWorker
+{
+    Q_OBJECT
+
+public:
+    // chat is null for the headless server
+    explicit Server(Chat *chat);
+    ~Server() override;
+
+    // the LocalDocs collections used for chat requests, if there is no chat to take them from; call before start()
+    void setCollections(const QList<QString> &collections);
+
+public Q_SLOTS:
+    void start();
+
+private:
+    struct Job;
+    struct BatchRun;
+    struct LastJob { QString client; QString model; };
+
+    // these run on the HTTP thread
+    void setupHttpServer();
+    void enqueue(const std::shared_ptr<Job> &job);
+    void dispatch();
+    void handleTimeout(const std::shared_ptr<Job> &job);
+    // cancels the job if its client disconnects
+    void watchConnection(const QHttpServerRequest &request, const std::shared_ptr<Job> &job);
+    void handleDisconnect(const std::shared_ptr<Job> &job);
+    // batches, see BatchRun
+    QHttpServerResponse createBatch(const QHttpServerRequest &request);
+    QHttpServerResponse cancelBatch(const QString &id);
+    void runNextBatchItem(const std::shared_ptr<BatchRun> &run, qsizetype laneIndex);
+    void finishBatch(const std::shared_ptr<BatchRun> &run);
+    bool isEnabled() const; // the API server can be turned off in the GUI
+
+private:
+    Chat *m_chat;
+    // the HTTP server has its own thread so it can keep accepting requests while the workers generate
+    QThread m_httpThread;
+    QHttpServer *m_server = nullptr;
+    ConnectionTracker *m_tcpServer = nullptr;
+    EmbeddingBatcher *m_embeddings = nullptr; // lives on the HTTP thread
+
+    // only accessed on the HTTP thread
+    QList<std::shared_ptr<Job>> m_queue;
+    QList<ServerWorker *> m_idleWorkers;
+    QHash<ServerWorker *, LastJob> m_workerLastJob; // for KV cache affinity
+    std::vector<std::unique_ptr<ServerWorker>> m_extraWorkers;
+    int m_busyWorkers = 0;
+    QHash<QString, quint64> m_clientLastServed; // for fair scheduling
+    quint64 m_dispatchCount = 0;
     QList<QString> m_collections;
+    std::unique_ptr<BatchStore> m_batchStore;
+    QHash<QString, std::shared_ptr<BatchRun>> m_batchRuns; // by batch ID, while they run
 };
 
 #endif // SERVER_H
@@ -0,0 +1,167 @@
+#include "config.h"
+#include "localdocs.h"
+#include "logger.h"
+#include "modellist.h"
+#include "mysettings.h"
+#include "server.h"
+
+#include <gpt4all-backend/llmodel.h>
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QObject>
+#include <QSettings>
+#include <QString>
+#include <QStringList>
+#include <QtSystemDetection>
+
+#include <cstdio>
+
+#ifndef GPT4ALL_USE_QTPDF
+#   include <fpdfview.h>
+#endif
+
+#ifndef Q_OS_WINDOWS
+#   include <signal.h>
+#endif
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// Runs the local API server without the chat UI. It shares its settings and models with the GUI, and retrieves from
+// its LocalDocs collections without changing them. Anything given on the command line or in a config file applies to
+// this process only.
+int main(int argc, char *argv[])
+{
+#ifndef GPT4ALL_USE_QTPDF
+    FPDF_InitLibrary();
+#endif
+
+    QCoreApplication::setOrganizationName("nomic.ai");
+    QCoreApplication::setOrganizationDomain("gpt4all.io");
+    QCoreApplication::setApplicationName("GPT4All");
+    QCoreApplication::setApplicationVersion(APP_VERSION);
+    QSettings::setDefaultFormat(QSettings::IniFormat);
+
+    Logger::globalInstance();
+
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(u"GPT4All local API server"_s);
+    parser.addHelpOption();
+    parser.addVersionOption();
+    QCommandLineOption configOption(u"config"_s,
+        u"Read settings from an INI file, using the same keys as the GPT4All settings file."_s, u"file"_s);
+    QCommandLineOption hostOption(u"host"_s, u"Address to listen on (default: 127.0.0.1)."_s, u"address"_s);
+    QCommandLineOption portOption(u"port"_s, u"Port to listen on (default: 4891)."_s, u"port"_s);
+    QCommandLineOption modelPathOption(u"model-path"_s, u"Directory to load models from."_s, u"dir"_s);
+    QCommandLineOption threadsOption(u"threads"_s, u"CPU threads used per request."_s, u"n"_s);
+    QCommandLineOption concurrencyOption(u"concurrency"_s,
+        u"Requests generated at once, each with its own copy of the model."_s, u"n"_s);
+    QCommandLineOption queueDepthOption(u"max-queue-depth"_s,
+        u"Requests that may wait for a worker before new ones are rejected."_s, u"n"_s);
+    QCommandLineOption timeoutOption(u"request-timeout"_s,
+        u"Seconds a request may take before it is cancelled, 0 for no limit."_s, u"seconds"_s);
+    QCommandLineOption collectionOption(u"collection"_s,
+        u"LocalDocs collection to use for chat completions. May be given more than once."_s, u"name"_s);
+    parser.addOptions({
+        configOption, hostOption, portOption, modelPathOption, threadsOption, concurrencyOption, queueDepthOption,
+        timeoutOption, collectionOption,
+    });
+    parser.process(app);
+
+    // set search path before constructing the MySettings instance, which relies on this
+    {
+        auto appDirPath = QCoreApplication::applicationDirPath();
+        QStringList searchPaths {
+#ifdef Q_OS_DARWIN
+            u"%1/../Frameworks"_s.arg(appDirPath),
+#else
+            appDirPath,
+            u"%1/../lib"_s.arg(appDirPath),
+#endif
+        };
+        LLModel::Implementation::setImplementationsSearchPath(searchPaths.join(u';').toStdString());
+    }
+
+    auto *mySettings = MySettings::globalInstance();
+
+    if (parser.isSet(configOption)) {
+        auto path = parser.value(configOption);
+        if (!QFileInfo::exists(path)) {
+            std::fprintf(stderr, "error: config file not found: %s\n", qPrintable(path));
+            return 1;
+        }
+        QSettings config(path, QSettings::IniFormat);
+        if (config.status() != QSettings::NoError) {
+            std::fprintf(stderr, "error: failed to parse config file: %s\n", qPrintable(path));
+            return 1;
+        }
+        for (auto &key : config.allKeys())
+            mySettings->setOverride(key, config.value(key));
+    }
+
+    // options on the command line take precedence over the config file
+    auto setIntOverride = [&](const QCommandLineOption &option, const QString &setting) {
+        if (!parser.isSet(option))
+            return true;
+        bool ok;
+        int value = parser.value(option).toInt(&ok);
+        if (!ok) {
+            std::fprintf(stderr, "error: --%s must be an integer\n", qPrintable(option.names().first()));
+            return false;
+        }
+        mySettings->setOverride(setting, value);
+        return true;
+    };
+    if (!setIntOverride(portOption,        u"networkPort"_s          ) ||
+        !setIntOverride(threadsOption,     u"threadCount"_s          ) ||
+        !setIntOverride(concurrencyOption, u"server/concurrency"_s   ) ||
+        !setIntOverride(queueDepthOption,  u"server/maxQueueDepth"_s ) ||
+        !setIntOverride(timeoutOption,     u"server/requestTimeout"_s))
+        return 1;
+    if (parser.isSet(hostOption))
+        mySettings->setOverride(u"server/listenAddress"_s, parser.value(hostOption));
+    if (parser.isSet(modelPathOption)) {
+        QFileInfo dir(parser.value(modelPathOption));
+        if (!dir.isDir()) {
+            std::fprintf(stderr, "error: model path is not a directory: %s\n", qPrintable(dir.filePath()));
+            return 1;
+        }
+        mySettings->setOverride(u"modelPath"_s, dir.canonicalFilePath() + u'/');
+    }
+
+    auto *modelList = ModelList::globalInstance();
+    QObject::connect(modelList, &ModelList::dataChanged, mySettings, &MySettings::onModelInfoChanged);
+
+    int res;
+    {
+        Server server(nullptr);
+        server.setCollections(parser.values(collectionOption));
+        if (parser.isSet(collectionOption))
+            LocalDocs::globalInstance()->startReadOnly(); // the GUI indexes them
+
+#ifndef Q_OS_WINDOWS
+        // handle signals gracefully
+        struct sigaction sa;
+        sa.sa_handler = [](int s) { QCoreApplication::exit(s == SIGINT ? 0 : 1); };
+        sa.sa_flags   = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT,  &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        sigaction(SIGHUP,  &sa, nullptr);
+#endif
+
+        res = app.exec();
+        // the server's LLM threads are joined here, before global destructors run
+    }
+
+#ifndef GPT4ALL_USE_QTPDF
+    FPDF_DestroyLibrary();
+#endif
+
+    return res;
+}
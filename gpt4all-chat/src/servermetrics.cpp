@@ -0,0 +1,202 @@
+#include "servermetrics.h"
+
+#include <QGlobalStatic>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <iterator>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+class MyServerMetrics : public ServerMetrics { };
+Q_GLOBAL_STATIC(MyServerMetrics, serverMetricsInstance)
+ServerMetrics *ServerMetrics::globalInstance()
+{
+    return serverMetricsInstance();
+}
+
+void ServerMetrics::Histogram::observe(double value)
+{
+    auto bucket = std::lower_bound(s_buckets.begin(), s_buckets.end(), value);
+    if (bucket != s_buckets.end())
+        counts[std::distance(s_buckets.begin(), bucket)]++;
+    count++;
+    sum += value;
+}
+
+void ServerMetrics::observeRequest(const QString &endpoint, const QString &model, int status, double seconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_requests[{ { endpoint, model }, status }]++;
+    m_requestDuration[{ endpoint, model }].observe(seconds);
+}
+
+void ServerMetrics::observeTimeToFirstToken(const QString &endpoint, const QString &model, double seconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_timeToFirstToken[{ endpoint, model }].observe(seconds);
+}
+
+void ServerMetrics::addTokens(const QString &model, qint64 prompt, qint64 completion, qint64 cached)
+{
+    QMutexLocker locker(&m_mutex);
+    auto &tokens = m_tokens[model];
+    tokens.prompt     += prompt;
+    tokens.completion += completion;
+    tokens.cached     += cached;
+}
+
+void ServerMetrics::observeModelLoad(const QString &model, double seconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_modelLoadDuration[model].observe(seconds);
+}
+
+void ServerMetrics::setLoadedModel(const void *worker, const QString &model, qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    if (model.isEmpty())
+        m_loadedModels.erase(worker);
+    else
+        m_loadedModels[worker] = { model, bytes };
+}
+
+void ServerMetrics::observeRetrieval(double seconds)
+{
+    QMutexLocker locker(&m_mutex);
+    m_retrievalDuration.observe(seconds);
+}
+
+void ServerMetrics::setQueueState(qsizetype queued, int busyWorkers)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queued      = queued;
+    m_busyWorkers = busyWorkers;
+}
+
+void ServerMetrics::observeResponseCache(bool hit)
+{
+    QMutexLocker locker(&m_mutex);
+    (hit ? m_responseCacheHits : m_responseCacheMisses)++;
+}
+
+void ServerMetrics::observeEmbeddingCache(bool hit)
+{
+    QMutexLocker locker(&m_mutex);
+    (hit ? m_embeddingCacheHits : m_embeddingCacheMisses)++;
+}
+
+static QByteArray labelValue(const QString &value)
+{
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return '"' + escaped + '"';
+}
+
+static QByteArray number(double value)
+{
+    return QByteArray::number(value, 'g', 17);
+}
+
+static void writeHeader(QByteArray &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP "_ba + name + ' ' + help + '\n';
+    out += "# TYPE "_ba + name + ' ' + type + '\n';
+}
+
+// labels is either empty or a comma-separated list of name="value" pairs
+static void writeHistogram(QByteArray &out, const char *name, const QByteArray &labels, const auto &buckets,
+                           const auto &histogram)
+{
+    QByteArray sep = labels.isEmpty() ? QByteArray() : labels + ',';
+    quint64 cumulative = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        cumulative += histogram.counts[i];
+        out += name + "_bucket{"_ba + sep + "le=\"" + number(buckets[i]) + "\"} " + QByteArray::number(cumulative)
+             + '\n';
+    }
+    out += name + "_bucket{"_ba + sep + "le=\"+Inf\"} " + QByteArray::number(histogram.count) + '\n';
+    QByteArray braced = labels.isEmpty() ? QByteArray() : '{' + labels + '}';
+    out += name + "_sum"_ba + braced + ' ' + number(histogram.sum) + '\n';
+    out += name + "_count"_ba + braced + ' ' + QByteArray::number(histogram.count) + '\n';
+}
+
+QByteArray ServerMetrics::render() const
+{
+    QMutexLocker locker(&m_mutex);
+    QByteArray out;
+
+    auto endpointLabels = [](const Labels &labels) {
+        return "endpoint="_ba + labelValue(labels.first) + ",model=" + labelValue(labels.second);
+    };
+
+    writeHeader(out, "gpt4all_requests_total", "counter", "Completed API requests.");
+    for (auto &[key, count] : m_requests) {
+        auto &[labels, status] = key;
+        out += "gpt4all_requests_total{" + endpointLabels(labels) + ",status=\"" + QByteArray::number(status) + "\"} "
+             + QByteArray::number(count) + '\n';
+    }
+
+    writeHeader(out, "gpt4all_request_duration_seconds", "histogram",
+                "Time from receiving an API request to completing the response, including time spent queued.");
+    for (auto &[labels, histogram] : m_requestDuration)
+        writeHistogram(out, "gpt4all_request_duration_seconds", endpointLabels(labels), s_buckets, histogram);
+
+    writeHeader(out, "gpt4all_time_to_first_token_seconds", "histogram",
+                "Time from receiving an API request to generating the first token, including time spent queued.");
+    for (auto &[labels, histogram] : m_timeToFirstToken)
+        writeHistogram(out, "gpt4all_time_to_first_token_seconds", endpointLabels(labels), s_buckets, histogram);
+
+    writeHeader(out, "gpt4all_queued_requests", "gauge", "API requests waiting for a worker.");
+    out += "gpt4all_queued_requests " + QByteArray::number(m_queued) + '\n';
+
+    writeHeader(out, "gpt4all_busy_workers", "gauge", "Workers that are handling an API request.");
+    out += "gpt4all_busy_workers " + QByteArray::number(m_busyWorkers) + '\n';
+
+    writeHeader(out, "gpt4all_prompt_tokens_total", "counter", "Prompt tokens processed, including cached ones.");
+    for (auto &[model, tokens] : m_tokens)
+        out += "gpt4all_prompt_tokens_total{model=" + labelValue(model) + "} " + QByteArray::number(tokens.prompt) + '\n';
+
+    writeHeader(out, "gpt4all_cached_prompt_tokens_total", "counter", "Prompt tokens reused from the KV cache.");
+    for (auto &[model, tokens] : m_tokens)
+        out += "gpt4all_cached_prompt_tokens_total{model=" + labelValue(model) + "} " + QByteArray::number(tokens.cached)
+             + '\n';
+
+    writeHeader(out, "gpt4all_completion_tokens_total", "counter", "Tokens generated.");
+    for (auto &[model, tokens] : m_tokens)
+        out += "gpt4all_completion_tokens_total{model=" + labelValue(model) + "} "
+             + QByteArray::number(tokens.completion) + '\n';
+
+    writeHeader(out, "gpt4all_model_load_duration_seconds", "histogram", "Time taken to load a model.");
+    for (auto &[model, histogram] : m_modelLoadDuration)
+        writeHistogram(out, "gpt4all_model_load_duration_seconds", "model=" + labelValue(model), s_buckets, histogram);
+
+    writeHeader(out, "gpt4all_loaded_model_bytes", "gauge", "Size of the model files loaded by the API server.");
+    {
+        std::map<QString, qint64> bytesByModel;
+        for (auto &[worker, loaded] : m_loadedModels)
+            bytesByModel[loaded.first] += loaded.second;
+        for (auto &[model, bytes] : bytesByModel)
+            out += "gpt4all_loaded_model_bytes{model=" + labelValue(model) + "} " + QByteArray::number(bytes) + '\n';
+    }
+
+    writeHeader(out, "gpt4all_localdocs_retrieval_duration_seconds", "histogram",
+                "Time taken to retrieve LocalDocs sources for an API request.");
+    writeHistogram(out, "gpt4all_localdocs_retrieval_duration_seconds", {}, s_buckets, m_retrievalDuration);
+
+    writeHeader(out, "gpt4all_response_cache_requests_total", "counter",
+                "Cacheable API requests, by whether the response cache had their response.");
+    out += "gpt4all_response_cache_requests_total{result=\"hit\"} " + QByteArray::number(m_responseCacheHits) + '\n';
+    out += "gpt4all_response_cache_requests_total{result=\"miss\"} " + QByteArray::number(m_responseCacheMisses)
+         + '\n';
+
+    writeHeader(out, "gpt4all_embedding_cache_requests_total", "counter",
+                "Embedding API requests, by whether the embedding cache had all of their inputs.");
+    out += "gpt4all_embedding_cache_requests_total{result=\"hit\"} " + QByteArray::number(m_embeddingCacheHits)
+         + '\n';
+    out += "gpt4all_embedding_cache_requests_total{result=\"miss\"} " + QByteArray::number(m_embeddingCacheMisses)
+         + '\n';
+
+    return out;
+}
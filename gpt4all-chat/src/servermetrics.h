@@ -0,0 +1,76 @@
+#ifndef SERVERMETRICS_H
+#define SERVERMETRICS_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QtTypes>
+
+#include <array>
+#include <map>
+#include <utility>
+
+
+// Statistics of the local API server, exposed in the Prometheus text format on /metrics. Thread-safe.
+class ServerMetrics
+{
+public:
+    static ServerMetrics *globalInstance();
+
+    void observeRequest(const QString &endpoint, const QString &model, int status, double seconds);
+    void observeTimeToFirstToken(const QString &endpoint, const QString &model, double seconds);
+    void addTokens(const QString &model, qint64 prompt, qint64 completion, qint64 cached);
+    void observeModelLoad(const QString &model, double seconds);
+    // worker identifies a model instance; an empty model means that it has none loaded
+    void setLoadedModel(const void *worker, const QString &model, qint64 bytes);
+    void observeRetrieval(double seconds);
+    void setQueueState(qsizetype queued, int busyWorkers);
+    void observeResponseCache(bool hit);
+    void observeEmbeddingCache(bool hit);
+
+    QByteArray render() const;
+
+private:
+    // upper bounds in seconds, in addition to +Inf
+    static constexpr std::array<double, 12> s_buckets {
+        0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120,
+    };
+
+    struct Histogram {
+        std::array<quint64, s_buckets.size()> counts {}; // not cumulative
+        quint64 count = 0;
+        double  sum   = 0;
+
+        void observe(double value);
+    };
+
+    struct Tokens {
+        qint64 prompt     = 0;
+        qint64 completion = 0;
+        qint64 cached     = 0;
+    };
+
+    using Labels = std::pair<QString, QString>; // endpoint, model
+
+    ServerMetrics() = default;
+    ~ServerMetrics() = default;
+
+    mutable QMutex                                     m_mutex;
+    std::map<std::pair<Labels, int>, quint64>          m_requests; // by status code
+    std::map<Labels, Histogram>                        m_requestDuration;
+    std::map<Labels, Histogram>                        m_timeToFirstToken;
+    std::map<QString, Tokens>                          m_tokens;
+    std::map<QString, Histogram>                       m_modelLoadDuration;
+    std::map<const void *, std::pair<QString, qint64>> m_loadedModels;
+    Histogram                                          m_retrievalDuration;
+    qsizetype                                          m_queued      = 0;
+    int                                                m_busyWorkers = 0;
+    quint64                                            m_responseCacheHits   = 0;
+    quint64                                            m_responseCacheMisses = 0;
+    quint64                                            m_embeddingCacheHits   = 0;
+    quint64                                            m_embeddingCacheMisses = 0;
+
+    friend class MyServerMetrics;
+};
+
+#endif // SERVERMETRICS_H
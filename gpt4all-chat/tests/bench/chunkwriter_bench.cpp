@@ -0,0 +1,243 @@
+// Compares writing LocalDocs chunks and embeddings one row per statement, as Database did before ChunkWriter, with
+// ChunkWriter's multi-row statements. Both write a synthetic corpus to a database that Database created, with the
+// schema and full-text triggers of the current version, and the rows per second of each are printed.
+//
+//     chunkwriter_bench [number of chunks]
+
+#include "chunkwriter.h"
+#include "database.h"
+#include "mysettings.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMetaObject>
+#include <QRandomGenerator>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QVariant>
+#include <Qt>
+#include <QtLogging>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// a folder in a collection that is embedded with "model", and a document in it
+static const QString CORPUS_SQL[] = {
+    u"insert into folders(id, path) values(1, '/bench');"_s,
+    u"insert into collections(id, name, embedding_model) values(1, 'bench', 'model');"_s,
+    u"insert into collection_items(collection_id, folder_id) values(1, 1);"_s,
+    u"insert into documents(id, folder_id, document_time, document_path) values(1, 1, 0, '/bench/bench.pdf');"_s,
+};
+
+// The statement that Database::addChunk prepared for each chunk before ChunkWriter, with the columns that version 4
+// added. The full-text index is kept by the triggers, as for ChunkWriter.
+static const QString INSERT_CHUNK_SQL = uR"(
+    insert into chunks(document_id, chunk_text,
+        file, title, author, subject, keywords, page, line_from, line_to, words, tokens, text_hash)
+        values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+        returning id;
+)"_s;
+
+// the statement that sqlAddEmbeddings prepared once and ran for each embedding before ChunkWriter
+static const QString INSERT_EMBEDDING_SQL = uR"(
+    insert into embeddings(model, folder_id, chunk_id, embedding)
+    select :model, d.folder_id, :chunk_id, :embedding
+    from chunks c
+    join documents d on d.id = c.document_id
+    join collection_items ci on ci.folder_id = d.folder_id
+    join collections co on co.id = ci.collection_id
+    where co.embedding_model = :model and c.id = :chunk_id
+    limit 1;
+)"_s;
+
+// as many chunks as the ingestion workers hand to the database thread at once
+static constexpr std::size_t CHUNKS_PER_BATCH = 64;
+static constexpr int EMBEDDING_DIMENSIONS = 768;
+
+struct Result {
+    double chunksPerSecond;
+    double embeddingsPerSecond;
+};
+
+static std::vector<ChunkWriter::Chunk> makeCorpus(qsizetype nChunks)
+{
+    static const QStringList words {
+        u"local"_s, u"documents"_s, u"embedding"_s, u"search"_s, u"model"_s, u"chunk"_s, u"index"_s, u"query"_s,
+        u"vector"_s, u"database"_s, u"transaction"_s, u"statement"_s, u"prepared"_s, u"insert"_s, u"page"_s,
+    };
+    QRandomGenerator rng(42);
+    std::vector<ChunkWriter::Chunk> chunks;
+    chunks.reserve(nChunks);
+    for (qsizetype i = 0; i < nChunks; i++) {
+        QStringList text;
+        for (int w = 0; w < 80; w++)
+            text << words[rng.bounded(int(words.size()))];
+        chunks.push_back({
+            .documentId = 1, .text = text.join(u' '), .file = u"bench.pdf"_s, .title = u"Title"_s,
+            .author = u"Author"_s, .subject = u"Subject"_s, .keywords = u"Keywords"_s, .page = int(i / 10),
+            .lineFrom = -1, .lineTo = -1, .words = 80, .tokens = 100, .textHash = QByteArray::number(i),
+        });
+    }
+    return chunks;
+}
+
+static QByteArray makeEmbedding(QRandomGenerator &rng)
+{
+    QByteArray data(EMBEDDING_DIMENSIONS * sizeof(float), Qt::Uninitialized);
+    auto *floats = reinterpret_cast<float *>(data.data());
+    for (int i = 0; i < EMBEDDING_DIMENSIONS; i++)
+        floats[i] = float(rng.generateDouble());
+    return data;
+}
+
+// Has Database create an empty database in dir, which is copied for each writer.
+static QString createDatabase(const QTemporaryDir &dir)
+{
+    MySettings::globalInstance()->setOverride(u"modelPath"_s, dir.path());
+    auto database = std::make_unique<Database>(512, QStringList { u"txt"_s });
+    QMetaObject::invokeMethod(database.get(), &Database::start, Qt::BlockingQueuedConnection);
+    if (!database->isValid())
+        qFatal() << "Database could not create a database in" << dir.path();
+    database.reset();
+    return dir.filePath(u"localdocs_v4.db"_s);
+}
+
+static QSqlDatabase openCopy(const QString &dbPath, const QString &path)
+{
+    if (!QFile::copy(dbPath, path))
+        qFatal() << "cannot copy" << dbPath << "to" << path;
+    auto db = QSqlDatabase::addDatabase(u"QSQLITE"_s, path);
+    db.setDatabaseName(path);
+    if (!db.open())
+        qFatal() << "cannot open" << path << db.lastError();
+    QSqlQuery q(db);
+    for (const auto &sql: CORPUS_SQL) {
+        if (!q.exec(sql))
+            qFatal() << "cannot add the document:" << q.lastError();
+    }
+    return db;
+}
+
+static Result rowByRow(QSqlDatabase &db, std::span<const ChunkWriter::Chunk> chunks)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QList<int> chunkIds;
+    for (std::size_t i = 0; i < chunks.size(); i += CHUNKS_PER_BATCH) {
+        db.transaction();
+        for (const auto &c: chunks.subspan(i, std::min(CHUNKS_PER_BATCH, chunks.size() - i))) {
+            QSqlQuery q(db);
+            if (!q.prepare(INSERT_CHUNK_SQL))
+                qFatal() << q.lastError();
+            for (const QVariant &v: { QVariant(c.documentId), QVariant(c.text), QVariant(c.file), QVariant(c.title),
+                                      QVariant(c.author), QVariant(c.subject), QVariant(c.keywords),
+                                      QVariant(c.page), QVariant(c.lineFrom), QVariant(c.lineTo),
+                                      QVariant(c.words), QVariant(c.tokens), QVariant(c.textHash) })
+                q.addBindValue(v);
+            if (!q.exec() || !q.next())
+                qFatal() << q.lastError();
+            chunkIds << q.value(0).toInt();
+        }
+        db.commit();
+    }
+    const double chunkSeconds = timer.nsecsElapsed() / 1e9;
+
+    QRandomGenerator rng(7);
+    timer.restart();
+    db.transaction();
+    QSqlQuery q(db);
+    if (!q.prepare(INSERT_EMBEDDING_SQL))
+        qFatal() << q.lastError();
+    for (int chunkId: std::as_const(chunkIds)) {
+        q.bindValue(u":model"_s, u"model"_s);
+        q.bindValue(u":chunk_id"_s, chunkId);
+        q.bindValue(u":embedding"_s, makeEmbedding(rng));
+        if (!q.exec())
+            qFatal() << q.lastError();
+    }
+    db.commit();
+    const double embeddingSeconds = timer.nsecsElapsed() / 1e9;
+
+    return { chunks.size() / chunkSeconds, chunkIds.size() / embeddingSeconds };
+}
+
+static Result multiRow(QSqlDatabase &db, std::span<const ChunkWriter::Chunk> chunks)
+{
+    ChunkWriter writer(db);
+
+    QElapsedTimer timer;
+    timer.start();
+    QList<int> chunkIds;
+    for (std::size_t i = 0; i < chunks.size(); i += CHUNKS_PER_BATCH) {
+        db.transaction();
+        if (!writer.addChunks(chunks.subspan(i, std::min(CHUNKS_PER_BATCH, chunks.size() - i)), chunkIds))
+            qFatal() << writer.lastError();
+        db.commit();
+    }
+    const double chunkSeconds = timer.nsecsElapsed() / 1e9;
+
+    QRandomGenerator rng(7);
+    timer.restart();
+    std::vector<ChunkWriter::Embedding> embeddings;
+    embeddings.reserve(chunkIds.size());
+    for (int chunkId: std::as_const(chunkIds))
+        embeddings.push_back({ u"model"_s, chunkId, makeEmbedding(rng) });
+    db.transaction();
+    QList<bool> added;
+    if (!writer.addEmbeddings(embeddings, added) || added.count(true) != chunkIds.size())
+        qFatal() << "embeddings were not added:" << writer.lastError();
+    db.commit();
+    const double embeddingSeconds = timer.nsecsElapsed() / 1e9;
+
+    return { chunks.size() / chunkSeconds, chunkIds.size() / embeddingSeconds };
+}
+
+// both writers leave the same rows, and the same full-text index
+static void checkSameRows(QSqlDatabase &a, QSqlDatabase &b)
+{
+    for (const auto &sql: { u"select count(*) from chunks;"_s, u"select count(*) from embeddings;"_s,
+                            u"select count(*) from chunks_fts where chunks_fts match 'prepared';"_s }) {
+        QSqlQuery qa(a), qb(b);
+        if (!qa.exec(sql) || !qa.next() || !qb.exec(sql) || !qb.next())
+            qFatal() << "cannot compare the databases:" << qa.lastError() << qb.lastError();
+        if (qa.value(0) != qb.value(0))
+            qFatal() << "the writers differ in" << sql << qa.value(0) << qb.value(0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const qsizetype nChunks = argc > 1 ? QString::fromLocal8Bit(argv[1]).toLongLong() : 20000;
+
+    QTemporaryDir dir;
+    if (!dir.isValid())
+        qFatal() << "cannot create a temporary directory";
+    const QString dbPath = createDatabase(dir);
+
+    const auto corpus = makeCorpus(nChunks);
+    QSqlDatabase before = openCopy(dbPath, dir.filePath(u"row-by-row.db"_s));
+    QSqlDatabase after  = openCopy(dbPath, dir.filePath(u"multi-row.db"_s));
+    const Result beforeResult = rowByRow(before, corpus);
+    const Result afterResult  = multiRow(after, corpus);
+    checkSameRows(before, after);
+
+    std::printf("%lld chunks of 80 words, embeddings of %d floats\n", qlonglong(nChunks), EMBEDDING_DIMENSIONS);
+    std::printf("%-12s %16s %16s\n", "", "chunks/s", "embeddings/s");
+    std::printf("%-12s %16.0f %16.0f\n", "row by row", beforeResult.chunksPerSecond, beforeResult.embeddingsPerSecond);
+    std::printf("%-12s %16.0f %16.0f\n", "multi-row", afterResult.chunksPerSecond, afterResult.embeddingsPerSecond);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "boundedqueue.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+
+TEST(BoundedQueueTest, PopsInOrder) {
+    BoundedQueue<int> queue(4);
+    EXPECT_TRUE(queue.isEmpty());
+    EXPECT_FALSE(queue.tryPop());
+    for (int i = 0; i < 4; i++)
+        ASSERT_TRUE(queue.push(i));
+    EXPECT_FALSE(queue.isEmpty());
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(queue.pop(), i);
+    EXPECT_TRUE(queue.isEmpty());
+}
+
+TEST(BoundedQueueTest, PushWaitsForRoom) {
+    BoundedQueue<int> queue(1);
+    ASSERT_TRUE(queue.push(1));
+
+    std::atomic<bool> pushed = false;
+    std::thread producer([&] {
+        EXPECT_TRUE(queue.push(2));
+        pushed = true;
+    });
+    std::this_thread::sleep_for(50ms);
+    EXPECT_FALSE(pushed); // the queue is full
+
+    EXPECT_EQ(queue.pop(), 1);
+    producer.join();
+    EXPECT_TRUE(pushed);
+    EXPECT_EQ(queue.pop(), 2);
+}
+
+TEST(BoundedQueueTest, CloseKeepsQueuedItems) {
+    BoundedQueue<int> queue(4);
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    queue.close();
+
+    EXPECT_FALSE(queue.push(3));
+    EXPECT_EQ(queue.pop(), 1);
+    EXPECT_EQ(queue.tryPop(), 2);
+    // closed and empty
+    EXPECT_FALSE(queue.pop());
+    EXPECT_FALSE(queue.tryPop());
+}
+
+TEST(BoundedQueueTest, CloseFailsWaitingPush) {
+    BoundedQueue<int> queue(1);
+    ASSERT_TRUE(queue.push(1));
+
+    std::atomic<int> result = -1;
+    std::thread producer([&] { result = queue.push(2); });
+    std::this_thread::sleep_for(50ms);
+    queue.close();
+    producer.join();
+
+    EXPECT_EQ(result, 0);
+    EXPECT_EQ(queue.pop(), 1);
+    EXPECT_FALSE(queue.pop());
+}
+
+TEST(BoundedQueueTest, CloseWakesWaitingPop) {
+    BoundedQueue<int> queue(1);
+    std::atomic<bool> popped = false;
+    std::thread consumer([&] {
+        EXPECT_FALSE(queue.pop());
+        popped = true;
+    });
+    std::this_thread::sleep_for(50ms);
+    EXPECT_FALSE(popped);
+    queue.close();
+    consumer.join();
+    EXPECT_TRUE(popped);
+}
+
+TEST(BoundedQueueTest, DeliversEveryItemOnce) {
+    constexpr int PRODUCERS = 4;
+    constexpr int ITEMS = 1000;
+    BoundedQueue<int> queue(8);
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; p++) {
+        producers.emplace_back([&queue, p] {
+            for (int i = 0; i < ITEMS; i++)
+                EXPECT_TRUE(queue.push(p * ITEMS + i));
+        });
+    }
+    std::vector<int> seen(PRODUCERS * ITEMS);
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 2; c++) {
+        consumers.emplace_back([&] {
+            while (auto item = queue.pop())
+                seen[*item]++; // each item is popped by one consumer only
+        });
+    }
+
+    for (auto &producer: producers)
+        producer.join();
+    queue.close();
+    for (auto &consumer: consumers)
+        consumer.join();
+
+    for (int i = 0; i < PRODUCERS * ITEMS; i++)
+        EXPECT_EQ(seen[i], 1) << "item " << i;
+}
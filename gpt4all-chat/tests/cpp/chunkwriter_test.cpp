@@ -0,0 +1,157 @@
+#include "chunkwriter.h"
+
+#include <gtest/gtest.h>
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QVariant>
+
+#include <utility>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// the tables of the LocalDocs database that ChunkWriter writes and reads
+static const QString SCHEMA_SQL[] = {
+    uR"(
+        create table chunks(
+            id            integer primary key autoincrement,
+            document_id   integer not null,
+            chunk_text    text not null,
+            file          text not null,
+            title         text,
+            author        text,
+            subject       text,
+            keywords      text,
+            page          integer,
+            line_from     integer,
+            line_to       integer,
+            words         integer default 0 not null,
+            tokens        integer default 0 not null,
+            text_hash     blob
+        );
+    )"_s,
+    u"create table collections(id integer primary key, name text unique not null, embedding_model text);"_s,
+    u"create table folders(id integer primary key autoincrement, path text unique not null);"_s,
+    u"create table collection_items(collection_id integer not null, folder_id integer not null);"_s,
+    uR"(
+        create table documents(
+            id integer primary key, folder_id integer not null, document_time integer not null,
+            document_path text unique not null, content_hash blob
+        );
+    )"_s,
+    uR"(
+        create table embeddings(
+            model text not null, folder_id integer not null, chunk_id integer not null, embedding blob not null,
+            primary key(model, folder_id, chunk_id), unique(model, chunk_id)
+        );
+    )"_s,
+    u"insert into folders(id, path) values(1, '/docs');"_s,
+    u"insert into collections(id, name, embedding_model) values(1, 'docs', 'model');"_s,
+    u"insert into collection_items(collection_id, folder_id) values(1, 1);"_s,
+    u"insert into documents(id, folder_id, document_time, document_path) values(1, 1, 0, '/docs/a.txt');"_s,
+};
+
+class ChunkWriterTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        m_db = QSqlDatabase::addDatabase(u"QSQLITE"_s, u"chunkwriter-test"_s);
+        m_db.setDatabaseName(u":memory:"_s);
+        ASSERT_TRUE(m_db.open());
+        QSqlQuery q(m_db);
+        for (const auto &sql: SCHEMA_SQL)
+            ASSERT_TRUE(q.exec(sql)) << qPrintable(q.lastError().text());
+    }
+
+    void TearDown() override
+    {
+        m_db.close();
+        m_db = {};
+        QSqlDatabase::removeDatabase(u"chunkwriter-test"_s);
+    }
+
+    static ChunkWriter::Chunk chunk(int i)
+    {
+        return {
+            .documentId = 1, .text = u"chunk %1"_s.arg(i), .file = u"a.txt"_s, .title = {}, .author = {},
+            .subject = {}, .keywords = {}, .page = -1, .lineFrom = i, .lineTo = i, .words = 2, .tokens = 3,
+            .textHash = QByteArray::number(i),
+        };
+    }
+
+    QSqlDatabase m_db;
+};
+
+TEST_F(ChunkWriterTest, AddsChunksInOrder) {
+    // two full statements and a remainder that is inserted one by one
+    std::vector<ChunkWriter::Chunk> chunks;
+    for (int i = 0; i < 70; i++)
+        chunks.push_back(chunk(i));
+
+    ChunkWriter writer(m_db);
+    QList<int> chunkIds;
+    ASSERT_TRUE(writer.addChunks(chunks, chunkIds)) << qPrintable(writer.lastError().text());
+    ASSERT_EQ(chunkIds.size(), 70);
+
+    QSqlQuery q(m_db);
+    ASSERT_TRUE(q.prepare(u"select chunk_text, line_from, tokens from chunks where id = ?;"_s));
+    for (int i = 0; i < 70; i++) {
+        if (i)
+            EXPECT_GT(chunkIds[i], chunkIds[i - 1]);
+        q.addBindValue(chunkIds[i]);
+        ASSERT_TRUE(q.exec());
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toString(), u"chunk %1"_s.arg(i));
+        EXPECT_EQ(q.value(1).toInt(), i);
+        EXPECT_EQ(q.value(2).toInt(), 3);
+    }
+
+    // the statements are kept for the next call
+    chunkIds.clear();
+    ASSERT_TRUE(writer.addChunks(std::vector { chunk(70) }, chunkIds));
+    EXPECT_EQ(chunkIds.size(), 1);
+}
+
+TEST_F(ChunkWriterTest, AddsOnlyNeededEmbeddings) {
+    ChunkWriter writer(m_db);
+    QList<int> chunkIds;
+    std::vector<ChunkWriter::Chunk> chunks;
+    for (int i = 0; i < 40; i++)
+        chunks.push_back(chunk(i));
+    ASSERT_TRUE(writer.addChunks(chunks, chunkIds));
+
+    const QByteArray data(16, '\1');
+    std::vector<ChunkWriter::Embedding> embeddings;
+    for (int id: std::as_const(chunkIds))
+        embeddings.push_back({ u"model"_s, id, data });
+    embeddings.push_back({ u"other model"_s, chunkIds.first(), data }); // not used by the collection
+    embeddings.push_back({ u"model"_s, chunkIds.last() + 1, data });    // no such chunk
+
+    QList<bool> added;
+    ASSERT_TRUE(writer.addEmbeddings(embeddings, added)) << qPrintable(writer.lastError().text());
+    ASSERT_EQ(added.size(), qsizetype(embeddings.size()));
+    for (qsizetype i = 0; i < chunkIds.size(); i++)
+        EXPECT_TRUE(added[i]) << "chunk " << chunkIds[i];
+    EXPECT_FALSE(added[chunkIds.size()]);
+    EXPECT_FALSE(added[chunkIds.size() + 1]);
+
+    QSqlQuery q(m_db);
+    ASSERT_TRUE(q.exec(u"select count(*) from embeddings where model = 'model' and folder_id = 1;"_s));
+    ASSERT_TRUE(q.next());
+    EXPECT_EQ(q.value(0).toInt(), 40);
+}
+
+TEST_F(ChunkWriterTest, ReportsErrors) {
+    QSqlQuery q(m_db);
+    ASSERT_TRUE(q.exec(u"drop table chunks;"_s));
+
+    ChunkWriter writer(m_db);
+    QList<int> chunkIds;
+    EXPECT_FALSE(writer.addChunks(std::vector { chunk(0) }, chunkIds));
+    EXPECT_TRUE(writer.lastError().isValid());
+    EXPECT_TRUE(chunkIds.isEmpty());
+}
@@ -0,0 +1,211 @@
+#include "database.h"
+#include "mysettings.h"
+
+#include <gtest/gtest.h>
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDeadlineTimer>
+#include <QDir>
+#include <QFile>
+#include <QFileDevice>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QList>
+#include <QMetaObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QVariant>
+#include <Qt>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+using namespace Qt::Literals::StringLiterals;
+using namespace std::chrono_literals;
+
+
+// the text of one chunk, which a.txt has from the start
+static const QByteArray DUPLICATE_TEXT = "the quick brown fox jumps over the lazy dog\n";
+
+// an embedding that the test gives the chunk of a.txt, as there is no embedding model
+static const QByteArray EMBEDDING = QByteArray::fromHex("0000803f000000400000404000008040");
+
+static const QString REJECT_EMBEDDINGS_SQL = uR"(
+    create trigger reject_embeddings before insert on embeddings begin
+        select raise(abort, 'rejected by the test');
+    end;
+)"_s;
+
+// polls until condition holds, or returns false after timeout
+static bool waitUntil(const std::function<bool()> &condition, std::chrono::milliseconds timeout = 10s)
+{
+    QDeadlineTimer deadline(timeout);
+    while (!condition()) {
+        if (deadline.hasExpired())
+            return false;
+        QThread::msleep(20);
+    }
+    return true;
+}
+
+// Indexes a folder with Database, which writes the chunks of its documents on the database thread, and checks the
+// result with a connection of the test's own. The collection's embedding model does not exist, so the chunks are not
+// embedded unless an embedding of the same text is found in the database.
+class DatabaseIndexingTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(m_dir.isValid());
+        m_folder = QFileInfo(m_dir.filePath(u"notes"_s)).absoluteFilePath();
+        ASSERT_TRUE(QDir().mkpath(m_folder));
+        m_folder = QFileInfo(m_folder).canonicalFilePath();
+        writeFile(u"a.txt"_s, DUPLICATE_TEXT);
+
+        MySettings::globalInstance()->setOverride(u"modelPath"_s, m_dir.path());
+        m_database = std::make_unique<Database>(512, QStringList { u"txt"_s });
+        QMetaObject::invokeMethod(m_database.get(), &Database::start, Qt::BlockingQueuedConnection);
+        ASSERT_TRUE(m_database->isValid());
+        bool added = false;
+        QMetaObject::invokeMethod(m_database.get(), [&] {
+            added = m_database->addFolder(u"notes"_s, m_folder, u"model"_s);
+        }, Qt::BlockingQueuedConnection);
+        ASSERT_TRUE(added);
+
+        m_db = QSqlDatabase::addDatabase(u"QSQLITE"_s, u"indexing-test"_s);
+        m_db.setDatabaseName(m_dir.filePath(u"localdocs_v4.db"_s));
+        ASSERT_TRUE(m_db.open()) << qPrintable(m_db.lastError().text());
+        ASSERT_TRUE(waitUntil([&] { return isIndexed(u"a.txt"_s); }));
+    }
+
+    void TearDown() override
+    {
+        m_database.reset();
+        m_db = {};
+        QSqlDatabase::removeDatabase(u"indexing-test"_s);
+    }
+
+    QString path(const QString &fileName) const { return m_folder + u'/' + fileName; }
+
+    void writeFile(const QString &fileName, const QByteArray &content)
+    {
+        QFile file(path(fileName));
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        file.write(content);
+    }
+
+    // the first column of the first row, invalid if there is none
+    QVariant select(const QString &sql, const QVariantList &values = {})
+    {
+        QSqlQuery q(m_db);
+        if (!q.prepare(sql)) {
+            ADD_FAILURE() << qPrintable(q.lastError().text());
+            return {};
+        }
+        for (const auto &value: values)
+            q.addBindValue(value);
+        if (!q.exec()) {
+            ADD_FAILURE() << qPrintable(q.lastError().text());
+            return {};
+        }
+        return q.next() ? q.value(0) : QVariant();
+    }
+
+    QList<int> chunkIds(const QString &fileName)
+    {
+        QSqlQuery q(m_db);
+        EXPECT_TRUE(q.prepare(u"select c.id from chunks c join documents d on d.id = c.document_id "
+                              "where d.document_path = ? order by c.id;"_s));
+        q.addBindValue(path(fileName));
+        EXPECT_TRUE(q.exec()) << qPrintable(q.lastError().text());
+        QList<int> ids;
+        while (q.next())
+            ids << q.value(0).toInt();
+        return ids;
+    }
+
+    QVariant contentHash(const QString &fileName)
+    {
+        return select(u"select content_hash from documents where document_path = ?;"_s, { path(fileName) });
+    }
+
+    // the content hash is saved with the last of the chunks, in the same transaction
+    bool isIndexed(const QString &fileName) { return !contentHash(fileName).isNull(); }
+
+    QTemporaryDir             m_dir;
+    QString                   m_folder;
+    std::unique_ptr<Database> m_database;
+    QSqlDatabase              m_db;
+};
+
+TEST_F(DatabaseIndexingTest, DoesNotChunkAnUnchangedDocumentAgain) {
+    const QList<int> before = chunkIds(u"a.txt"_s);
+    ASSERT_EQ(before.size(), 1);
+
+    // saved again without changes
+    {
+        QFile file(path(u"a.txt"_s));
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        file.write(DUPLICATE_TEXT);
+        file.flush();
+        ASSERT_TRUE(file.setFileTime(QDateTime::currentDateTime().addSecs(60), QFileDevice::FileModificationTime));
+    }
+    const qint64 touched = QFileInfo(path(u"a.txt"_s)).lastModified().toMSecsSinceEpoch();
+
+    const QString timeSql = u"select document_time from documents where document_path = ?;"_s;
+    ASSERT_TRUE(waitUntil([&] { return select(timeSql, { path(u"a.txt"_s) }).toLongLong() == touched; }));
+    EXPECT_EQ(chunkIds(u"a.txt"_s), before);
+}
+
+TEST_F(DatabaseIndexingTest, CopiesTheEmbeddingOfAChunkWithTheSameText) {
+    const QList<int> original = chunkIds(u"a.txt"_s);
+    ASSERT_EQ(original.size(), 1);
+    const QVariant folderId = select(u"select id from folders where path = ?;"_s, { m_folder });
+    QSqlQuery q(m_db);
+    ASSERT_TRUE(q.prepare(u"insert into embeddings(model, folder_id, chunk_id, embedding) "
+                          "values('model', ?, ?, ?);"_s));
+    q.addBindValue(folderId);
+    q.addBindValue(original.front());
+    q.addBindValue(EMBEDDING);
+    ASSERT_TRUE(q.exec()) << qPrintable(q.lastError().text());
+
+    writeFile(u"b.txt"_s, DUPLICATE_TEXT);
+    ASSERT_TRUE(waitUntil([&] { return isIndexed(u"b.txt"_s); }));
+    const QList<int> copy = chunkIds(u"b.txt"_s);
+    ASSERT_EQ(copy.size(), 1);
+    EXPECT_EQ(select(u"select embedding from embeddings where model = 'model' and chunk_id = ?;"_s, { copy.front() }),
+              QVariant(EMBEDDING));
+    EXPECT_EQ(select(u"select folder_id from embeddings where chunk_id = ?;"_s, { copy.front() }), folderId);
+}
+
+TEST_F(DatabaseIndexingTest, RollsBackABatchWhoseEmbeddingsCannotBeCopied) {
+    writeFile(u"d.txt"_s, "a sleepy cat naps in the sun\n");
+    ASSERT_TRUE(waitUntil([&] { return isIndexed(u"d.txt"_s); }));
+    ASSERT_EQ(chunkIds(u"d.txt"_s).size(), 1);
+
+    QSqlQuery q(m_db);
+    ASSERT_TRUE(q.prepare(u"insert into embeddings(model, folder_id, chunk_id, embedding) "
+                          "select 'model', d.folder_id, c.id, ? from chunks c join documents d on d.id = c.document_id "
+                          "where d.document_path = ?;"_s));
+    q.addBindValue(EMBEDDING);
+    q.addBindValue(path(u"a.txt"_s));
+    ASSERT_TRUE(q.exec()) << qPrintable(q.lastError().text());
+    ASSERT_TRUE(q.exec(REJECT_EMBEDDINGS_SQL)) << qPrintable(q.lastError().text());
+
+    // The new chunk of d.txt has the text of a.txt, whose embedding cannot be copied. A document that could not be
+    // written completely has no content hash, so that it is read again when it next changes.
+    writeFile(u"d.txt"_s, DUPLICATE_TEXT);
+    ASSERT_TRUE(waitUntil([&] { return !isIndexed(u"d.txt"_s); }));
+
+    // neither the new chunk nor its full-text entry is left, and the old chunk was replaced
+    EXPECT_TRUE(chunkIds(u"d.txt"_s).isEmpty());
+    EXPECT_EQ(select(u"select count(*) from chunks;"_s).toInt(), 1);
+    EXPECT_EQ(select(u"select count(*) from chunks_fts where chunks_fts match 'fox';"_s).toInt(), 1);
+    EXPECT_EQ(select(u"select count(*) from embeddings;"_s).toInt(), 1);
+}
@@ -0,0 +1,166 @@
+#include "database.h"
+#include "mysettings.h"
+
+#include <gtest/gtest.h>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QMetaObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QVariant>
+#include <Qt>
+
+#include <memory>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// A LocalDocs database as version 3 left it, with a folder, a document and two chunks that were embedded. %1 is the
+// path of the folder. The collection has no embedding model, so the test does not have to wait for it to be indexed.
+static const QString V3_FIXTURE_SQL[] = {
+    uR"(
+        create table chunks(
+            id integer primary key autoincrement, document_id integer not null, chunk_text text not null,
+            file text not null, title text, author text, subject text, keywords text, page integer,
+            line_from integer, line_to integer, words integer default 0 not null, tokens integer default 0 not null,
+            foreign key(document_id) references documents(id)
+        );
+    )"_s, uR"(
+        create virtual table chunks_fts using fts5(
+            id unindexed, document_id unindexed, chunk_text, file, title, author, subject, keywords,
+            content='chunks', content_rowid='id', tokenize='porter'
+        );
+    )"_s, uR"(
+        create table collections(
+            id integer primary key, name text unique not null, start_update_time integer,
+            last_update_time integer, embedding_model text
+        );
+    )"_s, uR"(
+        create table folders(id integer primary key autoincrement, path text unique not null);
+    )"_s, uR"(
+        create table collection_items(
+            collection_id integer not null, folder_id integer not null,
+            foreign key(collection_id) references collections(id)
+            foreign key(folder_id) references folders(id),
+            unique(collection_id, folder_id)
+        );
+    )"_s, uR"(
+        create table documents(
+            id integer primary key, folder_id integer not null, document_time integer not null,
+            document_path text unique not null, foreign key(folder_id) references folders(id)
+        );
+    )"_s, uR"(
+        create table embeddings(
+            model text not null, folder_id integer not null, chunk_id integer not null, embedding blob not null,
+            primary key(model, folder_id, chunk_id), foreign key(folder_id) references folders(id),
+            foreign key(chunk_id) references chunks(id), unique(model, chunk_id)
+        );
+    )"_s,
+    u"insert into collections(id, name) values(1, 'notes');"_s,
+    u"insert into folders(id, path) values(1, '%1');"_s,
+    u"insert into collection_items(collection_id, folder_id) values(1, 1);"_s,
+    u"insert into documents(id, folder_id, document_time, document_path) values(1, 1, 0, '%1/notes.txt');"_s,
+    u"insert into chunks(id, document_id, chunk_text, file) values(1, 1, 'the quick brown fox', 'notes.txt');"_s,
+    u"insert into chunks(id, document_id, chunk_text, file) values(2, 1, 'jumps over the lazy dog', 'notes.txt');"_s,
+    u"insert into chunks_fts(chunks_fts) values('rebuild');"_s,
+    u"insert into embeddings(model, folder_id, chunk_id, embedding) values('model', 1, 1, x'0000803f');"_s,
+};
+
+class DatabaseMigrationTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(m_dir.isValid());
+        m_folder = m_dir.filePath(u"notes"_s);
+        ASSERT_TRUE(QDir().mkpath(m_folder));
+        QFile document(m_folder + u"/notes.txt"_s);
+        ASSERT_TRUE(document.open(QIODevice::WriteOnly));
+        document.write("the quick brown fox\njumps over the lazy dog\n");
+    }
+
+    // runs a query on the database file with a connection of the test's own
+    template <typename F>
+    void withDatabase(const QString &path, F &&f)
+    {
+        {
+            QSqlDatabase db = QSqlDatabase::addDatabase(u"QSQLITE"_s, u"migration-test"_s);
+            db.setDatabaseName(path);
+            ASSERT_TRUE(db.open()) << qPrintable(db.lastError().text());
+            f(db);
+        }
+        QSqlDatabase::removeDatabase(u"migration-test"_s);
+    }
+
+    QTemporaryDir m_dir;
+    QString       m_folder;
+};
+
+TEST_F(DatabaseMigrationTest, MigratesV3InPlace) {
+    const QString v3Path = m_dir.filePath(u"localdocs_v3.db"_s);
+    const QString v4Path = m_dir.filePath(u"localdocs_v4.db"_s);
+    withDatabase(v3Path, [&](QSqlDatabase &db) {
+        QSqlQuery q(db);
+        for (const auto &sql: V3_FIXTURE_SQL)
+            ASSERT_TRUE(q.exec(sql.arg(m_folder))) << qPrintable(q.lastError().text());
+    });
+
+    MySettings::globalInstance()->setOverride(u"modelPath"_s, m_dir.path());
+    {
+        auto database = std::make_unique<Database>(512, QStringList { u"txt"_s });
+        QMetaObject::invokeMethod(database.get(), &Database::start, Qt::BlockingQueuedConnection);
+        EXPECT_TRUE(database->isValid());
+    }
+
+    // the old database is copied, not changed
+    EXPECT_TRUE(QFileInfo::exists(v3Path));
+    ASSERT_TRUE(QFileInfo::exists(v4Path));
+
+    withDatabase(v4Path, [&](QSqlDatabase &db) {
+        QSqlQuery q(db);
+
+        // the collection, its documents and their embeddings are kept
+        ASSERT_TRUE(q.exec(u"select count(*) from chunks;"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 2);
+        ASSERT_TRUE(q.exec(u"select count(*) from embeddings;"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 1);
+        ASSERT_TRUE(q.exec(u"select path from folders;"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toString(), m_folder);
+
+        // the text hashes of the chunks are filled in
+        ASSERT_TRUE(q.exec(u"select chunk_text, text_hash from chunks;"_s));
+        while (q.next()) {
+            auto expected = QCryptographicHash::hash(q.value(0).toString().toUtf8(), QCryptographicHash::Sha1);
+            EXPECT_EQ(q.value(1).toByteArray(), expected) << qPrintable(q.value(0).toString());
+        }
+
+        // the columns and tables of version 4
+        EXPECT_TRUE(q.exec(u"select content_hash from documents;"_s)) << qPrintable(q.lastError().text());
+        EXPECT_TRUE(q.exec(u"select model, folder_id, generation from embedding_stores;"_s))
+            << qPrintable(q.lastError().text());
+        ASSERT_TRUE(q.exec(u"select count(*) from database_id;"_s)) << qPrintable(q.lastError().text());
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 1);
+
+        // the full-text index is rebuilt, and follows the chunks by triggers from now on
+        ASSERT_TRUE(q.exec(u"select rowid from chunks_fts where chunks_fts match 'lazy';"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 2);
+        ASSERT_TRUE(q.exec(u"insert into chunks(document_id, chunk_text, file) values(1, 'a sleepy cat', 'x');"_s));
+        ASSERT_TRUE(q.exec(u"select count(*) from chunks_fts where chunks_fts match 'sleepy';"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 1);
+        ASSERT_TRUE(q.exec(u"delete from chunks where id = 1;"_s));
+        ASSERT_TRUE(q.exec(u"select count(*) from chunks_fts where chunks_fts match 'fox';"_s));
+        ASSERT_TRUE(q.next());
+        EXPECT_EQ(q.value(0).toInt(), 0);
+    });
+}
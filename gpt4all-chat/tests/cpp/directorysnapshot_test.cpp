@@ -0,0 +1,119 @@
+#include "directorysnapshot.h"
+
+#include <gtest/gtest.h>
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QStringList>
+#include <QTemporaryDir>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+class DirectorySnapshotTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(m_dir.isValid());
+        m_root = QFileInfo(m_dir.path()).canonicalFilePath();
+        writeFile(u"a.txt"_s, "a");
+        writeFile(u"sub/b.txt"_s, "b");
+        writeFile(u"sub/deeper/c.txt"_s, "c");
+    }
+
+    QString path(const QString &relativePath) const { return m_root + u'/' + relativePath; }
+
+    void writeFile(const QString &relativePath, const QByteArray &content)
+    {
+        const QString filePath = path(relativePath);
+        ASSERT_TRUE(QDir().mkpath(QFileInfo(filePath).path()));
+        QFile file(filePath);
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        file.write(content);
+    }
+
+    static QStringList sorted(QStringList paths)
+    {
+        paths.sort();
+        return paths;
+    }
+
+    QTemporaryDir m_dir;
+    QString       m_root;
+};
+
+TEST_F(DirectorySnapshotTest, ListsFilesOfTheTree) {
+    for (int nThreads: { 1, 4 }) {
+        auto snapshot = DirectorySnapshot::take(m_root, nThreads);
+        EXPECT_EQ(snapshot.root(), m_root);
+        EXPECT_EQ(sorted(snapshot.files()),
+                  (QStringList { path(u"a.txt"_s), path(u"sub/b.txt"_s), path(u"sub/deeper/c.txt"_s) }));
+    }
+}
+
+TEST_F(DirectorySnapshotTest, SkipsHiddenFiles) {
+    writeFile(u".hidden"_s, "h");
+    writeFile(u".git/config"_s, "h");
+    EXPECT_EQ(DirectorySnapshot::take(m_root).size(), 3);
+}
+
+TEST_F(DirectorySnapshotTest, DiffsAddedChangedAndRemovedFiles) {
+    auto before = DirectorySnapshot::take(m_root);
+    EXPECT_TRUE(DirectorySnapshot::take(m_root).changedSince(before).isEmpty());
+
+    writeFile(u"new.txt"_s, "new");
+    writeFile(u"sub/b.txt"_s, "b, longer now");
+    ASSERT_TRUE(QFile::remove(path(u"sub/deeper/c.txt"_s)));
+
+    auto after = DirectorySnapshot::take(m_root);
+    EXPECT_EQ(sorted(after.changedSince(before)),
+              (QStringList { path(u"new.txt"_s), path(u"sub/b.txt"_s), path(u"sub/deeper/c.txt"_s) }));
+}
+
+TEST_F(DirectorySnapshotTest, SavesAndLoads) {
+    const QString snapshotPath = m_dir.filePath(u"index/snapshot"_s);
+    auto snapshot = DirectorySnapshot::take(m_root);
+    ASSERT_TRUE(snapshot.save(snapshotPath, u"key"_s));
+
+    auto loaded = DirectorySnapshot::load(snapshotPath, u"key"_s);
+    ASSERT_TRUE(loaded);
+    EXPECT_EQ(loaded->root(), m_root);
+    EXPECT_EQ(sorted(loaded->files()), sorted(snapshot.files()));
+    EXPECT_TRUE(snapshot.changedSince(*loaded).isEmpty());
+
+    // a snapshot of other settings, or one that cannot be read, is not used
+    EXPECT_FALSE(DirectorySnapshot::load(snapshotPath, u"other key"_s));
+    EXPECT_FALSE(DirectorySnapshot::load(m_dir.filePath(u"missing"_s), u"key"_s));
+    QFile file(snapshotPath);
+    ASSERT_TRUE(file.open(QIODevice::ReadWrite));
+    ASSERT_TRUE(file.resize(file.size() / 2));
+    file.close();
+    EXPECT_FALSE(DirectorySnapshot::load(snapshotPath, u"key"_s));
+}
+
+TEST_F(DirectorySnapshotTest, UpdatesChangedPaths) {
+    auto snapshot = DirectorySnapshot::take(m_root);
+
+    // a changed file, a new directory, and a directory that was replaced
+    writeFile(u"a.txt"_s, "a, longer now");
+    writeFile(u"added/d.txt"_s, "d");
+    ASSERT_TRUE(QDir(path(u"sub/deeper"_s)).removeRecursively());
+    writeFile(u"sub/deeper/e.txt"_s, "e");
+    snapshot.update({ path(u"a.txt"_s), path(u"added"_s), path(u"sub/deeper"_s) });
+
+    auto taken = DirectorySnapshot::take(m_root);
+    EXPECT_TRUE(taken.changedSince(snapshot).isEmpty()) << qPrintable(taken.changedSince(snapshot).join(u", "));
+    EXPECT_EQ(snapshot.size(), 4);
+}
+
+TEST_F(DirectorySnapshotTest, UpdatesRemovedPaths) {
+    auto snapshot = DirectorySnapshot::take(m_root);
+
+    ASSERT_TRUE(QFile::remove(path(u"a.txt"_s)));
+    ASSERT_TRUE(QDir(path(u"sub"_s)).removeRecursively());
+    snapshot.update({ path(u"a.txt"_s), path(u"sub"_s) });
+    EXPECT_EQ(snapshot.size(), 0);
+}
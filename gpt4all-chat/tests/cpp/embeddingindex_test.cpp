@@ -0,0 +1,93 @@
+#include "embeddingindex.h"
+
+#include <gtest/gtest.h>
+
+#include <QTemporaryDir>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+static constexpr int DIMENSIONS = 32;
+
+// unit vectors, as the embedding model makes them
+static std::vector<std::vector<float>> randomEmbeddings(int count, int dimensions, unsigned seed = 42)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist;
+    std::vector<std::vector<float>> embeddings(count, std::vector<float>(dimensions));
+    for (auto &embedding: embeddings) {
+        float norm = 0;
+        for (float &x: embedding) {
+            x = dist(rng);
+            norm += x * x;
+        }
+        for (float &x: embedding)
+            x /= std::sqrt(norm);
+    }
+    return embeddings;
+}
+
+TEST(EmbeddingIndexTest, FindsEachEmbeddingFirst) {
+    auto embeddings = randomEmbeddings(200, DIMENSIONS);
+    auto index = EmbeddingIndex::create(DIMENSIONS);
+    ASSERT_TRUE(index);
+    for (int i = 0; i < int(embeddings.size()); i++)
+        ASSERT_TRUE(index->add(1000 + i, embeddings[i]));
+    EXPECT_EQ(index->size(), 200);
+    EXPECT_EQ(index->dimensions(), DIMENSIONS);
+
+    for (int i = 0; i < int(embeddings.size()); i++) {
+        auto matches = index->search(embeddings[i], 3);
+        ASSERT_FALSE(matches.isEmpty());
+        EXPECT_EQ(matches.first().chunkId, 1000 + i);
+        EXPECT_NEAR(matches.first().distance, 0.0f, 1e-4f);
+        for (qsizetype j = 1; j < matches.size(); j++)
+            EXPECT_LE(matches[j - 1].distance, matches[j].distance);
+    }
+}
+
+TEST(EmbeddingIndexTest, RejectsWrongDimensions) {
+    auto index = EmbeddingIndex::create(DIMENSIONS);
+    std::vector<float> embedding(DIMENSIONS + 1, 0.1f);
+    EXPECT_FALSE(index->add(1, embedding));
+    EXPECT_TRUE(index->search(embedding, 1).isEmpty());
+}
+
+TEST(EmbeddingIndexTest, RemovedChunksAreNotFound) {
+    auto embeddings = randomEmbeddings(10, DIMENSIONS);
+    auto index = EmbeddingIndex::create(DIMENSIONS);
+    for (int i = 0; i < int(embeddings.size()); i++)
+        ASSERT_TRUE(index->add(i, embeddings[i]));
+
+    index->remove(3);
+    EXPECT_FALSE(index->contains(3));
+    EXPECT_TRUE(index->contains(4));
+    for (const auto &match: index->search(embeddings[3], 10))
+        EXPECT_NE(match.chunkId, 3);
+}
+
+TEST(EmbeddingIndexTest, SavesAndLoads) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    const QString path = dir.filePath(u"index.usearch"_s);
+
+    auto embeddings = randomEmbeddings(50, DIMENSIONS);
+    {
+        auto index = EmbeddingIndex::create(DIMENSIONS);
+        for (int i = 0; i < int(embeddings.size()); i++)
+            ASSERT_TRUE(index->add(i, embeddings[i]));
+        ASSERT_TRUE(index->save(path));
+    }
+
+    auto index = EmbeddingIndex::load(path);
+    ASSERT_TRUE(index);
+    EXPECT_EQ(index->size(), 50);
+    EXPECT_EQ(index->dimensions(), DIMENSIONS);
+    EXPECT_EQ(index->search(embeddings[7], 1).value(0).chunkId, 7);
+
+    EXPECT_FALSE(EmbeddingIndex::load(dir.filePath(u"missing.usearch"_s)));
+}
@@ -0,0 +1,114 @@
+#include "embeddingstore.h"
+
+#include <gtest/gtest.h>
+
+#include <QList>
+#include <QTemporaryDir>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <span>
+#include <utility>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+// The exact search uses the widest SIMD kernel that the CPU supports. These compare it with a plain double-precision
+// inner product, over sizes that leave every tail length of the kernels.
+
+static std::vector<float> randomVector(std::mt19937 &rng, int size)
+{
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> v(size);
+    for (float &x: v)
+        x = dist(rng);
+    return v;
+}
+
+static double referenceDistance(std::span<const float> a, std::span<const float> b)
+{
+    double dot = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        dot += double(a[i]) * double(b[i]);
+    return 1.0 - dot;
+}
+
+TEST(EmbeddingSearchTest, DistanceMatchesScalarReference) {
+    std::mt19937 rng(1);
+    std::vector<int> sizes;
+    for (int n = 1; n <= 80; n++)
+        sizes.push_back(n);
+    sizes.insert(sizes.end(), { 127, 384, 768, 1024, 1031 });
+
+    for (int n: sizes) {
+        auto a = randomVector(rng, n);
+        auto b = randomVector(rng, n);
+        // the sum of n products rounds each time, in a different order for each kernel
+        const double tolerance = 1e-5 * n;
+        EXPECT_NEAR(EmbeddingStore::distance(a, b), referenceDistance(a, b), tolerance) << "size " << n;
+    }
+}
+
+TEST(EmbeddingSearchTest, SearchMatchesScalarReference) {
+    constexpr int DIMENSIONS = 100; // not a multiple of any vector width
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    std::mt19937 rng(2);
+
+    // more rows than fit in one shard, so that several threads scan them
+    std::vector<std::unique_ptr<EmbeddingStore>> stores;
+    std::vector<std::pair<int, std::vector<float>>> rows;
+    int chunkId = 0;
+    for (int s = 0; s < 3; s++) {
+        auto store = EmbeddingStore::create(dir.filePath(u"%1.vectors"_s.arg(s)), DIMENSIONS);
+        ASSERT_TRUE(store);
+        for (int i = 0; i < 1500; i++) {
+            auto embedding = randomVector(rng, DIMENSIONS);
+            ASSERT_TRUE(store->add(chunkId, embedding));
+            if (chunkId % 7) {
+                rows.emplace_back(chunkId, std::move(embedding));
+            } else {
+                ASSERT_TRUE(store->remove(chunkId)); // skipped by the search
+            }
+            chunkId++;
+        }
+        stores.push_back(std::move(store));
+    }
+    QList<const EmbeddingStore *> storeList;
+    for (const auto &store: stores)
+        storeList << store.get();
+
+    for (int q = 0; q < 5; q++) {
+        auto query = randomVector(rng, DIMENSIONS);
+        constexpr int k = 20;
+
+        std::vector<std::pair<double, int>> expected;
+        for (const auto &[id, embedding]: rows)
+            expected.emplace_back(referenceDistance(query, embedding), id);
+        std::partial_sort(expected.begin(), expected.begin() + k, expected.end());
+
+        auto matches = EmbeddingStore::search(query, storeList, k);
+        ASSERT_EQ(matches.size(), k);
+        for (int i = 0; i < k; i++) {
+            EXPECT_EQ(matches[i].chunkId, expected[i].second) << "query " << q << " rank " << i;
+            EXPECT_NEAR(matches[i].distance, expected[i].first, 1e-3) << "query " << q << " rank " << i;
+        }
+    }
+}
+
+TEST(EmbeddingSearchTest, SearchSkipsStoresOfOtherSizes) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    auto store = EmbeddingStore::create(dir.filePath(u"store.vectors"_s), 4);
+    ASSERT_TRUE(store);
+    ASSERT_TRUE(store->add(1, std::vector<float> { 1, 0, 0, 0 }));
+
+    EXPECT_TRUE(EmbeddingStore::search(std::vector<float> { 1, 0, 0 }, { store.get() }, 1).isEmpty());
+    auto matches = EmbeddingStore::search(std::vector<float> { 1, 0, 0, 0 }, { store.get() }, 5);
+    ASSERT_EQ(matches.size(), 1);
+    EXPECT_EQ(matches.first().chunkId, 1);
+    EXPECT_NEAR(matches.first().distance, 0.0f, 1e-6f);
+}
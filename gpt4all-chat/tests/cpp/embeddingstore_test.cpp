@@ -0,0 +1,156 @@
+#include "embeddingstore.h"
+
+#include <gtest/gtest.h>
+
+#include <QFile>
+#include <QIODevice>
+#include <QTemporaryDir>
+
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+static constexpr int DIMENSIONS = 8;
+
+// an embedding that tells which chunk it belongs to
+static std::vector<float> embeddingOf(int chunkId)
+{
+    std::vector<float> embedding(DIMENSIONS);
+    for (int i = 0; i < DIMENSIONS; i++)
+        embedding[i] = float(chunkId) + float(i) / DIMENSIONS;
+    return embedding;
+}
+
+static void expectEmbeddingOf(const EmbeddingStore &store, int chunkId)
+{
+    auto embedding = store.embedding(chunkId);
+    auto expected = embeddingOf(chunkId);
+    ASSERT_EQ(embedding.size(), expected.size()) << "chunk " << chunkId;
+    for (size_t i = 0; i < expected.size(); i++)
+        EXPECT_EQ(embedding[i], expected[i]) << "chunk " << chunkId;
+}
+
+class EmbeddingStoreTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(m_dir.isValid());
+        m_path = m_dir.filePath(u"store.vectors"_s);
+    }
+
+    QTemporaryDir m_dir;
+    QString       m_path;
+};
+
+TEST_F(EmbeddingStoreTest, AddsAndReplaces) {
+    auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+    ASSERT_TRUE(store);
+    EXPECT_EQ(store->dimensions(), DIMENSIONS);
+    EXPECT_EQ(store->generation(), 0);
+
+    for (int id = 1; id <= 3; id++)
+        ASSERT_TRUE(store->add(id, embeddingOf(id)));
+    EXPECT_EQ(store->size(), 3);
+    EXPECT_TRUE(store->contains(2));
+    expectEmbeddingOf(*store, 2);
+    EXPECT_TRUE(store->embedding(4).empty());
+
+    // adding a chunk again replaces its row
+    ASSERT_TRUE(store->add(2, embeddingOf(2)));
+    EXPECT_EQ(store->size(), 3);
+    EXPECT_EQ(store->rowCount(), 4);
+    EXPECT_EQ(store->removedCount(), 1);
+
+    EXPECT_FALSE(store->add(5, std::vector<float>(DIMENSIONS + 1)));
+}
+
+TEST_F(EmbeddingStoreTest, RemovesAndCompacts) {
+    auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+    ASSERT_TRUE(store);
+    for (int id = 0; id < 100; id++)
+        ASSERT_TRUE(store->add(id, embeddingOf(id)));
+
+    for (int id = 0; id < 100; id += 2)
+        ASSERT_TRUE(store->remove(id));
+    EXPECT_FALSE(store->remove(0));
+    EXPECT_FALSE(store->contains(0));
+    EXPECT_EQ(store->size(), 50);
+    EXPECT_EQ(store->removedCount(), 50);
+    EXPECT_TRUE(store->needsCompaction());
+
+    ASSERT_TRUE(store->compact());
+    EXPECT_EQ(store->size(), 50);
+    EXPECT_EQ(store->rowCount(), 50);
+    EXPECT_EQ(store->removedCount(), 0);
+    EXPECT_FALSE(store->needsCompaction());
+    for (int id = 1; id < 100; id += 2)
+        expectEmbeddingOf(*store, id);
+}
+
+TEST_F(EmbeddingStoreTest, GrowsBeyondItsCapacity) {
+    auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+    ASSERT_TRUE(store);
+    const qsizetype capacity = store->capacity();
+    for (int id = 0; id <= capacity; id++)
+        ASSERT_TRUE(store->add(id, embeddingOf(id)));
+    EXPECT_GT(store->capacity(), capacity);
+    EXPECT_EQ(store->size(), capacity + 1);
+    expectEmbeddingOf(*store, 0);
+    expectEmbeddingOf(*store, int(capacity));
+}
+
+TEST_F(EmbeddingStoreTest, Reopens) {
+    {
+        auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+        ASSERT_TRUE(store);
+        for (int id = 1; id <= 10; id++)
+            ASSERT_TRUE(store->add(id, embeddingOf(id)));
+        ASSERT_TRUE(store->remove(5));
+        store->setGeneration(7);
+    }
+
+    auto store = EmbeddingStore::open(m_path);
+    ASSERT_TRUE(store);
+    EXPECT_EQ(store->dimensions(), DIMENSIONS);
+    EXPECT_EQ(store->size(), 9);
+    EXPECT_FALSE(store->contains(5));
+    for (int id = 1; id <= 10; id++) {
+        if (id != 5)
+            expectEmbeddingOf(*store, id);
+    }
+    EXPECT_EQ(store->generation(), 7);
+
+    EXPECT_FALSE(EmbeddingStore::open(m_dir.filePath(u"missing.vectors"_s)));
+}
+
+TEST_F(EmbeddingStoreTest, ChangesResetTheGeneration) {
+    auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+    ASSERT_TRUE(store);
+    ASSERT_TRUE(store->add(1, embeddingOf(1)));
+    EXPECT_EQ(store->generation(), EmbeddingStore::NO_GENERATION);
+    store->setGeneration(3);
+    ASSERT_TRUE(store->add(2, embeddingOf(2)));
+    EXPECT_EQ(store->generation(), EmbeddingStore::NO_GENERATION);
+    store->setGeneration(4);
+    ASSERT_TRUE(store->remove(1));
+    EXPECT_EQ(store->generation(), EmbeddingStore::NO_GENERATION);
+
+    // compacting keeps the same embeddings
+    store->setGeneration(5);
+    ASSERT_TRUE(store->compact());
+    EXPECT_EQ(store->generation(), 5);
+}
+
+TEST_F(EmbeddingStoreTest, RejectsDamagedFiles) {
+    {
+        auto store = EmbeddingStore::create(m_path, DIMENSIONS);
+        ASSERT_TRUE(store);
+        ASSERT_TRUE(store->add(1, embeddingOf(1)));
+    }
+    QFile file(m_path);
+    ASSERT_TRUE(file.open(QIODevice::ReadWrite));
+    ASSERT_TRUE(file.resize(file.size() - 4));
+    file.close();
+    EXPECT_FALSE(EmbeddingStore::open(m_path));
+}
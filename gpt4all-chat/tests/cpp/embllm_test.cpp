@@ -0,0 +1,33 @@
+#include "embllm.h"
+
+#include <gtest/gtest.h>
+
+#include <QString>
+
+using namespace Qt::Literals::StringLiterals;
+
+
+TEST(EmbeddingLLMTest, EstimatesTokensOfWords) {
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u""_s), 0);
+    // a token per four letters, digits or spaces, rounded up
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"abcd"_s), 1);
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"abcde"_s), 2);
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"the 1st line"_s), 3);
+}
+
+TEST(EmbeddingLLMTest, EstimatesTokensOfOtherCharacters) {
+    // a token each for punctuation and for characters outside of ASCII
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"a, b."_s), 3);
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"héllo"_s), 2);
+    EXPECT_EQ(EmbeddingLLM::estimatedTokenCount(u"日本語"_s), 3);
+}
+
+TEST(EmbeddingLLMTest, EstimateOfJoinedTextIsAboutTheSum) {
+    const QString a = u"Embeddings are sized by tokens, "_s;
+    const QString b = u"not by characters or bytes."_s;
+    const int joined = EmbeddingLLM::estimatedTokenCount(a + b);
+    const int sum = EmbeddingLLM::estimatedTokenCount(a) + EmbeddingLLM::estimatedTokenCount(b);
+    // only the rounding of the word characters can differ
+    EXPECT_LE(joined, sum);
+    EXPECT_GE(joined, sum - 1);
+}
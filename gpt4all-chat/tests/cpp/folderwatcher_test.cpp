@@ -0,0 +1,189 @@
+#include "folderwatcher.h"
+
+#include <gtest/gtest.h>
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QIODevice>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+using namespace Qt::Literals::StringLiterals;
+using namespace std::chrono_literals;
+
+
+// runs the event loop until condition holds, or returns false after timeout
+static bool waitUntil(const std::function<bool()> &condition, std::chrono::milliseconds timeout)
+{
+    QDeadlineTimer deadline(timeout);
+    while (!condition()) {
+        if (deadline.hasExpired())
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents);
+        QThread::msleep(10);
+    }
+    return true;
+}
+
+class FolderWatcherTest : public testing::Test {
+protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(m_dir.isValid());
+        m_root = QFileInfo(m_dir.path()).canonicalFilePath();
+        writeFile(u"a.txt"_s, "a");
+        writeFile(u"sub/b.txt"_s, "b");
+
+        QObject::connect(&m_watcher, &FolderWatcher::pathsChanged, &m_watcher,
+                         [this](const QString &folder, const QStringList &paths) {
+            m_batches.emplace_back(folder, paths);
+        });
+        m_watcher.addFolder(m_dir.path());
+    }
+
+    QString path(const QString &relativePath) const { return m_root + u'/' + relativePath; }
+
+    void writeFile(const QString &relativePath, const QByteArray &content)
+    {
+        const QString filePath = path(relativePath);
+        ASSERT_TRUE(QDir().mkpath(QFileInfo(filePath).path()));
+        QFile file(filePath);
+        ASSERT_TRUE(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        file.write(content);
+    }
+
+    bool waitForBatches(std::size_t count, std::chrono::milliseconds timeout)
+    {
+        return waitUntil([&] { return m_batches.size() >= count; }, timeout);
+    }
+
+    // more than the debounce of the watcher, so that a batch that is still to come would have been reported
+    static constexpr auto QUIET_TIME = 2500ms;
+
+    static QStringList sorted(QStringList paths)
+    {
+        paths.sort();
+        return paths;
+    }
+
+    // as if the folder had more directories than can be watched
+    void pollInstead() { m_watcher.pollInstead(m_root); }
+    void pollFolders() { m_watcher.pollFolders(); }
+    bool isWatching() const { return !m_watcher.m_watches.isEmpty(); }
+    bool isPolling() const { return !m_watcher.m_pollsRunning.isEmpty(); }
+
+    QTemporaryDir                                m_dir;
+    QString                                      m_root;
+    std::vector<std::pair<QString, QStringList>> m_batches; // folder and paths, as reported
+    FolderWatcher                                m_watcher;
+};
+
+TEST_F(FolderWatcherTest, ComparesPolledFoldersWithTheirSnapshot) {
+    pollInstead();
+    EXPECT_FALSE(isWatching());
+    // the first snapshot is only compared with the next one
+    ASSERT_TRUE(waitUntil([&] { return !isPolling(); }, 5s));
+
+    writeFile(u"sub/b.txt"_s, "b, longer now");
+    writeFile(u"c.txt"_s, "c");
+    pollFolders();
+    ASSERT_TRUE(waitForBatches(1, 5s));
+    EXPECT_EQ(m_batches[0].first, m_dir.path());
+    EXPECT_EQ(m_batches[0].second, sorted({ path(u"c.txt"_s), path(u"sub/b.txt"_s) }));
+}
+
+// The tests below expect the paths of files. Elsewhere than on Linux, changes are reported by directory.
+#ifdef Q_OS_LINUX
+
+TEST_F(FolderWatcherTest, ReportsChangesInOneBatch) {
+    writeFile(u"new.txt"_s, "new");
+    writeFile(u"sub/b.txt"_s, "b, changed");
+    ASSERT_TRUE(QFile::rename(path(u"a.txt"_s), path(u"sub/a.txt"_s)));
+
+    ASSERT_TRUE(waitForBatches(1, 5s));
+    EXPECT_FALSE(waitForBatches(2, QUIET_TIME));
+    EXPECT_EQ(m_batches[0].first, m_dir.path());
+    EXPECT_EQ(m_batches[0].second,
+              sorted({ path(u"a.txt"_s), path(u"new.txt"_s), path(u"sub/a.txt"_s), path(u"sub/b.txt"_s) }));
+}
+
+TEST_F(FolderWatcherTest, ReportsOnceChangesStop) {
+    QElapsedTimer timer;
+    timer.start();
+    writeFile(u"new.txt"_s, "new");
+    ASSERT_TRUE(waitForBatches(1, 5s));
+    EXPECT_GE(timer.durationElapsed(), 1s);
+}
+
+TEST_F(FolderWatcherTest, ReportsChangesThatKeepComing) {
+    // one change every 300 ms, each of which would put off the report by another second
+    int nWrites = 0;
+    QTimer writer;
+    writer.callOnTimeout([&] { writeFile(u"busy-%1.txt"_s.arg(nWrites++), "busy"); });
+    writer.start(300ms);
+
+    QElapsedTimer timer;
+    timer.start();
+    ASSERT_TRUE(waitForBatches(1, 15s));
+    writer.stop();
+    EXPECT_GE(timer.durationElapsed(), 10s);
+    EXPECT_LT(timer.durationElapsed(), 12s);
+    EXPECT_GE(m_batches[0].second.size(), 30);
+}
+
+TEST_F(FolderWatcherTest, WatchesNewDirectories) {
+    ASSERT_TRUE(QDir().mkpath(path(u"new/deeper"_s)));
+    ASSERT_TRUE(waitForBatches(1, 5s));
+    EXPECT_EQ(m_batches[0].second, QStringList { path(u"new"_s) });
+
+    writeFile(u"new/deeper/c.txt"_s, "c");
+    ASSERT_TRUE(waitForBatches(2, 5s));
+    EXPECT_EQ(m_batches[1].second, QStringList { path(u"new/deeper/c.txt"_s) });
+}
+
+TEST_F(FolderWatcherTest, UnwatchesDirectoriesThatMovedAway) {
+    QTemporaryDir outside;
+    ASSERT_TRUE(outside.isValid());
+    const QString moved = outside.filePath(u"sub"_s);
+    ASSERT_TRUE(QDir().rename(path(u"sub"_s), moved));
+    ASSERT_TRUE(waitForBatches(1, 5s));
+    EXPECT_EQ(m_batches[0].second, QStringList { path(u"sub"_s) });
+
+    // no longer in the folder
+    QFile file(moved + u"/c.txt"_s);
+    ASSERT_TRUE(file.open(QIODevice::WriteOnly));
+    file.close();
+    EXPECT_FALSE(waitForBatches(2, QUIET_TIME));
+}
+
+TEST_F(FolderWatcherTest, ReportsTheFolderWhenEventsAreLost) {
+    QFile maxEvents(u"/proc/sys/fs/inotify/max_queued_events"_s);
+    ASSERT_TRUE(maxEvents.open(QIODevice::ReadOnly));
+    const int nEvents = maxEvents.readAll().trimmed().toInt();
+    if (nEvents <= 0 || nEvents > 100'000)
+        GTEST_SKIP() << "cannot overflow a queue of " << nEvents << " events";
+
+    // two events for each file, created and closed, while the events are not read
+    for (int i = 0; i < nEvents / 2 + 100; i++)
+        writeFile(u"many-%1.txt"_s.arg(i), "");
+    ASSERT_TRUE(waitForBatches(1, 10s));
+    EXPECT_TRUE(m_batches[0].second.contains(m_root));
+}
+
+#endif // Q_OS_LINUX
@@ -1,3 +1,6 @@
+import base64
+import http.client
+import json
 import os
 import shutil
 import signal
@@ -5,6 +8,8 @@ import subprocess
 import sys
 import tempfile
 import textwrap
+import time
+from concurrent.futures import ThreadPoolExecutor
 from contextlib import contextmanager
 from pathlib import Path
 from subprocess import CalledProcessError
@@ -28,15 +33,26 @@ class Requestor:
     def post(self, path: str, data: dict[str, Any] | None, *, raise_for_status: bool = True, wait: bool = False) -> Any:
         return self._request('POST', path, data, raise_for_status=raise_for_status, wait=wait)
 
-    def _request(
-        self, method: str, path: str, data: dict[str, Any] | None = None, *, raise_for_status: bool, wait: bool,
-    ) -> Any:
+    def post_stream(self, path: str, data: dict[str, Any], *, wait: bool = False) -> list[str]:
+        # returns the data of each server-sent event
+        self._set_retry(wait)
+        with self.session.post(f'http://localhost:4891/v1/{path}', json=data, stream=True) as resp:
+            resp.raise_for_status()
+            assert resp.headers['Content-Type'] == 'text/event-stream'
+            return [line.removeprefix('data: ') for line in resp.iter_lines(decode_unicode=True) if line]
+
+    def _set_retry(self, wait: bool) -> None:
         if wait:
             retry = Retry(total=None, connect=10, read=False, status=0, other=0, backoff_factor=.01)
         else:
             retry = Retry(total=False)
         self.http_adapter.max_retries = retry  # type: ignore[attr-defined]
 
+    def _request(
+        self, method: str, path: str, data: dict[str, Any] | None = None, *, raise_for_status: bool, wait: bool,
+    ) -> Any:
+        self._set_retry(wait)
+
         resp = self.session.request(method, f'http://localhost:4891/v1/{path}', json=data)
         if raise_for_status:
             resp.raise_for_status()
@@ -52,7 +68,9 @@ class Requestor:
 request = Requestor()
 
 
-def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[str, str]:
+def create_chat_server_config(
+    tmpdir: Path, model_copied: bool = False, server_settings: dict[str, str] | None = None,
+) -> dict[str, str]:
     xdg_confdir = tmpdir / 'config'
     app_confdir = xdg_confdir / 'nomic.ai'
     app_confdir.mkdir(parents=True)
@@ -68,6 +86,9 @@ def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[
             isActive=false
             usageStatsActive=false
         """))
+        if server_settings:
+            conf.write('\n[server]\n')
+            conf.writelines(f'{key}={value}\n' for key, value in server_settings.items())
 
     if model_copied:
         app_data_dir = tmpdir / 'share' / 'nomic.ai' / 'GPT4All'
@@ -85,13 +106,15 @@ def create_chat_server_config(tmpdir: Path, model_copied: bool = False) -> dict[
 
 
 @contextmanager
-def prepare_chat_server(model_copied: bool = False) -> Iterator[dict[str, str]]:
+def prepare_chat_server(
+    model_copied: bool = False, server_settings: dict[str, str] | None = None,
+) -> Iterator[dict[str, str]]:
     if os.name != 'posix' or sys.platform == 'darwin':
         pytest.skip('Need non-Apple Unix to use alternate config path')
 
     with tempfile.TemporaryDirectory(prefix='gpt4all-test') as td:
         tmpdir = Path(td)
-        config = create_chat_server_config(tmpdir, model_copied=model_copied)
+        config = create_chat_server_config(tmpdir, model_copied=model_copied, server_settings=server_settings)
         yield config
 
 
@@ -120,6 +143,19 @@ def chat_server_with_model() -> Iterator[None]:
         yield from start_chat_server(config)
 
 
+@pytest.fixture
+def chat_server_with_response_cache() -> Iterator[None]:
+    with prepare_chat_server(model_copied=True, server_settings=dict(responseCache='true')) as config:
+        yield from start_chat_server(config)
+
+
+@pytest.fixture
+def chat_server_with_queue(request: pytest.FixtureRequest) -> Iterator[None]:
+    # the [server] settings are given by parametrizing the test indirectly
+    with prepare_chat_server(model_copied=True, server_settings=request.param) as config:
+        yield from start_chat_server(config)
+
+
 def test_with_models_empty(chat_server: None) -> None:
     # non-sense endpoint
     status_code, response = request.get('foobarbaz', wait=True, raise_for_status=False)
@@ -215,6 +251,7 @@ EXPECTED_COMPLETIONS_RESPONSE = {
     'usage': {
         'completion_tokens': 6,
         'prompt_tokens': 5,
+        'prompt_tokens_details': {'cached_tokens': 0},
         'total_tokens': 11,
     },
 }
@@ -261,3 +298,368 @@ def test_with_models_temperature(chat_server_with_model: None) -> None:
     }
 
     request.post('completions', data=data, wait=True, raise_for_status=True)
+
+
+def test_with_models_cached_prompt(chat_server_with_model: None) -> None:
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+    request.post('completions', data=data, wait=True)
+
+    # all but the last prompt token are reused from the previous request
+    response = request.post('completions', data=data)
+    del response['created']
+    assert response['choices'] == EXPECTED_COMPLETIONS_RESPONSE['choices']
+    assert response['usage'] == {
+        **EXPECTED_COMPLETIONS_RESPONSE['usage'],
+        'prompt_tokens_details': {'cached_tokens': 4},
+    }
+
+
+def test_with_models_n(chat_server_with_model: None) -> None:
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'Once upon a time',
+        temperature = 1.0,
+        max_tokens  = 16,
+        n           = 3,
+    )
+    response = request.post('completions', data=data, wait=True)
+    choices = response['choices']
+    assert [c['index'] for c in choices] == [0, 1, 2]
+    assert len({c['text'] for c in choices}) == 3  # each choice is sampled on its own
+
+    # the prompt is counted once, as the other choices reuse it from the KV cache
+    single = request.post('completions', data=dict(data, n=1))
+    usage = response['usage']
+    assert usage['prompt_tokens'] == single['usage']['prompt_tokens']
+    assert usage['prompt_tokens_details'] == {'cached_tokens': 0}
+    if all(c['finish_reason'] == 'length' for c in choices):
+        assert usage['completion_tokens'] == 3 * data['max_tokens']
+    assert 0 < usage['completion_tokens'] <= 3 * data['max_tokens']
+    assert usage['total_tokens'] == usage['prompt_tokens'] + usage['completion_tokens']
+
+
+def test_with_models_response_cache(chat_server_with_response_cache: None) -> None:
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+    request.post('completions', data=data, wait=True)
+
+    # the second request is answered from the cache, so all of its prompt is cached
+    response = request.post('completions', data=data)
+    del response['created']
+    assert response['choices'] == EXPECTED_COMPLETIONS_RESPONSE['choices']
+    assert response['usage'] == {
+        **EXPECTED_COMPLETIONS_RESPONSE['usage'],
+        'prompt_tokens_details': {'cached_tokens': 5},
+    }
+
+    # sampled responses are not cached
+    request.post('completions', data=dict(data, temperature=0.5))
+    response = requests.get('http://localhost:4891/metrics')
+    response.raise_for_status()
+    assert 'gpt4all_response_cache_requests_total{result="hit"} 1\n' in response.text
+    assert 'gpt4all_response_cache_requests_total{result="miss"} 1\n' in response.text
+
+
+def get_metrics() -> dict[str, float]:
+    response = requests.get('http://localhost:4891/metrics')
+    response.raise_for_status()
+    assert response.headers['Content-Type'].startswith('text/plain')
+    return {
+        line.rpartition(' ')[0]: float(line.rpartition(' ')[2])
+        for line in response.text.splitlines() if not line.startswith('#')
+    }
+
+
+def test_metrics(chat_server_with_model: None) -> None:
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'The quick brown fox',
+        temperature = 0,
+        max_tokens  = 6,
+    )
+    request.post('completions', data=data, wait=True)
+
+    metrics = get_metrics()
+    labels = 'endpoint="/v1/completions",model="Llama 3.2 1B Instruct"'
+    assert metrics[f'gpt4all_requests_total{{{labels},status="200"}}'] == 1
+    assert metrics[f'gpt4all_request_duration_seconds_count{{{labels}}}'] == 1
+    assert metrics[f'gpt4all_time_to_first_token_seconds_count{{{labels}}}'] == 1
+    assert metrics['gpt4all_prompt_tokens_total{model="Llama 3.2 1B Instruct"}'] == 5
+    assert metrics['gpt4all_completion_tokens_total{model="Llama 3.2 1B Instruct"}'] == 6
+    assert metrics['gpt4all_model_load_duration_seconds_count{model="Llama 3.2 1B Instruct"}'] == 1
+    assert metrics['gpt4all_queued_requests'] == 0
+
+
+def test_with_models_stream(chat_server_with_model: None) -> None:
+    data = dict(
+        model          = 'Llama 3.2 1B Instruct',
+        prompt         = 'The quick brown fox',
+        temperature    = 0,
+        max_tokens     = 6,
+        stream         = True,
+        stream_options = dict(include_usage=True),
+    )
+    events = request.post_stream('completions', data=data, wait=True)
+    assert events[-1] == '[DONE]'
+
+    chunks = [json.loads(e) for e in events[:-1]]
+    assert all(c['object'] == 'text_completion' for c in chunks)
+    expected_choice = EXPECTED_COMPLETIONS_RESPONSE['choices'][0]
+    assert ''.join(c['choices'][0]['text'] for c in chunks[:-1]) == expected_choice['text']
+    assert chunks[-2]['choices'][0]['finish_reason'] == expected_choice['finish_reason']
+
+    # usage is reported in a final chunk without choices
+    assert chunks[-1]['choices'] == []
+    assert chunks[-1]['usage'] == EXPECTED_COMPLETIONS_RESPONSE['usage']
+
+
+def test_with_models_client_disconnect(chat_server_with_model: None) -> None:
+    data = dict(
+        model       = 'Llama 3.2 1B Instruct',
+        prompt      = 'Write a long story.',
+        temperature = 0,
+        max_tokens  = 2000,
+        stream      = True,
+    )
+    request.post('completions', data=dict(data, stream=False, max_tokens=1), wait=True)  # load the model
+    with requests.post('http://localhost:4891/v1/completions', json=data, stream=True) as resp:
+        resp.raise_for_status()
+        next(resp.iter_lines())  # generation has started
+
+    # the server stops generating for the request once the client is gone
+    deadline = time.monotonic() + 30
+    while True:
+        response = requests.get('http://localhost:4891/metrics')
+        response.raise_for_status()
+        if 'endpoint="/v1/completions",model="Llama 3.2 1B Instruct",status="499"} 1' in response.text:
+            break
+        assert time.monotonic() < deadline, 'request was not cancelled'
+        time.sleep(.1)
+    completion_tokens = next(
+        float(line.rpartition(' ')[2]) for line in response.text.splitlines()
+        if line.startswith('gpt4all_completion_tokens_total{model="Llama 3.2 1B Instruct"}')
+    )
+    assert completion_tokens < 1 + data['max_tokens']
+
+
+LONG_COMPLETION = dict(
+    model       = 'Llama 3.2 1B Instruct',
+    prompt      = 'Write a long story.',
+    temperature = 0,
+    max_tokens  = 2000,
+)
+SHORT_COMPLETION = dict(LONG_COMPLETION, max_tokens=8)
+
+
+def post_from(address: str, path: str, data: dict[str, Any]) -> tuple[int, Any, float]:
+    # Sends a request from another loopback address, which the server sees as another client. Returns the status, the
+    # response, and when it was received.
+    conn = http.client.HTTPConnection('127.0.0.1', 4891, source_address=(address, 0))
+    try:
+        conn.request('POST', f'/v1/{path}', json.dumps(data), {'Content-Type': 'application/json'})
+        resp = conn.getresponse()
+        body = json.loads(resp.read())
+        return resp.status, body, time.monotonic()
+    finally:
+        conn.close()
+
+
+def wait_for_metric(name: str, value: float) -> None:
+    deadline = time.monotonic() + 30
+    while get_metrics().get(name) != value:
+        assert time.monotonic() < deadline, f'{name} did not reach {value}'
+        time.sleep(.05)
+
+
+def start_long_stream() -> requests.Response:
+    # returns once the response has started, so the request holds a worker until the response is closed
+    resp = requests.post('http://localhost:4891/v1/completions', json=dict(LONG_COMPLETION, stream=True), stream=True)
+    resp.raise_for_status()
+    next(resp.iter_lines())
+    return resp
+
+
+@pytest.mark.parametrize('chat_server_with_queue', [dict(concurrency='1', maxQueueDepth='1')], indirect=True)
+def test_with_models_queue_full(chat_server_with_queue: None) -> None:
+    request.post('completions', data=dict(SHORT_COMPLETION, max_tokens=1), wait=True)  # load the model
+
+    with ThreadPoolExecutor() as pool:
+        with start_long_stream():
+            queued = pool.submit(post_from, '127.0.0.1', 'completions', SHORT_COMPLETION)
+            wait_for_metric('gpt4all_queued_requests', 1)
+
+            # the queue is full
+            resp = requests.post('http://localhost:4891/v1/completions', json=SHORT_COMPLETION)
+            assert resp.status_code == 429
+            assert resp.headers['Retry-After'] == '1'
+            assert resp.json() == {'error': {
+                'code': 'rate_limit_exceeded',
+                'message': 'The server has too many pending requests. Please try again later.',
+                'param': None,
+                'type': 'requests',
+            }}
+
+        # the stream is cancelled once it is closed, and the queued request is served
+        status, response, _ = queued.result()
+        assert status == 200
+        assert response['choices'][0]['text']
+
+
+@pytest.mark.parametrize('chat_server_with_queue', [dict(concurrency='1', requestTimeout='2')], indirect=True)
+def test_with_models_request_timeout(chat_server_with_queue: None) -> None:
+    # loading the model may take longer than the timeout, but the model stays loaded
+    for _ in range(10):
+        status, _ = request.post('completions', data=dict(SHORT_COMPLETION, max_tokens=1), raise_for_status=False,
+                                 wait=True)
+        if status == 200:
+            break
+    assert status == 200
+
+    # one request times out while it is generating, and the other while it waits for the worker
+    start = time.monotonic()
+    with ThreadPoolExecutor() as pool:
+        running = pool.submit(post_from, '127.0.0.1', 'completions', LONG_COMPLETION)
+        wait_for_metric('gpt4all_busy_workers', 1)
+        queued = pool.submit(post_from, '127.0.0.1', 'completions', LONG_COMPLETION)
+        for future in (running, queued):
+            status, response, _ = future.result()
+            assert status == 503
+            assert response == {'error': {
+                'code': 'timeout',
+                'message': 'The request timed out.',
+                'param': None,
+                'type': 'server_error',
+            }}
+    assert time.monotonic() - start < 30  # generation is stopped, not run to max_tokens
+
+    labels = 'endpoint="/v1/completions",model="Llama 3.2 1B Instruct"'
+    assert get_metrics()[f'gpt4all_requests_total{{{labels},status="503"}}'] >= 1
+
+
+@pytest.mark.parametrize('chat_server_with_queue', [dict(concurrency='1')], indirect=True)
+def test_with_models_fair_scheduling(chat_server_with_queue: None) -> None:
+    request.post('completions', data=dict(SHORT_COMPLETION, max_tokens=1), wait=True)  # load the model
+
+    # one client queues three requests before another client queues one
+    clients = ['127.0.0.2', '127.0.0.2', '127.0.0.2', '127.0.0.3']
+    with ThreadPoolExecutor(max_workers=len(clients)) as pool:
+        with start_long_stream():
+            futures = []
+            for queued, client in enumerate(clients, start=1):
+                futures.append(pool.submit(post_from, client, 'completions', SHORT_COMPLETION))
+                wait_for_metric('gpt4all_queued_requests', queued)
+        results = [(future.result(), client) for future, client in zip(futures, clients)]
+
+    assert all(status == 200 for (status, _, _), _ in results)
+    # the one worker serves them one at a time, and the second client does not wait for all of the first's requests
+    served = [client for _, client in sorted(results, key=lambda r: r[0][2])]
+    assert served == ['127.0.0.2', '127.0.0.3', '127.0.0.2', '127.0.0.2']
+
+
+@pytest.mark.parametrize('chat_server_with_queue', [dict(concurrency='2')], indirect=True)
+def test_with_models_concurrency(chat_server_with_queue: None) -> None:
+    request.post('completions', data=dict(SHORT_COMPLETION, max_tokens=1), wait=True)  # load the model
+
+    # both requests generate at the same time, each on its own worker
+    with start_long_stream(), start_long_stream():
+        metrics = get_metrics()
+        assert metrics['gpt4all_busy_workers'] == 2
+        assert metrics['gpt4all_queued_requests'] == 0
+
+
+def upload_batch_file(lines: list[dict[str, Any]]) -> str:
+    content = ''.join(json.dumps(line) + '\n' for line in lines)
+    resp = requests.post('http://localhost:4891/v1/files', data=dict(purpose='batch'),
+                         files=dict(file=('batch.jsonl', content)))
+    resp.raise_for_status()
+    return resp.json()['id']
+
+
+def test_batches_invalid(chat_server: None) -> None:
+    request.get('models', wait=True)
+    file_id = upload_batch_file([
+        dict(custom_id='a', method='POST', url='/v1/completions', body=dict(model='x', prompt='y')),
+        dict(custom_id='a', method='POST', url='/v1/completions', body=dict(model='x', prompt='y')),
+        dict(custom_id='b', method='POST', url='/v1/completions', body=dict(model='x', prompt='y', stream=True)),
+    ])
+    batch = request.post('batches', data=dict(
+        input_file_id=file_id, endpoint='/v1/completions', completion_window='24h',
+    ))
+    assert batch['status'] == 'failed'
+    assert [(e['code'], e['line']) for e in batch['errors']['data']] == [
+        ('duplicate_custom_id', 2), ('invalid_request', 3),
+    ]
+    assert request.get(f'batches/{batch["id"]}') == batch
+
+
+def test_with_models_batches(chat_server_with_model: None) -> None:
+    prompts = ['The quick brown fox', 'The quick brown dog', 'Once upon a time']
+    file_id = upload_batch_file([
+        dict(custom_id=f'request-{i}', method='POST', url='/v1/completions', body=dict(
+            model='Llama 3.2 1B Instruct', prompt=prompt, temperature=0, max_tokens=6,
+        ))
+        for i, prompt in enumerate(prompts)
+    ])
+    batch = request.post('batches', data=dict(
+        input_file_id=file_id, endpoint='/v1/completions', completion_window='24h',
+    ), wait=True)
+    assert batch['status'] == 'in_progress'
+    assert batch['request_counts'] == {'total': 3, 'completed': 0, 'failed': 0}
+
+    deadline = time.monotonic() + 60
+    while batch['status'] != 'completed':
+        assert time.monotonic() < deadline, 'batch did not complete'
+        time.sleep(.1)
+        batch = request.get(f'batches/{batch["id"]}')
+    assert batch['request_counts'] == {'total': 3, 'completed': 3, 'failed': 0}
+    assert batch['error_file_id'] is None
+
+    resp = requests.get(f'http://localhost:4891/v1/files/{batch["output_file_id"]}/content')
+    resp.raise_for_status()
+    results = {r['custom_id']: r for r in map(json.loads, resp.text.splitlines())}
+    assert sorted(results) == ['request-0', 'request-1', 'request-2']
+    assert all(r['response']['status_code'] == 200 for r in results.values())
+    response = results['request-0']['response']['body']
+    assert response['choices'] == EXPECTED_COMPLETIONS_RESPONSE['choices']
+
+
+def test_embeddings(chat_server: None) -> None:
+    data = dict(
+        model = 'nomic-embed-text-v1.5',
+        input = ['The quick brown fox', 'jumps over the lazy dog'],
+    )
+    response = request.post('embeddings', data=data, wait=True)
+    assert response['object'] == 'list'
+    assert response['model'] == 'nomic-embed-text-v1.5'
+    assert [d['index'] for d in response['data']] == [0, 1]
+    assert all(len(d['embedding']) == 768 for d in response['data'])
+    assert response['usage']['prompt_tokens'] == response['usage']['total_tokens'] > 0
+
+    metrics = get_metrics()
+    assert metrics['gpt4all_embedding_cache_requests_total{result="hit"}'] == 0
+    assert metrics['gpt4all_embedding_cache_requests_total{result="miss"}'] == 1
+
+    # a repeated request is answered from the embedding cache, with the same result and usage
+    assert request.post('embeddings', data=data) == response
+    metrics = get_metrics()
+    assert metrics['gpt4all_embedding_cache_requests_total{result="hit"}'] == 1
+    assert metrics['gpt4all_embedding_cache_requests_total{result="miss"}'] == 1
+
+    # truncated, and encoded as little-endian float32
+    data.update(dimensions=256, encoding_format='base64')
+    response = request.post('embeddings', data=data)
+    assert all(len(base64.b64decode(d['embedding'])) == 256 * 4 for d in response['data'])
+
+    data['model'] = 'foo'
+    status_code, response = request.post('embeddings', data=data, raise_for_status=False)
+    assert status_code == 404
+    assert response['error']['code'] == 'model_not_found'